@@ -0,0 +1,1050 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "proxy.h"
+
+#define BENCH_PATTERN_SIZE (1024 * 1024)    // Files are this pattern repeated, so the server reads no disk
+#define BENCH_BLOCK_SHIFT 4099              // Bytes each pattern-sized block of a file starts further into the pattern
+#define BENCH_SEND_SIZE (256 * 1024)
+#define BENCH_RECEIVE_SIZE (256 * 1024)
+#define BENCH_LINE_SIZE 1024
+#define BENCH_START_TIMEOUT 5000            // Milliseconds the proxy is given to accept connections
+#define BENCH_MAX_SESSIONS 1024
+#define BENCH_MODIFIED "20260101000000"
+
+#ifndef FTP_PROXY_PATH
+#define FTP_PROXY_PATH "./FTP_Proxy"
+#endif
+
+/**
+ * Buffered reader of the lines of a blocking control connection.
+ */
+struct bench_connection {
+    int socket_fd;
+    char buffer[BENCH_LINE_SIZE];
+    size_t length;
+};
+
+/**
+ * Control connection of a client of the stand-in server, served by its own thread.
+ */
+struct bench_server_session {
+    struct bench_connection connection;
+    int passive_fd;                 // Listening data socket after PASV, -1 in active mode
+    struct sockaddr_in active;      // Address given by PORT
+    off_t restart;
+};
+
+/**
+ * One load to measure: every session logs in once and downloads its files one after another.
+ */
+struct bench_scenario {
+    const char *name;
+    int passive;
+    int hit;                        // The files were downloaded once before, so they are cached
+    int shared;                     // Every session downloads the same files, instead of its own
+    off_t size;
+    int transfers;                  // Downloads per session
+};
+
+/**
+ * What one client session measured.
+ */
+struct bench_client {
+    pthread_t thread;
+    const struct bench_scenario *scenario;
+    int index;
+    int run;                        // Picks new file names for each run of a miss scenario
+    unsigned long long bytes;
+    int failures;
+    double *first_byte;             // Seconds from each RETR to its first data byte
+    int transfers;
+};
+
+static char bench_pattern[BENCH_PATTERN_SIZE];
+static int bench_proxy_port;
+static int bench_server_port;
+static pid_t bench_proxy_pid = -1;
+static char bench_directory[] = "/tmp/ftp-bench-XXXXXX";
+static int bench_run_count;
+
+static const char *bench_proxy_path = FTP_PROXY_PATH;
+static int bench_sessions = 4;
+static int bench_workers = 1;
+static off_t bench_small_size = 16 * 1024;
+static int bench_small_count = 250;
+static off_t bench_large_size = 2048LL * 1024 * 1024;
+static int bench_modes = 3;                 // Passive in bit 0, active in bit 1
+static int bench_workloads = 3;             // Small files in bit 0, large files in bit 1
+static int bench_caching = 3;               // Misses in bit 0, hits in bit 1
+
+/**
+ * Gets the monotonic time in seconds.
+ */
+static double bench_now(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/**
+ * Sends the whole formatted text over a blocking socket.
+ * Returns 0 on success and -1 on failure.
+ */
+static int bench_send(int socket_fd, const char *format, ...) {
+    char text[BENCH_LINE_SIZE];
+    va_list arguments;
+
+    va_start(arguments, format);
+    int length = vsnprintf(text, sizeof(text), format, arguments);
+    va_end(arguments);
+
+    for (int sent = 0; sent < length;) {
+        ssize_t written = send(socket_fd, text + sent, length - sent, MSG_NOSIGNAL);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return -1;
+        }
+        sent += written;
+    }
+
+    return 0;
+}
+
+/**
+ * Reads the next line of a control connection, without its line ending.
+ * Returns 0 on success and -1 once the connection is closed.
+ */
+static int bench_read_line(struct bench_connection *connection, char *line, size_t size) {
+    while (TRUE) {
+        char *end = memchr(connection->buffer, '\n', connection->length);
+        if (end != NULL) {
+            size_t length = end - connection->buffer + 1;
+            size_t copied = length < size ? length : size - 1;
+
+            memcpy(line, connection->buffer, copied);
+            line[copied] = '\0';
+            line[strcspn(line, "\r\n")] = '\0';
+            memmove(connection->buffer, connection->buffer + length, connection->length - length);
+            connection->length -= length;
+            return 0;
+        }
+
+        if (connection->length == sizeof(connection->buffer)) {
+            // Longer than any line either side sends
+            return -1;
+        }
+
+        ssize_t read_size = read(connection->socket_fd, connection->buffer + connection->length,
+                                 sizeof(connection->buffer) - connection->length);
+        if (read_size < 0 && errno == EINTR) {
+            continue;
+        }
+        if (read_size <= 0) {
+            return -1;
+        }
+        connection->length += read_size;
+    }
+}
+
+/**
+ * Reads a reply, skipping the lines of a multi-line one up to the last.
+ * Returns the reply code, or -1 once the connection is closed.
+ */
+static int bench_read_reply(struct bench_connection *connection, char *line, size_t size) {
+    do {
+        if (bench_read_line(connection, line, size) < 0) {
+            return -1;
+        }
+    } while (strlen(line) < 4 || line[3] != ' ' || line[0] < '1' || line[0] > '5');
+
+    return atoi(line);
+}
+
+/**
+ * Creates a socket listening on a port of the loopback interface the kernel picks.
+ * Returns the socket, or -1 on failure.
+ */
+static int bench_listen(int *port) {
+    struct sockaddr_in address = {0};
+    socklen_t length = sizeof(address);
+
+    int socket_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (socket_fd < 0) {
+        return -1;
+    }
+
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(socket_fd, (struct sockaddr *) &address, sizeof(address)) < 0 || listen(socket_fd, SOMAXCONN) < 0 ||
+        getsockname(socket_fd, (struct sockaddr *) &address, &length) < 0) {
+        close(socket_fd);
+        return -1;
+    }
+    *port = ntohs(address.sin_port);
+
+    return socket_fd;
+}
+
+/**
+ * Connects a blocking socket to the port of the loopback interface.
+ * Returns the socket, or -1 on failure.
+ */
+static int bench_connect(int port) {
+    struct sockaddr_in address = {0};
+
+    int socket_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (socket_fd < 0) {
+        return -1;
+    }
+
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    if (connect(socket_fd, (struct sockaddr *) &address, sizeof(address)) < 0) {
+        close(socket_fd);
+        return -1;
+    }
+    setsockopt(socket_fd, IPPROTO_TCP, TCP_NODELAY, &(int) {1}, sizeof(int));
+
+    return socket_fd;
+}
+
+/**
+ * Gets the size of a file from its name, which the load generator makes up as f<size>-<id>.
+ * Returns the size, or -1 if the name is no such file.
+ */
+static off_t bench_file_size(const char *name) {
+    long long size;
+
+    if (name[0] == '/') {
+        name += 1;
+    }
+    if (sscanf(name, "f%lld-", &size) != 1 || size < 0) {
+        return -1;
+    }
+
+    return size;
+}
+
+/**
+ * Gets the place in the pattern that the files of the name start at, so no two files hold the same bytes.
+ */
+static unsigned long long bench_file_seed(const char *name) {
+    unsigned long long seed = 14695981039346656037ULL;
+
+    if (name[0] == '/') {
+        name += 1;
+    }
+    for (; *name != '\0'; name += 1) {
+        seed = (seed ^ (unsigned char) *name) * 1099511628211ULL;
+    }
+
+    return seed % BENCH_PATTERN_SIZE;
+}
+
+/**
+ * Gets where in the pattern the byte of a file at the offset is, and how many bytes of the file follow
+ * it there in a row. Each pattern-sized block of a file starts further into the pattern, so bytes sent
+ * from a wrong offset differ even by a multiple of the pattern size.
+ */
+static const char *bench_file_bytes(unsigned long long seed, off_t offset, size_t *length) {
+    size_t within = offset % BENCH_PATTERN_SIZE;
+    size_t start = (seed + (unsigned long long) (offset / BENCH_PATTERN_SIZE) * BENCH_BLOCK_SHIFT + within) %
+                   BENCH_PATTERN_SIZE;
+
+    *length = BENCH_PATTERN_SIZE - (start > within ? start : within);
+    return bench_pattern + start;
+}
+
+/**
+ * Opens the data connection of a transfer of the stand-in server.
+ * Returns the socket, or -1 on failure.
+ */
+static int bench_server_open_data(struct bench_server_session *session) {
+    int data_fd;
+
+    if (session->passive_fd >= 0) {
+        data_fd = accept4(session->passive_fd, NULL, NULL, SOCK_CLOEXEC);
+        close(session->passive_fd);
+        session->passive_fd = -1;
+        return data_fd;
+    }
+
+    data_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (data_fd >= 0 && connect(data_fd, (struct sockaddr *) &session->active, sizeof(session->active)) < 0) {
+        close(data_fd);
+        return -1;
+    }
+
+    return data_fd;
+}
+
+/**
+ * Sends the file from the offset of the last REST on. Its bytes are taken from the pattern, see
+ * bench_file_bytes().
+ * Returns 0 on success and -1 on failure.
+ */
+static int bench_server_send_file(int data_fd, const char *name, off_t offset, off_t size) {
+    unsigned long long seed = bench_file_seed(name);
+
+    while (offset < size) {
+        size_t length;
+        const char *bytes = bench_file_bytes(seed, offset, &length);
+
+        if (length > BENCH_SEND_SIZE) {
+            length = BENCH_SEND_SIZE;
+        }
+        if ((off_t) length > size - offset) {
+            length = size - offset;
+        }
+
+        ssize_t written = send(data_fd, bytes, length, MSG_NOSIGNAL);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return -1;
+        }
+        offset += written;
+    }
+
+    return 0;
+}
+
+/**
+ * Answers one command of a client of the stand-in server.
+ * Returns 0 while the session goes on and -1 once it ended.
+ */
+static int bench_server_handle(struct bench_server_session *session, const char *line) {
+    int socket_fd = session->connection.socket_fd;
+    const char *argument = strchr(line, ' ') != NULL ? strchr(line, ' ') + 1 : "";
+    int address[6];
+    int port;
+
+    if (strncasecmp(line, "USER", 4) == 0) {
+        return bench_send(socket_fd, "331 Password required.\r\n");
+    }
+    if (strncasecmp(line, "PASS", 4) == 0) {
+        return bench_send(socket_fd, "230 Logged in.\r\n");
+    }
+    if (strncasecmp(line, "TYPE", 4) == 0 || strncasecmp(line, "NOOP", 4) == 0) {
+        return bench_send(socket_fd, "200 OK.\r\n");
+    }
+    if (strncasecmp(line, "PWD", 3) == 0) {
+        return bench_send(socket_fd, "257 \"/\" is the current directory.\r\n");
+    }
+    if (strncasecmp(line, "CWD", 3) == 0) {
+        return bench_send(socket_fd, "250 OK.\r\n");
+    }
+    if (strncasecmp(line, "SIZE", 4) == 0 && bench_file_size(argument) >= 0) {
+        return bench_send(socket_fd, "213 %lld\r\n", (long long) bench_file_size(argument));
+    }
+    if (strncasecmp(line, "MDTM", 4) == 0 && bench_file_size(argument) >= 0) {
+        return bench_send(socket_fd, "213 " BENCH_MODIFIED "\r\n");
+    }
+    if (strncasecmp(line, "REST", 4) == 0) {
+        session->restart = atoll(argument);
+        return bench_send(socket_fd, "350 Restarting.\r\n");
+    }
+    if (strncasecmp(line, "PASV", 4) == 0) {
+        if (session->passive_fd >= 0) {
+            close(session->passive_fd);
+        }
+        session->passive_fd = bench_listen(&port);
+        if (session->passive_fd < 0) {
+            return bench_send(socket_fd, "425 Cannot listen.\r\n");
+        }
+        return bench_send(socket_fd, "227 Entering Passive Mode (127,0,0,1,%d,%d).\r\n", port / 256, port % 256);
+    }
+    if (strncasecmp(line, "PORT", 4) == 0 &&
+        sscanf(argument, "%d,%d,%d,%d,%d,%d", &address[0], &address[1], &address[2], &address[3], &address[4],
+               &address[5]) == 6) {
+        char host[INET_ADDRSTRLEN];
+
+        snprintf(host, sizeof(host), "%d.%d.%d.%d", address[0], address[1], address[2], address[3]);
+        memset(&session->active, 0, sizeof(session->active));
+        session->active.sin_family = AF_INET;
+        session->active.sin_port = htons(address[4] * 256 + address[5]);
+        inet_pton(AF_INET, host, &session->active.sin_addr);
+        if (session->passive_fd >= 0) {
+            close(session->passive_fd);
+            session->passive_fd = -1;
+        }
+        return bench_send(socket_fd, "200 PORT command successful.\r\n");
+    }
+    if (strncasecmp(line, "RETR", 4) == 0) {
+        off_t size = bench_file_size(argument);
+        off_t offset = session->restart;
+
+        session->restart = 0;
+        if (size < 0) {
+            return bench_send(socket_fd, "550 No such file.\r\n");
+        }
+        if (bench_send(socket_fd, "150 Opening BINARY mode data connection (%lld bytes).\r\n", (long long) size) < 0) {
+            return -1;
+        }
+
+        int data_fd = bench_server_open_data(session);
+        if (data_fd < 0) {
+            return bench_send(socket_fd, "425 Cannot open data connection.\r\n");
+        }
+        int sent = bench_server_send_file(data_fd, argument, offset, size);
+        close(data_fd);
+
+        return bench_send(socket_fd, sent == 0 ? "226 Transfer complete.\r\n" : "426 Transfer aborted.\r\n");
+    }
+    if (strncasecmp(line, "QUIT", 4) == 0) {
+        bench_send(socket_fd, "221 Bye.\r\n");
+        return -1;
+    }
+
+    return bench_send(socket_fd, "502 Not implemented.\r\n");
+}
+
+/**
+ * Serves one control connection of the stand-in server.
+ */
+static void *bench_server_run_session(void *data) {
+    struct bench_server_session *session = data;
+    char line[BENCH_LINE_SIZE];
+
+    if (bench_send(session->connection.socket_fd, "220 Benchmark server ready.\r\n") == 0) {
+        while (bench_read_line(&session->connection, line, sizeof(line)) == 0 &&
+               bench_server_handle(session, line) == 0) {
+        }
+    }
+
+    if (session->passive_fd >= 0) {
+        close(session->passive_fd);
+    }
+    close(session->connection.socket_fd);
+    free(session);
+
+    return NULL;
+}
+
+/**
+ * Accepts the control connections of the stand-in server, each served by a thread of its own.
+ */
+static void *bench_server_run(void *data) {
+    int listen_fd = *(int *) data;
+
+    while (TRUE) {
+        int socket_fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (socket_fd < 0) {
+            continue;
+        }
+
+        struct bench_server_session *session = calloc(1, sizeof(struct bench_server_session));
+        pthread_t thread;
+        if (session == NULL) {
+            close(socket_fd);
+            continue;
+        }
+        session->connection.socket_fd = socket_fd;
+        session->passive_fd = -1;
+        setsockopt(socket_fd, IPPROTO_TCP, TCP_NODELAY, &(int) {1}, sizeof(int));
+
+        if (pthread_create(&thread, NULL, bench_server_run_session, session) != 0) {
+            close(socket_fd);
+            free(session);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    return NULL;
+}
+
+/**
+ * Reads the CPU time the proxy used so far, in seconds.
+ */
+static double bench_proxy_cpu(void) {
+    char path[64];
+    char text[1024];
+    unsigned long user_time = 0;
+    unsigned long system_time = 0;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int) bench_proxy_pid);
+    FILE *stat_file = fopen(path, "r");
+    if (stat_file == NULL) {
+        return 0;
+    }
+    size_t length = fread(text, 1, sizeof(text) - 1, stat_file);
+    fclose(stat_file);
+    text[length] = '\0';
+
+    // The fields after the command name, which may hold spaces, start with the state as the third
+    const char *fields = strrchr(text, ')');
+    if (fields == NULL || sscanf(fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                                 &user_time, &system_time) != 2) {
+        return 0;
+    }
+
+    return (double) (user_time + system_time) / sysconf(_SC_CLK_TCK);
+}
+
+/**
+ * Removes a file or directory of the cache left by the proxy.
+ */
+static int bench_remove_file(const char *path, const struct stat *stat, int flag, struct FTW *ftw) {
+    return remove(path);
+}
+
+/**
+ * Stops the proxy of the previous scenario and empties its cache.
+ */
+static void bench_stop_proxy(void) {
+    char cache_directory[sizeof(bench_directory) + 16];
+
+    if (bench_proxy_pid > 0) {
+        kill(bench_proxy_pid, SIGTERM);
+        waitpid(bench_proxy_pid, NULL, 0);
+        bench_proxy_pid = -1;
+    }
+
+    snprintf(cache_directory, sizeof(cache_directory), "%s/cache", bench_directory);
+    nftw(cache_directory, bench_remove_file, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+/**
+ * Starts the proxy with an empty cache large enough for the scenario, and waits until it accepts
+ * connections.
+ * Returns 0 on success and -1 on failure.
+ */
+static int bench_start_proxy(unsigned long long cache_size) {
+    char port[16];
+    char server[32];
+    char cache_argument[32];
+    char workers[16];
+    char log_path[sizeof(bench_directory) + 16];
+
+    // Any free port will do, the proxy binds it right after
+    int probe_fd = bench_listen(&bench_proxy_port);
+    if (probe_fd < 0) {
+        perror("Error picking the proxy port");
+        return -1;
+    }
+    close(probe_fd);
+
+    snprintf(port, sizeof(port), "%d", bench_proxy_port);
+    snprintf(server, sizeof(server), "127.0.0.1:%d", bench_server_port);
+    snprintf(cache_argument, sizeof(cache_argument), "%llu", cache_size);
+    snprintf(workers, sizeof(workers), "%d", bench_workers);
+    snprintf(log_path, sizeof(log_path), "%s/proxy.log", bench_directory);
+
+    bench_proxy_pid = fork();
+    if (bench_proxy_pid < 0) {
+        perror("Error starting the proxy");
+        return -1;
+    }
+    if (bench_proxy_pid == 0) {
+        int log_fd = open(log_path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (chdir(bench_directory) < 0 || log_fd < 0) {
+            _exit(127);
+        }
+        dup2(log_fd, STDOUT_FILENO);
+        dup2(log_fd, STDERR_FILENO);
+        execl(bench_proxy_path, bench_proxy_path, "--port", port, "--cache-size", cache_argument,
+              "--workers", workers, "--log-level", "warning", server, "127.0.0.1", (char *) NULL);
+        _exit(127);
+    }
+
+    for (int waited = 0; waited < BENCH_START_TIMEOUT; waited += 10) {
+        int socket_fd = bench_connect(bench_proxy_port);
+        if (socket_fd >= 0) {
+            close(socket_fd);
+            return 0;
+        }
+        if (waitpid(bench_proxy_pid, NULL, WNOHANG) == bench_proxy_pid) {
+            break;
+        }
+        usleep(10000);
+    }
+
+    fprintf(stderr, "The proxy did not start, see %s\n", log_path);
+    bench_proxy_pid = -1;
+    return -1;
+}
+
+/**
+ * Opens the data connection of the next transfer through the proxy: in passive mode the client
+ * connects to the port of the 227 reply, in active mode it listens and tells the port with PORT.
+ * Returns the connected socket in passive mode or the listening one in active mode, or -1 on failure.
+ */
+static int bench_client_prepare_data(struct bench_connection *control, int passive) {
+    char line[BENCH_LINE_SIZE];
+    int address[6];
+    int port;
+
+    if (passive) {
+        const char *tuple;
+        if (bench_send(control->socket_fd, "PASV\r\n") < 0 || bench_read_reply(control, line, sizeof(line)) != 227 ||
+            (tuple = strchr(line, '(')) == NULL ||
+            sscanf(tuple + 1, "%d,%d,%d,%d,%d,%d", &address[0], &address[1], &address[2], &address[3], &address[4],
+                   &address[5]) != 6) {
+            return -1;
+        }
+        return bench_connect(address[4] * 256 + address[5]);
+    }
+
+    int listen_fd = bench_listen(&port);
+    if (listen_fd < 0) {
+        return -1;
+    }
+    if (bench_send(control->socket_fd, "PORT 127,0,0,1,%d,%d\r\n", port / 256, port % 256) < 0 ||
+        bench_read_reply(control, line, sizeof(line)) != 200) {
+        close(listen_fd);
+        return -1;
+    }
+
+    return listen_fd;
+}
+
+/**
+ * Tells whether bytes received at the offset of the file with the seed are the ones the stand-in
+ * server sends there.
+ */
+static int bench_client_check(unsigned long long seed, off_t offset, const char *data, size_t size) {
+    while (size > 0) {
+        size_t length;
+        const char *expected = bench_file_bytes(seed, offset, &length);
+
+        if (length > size) {
+            length = size;
+        }
+        if (memcmp(data, expected, length) != 0) {
+            return FALSE;
+        }
+        data += length;
+        offset += length;
+        size -= length;
+    }
+
+    return TRUE;
+}
+
+/**
+ * Downloads one file through the proxy, checks its content and measures the time to its first byte.
+ * Returns the number of bytes received, or -1 on failure. Content that differs from the file's leaves
+ * intact FALSE.
+ */
+static long long bench_client_download(struct bench_client *client, struct bench_connection *control,
+                                       const char *name, double *first_byte, int *intact) {
+    static __thread char data[BENCH_RECEIVE_SIZE];
+    char line[BENCH_LINE_SIZE];
+    int passive = client->scenario->passive;
+    unsigned long long seed = bench_file_seed(name);
+    long long received = 0;
+
+    int data_fd = bench_client_prepare_data(control, passive);
+    if (data_fd < 0) {
+        return -1;
+    }
+
+    double requested = bench_now();
+    if (bench_send(control->socket_fd, "RETR %s\r\n", name) < 0 || bench_read_reply(control, line, sizeof(line)) != 150) {
+        close(data_fd);
+        return -1;
+    }
+
+    if (!passive) {
+        int listen_fd = data_fd;
+        data_fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        close(listen_fd);
+        if (data_fd < 0) {
+            return -1;
+        }
+    }
+
+    *first_byte = -1;
+    *intact = TRUE;
+    while (TRUE) {
+        ssize_t read_size = read(data_fd, data, sizeof(data));
+        if (read_size < 0 && errno == EINTR) {
+            continue;
+        }
+        if (read_size <= 0) {
+            break;
+        }
+        if (*first_byte < 0) {
+            *first_byte = bench_now() - requested;
+        }
+        if (*intact && !bench_client_check(seed, received, data, read_size)) {
+            fprintf(stderr, "Content of %s differs at offset %lld\n", name, received);
+            *intact = FALSE;
+        }
+        received += read_size;
+    }
+    close(data_fd);
+
+    if (bench_read_reply(control, line, sizeof(line)) != 226) {
+        return -1;
+    }
+
+    return received;
+}
+
+/**
+ * Runs one client session of the scenario: logs in, then downloads its files in turn.
+ */
+static void *bench_client_run(void *data) {
+    struct bench_client *client = data;
+    const struct bench_scenario *scenario = client->scenario;
+    struct bench_connection control = {0};
+    char line[BENCH_LINE_SIZE];
+
+    control.socket_fd = bench_connect(bench_proxy_port);
+    if (control.socket_fd < 0 || bench_read_reply(&control, line, sizeof(line)) != 220 ||
+        bench_send(control.socket_fd, "USER bench\r\n") < 0 || bench_read_reply(&control, line, sizeof(line)) != 331 ||
+        bench_send(control.socket_fd, "PASS bench\r\n") < 0 || bench_read_reply(&control, line, sizeof(line)) != 230 ||
+        bench_send(control.socket_fd, "TYPE I\r\n") < 0 || bench_read_reply(&control, line, sizeof(line)) != 200) {
+        client->failures = scenario->transfers;
+        if (control.socket_fd >= 0) {
+            close(control.socket_fd);
+        }
+        return NULL;
+    }
+
+    for (int i = 0; i < scenario->transfers; i += 1) {
+        char name[64];
+        double first_byte = -1;
+        int intact;
+
+        // Misses get names never asked for before, hits the names of the warm-up run
+        int owner = scenario->shared ? 0 : client->index;
+        snprintf(name, sizeof(name), "f%lld-%d-%d-%d", (long long) scenario->size, scenario->hit ? 0 : client->run,
+                 owner, i);
+
+        long long received = bench_client_download(client, &control, name, &first_byte, &intact);
+        if (received != scenario->size || !intact) {
+            client->failures += 1;
+            if (received < 0) {
+                break;
+            }
+            continue;
+        }
+
+        client->bytes += received;
+        client->first_byte[client->transfers++] = first_byte;
+    }
+
+    bench_send(control.socket_fd, "QUIT\r\n");
+    bench_read_reply(&control, line, sizeof(line));
+    close(control.socket_fd);
+
+    return NULL;
+}
+
+/**
+ * Runs every session of the scenario at once.
+ * Returns the number of failed transfers.
+ */
+static int bench_run_clients(const struct bench_scenario *scenario, struct bench_client *clients) {
+    int failures = 0;
+
+    bench_run_count += 1;
+    for (int i = 0; i < bench_sessions; i += 1) {
+        clients[i].scenario = scenario;
+        clients[i].index = i;
+        clients[i].run = bench_run_count;
+        clients[i].bytes = 0;
+        clients[i].failures = 0;
+        clients[i].transfers = 0;
+        if (pthread_create(&clients[i].thread, NULL, bench_client_run, &clients[i]) != 0) {
+            perror("Error creating client thread");
+            exit(1);
+        }
+    }
+
+    for (int i = 0; i < bench_sessions; i += 1) {
+        pthread_join(clients[i].thread, NULL);
+        failures += clients[i].failures;
+    }
+
+    return failures;
+}
+
+static int bench_compare_doubles(const void *a, const void *b) {
+    double difference = *(const double *) a - *(const double *) b;
+
+    return difference < 0 ? -1 : difference > 0;
+}
+
+/**
+ * Runs a scenario against a fresh proxy and prints what it sustained.
+ */
+static void bench_run_scenario(const struct bench_scenario *scenario) {
+    static struct bench_client clients[BENCH_MAX_SESSIONS];
+    unsigned long long files = (unsigned long long) scenario->transfers * (scenario->shared ? 1 : bench_sessions);
+    unsigned long long cache_size = files * scenario->size + 1024ULL * 1024 * 1024;
+
+    for (int i = 0; i < bench_sessions; i += 1) {
+        clients[i].first_byte = calloc(scenario->transfers, sizeof(double));
+        if (clients[i].first_byte == NULL) {
+            perror("Error allocating measurements");
+            exit(1);
+        }
+    }
+
+    if (bench_start_proxy(cache_size) < 0) {
+        exit(1);
+    }
+
+    // A hit scenario measures the second run, once the first one filled the cache
+    int failures = scenario->hit ? bench_run_clients(scenario, clients) : 0;
+
+    double cpu_before = bench_proxy_cpu();
+    double started = bench_now();
+    failures += bench_run_clients(scenario, clients);
+    double elapsed = bench_now() - started;
+    double cpu = bench_proxy_cpu() - cpu_before;
+
+    bench_stop_proxy();
+
+    unsigned long long bytes = 0;
+    int transfers = 0;
+    for (int i = 0; i < bench_sessions; i += 1) {
+        bytes += clients[i].bytes;
+        transfers += clients[i].transfers;
+    }
+
+    double *first_byte = calloc(transfers > 0 ? transfers : 1, sizeof(double));
+    if (first_byte == NULL) {
+        perror("Error allocating measurements");
+        exit(1);
+    }
+    for (int i = 0, n = 0; i < bench_sessions; i += 1) {
+        memcpy(first_byte + n, clients[i].first_byte, clients[i].transfers * sizeof(double));
+        n += clients[i].transfers;
+        free(clients[i].first_byte);
+    }
+    qsort(first_byte, transfers, sizeof(double), bench_compare_doubles);
+
+    double p50 = transfers > 0 ? first_byte[transfers / 2] : 0;
+    double p99 = transfers > 0 ? first_byte[transfers * 99 / 100 < transfers ? transfers * 99 / 100 : transfers - 1] : 0;
+    free(first_byte);
+
+    printf("%-20s %8d %9d %12.1f %10.1f %10.3f %10.3f %10.3f %8d\n", scenario->name, bench_sessions, transfers,
+           bytes / 1048576.0, elapsed > 0 ? bytes / 1048576.0 / elapsed : 0, p50 * 1000, p99 * 1000,
+           bytes > 0 ? cpu / (bytes / 1e9) : 0, failures);
+}
+
+/**
+ * Parses a byte count with an optional K, M or G suffix.
+ * Returns 0 on success and -1 if the text is not a byte count.
+ */
+static int bench_parse_size(const char *text, off_t *size) {
+    char *end;
+    long long value = strtoll(text, &end, 10);
+
+    if (end == text || value < 0) {
+        return -1;
+    }
+
+    switch (*end) {
+        case 'G':
+        case 'g':
+            value *= 1024;
+            // fall through
+        case 'M':
+        case 'm':
+            value *= 1024;
+            // fall through
+        case 'K':
+        case 'k':
+            value *= 1024;
+            end += 1;
+        default:
+            break;
+    }
+
+    if (*end != '\0') {
+        return -1;
+    }
+
+    *size = value;
+    return 0;
+}
+
+/**
+ * Parses a list of two choices separated by commas into a bitmask.
+ * Returns the bitmask, or 0 if the list holds something else.
+ */
+static int bench_parse_choices(const char *text, const char *first, const char *second) {
+    char list[64];
+    char *saved;
+    int mask = 0;
+
+    snprintf(list, sizeof(list), "%s", text);
+    for (char *choice = strtok_r(list, ",", &saved); choice != NULL; choice = strtok_r(NULL, ",", &saved)) {
+        if (strcmp(choice, first) == 0) {
+            mask |= 1;
+        } else if (strcmp(choice, second) == 0) {
+            mask |= 2;
+        } else {
+            return 0;
+        }
+    }
+
+    return mask;
+}
+
+static void print_usage(const char *program) {
+    fprintf(stderr, "Usage: %s [--proxy PATH] [--sessions N] [--workers N] [--modes passive,active] "
+                    "[--workloads small,large] [--caching miss,hit] [--small-size BYTES[K|M|G]] "
+                    "[--small-count N] [--large-size BYTES[K|M|G]]\n", program);
+}
+
+int main(int argc, char *argv[]) {
+    static const struct option options[] = {
+            {"proxy",       required_argument, NULL, 'x'},
+            {"sessions",    required_argument, NULL, 'c'},
+            {"workers",     required_argument, NULL, 'n'},
+            {"modes",       required_argument, NULL, 'm'},
+            {"workloads",   required_argument, NULL, 'w'},
+            {"caching",     required_argument, NULL, 'k'},
+            {"small-size",  required_argument, NULL, 's'},
+            {"small-count", required_argument, NULL, 'f'},
+            {"large-size",  required_argument, NULL, 'l'},
+            {"help",        no_argument,       NULL, 'h'},
+            {NULL, 0,                          NULL, 0}
+    };
+
+    int option;
+    while ((option = getopt_long(argc, argv, "x:c:n:m:w:k:s:f:l:h", options, NULL)) != -1) {
+        switch (option) {
+            case 'x':
+                bench_proxy_path = optarg;
+                break;
+            case 'c':
+                bench_sessions = atoi(optarg);
+                if (bench_sessions < 1 || bench_sessions > BENCH_MAX_SESSIONS) {
+                    fprintf(stderr, "Invalid number of sessions: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'n':
+                bench_workers = atoi(optarg);
+                if (bench_workers < 1) {
+                    fprintf(stderr, "Invalid number of workers: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'm':
+                if ((bench_modes = bench_parse_choices(optarg, "passive", "active")) == 0) {
+                    fprintf(stderr, "Invalid modes: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'w':
+                if ((bench_workloads = bench_parse_choices(optarg, "small", "large")) == 0) {
+                    fprintf(stderr, "Invalid workloads: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'k':
+                if ((bench_caching = bench_parse_choices(optarg, "miss", "hit")) == 0) {
+                    fprintf(stderr, "Invalid caching: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 's':
+                if (bench_parse_size(optarg, &bench_small_size) < 0) {
+                    fprintf(stderr, "Invalid small file size: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'f':
+                bench_small_count = atoi(optarg);
+                if (bench_small_count < 1) {
+                    fprintf(stderr, "Invalid number of small files: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'l':
+                if (bench_parse_size(optarg, &bench_large_size) < 0) {
+                    fprintf(stderr, "Invalid large file size: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            default:
+                print_usage(argv[0]);
+                exit(1);
+        }
+    }
+
+    // Any content will do, as long as it does not compress or repeat within a buffer
+    unsigned int seed = 1;
+    for (size_t i = 0; i < sizeof(bench_pattern); i += 1) {
+        seed = seed * 1103515245 + 12345;
+        bench_pattern[i] = (char) (seed >> 16);
+    }
+
+    if (mkdtemp(bench_directory) == NULL) {
+        perror("Error creating the benchmark directory");
+        exit(1);
+    }
+
+    static int server_fd;
+    pthread_t server_thread;
+    server_fd = bench_listen(&bench_server_port);
+    if (server_fd < 0 || pthread_create(&server_thread, NULL, bench_server_run, &server_fd) != 0) {
+        perror("Error starting the stand-in server");
+        exit(1);
+    }
+
+    printf("%-20s %8s %9s %12s %10s %10s %10s %10s %8s\n", "scenario", "sessions", "transfers", "MB", "MB/s",
+           "ttfb p50", "ttfb p99", "cpu s/GB", "failed");
+    printf("%-20s %8s %9s %12s %10s %10s %10s %10s %8s\n", "", "", "", "", "", "(ms)", "(ms)", "(proxy)", "");
+
+    for (int mode = 0; mode < 2; mode += 1) {
+        for (int workload = 0; workload < 2; workload += 1) {
+            for (int hit = 0; hit < 2; hit += 1) {
+                if (!(bench_modes & (1 << mode)) || !(bench_workloads & (1 << workload)) ||
+                    !(bench_caching & (1 << hit))) {
+                    continue;
+                }
+
+                char name[32];
+                snprintf(name, sizeof(name), "%s %s %s", mode == 0 ? "passive" : "active",
+                         workload == 0 ? "small" : "large", hit ? "hit" : "miss");
+
+                // Every session downloads the same large file once, so hits need a single copy of it
+                struct bench_scenario scenario = {
+                        name, mode == 0, hit, workload == 1,
+                        workload == 0 ? bench_small_size : bench_large_size,
+                        workload == 0 ? bench_small_count : 1
+                };
+                bench_run_scenario(&scenario);
+            }
+        }
+    }
+
+    bench_stop_proxy();
+    nftw(bench_directory, bench_remove_file, 16, FTW_DEPTH | FTW_PHYS);
+
+    return 0;
+}
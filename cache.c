@@ -0,0 +1,1399 @@
+#include "cache.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "hot_cache.h"
+#include "log.h"
+#include "proxy.h"
+
+#define CACHE_INITIAL_BUCKETS 64
+#define CACHE_SNAPSHOT_INTERVAL 64
+#define CACHE_SNAPSHOT_MAGIC "FTPCIDX4"
+#define CACHE_SNAPSHOT_MAGIC_V3 "FTPCIDX3"  // Same layout without the checksums
+#define CACHE_SNAPSHOT_MAX_RANGES (1024 * 1024)
+#define CACHE_SNAPSHOT_SIZE_KNOWN 1
+#define CACHE_SNAPSHOT_CHECKSUM_KNOWN 1
+#define CACHE_SNAPSHOT_SHA256_KNOWN 2
+#define CACHE_VERIFY_CHUNK (1024 * 1024)
+#define CACHE_VERIFY_RATE (64ULL * 1024 * 1024)    // Bytes per second the verifier reads at most
+
+/**
+ * Header of the snapshot file, followed per entry by one record, its key and upstream bytes,
+ * its coverage, the ranges of the coverage and its checksums.
+ */
+struct cache_snapshot_header {
+    char magic[8];
+    uint64_t entry_count;
+};
+
+struct cache_snapshot_record {
+    uint64_t size;
+    int64_t last_access;
+    int64_t validated;
+    char modified[CACHE_MODIFIED_SIZE];
+    uint16_t key_length;
+    uint16_t upstream_length;
+};
+
+struct cache_snapshot_coverage {
+    uint32_t range_count;
+    uint32_t flags;
+};
+
+struct cache_snapshot_range {
+    uint64_t start;
+    uint64_t end;
+};
+
+struct cache_snapshot_checksums {
+    uint64_t checksum;
+    uint8_t sha256[CHECKSUM_SHA256_SIZE];
+    uint32_t flags;
+    uint32_t reserved;
+};
+
+/**
+ * Hashes the upstream identity and key of an entry with 64-bit FNV-1a.
+ */
+static unsigned long long cache_hash(const char *key, const char *upstream) {
+    unsigned long long hash = 14695981039346656037ULL;
+
+    for (const char *c = upstream; *c != '\0'; c += 1) {
+        hash = (hash ^ (unsigned char) *c) * 1099511628211ULL;
+    }
+    hash = (hash ^ 0xff) * 1099511628211ULL;
+    for (const char *c = key; *c != '\0'; c += 1) {
+        hash = (hash ^ (unsigned char) *c) * 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+static void cache_lru_unlink(struct cache_entry *entry) {
+    entry->lru_prev->lru_next = entry->lru_next;
+    entry->lru_next->lru_prev = entry->lru_prev;
+    entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void cache_lru_push_front(struct cache_shard *shard, struct cache_entry *entry) {
+    entry->lru_prev = &shard->lru;
+    entry->lru_next = shard->lru.lru_next;
+    shard->lru.lru_next->lru_prev = entry;
+    shard->lru.lru_next = entry;
+}
+
+/**
+ * Makes an entry that is not being filled the most recently used one, and counts its bytes
+ * against the budget.
+ */
+static void cache_lru_add(struct cache *cache, struct cache_entry *entry) {
+    entry->stored = range_set_total(&entry->coverage);
+    cache_lru_push_front(entry->shard, entry);
+    __atomic_add_fetch(&cache->used, entry->stored, __ATOMIC_RELAXED);
+}
+
+/**
+ * Takes an entry out of eviction, before it gets filled or removed.
+ */
+static void cache_lru_remove(struct cache *cache, struct cache_entry *entry) {
+    if (entry->lru_prev != NULL) {
+        cache_lru_unlink(entry);
+        __atomic_sub_fetch(&cache->used, entry->stored, __ATOMIC_RELAXED);
+        entry->stored = 0;
+    }
+}
+
+/**
+ * Gets the shard of a hash from its top bits; the low bits select the bucket inside the shard.
+ */
+static struct cache_shard *cache_shard(struct cache *cache, unsigned long long hash) {
+    return &cache->shards[hash >> (64 - CACHE_SHARD_BITS)];
+}
+
+/**
+ * Doubles the number of hash buckets of the shard.
+ */
+static void cache_grow(struct cache_shard *shard) {
+    size_t bucket_count = shard->bucket_count * 2;
+    struct cache_entry **buckets = calloc(bucket_count, sizeof(struct cache_entry *));
+    if (buckets == NULL) {
+        return;
+    }
+
+    for (size_t i = 0; i < shard->bucket_count; i += 1) {
+        struct cache_entry *entry = shard->buckets[i];
+        while (entry != NULL) {
+            struct cache_entry *next = entry->hash_next;
+            size_t bucket = entry->hash & (bucket_count - 1);
+            entry->hash_next = buckets[bucket];
+            buckets[bucket] = entry;
+            entry = next;
+        }
+    }
+
+    free(shard->buckets);
+    shard->buckets = buckets;
+    shard->bucket_count = bucket_count;
+}
+
+/**
+ * Creates an incomplete entry and adds it to the hash table of its shard, which must be locked.
+ * Returns the entry, or NULL if it could not be allocated.
+ */
+static struct cache_entry *cache_insert(struct cache_shard *shard, const char *key, const char *upstream) {
+    struct cache_entry *entry = calloc(1, sizeof(struct cache_entry));
+    if (entry == NULL) {
+        return NULL;
+    }
+
+    entry->key = strdup(key);
+    entry->upstream = strdup(upstream);
+    if (entry->key == NULL || entry->upstream == NULL) {
+        free(entry->key);
+        free(entry->upstream);
+        free(entry);
+        return NULL;
+    }
+
+    entry->hash = cache_hash(key, upstream);
+    snprintf(entry->path, sizeof(entry->path), CACHE_DIRECTORY "/%016llx", entry->hash);
+    entry->last_access = time(NULL);
+    entry->shard = shard;
+    range_set_init(&entry->coverage);
+
+    if (shard->entry_count >= shard->bucket_count) {
+        cache_grow(shard);
+    }
+
+    size_t bucket = entry->hash & (shard->bucket_count - 1);
+    entry->hash_next = shard->buckets[bucket];
+    shard->buckets[bucket] = entry;
+    shard->entry_count += 1;
+
+    return entry;
+}
+
+/**
+ * Finds the entry of the key fetched from the upstream, whether complete or not.
+ * The shard of the hash must be locked.
+ */
+static struct cache_entry *cache_find(struct cache_shard *shard, unsigned long long hash,
+                                      const char *key, const char *upstream) {
+    for (struct cache_entry *entry = shard->buckets[hash & (shard->bucket_count - 1)];
+         entry != NULL; entry = entry->hash_next) {
+        if (entry->hash == hash && strcmp(entry->key, key) == 0 && strcmp(entry->upstream, upstream) == 0) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Loads the entries recorded in the snapshot at the path, most recently used last. Entries the index
+ * holds already are kept; when merging the snapshot of another process, they are checked again, as it
+ * may have moved its own copy of the file into place. Merged entries are checked too, and those whose
+ * file is gone are skipped.
+ * Returns 0 on success and -1 if there is no usable snapshot.
+ */
+static int cache_load_snapshot(struct cache *cache, const char *path, int merge) {
+    FILE *snapshot = fopen(path, "rb");
+    if (snapshot == NULL) {
+        return -1;
+    }
+
+    struct cache_snapshot_header header;
+    if (fread(&header, sizeof(header), 1, snapshot) != 1) {
+        fclose(snapshot);
+        return -1;
+    }
+
+    // Older snapshots keyed files by the bare name given to RETR, so their entries cannot be found anymore
+    int with_checksums = memcmp(header.magic, CACHE_SNAPSHOT_MAGIC, sizeof(header.magic)) == 0;
+    if (!with_checksums && memcmp(header.magic, CACHE_SNAPSHOT_MAGIC_V3, sizeof(header.magic)) != 0) {
+        log_info("Cache snapshot has an older format, starting empty\n");
+        fclose(snapshot);
+        return -1;
+    }
+
+    for (uint64_t i = 0; i < header.entry_count; i += 1) {
+        struct cache_snapshot_record record;
+        struct cache_snapshot_coverage coverage;
+        char key[UINT16_MAX + 1];
+        char upstream[UINT16_MAX + 1];
+
+        if (fread(&record, sizeof(record), 1, snapshot) != 1 ||
+            fread(key, 1, record.key_length, snapshot) != record.key_length ||
+            fread(upstream, 1, record.upstream_length, snapshot) != record.upstream_length ||
+            fread(&coverage, sizeof(coverage), 1, snapshot) != 1 ||
+            coverage.range_count > CACHE_SNAPSHOT_MAX_RANGES) {
+            log_warning("Cache snapshot is truncated\n");
+            break;
+        }
+        key[record.key_length] = '\0';
+        upstream[record.upstream_length] = '\0';
+
+        // The shard stays locked until the entry is complete, since workers run while merging
+        unsigned long long hash = cache_hash(key, upstream);
+        struct cache_shard *shard = cache_shard(cache, hash);
+        pthread_mutex_lock(&shard->mutex);
+        struct cache_entry *existing = cache_find(shard, hash, key, upstream);
+
+        // This process may have deleted the file since the other one recorded it
+        int missing = FALSE;
+        if (merge) {
+            char file_path[sizeof(existing->path)];
+            struct stat file_stat;
+            snprintf(file_path, sizeof(file_path), CACHE_DIRECTORY "/%016llx", hash);
+            missing = stat(file_path, &file_stat) < 0;
+        }
+
+        struct cache_entry *entry = existing == NULL && !missing ? cache_insert(shard, key, upstream) : NULL;
+        if (existing != NULL && merge && !missing) {
+            existing->verified = FALSE;
+        }
+
+        int truncated = FALSE;
+        for (uint32_t j = 0; j < coverage.range_count; j += 1) {
+            struct cache_snapshot_range range;
+            if (fread(&range, sizeof(range), 1, snapshot) != 1) {
+                truncated = TRUE;
+                break;
+            }
+            if (entry != NULL) {
+                range_set_add(&entry->coverage, range.start, range.end);
+            }
+        }
+
+        struct cache_snapshot_checksums checksums;
+        memset(&checksums, 0, sizeof(checksums));
+        if (!truncated && with_checksums && fread(&checksums, sizeof(checksums), 1, snapshot) != 1) {
+            truncated = TRUE;
+        }
+
+        if (entry != NULL) {
+            entry->size = record.size;
+            entry->size_known = (coverage.flags & CACHE_SNAPSHOT_SIZE_KNOWN) != 0;
+            entry->complete = entry->size_known && range_set_end_from(&entry->coverage, 0) >= entry->size;
+            entry->last_access = record.last_access;
+            entry->validated = record.validated;
+            memcpy(entry->modified, record.modified, sizeof(entry->modified));
+            entry->modified[sizeof(entry->modified) - 1] = '\0';
+            // A stored checksum is trusted, so the verifier only reads the files that lack one or were merged
+            entry->checksum = checksums.checksum;
+            entry->checksum_known = (checksums.flags & CACHE_SNAPSHOT_CHECKSUM_KNOWN) != 0;
+            entry->verified = entry->checksum_known && !merge;
+            memcpy(entry->sha256, checksums.sha256, sizeof(entry->sha256));
+            entry->sha256_known = (checksums.flags & CACHE_SNAPSHOT_SHA256_KNOWN) != 0;
+            cache_lru_add(cache, entry);
+        }
+        pthread_mutex_unlock(&shard->mutex);
+        if (truncated) {
+            log_warning("Cache snapshot is truncated\n");
+            break;
+        }
+    }
+
+    fclose(snapshot);
+
+    return 0;
+}
+
+/**
+ * Deletes files of the cache directory that no entry refers to, such as fills interrupted by a crash.
+ * Only the directory is read; no file is stat()ed.
+ */
+static void cache_remove_orphans(struct cache *cache) {
+    DIR *directory = opendir(CACHE_DIRECTORY);
+    if (directory == NULL) {
+        return;
+    }
+
+    struct dirent *file;
+    while ((file = readdir(directory)) != NULL) {
+        if (file->d_name[0] == '.' || file->d_type == DT_DIR) {
+            continue;
+        }
+
+        unsigned long long hash = strtoull(file->d_name, NULL, 16);
+        struct cache_shard *shard = cache_shard(cache, hash);
+        int referenced = FALSE;
+        for (struct cache_entry *entry = shard->buckets[hash & (shard->bucket_count - 1)];
+             entry != NULL; entry = entry->hash_next) {
+            if (strcmp(entry->path + strlen(CACHE_DIRECTORY "/"), file->d_name) == 0) {
+                referenced = TRUE;
+                break;
+            }
+        }
+
+        if (!referenced) {
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), CACHE_DIRECTORY "/%s", file->d_name);
+            unlink(path);
+        }
+    }
+
+    closedir(directory);
+}
+
+/**
+ * Calls every waiter of the entry once. The shard of the entry must be locked.
+ */
+static void cache_wake(struct cache_entry *entry) {
+    struct cache_waiter *waiter = entry->waiters;
+    entry->waiters = NULL;
+
+    while (waiter != NULL) {
+        struct cache_waiter *next = waiter->next;
+        waiter->wake(waiter);
+        waiter = next;
+    }
+}
+
+static void cache_free(struct cache_entry *entry) {
+    range_set_free(&entry->coverage);
+    free(entry->key);
+    free(entry->upstream);
+    free(entry);
+}
+
+/**
+ * Removes the entry from the index of its locked shard and deletes its file, unless a new process owns
+ * the cache directory, which may have a file of its own at the path by now.
+ * Returns TRUE if no transfer references the entry anymore, so the caller frees it after unlocking.
+ */
+static int cache_unlink(struct cache *cache, struct cache_entry *entry) {
+    struct cache_shard *shard = entry->shard;
+    unsigned long long hash = entry->hash;
+
+    for (struct cache_entry **link = &shard->buckets[hash & (shard->bucket_count - 1)];
+         *link != NULL; link = &(*link)->hash_next) {
+        if (*link == entry) {
+            *link = entry->hash_next;
+            break;
+        }
+    }
+    shard->entry_count -= 1;
+
+    if (entry->lru_prev != NULL) {
+        cache_lru_remove(cache, entry);
+        __atomic_add_fetch(&cache->changes, 1, __ATOMIC_RELAXED);
+    }
+
+    if (!__atomic_load_n(&cache->handed_off, __ATOMIC_RELAXED)) {
+        unlink(entry->path);
+    }
+    if (cache->hot != NULL) {
+        hot_cache_drop(cache->hot, &entry->hot);
+    }
+
+    // Transfers streaming the entry learn that it will never be complete
+    entry->removed = 1;
+    entry->filling = 0;
+    cache_wake(entry);
+
+    return entry->refs == 0;
+}
+
+/**
+ * Evicts least recently used entries until the cached files fit into the budget.
+ * The victim is the oldest of the shards' least recently used entries, and at most one shard
+ * is locked at a time.
+ */
+static void cache_evict(struct cache *cache) {
+    // The new process may serve any of the files
+    if (__atomic_load_n(&cache->handed_off, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    while (__atomic_load_n(&cache->used, __ATOMIC_RELAXED) > cache->budget) {
+        struct cache_shard *oldest = NULL;
+        time_t oldest_access = 0;
+
+        for (int i = 0; i < CACHE_SHARDS; i += 1) {
+            struct cache_shard *shard = &cache->shards[i];
+
+            pthread_mutex_lock(&shard->mutex);
+            struct cache_entry *tail = shard->lru.lru_prev;
+            if (tail != &shard->lru && (oldest == NULL || tail->last_access < oldest_access)) {
+                oldest = shard;
+                oldest_access = tail->last_access;
+            }
+            pthread_mutex_unlock(&shard->mutex);
+        }
+
+        if (oldest == NULL) {
+            return;
+        }
+
+        // The shard may have changed meanwhile, but its tail is still a fine victim
+        pthread_mutex_lock(&oldest->mutex);
+        struct cache_entry *victim = oldest->lru.lru_prev;
+        int unused = FALSE;
+        if (victim != &oldest->lru) {
+            log_info("Evicting %s (%lld bytes) from cache\n", victim->key, (long long) victim->stored);
+            unused = cache_unlink(cache, victim);
+            __atomic_add_fetch(&cache->evictions, 1, __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&oldest->mutex);
+
+        if (unused) {
+            cache_free(victim);
+        }
+    }
+}
+
+/**
+ * Wakes the snapshot writer up to write the index again.
+ */
+static void cache_request_snapshot(struct cache *cache) {
+    pthread_mutex_lock(&cache->snapshot_request_mutex);
+    cache->snapshot_requested = TRUE;
+    pthread_cond_signal(&cache->snapshot_wake);
+    pthread_mutex_unlock(&cache->snapshot_request_mutex);
+}
+
+/**
+ * Has a new snapshot written once enough changes of the index piled up.
+ */
+static void cache_changed(struct cache *cache) {
+    if (__atomic_load_n(&cache->changes, __ATOMIC_RELAXED) >= CACHE_SNAPSHOT_INTERVAL) {
+        cache_request_snapshot(cache);
+    }
+}
+
+/**
+ * Tells the verifier that complete entries may need to be checked.
+ */
+static void cache_request_verify(struct cache *cache) {
+    pthread_mutex_lock(&cache->verify_mutex);
+    cache->verify_requested = TRUE;
+    pthread_cond_signal(&cache->verify_wake);
+    pthread_mutex_unlock(&cache->verify_mutex);
+}
+
+/**
+ * Creates the cache directory and loads its index from the snapshot. Files no entry refers to are
+ * deleted, unless keep_orphans because a previous process still fills some of them.
+ * Returns 0 on success and -1 on failure.
+ */
+int cache_init(struct cache *cache, unsigned long long budget, int keep_orphans) {
+    memset(cache, 0, sizeof(*cache));
+
+    cache->budget = budget;
+    pthread_mutex_init(&cache->snapshot_mutex, NULL);
+    pthread_mutex_init(&cache->snapshot_request_mutex, NULL);
+    pthread_cond_init(&cache->snapshot_wake, NULL);
+    pthread_mutex_init(&cache->verify_mutex, NULL);
+    pthread_cond_init(&cache->verify_wake, NULL);
+    // Files loaded from the snapshot without a checksum get one once the verifier starts
+    cache->verify_requested = TRUE;
+
+    for (int i = 0; i < CACHE_SHARDS; i += 1) {
+        struct cache_shard *shard = &cache->shards[i];
+
+        pthread_mutex_init(&shard->mutex, NULL);
+        shard->lru.lru_prev = shard->lru.lru_next = &shard->lru;
+        shard->bucket_count = CACHE_INITIAL_BUCKETS;
+        shard->buckets = calloc(shard->bucket_count, sizeof(struct cache_entry *));
+        if (shard->buckets == NULL) {
+            perror("Error allocating cache index");
+            return -1;
+        }
+    }
+
+    // Create directory for cached files.
+    mkdir(CACHE_DIRECTORY, 0775);
+
+    if (cache_load_snapshot(cache, CACHE_SNAPSHOT_PATH, FALSE) < 0) {
+        log_info("No cache snapshot, starting with an empty cache\n");
+    }
+    if (!keep_orphans) {
+        cache_remove_orphans(cache);
+    }
+    cache_evict(cache);
+
+    size_t entry_count = 0;
+    for (int i = 0; i < CACHE_SHARDS; i += 1) {
+        entry_count += cache->shards[i].entry_count;
+    }
+    log_info("Cache holds %zu files, %llu of %llu bytes\n", entry_count, cache->used, cache->budget);
+
+    return 0;
+}
+
+/**
+ * Looks up an entry holding every byte from the offset to the end of the file, marks it as the most
+ * recently used one and copies the path of its file and the size the file must have.
+ * Returns 0 on a hit and -1 on a miss.
+ */
+int cache_lookup(struct cache *cache, const char *key, const char *upstream, off_t offset,
+                 char *path, size_t size, off_t *file_size) {
+    unsigned long long hash = cache_hash(key, upstream);
+    struct cache_shard *shard = cache_shard(cache, hash);
+    int result = -1;
+
+    pthread_mutex_lock(&shard->mutex);
+    struct cache_entry *entry = cache_find(shard, hash, key, upstream);
+
+    // A new fill writes a temporary file, so its bytes are not at the entry's path yet
+    if (entry != NULL && !entry->temporary &&
+        (entry->complete || (entry->size_known && range_set_end_from(&entry->coverage, offset) >= entry->size))) {
+        entry->last_access = time(NULL);
+        if (entry->lru_prev != NULL) {
+            cache_lru_unlink(entry);
+            cache_lru_push_front(shard, entry);
+        }
+        snprintf(path, size, "%s", entry->path);
+        *file_size = entry->size;
+        result = 0;
+    }
+    pthread_mutex_unlock(&shard->mutex);
+
+    return result;
+}
+
+/**
+ * Gets the SHA-256 and size of a complete cached file. If the SHA-256 is not known yet, the verifier
+ * is asked to compute it, so the next lookup finds it.
+ * Returns 0 if the SHA-256 is known and -1 otherwise.
+ */
+int cache_lookup_sha256(struct cache *cache, const char *key, const char *upstream, off_t *file_size,
+                        unsigned char sha256[CHECKSUM_SHA256_SIZE]) {
+    unsigned long long hash = cache_hash(key, upstream);
+    struct cache_shard *shard = cache_shard(cache, hash);
+    int result = -1;
+    int wanted = FALSE;
+
+    pthread_mutex_lock(&shard->mutex);
+    struct cache_entry *entry = cache_find(shard, hash, key, upstream);
+    if (entry != NULL && entry->complete && !entry->temporary) {
+        if (entry->sha256_known) {
+            memcpy(sha256, entry->sha256, CHECKSUM_SHA256_SIZE);
+            *file_size = entry->size;
+            result = 0;
+        } else if (!entry->sha256_wanted) {
+            entry->sha256_wanted = TRUE;
+            wanted = TRUE;
+        }
+    }
+    pthread_mutex_unlock(&shard->mutex);
+
+    if (wanted) {
+        cache_request_verify(cache);
+    }
+
+    return result;
+}
+
+/**
+ * Looks up the copy in memory of a complete entry.
+ * Returns the copy, which the caller releases with hot_cache_put(), or NULL if there is none.
+ */
+struct hot_file *cache_lookup_hot(struct cache *cache, const char *key, const char *upstream) {
+    unsigned long long hash = cache_hash(key, upstream);
+    struct cache_shard *shard = cache_shard(cache, hash);
+    struct hot_file *file = NULL;
+
+    if (cache->hot == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&shard->mutex);
+    struct cache_entry *entry = cache_find(shard, hash, key, upstream);
+    if (entry != NULL && entry->complete && !entry->temporary) {
+        file = hot_cache_get(cache->hot, &entry->hot);
+    }
+    pthread_mutex_unlock(&shard->mutex);
+
+    return file;
+}
+
+/**
+ * Copies a small cached file, opened from the path of its entry, into the memory tier, so later hits
+ * never touch the disk. The copy is only attached if the file at the entry's path is still that one.
+ * Returns the copy, which the caller releases with hot_cache_put(), or NULL if the file is not kept
+ * in memory.
+ */
+struct hot_file *cache_promote(struct cache *cache, const char *key, const char *upstream, int fd, off_t size) {
+    unsigned long long hash = cache_hash(key, upstream);
+    struct cache_shard *shard = cache_shard(cache, hash);
+    struct stat opened;
+    struct stat current;
+
+    if (cache->hot == NULL || size > cache->hot->threshold || fstat(fd, &opened) < 0) {
+        return NULL;
+    }
+
+    // Read without the lock of the shard, since the descriptor keeps the file even if it is replaced
+    struct hot_file *file = hot_cache_load(cache->hot, fd, size);
+    if (file == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&shard->mutex);
+    struct cache_entry *entry = cache_find(shard, hash, key, upstream);
+    // A fill replacing the file renames its new one over the path
+    if (entry != NULL && entry->complete && !entry->temporary && entry->size == size &&
+        stat(entry->path, &current) == 0 && current.st_ino == opened.st_ino && current.st_dev == opened.st_dev) {
+        hot_cache_attach(cache->hot, &entry->hot, file);
+    }
+    pthread_mutex_unlock(&shard->mutex);
+
+    return file;
+}
+
+/**
+ * Removes the entry of the key, if any, after its file turned out to be unusable.
+ * A fill of the key in progress is left alone.
+ */
+void cache_invalidate(struct cache *cache, const char *key, const char *upstream) {
+    unsigned long long hash = cache_hash(key, upstream);
+    struct cache_shard *shard = cache_shard(cache, hash);
+    int unused = FALSE;
+
+    pthread_mutex_lock(&shard->mutex);
+    struct cache_entry *entry = cache_find(shard, hash, key, upstream);
+    if (entry != NULL && !entry->filling) {
+        unused = cache_unlink(cache, entry);
+    }
+    pthread_mutex_unlock(&shard->mutex);
+
+    if (unused) {
+        cache_free(entry);
+    }
+    cache_changed(cache);
+}
+
+/**
+ * Tells whether the entry of the key can be used without asking the server whether the file changed.
+ */
+enum cache_freshness cache_check_freshness(struct cache *cache, const char *key, const char *upstream, int window) {
+    unsigned long long hash = cache_hash(key, upstream);
+    struct cache_shard *shard = cache_shard(cache, hash);
+    enum cache_freshness freshness = CACHE_ABSENT;
+
+    pthread_mutex_lock(&shard->mutex);
+    struct cache_entry *entry = cache_find(shard, hash, key, upstream);
+    if (entry != NULL) {
+        freshness = entry->filling || time(NULL) - entry->validated < window ? CACHE_FRESH : CACHE_STALE;
+    }
+    pthread_mutex_unlock(&shard->mutex);
+
+    return freshness;
+}
+
+/**
+ * Compares the entry of the key with the size and modification time the server reported, either of
+ * which may be unknown (-1 and an empty string). An entry that no longer matches is removed; one
+ * that does is fresh again, and learns what it did not know of the file yet, which may complete it.
+ */
+void cache_revalidate(struct cache *cache, const char *key, const char *upstream, off_t size, const char *modified) {
+    unsigned long long hash = cache_hash(key, upstream);
+    struct cache_shard *shard = cache_shard(cache, hash);
+    int unused = FALSE;
+
+    pthread_mutex_lock(&shard->mutex);
+    struct cache_entry *entry = cache_find(shard, hash, key, upstream);
+    if (entry == NULL || entry->filling) {
+        pthread_mutex_unlock(&shard->mutex);
+        return;
+    }
+
+    off_t end = entry->coverage.count > 0 ? entry->coverage.ranges[entry->coverage.count - 1].end : 0;
+    if ((size >= 0 && entry->size_known && size != entry->size) || (size >= 0 && end > size) ||
+        (modified[0] != '\0' && entry->modified[0] != '\0' && strcmp(modified, entry->modified) != 0)) {
+        log_info("Cached %s changed on the server\n", entry->key);
+        unused = cache_unlink(cache, entry);
+    } else {
+        entry->validated = time(NULL);
+        if (entry->modified[0] == '\0') {
+            snprintf(entry->modified, sizeof(entry->modified), "%s", modified);
+        }
+        if (size >= 0 && !entry->size_known) {
+            entry->size = size;
+            entry->size_known = 1;
+            entry->complete = range_set_end_from(&entry->coverage, 0) >= size;
+        }
+    }
+    int verify = !unused && entry->complete && !entry->verified;
+    pthread_mutex_unlock(&shard->mutex);
+
+    if (unused) {
+        cache_free(entry);
+    }
+    if (verify) {
+        cache_request_verify(cache);
+    }
+    cache_changed(cache);
+}
+
+/**
+ * Records the modification time the server reported for the file of an entry being filled, for the
+ * transfer filling it.
+ */
+void cache_set_modified(struct cache_entry *entry, const char *modified) {
+    pthread_mutex_lock(&entry->shard->mutex);
+    snprintf(entry->modified, sizeof(entry->modified), "%s", modified);
+    pthread_mutex_unlock(&entry->shard->mutex);
+}
+
+/**
+ * Records the checksum a fill computed while writing the whole file in order, for the transfer filling
+ * the entry. The file needs no verification until the proxy restarts.
+ */
+void cache_set_checksum(struct cache_entry *entry, unsigned long long checksum) {
+    pthread_mutex_lock(&entry->shard->mutex);
+    entry->checksum = checksum;
+    entry->checksum_known = TRUE;
+    entry->verified = TRUE;
+    pthread_mutex_unlock(&entry->shard->mutex);
+}
+
+/**
+ * Gets the file the fill of an entry writes into. The shard of the entry must be locked, unless
+ * the caller is the one filling it.
+ */
+static void cache_fill_file(const struct cache_entry *entry, char *path, size_t size) {
+    if (entry->temporary) {
+        // Named after the process, so the fill of a process that handed off never shares the file
+        snprintf(path, size, "%s.%d.part", entry->path, (int) getpid());
+    } else {
+        snprintf(path, size, "%s", entry->path);
+    }
+}
+
+/**
+ * Finds the entry of the key while another transfer is still filling it, provided the fill will reach
+ * every byte from the offset without a gap. The entry stays allocated until the caller releases it
+ * with cache_release(), and the path of the file being filled is copied.
+ * Returns the entry, or NULL if there is no such fill.
+ */
+struct cache_entry *cache_join_fill(struct cache *cache, const char *key, const char *upstream, off_t offset,
+                                    char *path, size_t size) {
+    unsigned long long hash = cache_hash(key, upstream);
+    struct cache_shard *shard = cache_shard(cache, hash);
+
+    pthread_mutex_lock(&shard->mutex);
+    struct cache_entry *entry = cache_find(shard, hash, key, upstream);
+    if (entry != NULL && entry->filling) {
+        off_t end = range_set_end_from(&entry->coverage, offset);
+
+        if (end >= entry->fill_offset && (offset <= entry->fill_offset || end > offset)) {
+            entry->refs += 1;
+            cache_fill_file(entry, path, size);
+        } else {
+            entry = NULL;
+        }
+    } else {
+        entry = NULL;
+    }
+    pthread_mutex_unlock(&shard->mutex);
+
+    return entry;
+}
+
+/**
+ * Starts filling the entry of the key from the offset. The bytes of a partial entry are kept, and
+ * the fill starts at the first byte missing from the offset on, which is left in entry->fill_offset.
+ * Without a partial entry, or with replace, a new entry is created and written to a temporary file.
+ * Once a new process owns the cache directory, nothing is filled anymore and misses are only relayed.
+ * Returns the entry, or NULL if the key is already being filled by another transfer or the cache was
+ * handed off.
+ */
+struct cache_entry *cache_begin_fill(struct cache *cache, const char *key, const char *upstream, off_t offset,
+                                     int replace) {
+    unsigned long long hash = cache_hash(key, upstream);
+    struct cache_shard *shard = cache_shard(cache, hash);
+    struct cache_entry *replaced = NULL;
+
+    if (__atomic_load_n(&cache->handed_off, __ATOMIC_RELAXED)) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&shard->mutex);
+    struct cache_entry *entry = cache_find(shard, hash, key, upstream);
+    if (entry != NULL && entry->filling) {
+        pthread_mutex_unlock(&shard->mutex);
+        return NULL;
+    }
+
+    if (entry != NULL && (entry->complete || replace)) {
+        // Transfers still reading the old file keep their descriptor to it
+        if (cache_unlink(cache, entry)) {
+            replaced = entry;
+        }
+        entry = NULL;
+    }
+
+    if (entry != NULL) {
+        cache_lru_remove(cache, entry);
+        entry->fill_offset = range_set_end_from(&entry->coverage, offset);
+    } else {
+        entry = cache_insert(shard, key, upstream);
+        if (entry != NULL) {
+            entry->temporary = 1;
+            entry->fill_offset = offset;
+        }
+    }
+    if (entry != NULL) {
+        entry->filling = 1;
+    }
+    pthread_mutex_unlock(&shard->mutex);
+
+    if (replaced != NULL) {
+        cache_free(replaced);
+    }
+
+    return entry;
+}
+
+/**
+ * Ends the fill of an entry once its file is at the entry's path. A successful fill reached the end
+ * of the file, which tells its size. The bytes written are kept either way, and the entry becomes
+ * a hit once every byte of the file is present. Entries over the budget are evicted afterwards.
+ */
+void cache_end_fill(struct cache *cache, struct cache_entry *entry, int success) {
+    struct cache_shard *shard = entry->shard;
+
+    pthread_mutex_lock(&shard->mutex);
+    entry->filling = 0;
+    entry->temporary = 0;
+    if (success) {
+        entry->size = entry->fill_offset;
+        entry->size_known = 1;
+        entry->validated = time(NULL);
+    }
+    entry->complete = entry->size_known && range_set_end_from(&entry->coverage, 0) >= entry->size;
+    entry->last_access = time(NULL);
+    if (__atomic_load_n(&cache->handed_off, __ATOMIC_RELAXED)) {
+        entry->handoff_fill = TRUE;
+    }
+
+    int unused = FALSE;
+    if (!entry->complete && entry->coverage.count == 0) {
+        unused = cache_unlink(cache, entry);
+    } else {
+        cache_lru_add(cache, entry);
+        __atomic_add_fetch(&cache->changes, 1, __ATOMIC_RELAXED);
+
+        if ((unsigned long long) entry->stored > cache->budget) {
+            // Keeping it would flush everything else out of the cache; transfers streaming it still finish
+            log_info("Not caching %s, %lld bytes exceed the cache size\n", entry->key, (long long) entry->stored);
+            unused = cache_unlink(cache, entry);
+        } else if (entry->complete) {
+            log_info("Cached %s (%lld bytes)\n", entry->key, (long long) entry->size);
+        } else {
+            log_info("Cached %lld bytes of %s in %zu segments\n",
+                   (long long) entry->stored, entry->key, entry->coverage.count);
+        }
+    }
+
+    // Files filled out of order, such as by segments, get their checksum from the verifier
+    int verify = !unused && entry->complete && !entry->verified;
+
+    cache_wake(entry);
+    pthread_mutex_unlock(&shard->mutex);
+
+    if (unused) {
+        cache_free(entry);
+    }
+    if (verify) {
+        cache_request_verify(cache);
+    }
+
+    cache_evict(cache);
+    cache_changed(cache);
+}
+
+/**
+ * Removes the entry from the index and deletes its file.
+ */
+void cache_remove(struct cache *cache, struct cache_entry *entry) {
+    struct cache_shard *shard = entry->shard;
+
+    pthread_mutex_lock(&shard->mutex);
+    int unused = cache_unlink(cache, entry);
+    pthread_mutex_unlock(&shard->mutex);
+
+    if (unused) {
+        cache_free(entry);
+    }
+    cache_changed(cache);
+}
+
+/**
+ * Gets the file the fill of an entry writes into, for the transfer filling it.
+ */
+void cache_fill_path(const struct cache_entry *entry, char *path, size_t size) {
+    cache_fill_file(entry, path, size);
+}
+
+/**
+ * Records that bytes of the entry have been written at the offset and wakes up the transfers waiting
+ * for them. The fill offset moves on to the end of the bytes present without a gap, so a fill written
+ * by several writers at once advances as their ranges join up.
+ */
+void cache_fill_progress(struct cache_entry *entry, off_t offset, off_t size) {
+    pthread_mutex_lock(&entry->shard->mutex);
+    range_set_add(&entry->coverage, offset, offset + size);
+    entry->fill_offset = range_set_end_from(&entry->coverage, entry->fill_offset);
+    cache_wake(entry);
+    pthread_mutex_unlock(&entry->shard->mutex);
+}
+
+/**
+ * Gets how many bytes of a joined entry are present without a gap from the offset, and whether more
+ * are coming.
+ */
+enum cache_fill_state cache_fill_status(struct cache_entry *entry, off_t offset, off_t *available) {
+    enum cache_fill_state state = CACHE_FILL_FAILED;
+
+    pthread_mutex_lock(&entry->shard->mutex);
+    *available = range_set_end_from(&entry->coverage, offset);
+    if (entry->size_known && *available >= entry->size) {
+        state = CACHE_FILL_COMPLETE;
+    } else if (entry->filling) {
+        state = CACHE_FILL_ACTIVE;
+    }
+    pthread_mutex_unlock(&entry->shard->mutex);
+
+    return state;
+}
+
+/**
+ * Releases a reference taken with cache_join_fill(), freeing the entry if it was removed.
+ */
+void cache_release(struct cache_entry *entry) {
+    pthread_mutex_lock(&entry->shard->mutex);
+    entry->refs -= 1;
+    int unused = entry->refs == 0 && entry->removed;
+    pthread_mutex_unlock(&entry->shard->mutex);
+
+    if (unused) {
+        cache_free(entry);
+    }
+}
+
+/**
+ * Registers a one-shot callback for the next progress or the end of the fill of the entry,
+ * unless the fill already got past the offset or ended since the caller looked at it.
+ * Returns 0 if the callback was registered and -1 if the caller can go on right away.
+ */
+int cache_wait(struct cache_entry *entry, off_t offset, struct cache_waiter *waiter) {
+    int result = 0;
+
+    pthread_mutex_lock(&entry->shard->mutex);
+    if (range_set_end_from(&entry->coverage, offset) > offset || !entry->filling) {
+        result = -1;
+    } else {
+        struct cache_waiter *other = entry->waiters;
+        while (other != NULL && other != waiter) {
+            other = other->next;
+        }
+        if (other == NULL) {
+            waiter->next = entry->waiters;
+            entry->waiters = waiter;
+        }
+    }
+    pthread_mutex_unlock(&entry->shard->mutex);
+
+    return result;
+}
+
+/**
+ * Unregisters a callback added with cache_wait() that has not been called yet.
+ */
+void cache_cancel_wait(struct cache_entry *entry, struct cache_waiter *waiter) {
+    pthread_mutex_lock(&entry->shard->mutex);
+    for (struct cache_waiter **link = &entry->waiters; *link != NULL; link = &(*link)->next) {
+        if (*link == waiter) {
+            *link = waiter->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&entry->shard->mutex);
+}
+
+/**
+ * Tells whether the file of an entry has to be read by the verifier. The shard of the entry must be locked.
+ */
+static int cache_needs_verify(const struct cache_entry *entry) {
+    return entry->complete && !entry->filling && !entry->temporary && !entry->removed &&
+           (!entry->verified || (entry->sha256_wanted && !entry->sha256_known));
+}
+
+/**
+ * Reads a whole cached file into the checksums, no faster than CACHE_VERIFY_RATE so the verifier
+ * leaves the disk to the transfers.
+ * Returns 0 on success and -1 if the file is missing, has another size or cannot be read.
+ */
+static int cache_verify_file(const char *path, off_t size, char *buffer, struct checksum *checksum) {
+    struct timespec pause = {0, (long) (CACHE_VERIFY_CHUNK * 1000000000ULL / CACHE_VERIFY_RATE)};
+    struct stat file_stat;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &file_stat) < 0 || file_stat.st_size != size) {
+        close(fd);
+        return -1;
+    }
+
+    off_t offset = 0;
+    while (offset < size) {
+        ssize_t read_size = pread(fd, buffer, CACHE_VERIFY_CHUNK, offset);
+        if (read_size < 0 && errno == EINTR) {
+            continue;
+        }
+        if (read_size <= 0) {
+            close(fd);
+            return -1;
+        }
+        checksum_update(checksum, buffer, read_size);
+        offset += read_size;
+        nanosleep(&pause, NULL);
+    }
+
+    close(fd);
+    return 0;
+}
+
+/**
+ * Checks one entry found by the verifier, which holds a reference to it. A file that does not match
+ * its checksum, or is missing or cut short, is dropped so the next download fetches it again; a file
+ * without a checksum yet gets one.
+ */
+static void cache_verify_entry(struct cache *cache, struct cache_entry *entry, char *buffer) {
+    struct cache_shard *shard = entry->shard;
+    struct checksum checksum;
+    char path[sizeof(entry->path)];
+    unsigned long long computed;
+    unsigned char sha256[CHECKSUM_SHA256_SIZE];
+
+    pthread_mutex_lock(&shard->mutex);
+    snprintf(path, sizeof(path), "%s", entry->path);
+    off_t size = entry->size;
+    checksum_init(&checksum, entry->sha256_wanted && !entry->sha256_known);
+    pthread_mutex_unlock(&shard->mutex);
+
+    int result = cache_verify_file(path, size, buffer, &checksum);
+    checksum_final(&checksum, &computed, sha256);
+
+    int unused = FALSE;
+    pthread_mutex_lock(&shard->mutex);
+    // A fill replacing the entry meanwhile removed it, and may have written a new file at its path
+    if (!entry->removed && entry->complete && !entry->filling && entry->size == size) {
+        if (result < 0 || (entry->checksum_known && computed != entry->checksum)) {
+            log_warning("Cached %s is damaged, dropping it\n", entry->key);
+            cache_unlink(cache, entry);
+            __atomic_add_fetch(&cache->damaged, 1, __ATOMIC_RELAXED);
+        } else {
+            if (!entry->checksum_known) {
+                __atomic_add_fetch(&cache->changes, 1, __ATOMIC_RELAXED);
+            }
+            entry->checksum = computed;
+            entry->checksum_known = TRUE;
+            entry->verified = TRUE;
+            if (checksum.with_sha256) {
+                memcpy(entry->sha256, sha256, sizeof(entry->sha256));
+                entry->sha256_known = TRUE;
+                __atomic_add_fetch(&cache->changes, 1, __ATOMIC_RELAXED);
+            }
+        }
+    }
+    entry->refs -= 1;
+    unused = entry->refs == 0 && entry->removed;
+    pthread_mutex_unlock(&shard->mutex);
+
+    if (unused) {
+        cache_free(entry);
+    }
+}
+
+/**
+ * Checks every entry needing it that one sweep over the shards finds.
+ * Returns how many entries were checked.
+ */
+static int cache_verify_sweep(struct cache *cache, char *buffer) {
+    int checked = 0;
+
+    for (int i = 0; i < CACHE_SHARDS; i += 1) {
+        struct cache_shard *shard = &cache->shards[i];
+        size_t bucket = 0;
+
+        while (TRUE) {
+            struct cache_entry *found = NULL;
+
+            // The buckets may grow while a file is read, which at worst skips entries until the next sweep
+            pthread_mutex_lock(&shard->mutex);
+            for (; bucket < shard->bucket_count && found == NULL; bucket += 1) {
+                for (struct cache_entry *entry = shard->buckets[bucket]; entry != NULL; entry = entry->hash_next) {
+                    if (cache_needs_verify(entry)) {
+                        found = entry;
+                        found->refs += 1;
+                        break;
+                    }
+                }
+            }
+            pthread_mutex_unlock(&shard->mutex);
+
+            if (found == NULL) {
+                break;
+            }
+            // The bucket is looked at again, as it may hold more entries to check
+            bucket -= 1;
+            cache_verify_entry(cache, found, buffer);
+            checked += 1;
+        }
+    }
+
+    return checked;
+}
+
+/**
+ * Background thread checking complete files against their checksums whenever entries need it: files
+ * loaded from the snapshot without a checksum, files whose fill could not compute the checksum on the
+ * way, files the previous process wrote again after a handoff, and files a client asked the SHA-256 of.
+ */
+static void *cache_verify_thread(void *data) {
+    struct cache *cache = data;
+    char *buffer = malloc(CACHE_VERIFY_CHUNK);
+
+    if (buffer == NULL) {
+        log_error("Cannot allocate the buffer of the cache verifier\n");
+        return NULL;
+    }
+
+    while (TRUE) {
+        pthread_mutex_lock(&cache->verify_mutex);
+        while (!cache->verify_requested) {
+            pthread_cond_wait(&cache->verify_wake, &cache->verify_mutex);
+        }
+        cache->verify_requested = FALSE;
+        pthread_mutex_unlock(&cache->verify_mutex);
+
+        // Sweep until nothing is left, since requests arriving during a sweep may concern entries already passed
+        while (cache_verify_sweep(cache, buffer) > 0) {
+        }
+        cache_changed(cache);
+    }
+
+    return NULL;
+}
+
+/**
+ * Background thread writing the snapshot whenever the workers report enough changes, so they never
+ * wait on the disk for it.
+ */
+static void *cache_snapshot_thread(void *data) {
+    struct cache *cache = data;
+
+    while (TRUE) {
+        pthread_mutex_lock(&cache->snapshot_request_mutex);
+        while (!cache->snapshot_requested) {
+            pthread_cond_wait(&cache->snapshot_wake, &cache->snapshot_request_mutex);
+        }
+        cache->snapshot_requested = FALSE;
+        pthread_mutex_unlock(&cache->snapshot_request_mutex);
+
+        cache_save_snapshot(cache);
+    }
+
+    return NULL;
+}
+
+/**
+ * Starts the background threads verifying the cached files and writing the snapshot.
+ * Returns 0 on success and -1 on failure.
+ */
+int cache_start_threads(struct cache *cache) {
+    if (pthread_create(&cache->verifier, NULL, cache_verify_thread, cache) != 0) {
+        perror("Error creating cache verifier thread");
+        return -1;
+    }
+    if (pthread_create(&cache->snapshot_writer, NULL, cache_snapshot_thread, cache) != 0) {
+        perror("Error creating cache snapshot thread");
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Writes every entry that is not being filled into the snapshot file at the path, or with handoff_fills
+ * only those whose fill ended after the handoff, replacing the previous snapshot atomically. The records
+ * of a shard are copied into memory while it is locked, and written to the file after it was unlocked.
+ * Called with the snapshot mutex held.
+ * Returns 0 on success and -1 on failure.
+ */
+static int cache_write_snapshot(struct cache *cache, const char *path, int handoff_fills) {
+    char temp_path[PATH_MAX];
+
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+    __atomic_store_n(&cache->changes, 0, __ATOMIC_RELAXED);
+
+    FILE *snapshot = fopen(temp_path, "wb");
+    if (snapshot == NULL) {
+        perror("Error writing cache snapshot");
+        return -1;
+    }
+
+    // The entry count is patched in once every shard has been written
+    struct cache_snapshot_header header;
+    memcpy(header.magic, CACHE_SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.entry_count = 0;
+    fwrite(&header, sizeof(header), 1, snapshot);
+
+    for (int i = 0; i < CACHE_SHARDS; i += 1) {
+        struct cache_shard *shard = &cache->shards[i];
+        char *records = NULL;
+        size_t records_size = 0;
+
+        FILE *buffer = open_memstream(&records, &records_size);
+        if (buffer == NULL) {
+            perror("Error writing cache snapshot");
+            fclose(snapshot);
+            unlink(temp_path);
+            return -1;
+        }
+
+        // Least recently used first, so loading restores the order of each shard
+        pthread_mutex_lock(&shard->mutex);
+        for (struct cache_entry *entry = shard->lru.lru_prev; entry != &shard->lru; entry = entry->lru_prev) {
+            if (handoff_fills && !entry->handoff_fill) {
+                continue;
+            }
+
+            struct cache_snapshot_record record;
+            memset(&record, 0, sizeof(record));
+            record.size = entry->size;
+            record.last_access = entry->last_access;
+            record.validated = entry->validated;
+            memcpy(record.modified, entry->modified, sizeof(record.modified));
+            record.key_length = strnlen(entry->key, UINT16_MAX);
+            record.upstream_length = strnlen(entry->upstream, UINT16_MAX);
+
+            struct cache_snapshot_coverage coverage;
+            coverage.range_count = entry->coverage.count;
+            coverage.flags = entry->size_known ? CACHE_SNAPSHOT_SIZE_KNOWN : 0;
+
+            fwrite(&record, sizeof(record), 1, buffer);
+            fwrite(entry->key, 1, record.key_length, buffer);
+            fwrite(entry->upstream, 1, record.upstream_length, buffer);
+            fwrite(&coverage, sizeof(coverage), 1, buffer);
+            for (size_t j = 0; j < entry->coverage.count; j += 1) {
+                struct cache_snapshot_range range;
+                range.start = entry->coverage.ranges[j].start;
+                range.end = entry->coverage.ranges[j].end;
+                fwrite(&range, sizeof(range), 1, buffer);
+            }
+
+            struct cache_snapshot_checksums checksums;
+            memset(&checksums, 0, sizeof(checksums));
+            checksums.checksum = entry->checksum;
+            memcpy(checksums.sha256, entry->sha256, sizeof(checksums.sha256));
+            checksums.flags = (entry->checksum_known ? CACHE_SNAPSHOT_CHECKSUM_KNOWN : 0) |
+                              (entry->sha256_known ? CACHE_SNAPSHOT_SHA256_KNOWN : 0);
+            fwrite(&checksums, sizeof(checksums), 1, buffer);
+            header.entry_count += 1;
+        }
+        pthread_mutex_unlock(&shard->mutex);
+
+        fclose(buffer);
+        fwrite(records, 1, records_size, snapshot);
+        free(records);
+    }
+
+    rewind(snapshot);
+    fwrite(&header, sizeof(header), 1, snapshot);
+
+    if (fclose(snapshot) != 0 || rename(temp_path, path) < 0) {
+        perror("Error writing cache snapshot");
+        unlink(temp_path);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Writes the snapshot of the index, which goes to CACHE_HANDOFF_PATH once a new process owns the
+ * cache directory.
+ * Returns 0 on success and -1 on failure.
+ */
+int cache_save_snapshot(struct cache *cache) {
+    pthread_mutex_lock(&cache->snapshot_mutex);
+    int handed_off = __atomic_load_n(&cache->handed_off, __ATOMIC_RELAXED);
+    int result = cache_write_snapshot(cache, handed_off ? CACHE_HANDOFF_PATH : CACHE_SNAPSHOT_PATH, handed_off);
+    pthread_mutex_unlock(&cache->snapshot_mutex);
+
+    return result;
+}
+
+/**
+ * Leaves the cache directory to the new process and writes the snapshot it starts from: files are no
+ * longer deleted and no fill starts, and later snapshots only record the fills that ended since, for
+ * the new one to merge once this one exited.
+ */
+void cache_hand_off(struct cache *cache) {
+    pthread_mutex_lock(&cache->snapshot_mutex);
+    // Set first, so a fill ending while the snapshot is written is recorded in one of the two at least
+    __atomic_store_n(&cache->handed_off, TRUE, __ATOMIC_RELAXED);
+    unlink(CACHE_HANDOFF_PATH);
+    cache_write_snapshot(cache, CACHE_SNAPSHOT_PATH, FALSE);
+    pthread_mutex_unlock(&cache->snapshot_mutex);
+}
+
+/**
+ * Tells whether a transfer or fetch still fills an entry.
+ * Returns TRUE if any entry is being filled.
+ */
+int cache_filling(struct cache *cache) {
+    int filling = FALSE;
+
+    for (int i = 0; i < CACHE_SHARDS && !filling; i += 1) {
+        struct cache_shard *shard = &cache->shards[i];
+
+        pthread_mutex_lock(&shard->mutex);
+        for (size_t j = 0; j < shard->bucket_count && !filling; j += 1) {
+            for (struct cache_entry *entry = shard->buckets[j]; entry != NULL; entry = entry->hash_next) {
+                if (entry->filling) {
+                    filling = TRUE;
+                    break;
+                }
+            }
+        }
+        pthread_mutex_unlock(&shard->mutex);
+    }
+
+    return filling;
+}
+
+/**
+ * Adds the files the previous process cached after it handed off, once it exited. Its files were moved
+ * into place already, and the verifier reads every one of them before trusting its checksum; records
+ * of files this process deleted meanwhile are skipped. Orphans left by fills it did not finish are only deleted on the next start without a
+ * handoff.
+ */
+void cache_merge_handoff(struct cache *cache) {
+    if (cache_load_snapshot(cache, CACHE_HANDOFF_PATH, TRUE) < 0) {
+        return;
+    }
+    unlink(CACHE_HANDOFF_PATH);
+    log_info("Merged the cache index of the previous process\n");
+
+    cache_request_verify(cache);
+    cache_evict(cache);
+    cache_request_snapshot(cache);
+}
@@ -0,0 +1,181 @@
+#ifndef FTP_PROXY_CACHE_H
+#define FTP_PROXY_CACHE_H
+
+#include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "checksum.h"
+#include "range.h"
+
+#define CACHE_DIRECTORY "cache"
+#define CACHE_SNAPSHOT_PATH CACHE_DIRECTORY "/.index"
+#define CACHE_HANDOFF_PATH CACHE_DIRECTORY "/.index.handoff"   // Snapshot of a process that handed off, until it exited
+#define CACHE_DEFAULT_BUDGET (1024ULL * 1024 * 1024)
+#define CACHE_SHARD_BITS 4
+#define CACHE_SHARDS (1 << CACHE_SHARD_BITS)
+#define CACHE_MODIFIED_SIZE 24              // Longest MDTM timestamp kept, with fractional seconds
+#define CACHE_DEFAULT_FRESHNESS 60          // Seconds an entry is served before the server is asked again
+
+struct cache_shard;
+struct hot_cache;
+struct hot_file;
+
+/**
+ * Callback registered by a transfer waiting for more bytes of an entry being filled.
+ * It is called with the entry's shard locked, possibly from another worker's thread.
+ */
+struct cache_waiter {
+    void (*wake)(struct cache_waiter *waiter);
+    struct cache_waiter *next;
+};
+
+/**
+ * Metadata of one cached file, which may only hold some byte ranges of the upstream file when
+ * transfers were resumed or aborted. Complete entries are hits from any offset, partial ones from
+ * offsets whose bytes are present up to the known end of the file. Entries that are not being
+ * filled take part in eviction.
+ * Every field that changes after creation is guarded by the lock of the entry's shard.
+ */
+struct cache_entry {
+    struct cache_shard *shard;
+    char *key;                      // Path of the file resolved against the working directory of the session
+    char *upstream;                 // User and server the path belongs to, the first mirror standing for all
+    char path[32];                  // Location of the file inside the cache directory
+    unsigned long long hash;
+    off_t size;                     // Size of the upstream file, once size_known
+    int size_known;                 // A fill reached the end of the file, or the server told its size
+    char modified[CACHE_MODIFIED_SIZE];     // Modification time of the upstream file from MDTM, empty if unknown
+    time_t validated;               // When the file was last fetched or confirmed unchanged by the server
+    struct range_set coverage;      // Byte ranges of the file present in the cache
+    off_t stored;                   // Bytes counted against the budget while in the LRU list
+    off_t fill_offset;              // End of the bytes written without a gap while the entry is being filled
+    time_t last_access;
+    int complete;                   // Every byte of the file is present
+    int filling;                    // A transfer writes into the entry
+    int temporary;                  // The fill writes a new file, which replaces the entry's one once it ends
+    int removed;                    // No longer in the index, freed once the last reference is released
+    int refs;                       // Transfers streaming the entry while it is being filled, and the verifier
+    struct cache_waiter *waiters;   // Woken up when the fill progresses or ends
+    struct hot_file *hot;           // Copy of a complete small file in memory, guarded by the hot cache's mutex
+    unsigned long long checksum;    // XXH64 of the complete file, once checksum_known
+    int checksum_known;
+    int verified;                   // The checksum was computed or checked since the file was written, or loaded with it
+    unsigned char sha256[CHECKSUM_SHA256_SIZE];     // SHA-256 of the complete file, once sha256_known
+    int sha256_known;
+    int sha256_wanted;              // A client asked for the SHA-256, which the verifier computes
+    int handoff_fill;               // A fill ended after the cache was handed off, so the new process merges the entry
+
+    struct cache_entry *hash_next;
+    struct cache_entry *lru_prev;   // Towards the most recently used entry
+    struct cache_entry *lru_next;   // Towards the least recently used entry
+};
+
+enum cache_freshness {
+    CACHE_ABSENT,                   // Nothing of the file is cached
+    CACHE_FRESH,                    // The entry was validated within the freshness window, or is being filled
+    CACHE_STALE                     // The server has to confirm the entry before it is used
+};
+
+enum cache_fill_state {
+    CACHE_FILL_ACTIVE,              // More bytes are coming
+    CACHE_FILL_COMPLETE,            // Every byte up to the end of the file is written
+    CACHE_FILL_FAILED               // The fill ended or was dropped before reaching the end
+};
+
+/**
+ * Part of the index holding the entries whose hash starts with the same bits. Workers only
+ * contend when they touch entries of the same shard.
+ */
+struct cache_shard {
+    pthread_mutex_t mutex;
+    struct cache_entry **buckets;
+    size_t bucket_count;
+    size_t entry_count;
+
+    struct cache_entry lru;         // Sentinel of the LRU list of the shard's entries not being filled
+};
+
+/**
+ * In-memory index of the cache directory with a byte budget enforced by LRU eviction.
+ * It is shared by every worker thread.
+ */
+struct cache {
+    struct cache_shard shards[CACHE_SHARDS];
+
+    unsigned long long budget;      // Maximum total size of cached files in bytes
+    unsigned long long used;        // Total bytes of the entries in the LRU lists, updated atomically
+    int changes;                    // Changes since the snapshot was last written, updated atomically
+    unsigned long long evictions;   // Entries evicted for space, updated atomically
+    pthread_mutex_t snapshot_mutex; // Held while the snapshot is written
+    pthread_t snapshot_writer;      // Writes the snapshot once enough changes piled up, off the worker threads
+    pthread_mutex_t snapshot_request_mutex;
+    pthread_cond_t snapshot_wake;
+    int snapshot_requested;         // The index changed enough to be written again, guarded by snapshot_request_mutex
+    int handed_off;                 // A new process owns the directory: nothing is deleted or filled, and the snapshot goes to CACHE_HANDOFF_PATH
+    struct hot_cache *hot;          // Memory tier of small files, NULL if disabled
+
+    pthread_t verifier;             // Checks complete files against their checksums in the background
+    pthread_mutex_t verify_mutex;
+    pthread_cond_t verify_wake;
+    int verify_requested;           // Entries may need the verifier, guarded by verify_mutex
+    unsigned long long damaged;     // Entries dropped after failing verification, updated atomically
+};
+
+int cache_init(struct cache *cache, unsigned long long budget, int keep_orphans);
+
+int cache_start_threads(struct cache *cache);
+
+int cache_lookup(struct cache *cache, const char *key, const char *upstream, off_t offset,
+                 char *path, size_t size, off_t *file_size);
+
+int cache_lookup_sha256(struct cache *cache, const char *key, const char *upstream, off_t *file_size,
+                        unsigned char sha256[CHECKSUM_SHA256_SIZE]);
+
+struct hot_file *cache_lookup_hot(struct cache *cache, const char *key, const char *upstream);
+
+struct hot_file *cache_promote(struct cache *cache, const char *key, const char *upstream, int fd, off_t size);
+
+void cache_invalidate(struct cache *cache, const char *key, const char *upstream);
+
+enum cache_freshness cache_check_freshness(struct cache *cache, const char *key, const char *upstream, int window);
+
+void cache_revalidate(struct cache *cache, const char *key, const char *upstream, off_t size, const char *modified);
+
+void cache_set_modified(struct cache_entry *entry, const char *modified);
+
+void cache_set_checksum(struct cache_entry *entry, unsigned long long checksum);
+
+struct cache_entry *cache_join_fill(struct cache *cache, const char *key, const char *upstream, off_t offset,
+                                    char *path, size_t size);
+
+struct cache_entry *cache_begin_fill(struct cache *cache, const char *key, const char *upstream, off_t offset,
+                                     int replace);
+
+void cache_end_fill(struct cache *cache, struct cache_entry *entry, int success);
+
+void cache_remove(struct cache *cache, struct cache_entry *entry);
+
+void cache_fill_path(const struct cache_entry *entry, char *path, size_t size);
+
+void cache_fill_progress(struct cache_entry *entry, off_t offset, off_t size);
+
+enum cache_fill_state cache_fill_status(struct cache_entry *entry, off_t offset, off_t *available);
+
+void cache_release(struct cache_entry *entry);
+
+int cache_wait(struct cache_entry *entry, off_t offset, struct cache_waiter *waiter);
+
+void cache_cancel_wait(struct cache_entry *entry, struct cache_waiter *waiter);
+
+int cache_save_snapshot(struct cache *cache);
+
+void cache_hand_off(struct cache *cache);
+
+int cache_filling(struct cache *cache);
+
+void cache_merge_handoff(struct cache *cache);
+
+#endif
@@ -0,0 +1,505 @@
+#include "cache_writer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "log.h"
+#include "proxy.h"
+
+static void cache_writer_finalize(struct cache_writer *writer);
+
+/**
+ * Writes the whole buffer at its offset of the fill file, recording failures in the buffer. The bytes
+ * are added to the checksum of the fill while they are still in the CPU cache.
+ */
+static void cache_writer_write_buffer(struct cache_writer_buffer *buffer) {
+    size_t written = 0;
+
+    if (buffer->writer->checksummed) {
+        checksum_update(&buffer->writer->checksum, buffer->data, buffer->length);
+    }
+
+    while (written < buffer->length) {
+        ssize_t write_size = pwrite(buffer->writer->file_fd, buffer->data + written,
+                                    buffer->length - written, buffer->offset + written);
+        if (write_size < 0 && errno == EINTR) {
+            continue;
+        }
+        if (write_size <= 0) {
+            buffer->error = 1;
+            return;
+        }
+        written += write_size;
+    }
+}
+
+/**
+ * Takes back a buffer from the backend. Its bytes become visible to transfers streaming the entry.
+ */
+static void cache_writer_buffer_done(struct cache_writer_buffer *buffer) {
+    struct cache_writer *writer = buffer->writer;
+
+    writer->in_flight -= 1;
+    if (buffer->error) {
+        log_warning("Cannot write cache file %s\n", writer->fill_path);
+        writer->error = 1;
+    } else if (!writer->error) {
+        cache_fill_progress(writer->entry, buffer->offset, buffer->length);
+    }
+
+    buffer->length = 0;
+    buffer->error = 0;
+    buffer->next = writer->free;
+    writer->free = buffer;
+
+    if (writer->finishing) {
+        if (writer->in_flight == 0) {
+            cache_writer_finalize(writer);
+        }
+        return;
+    }
+
+    // The writer may be finished by the woken transfer, so it is not used afterwards
+    if (writer->wake != NULL) {
+        void (*wake)(void *data) = writer->wake;
+        writer->wake = NULL;
+        wake(writer->wake_data);
+    }
+}
+
+/**
+ * Takes back every buffer the background thread has written so far, in submission order.
+ */
+static void cache_io_collect(struct cache_io *io) {
+    pthread_mutex_lock(&io->mutex);
+    struct cache_writer_buffer *done = io->done;
+    io->done = NULL;
+    pthread_mutex_unlock(&io->mutex);
+
+    // The thread pushes finished buffers in front of the list
+    struct cache_writer_buffer *ordered = NULL;
+    while (done != NULL) {
+        struct cache_writer_buffer *next = done->next;
+        done->next = ordered;
+        ordered = done;
+        done = next;
+    }
+
+    while (ordered != NULL) {
+        struct cache_writer_buffer *next = ordered->next;
+        cache_writer_buffer_done(ordered);
+        ordered = next;
+    }
+}
+
+/**
+ * Called by the event loop when the background thread has finished buffers.
+ */
+static void cache_io_handle_event(struct event_loop *loop, int fd, uint32_t events, void *data) {
+    uint64_t count;
+
+    while (read(fd, &count, sizeof(count)) == sizeof(count)) {
+    }
+
+    cache_io_collect(data);
+}
+
+/**
+ * Background thread writing queued buffers in order.
+ */
+static void *cache_io_thread(void *data) {
+    struct cache_io *io = data;
+
+    pthread_mutex_lock(&io->mutex);
+    while (TRUE) {
+        while (io->jobs == NULL) {
+            pthread_cond_wait(&io->job_ready, &io->mutex);
+        }
+
+        struct cache_writer_buffer *buffer = io->jobs;
+        io->jobs = buffer->next;
+        if (io->jobs == NULL) {
+            io->jobs_tail = NULL;
+        }
+        pthread_mutex_unlock(&io->mutex);
+
+        cache_writer_write_buffer(buffer);
+
+        pthread_mutex_lock(&io->mutex);
+        buffer->next = io->done;
+        io->done = buffer;
+
+        uint64_t one = 1;
+        if (write(io->event_fd, &one, sizeof(one)) < 0) {
+            // The counter can only overflow, and then the loop is woken up anyway
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Sets up the disk I/O backend of an event loop.
+ * Returns 0 on success and -1 on failure.
+ */
+int cache_io_init(struct cache_io *io, struct cache *cache, struct event_loop *loop,
+                  enum cache_writer_backend backend) {
+    memset(io, 0, sizeof(*io));
+    io->cache = cache;
+    io->loop = loop;
+    io->backend = backend;
+    io->event_fd = -1;
+
+    if (backend == CACHE_WRITER_SYNC) {
+        return 0;
+    }
+
+    pthread_mutex_init(&io->mutex, NULL);
+    pthread_cond_init(&io->job_ready, NULL);
+
+    io->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (io->event_fd < 0) {
+        perror("Error creating eventfd");
+        return -1;
+    }
+
+    if (event_loop_add(loop, io->event_fd, EPOLLIN | EPOLLET, cache_io_handle_event, io) < 0) {
+        return -1;
+    }
+
+    if (pthread_create(&io->thread, NULL, cache_io_thread, io) != 0) {
+        perror("Error creating cache writer thread");
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Creates a writer of the entry's fill file starting at the offset.
+ * Returns the writer, or NULL if the file could not be opened.
+ */
+static struct cache_writer *cache_writer_create(struct cache_io *io, struct cache_entry *entry, off_t offset,
+                                                int flags) {
+    struct cache_writer *writer = calloc(1, sizeof(struct cache_writer));
+    if (writer == NULL) {
+        return NULL;
+    }
+
+    writer->io = io;
+    writer->entry = entry;
+    writer->offset = offset;
+    cache_fill_path(entry, writer->fill_path, sizeof(writer->fill_path));
+
+    writer->file_fd = open(writer->fill_path, O_WRONLY | O_CREAT | O_CLOEXEC | flags, 0664);
+    if (writer->file_fd < 0) {
+        log_warning("Cannot open cache file %s\n", writer->fill_path);
+        free(writer);
+        return NULL;
+    }
+
+    return writer;
+}
+
+/**
+ * Starts writing the fill of an entry at its fill offset, into a new temporary file or into the file
+ * of a partial entry. The writer ends the fill when it is done.
+ * Returns the writer, or NULL if the file could not be opened.
+ */
+struct cache_writer *cache_writer_open(struct cache_io *io, struct cache_entry *entry) {
+    struct cache_writer *writer = cache_writer_create(io, entry, entry->fill_offset, entry->temporary ? O_TRUNC : 0);
+
+    // Resumed fills leave bytes they never see in the file, so only the verifier can hash it
+    if (writer != NULL && entry->temporary && entry->fill_offset == 0) {
+        writer->checksummed = TRUE;
+        checksum_init(&writer->checksum, FALSE);
+    }
+
+    return writer;
+}
+
+/**
+ * Starts writing one range of a fill that several writers write at once, such as a segmented fetch.
+ * The writer leaves ending the fill to its owner, and calls done once its bytes are written or it failed.
+ * Returns the writer, or NULL if the file could not be opened.
+ */
+struct cache_writer *cache_writer_open_range(struct cache_io *io, struct cache_entry *entry, off_t offset,
+                                             void (*done)(void *data, int success), void *data) {
+    struct cache_writer *writer = cache_writer_create(io, entry, offset, 0);
+
+    if (writer != NULL) {
+        writer->done = done;
+        writer->done_data = data;
+    }
+
+    return writer;
+}
+
+/**
+ * Hands the buffer being filled to the backend.
+ */
+static void cache_writer_submit(struct cache_writer *writer) {
+    struct cache_writer_buffer *buffer = writer->current;
+    struct cache_io *io = writer->io;
+
+    if (buffer == NULL || buffer->length == 0) {
+        return;
+    }
+
+    writer->current = NULL;
+    buffer->offset = writer->offset;
+    writer->offset += buffer->length;
+    writer->in_flight += 1;
+
+    if (io->backend == CACHE_WRITER_SYNC) {
+        cache_writer_write_buffer(buffer);
+        cache_writer_buffer_done(buffer);
+        return;
+    }
+
+    pthread_mutex_lock(&io->mutex);
+    buffer->next = NULL;
+    if (io->jobs_tail != NULL) {
+        io->jobs_tail->next = buffer;
+    } else {
+        io->jobs = buffer;
+    }
+    io->jobs_tail = buffer;
+    pthread_cond_signal(&io->job_ready);
+    pthread_mutex_unlock(&io->mutex);
+}
+
+/**
+ * Gets a buffer with free space, allocating one if needed. Callers keep to cache_writer_room(), so
+ * a free buffer is only missing when none could be allocated.
+ * Returns the buffer, or NULL if there is none.
+ */
+static struct cache_writer_buffer *cache_writer_buffer(struct cache_writer *writer) {
+    if (writer->current != NULL) {
+        return writer->current;
+    }
+
+    if (writer->free == NULL && writer->allocated < CACHE_WRITER_BUFFERS) {
+        struct cache_writer_buffer *buffer = calloc(1, sizeof(struct cache_writer_buffer));
+        void *data = NULL;
+
+        if (buffer == NULL || posix_memalign(&data, CACHE_WRITER_BUFFER_ALIGNMENT, CACHE_WRITER_BUFFER_SIZE) != 0) {
+            free(buffer);
+            return NULL;
+        }
+        buffer->writer = writer;
+        buffer->data = data;
+        buffer->next = writer->free;
+        writer->free = buffer;
+        writer->allocated += 1;
+    }
+
+    if (writer->free == NULL) {
+        return NULL;
+    }
+
+    writer->current = writer->free;
+    writer->free = writer->current->next;
+    writer->current->next = NULL;
+
+    return writer->current;
+}
+
+/**
+ * Gets how many bytes the writer takes without waiting for the disk: the room left in its buffers that
+ * are not with the backend. Once the disk fell behind by CACHE_WRITER_BUFFERS buffers there is none,
+ * and the transfer stops reading its source until cache_writer_wait() wakes it up.
+ * Returns the number of bytes.
+ */
+size_t cache_writer_room(const struct cache_writer *writer) {
+    if (writer->io->backend == CACHE_WRITER_SYNC) {
+        // Buffers are written as soon as they are full
+        return SIZE_MAX;
+    }
+
+    size_t room = writer->current != NULL ? CACHE_WRITER_BUFFER_SIZE - writer->current->length : 0;
+
+    for (struct cache_writer_buffer *buffer = writer->free; buffer != NULL; buffer = buffer->next) {
+        room += CACHE_WRITER_BUFFER_SIZE;
+    }
+    room += (size_t) (CACHE_WRITER_BUFFERS - writer->allocated) * CACHE_WRITER_BUFFER_SIZE;
+
+    return room;
+}
+
+/**
+ * Calls wake once the backend gave a buffer back, after cache_writer_room() found no room. The call
+ * is dropped if the fill ends before.
+ */
+void cache_writer_wait(struct cache_writer *writer, void (*wake)(void *data), void *data) {
+    writer->wake = wake;
+    writer->wake_data = data;
+}
+
+/**
+ * Appends bytes to the fill, no more than cache_writer_room() allows.
+ * Returns 0 on success and -1 if the fill failed.
+ */
+int cache_writer_write(struct cache_writer *writer, const char *data, size_t length) {
+    while (length > 0 && !writer->error) {
+        struct cache_writer_buffer *buffer = cache_writer_buffer(writer);
+        if (buffer == NULL) {
+            writer->error = 1;
+            break;
+        }
+
+        size_t copy_size = CACHE_WRITER_BUFFER_SIZE - buffer->length;
+        if (copy_size > length) {
+            copy_size = length;
+        }
+        memcpy(buffer->data + buffer->length, data, copy_size);
+        buffer->length += copy_size;
+        data += copy_size;
+        length -= copy_size;
+
+        if (buffer->length == CACHE_WRITER_BUFFER_SIZE) {
+            cache_writer_submit(writer);
+        }
+    }
+
+    return writer->error ? -1 : 0;
+}
+
+/**
+ * Appends bytes waiting in a pipe to the fill, reading them straight into the write buffers, no more
+ * than cache_writer_room() allows.
+ * Returns 0 on success and -1 if the fill failed.
+ */
+int cache_writer_write_from_pipe(struct cache_writer *writer, int pipe_fd, size_t length) {
+    while (length > 0 && !writer->error) {
+        struct cache_writer_buffer *buffer = cache_writer_buffer(writer);
+        if (buffer == NULL) {
+            writer->error = 1;
+            break;
+        }
+
+        size_t read_size = CACHE_WRITER_BUFFER_SIZE - buffer->length;
+        if (read_size > length) {
+            read_size = length;
+        }
+        ssize_t received = read(pipe_fd, buffer->data + buffer->length, read_size);
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            writer->error = 1;
+            break;
+        }
+        buffer->length += received;
+        length -= received;
+
+        if (buffer->length == CACHE_WRITER_BUFFER_SIZE) {
+            cache_writer_submit(writer);
+        }
+    }
+
+    return writer->error ? -1 : 0;
+}
+
+/**
+ * Hands a partially filled buffer to the backend, so transfers streaming the entry do not wait
+ * for a full buffer while the upstream is idle.
+ */
+void cache_writer_flush(struct cache_writer *writer) {
+    cache_writer_submit(writer);
+}
+
+/**
+ * Publishes the fill once every buffer is written, as it reached the end of the file: a temporary
+ * file is renamed over the entry's file and the entry learns its size. The writer is released afterwards.
+ */
+void cache_writer_finish(struct cache_writer *writer) {
+    cache_writer_submit(writer);
+
+    writer->success = 1;
+    writer->finishing = 1;
+    if (writer->in_flight == 0) {
+        cache_writer_finalize(writer);
+    }
+}
+
+/**
+ * Ends the fill before the end of the file. With keep, the bytes written so far stay in the entry as
+ * a segment a later transfer can resume from; otherwise the entry is dropped. The writer is released
+ * once the backend gave its buffers back.
+ */
+void cache_writer_abort(struct cache_writer *writer, int keep) {
+    writer->discard = !keep;
+
+    if (writer->current != NULL) {
+        writer->current->length = 0;
+        writer->current->next = writer->free;
+        writer->free = writer->current;
+        writer->current = NULL;
+    }
+
+    writer->finishing = 1;
+    if (writer->in_flight == 0) {
+        cache_writer_finalize(writer);
+    }
+}
+
+/**
+ * Moves the file of a fill into place if it is a temporary one, then ends the fill of the entry.
+ */
+void cache_publish_fill(struct cache *cache, struct cache_entry *entry, int success) {
+    char fill_path[64];
+
+    cache_fill_path(entry, fill_path, sizeof(fill_path));
+    if (entry->temporary && rename(fill_path, entry->path) < 0) {
+        log_warning("Cannot move cache file %s into place\n", fill_path);
+        unlink(fill_path);
+        cache_remove(cache, entry);
+        return;
+    }
+
+    cache_end_fill(cache, entry, success);
+}
+
+/**
+ * Closes the fill file, publishes or discards the fill unless the writer only wrote a range of it,
+ * and releases the writer. Only the bytes written before a failure count, so the entry never holds
+ * a gap it does not know of.
+ */
+static void cache_writer_finalize(struct cache_writer *writer) {
+    struct cache_entry *entry = writer->entry;
+    struct cache *cache = writer->io->cache;
+    int success = writer->success && !writer->error;
+
+    close(writer->file_fd);
+
+    if (success && writer->checksummed) {
+        unsigned long long checksum;
+        checksum_final(&writer->checksum, &checksum, NULL);
+        cache_set_checksum(entry, checksum);
+    }
+
+    if (writer->done != NULL) {
+        writer->done(writer->done_data, success);
+    } else if (writer->discard) {
+        unlink(writer->fill_path);
+        cache_remove(cache, entry);
+    } else {
+        cache_publish_fill(cache, entry, success);
+    }
+
+    while (writer->free != NULL) {
+        struct cache_writer_buffer *buffer = writer->free;
+        writer->free = buffer->next;
+        free(buffer->data);
+        free(buffer);
+    }
+
+    free(writer);
+}
@@ -0,0 +1,102 @@
+#ifndef FTP_PROXY_CACHE_WRITER_H
+#define FTP_PROXY_CACHE_WRITER_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "cache.h"
+#include "event_loop.h"
+
+#define CACHE_WRITER_BUFFER_SIZE (512 * 1024)
+#define CACHE_WRITER_BUFFER_ALIGNMENT 4096
+#define CACHE_WRITER_BUFFERS 4
+
+enum cache_writer_backend {
+    CACHE_WRITER_SYNC,              // Buffers are written by the event loop thread
+    CACHE_WRITER_THREAD             // Buffers are written by a background thread
+};
+
+struct cache_writer;
+
+/**
+ * Aligned buffer holding bytes of a fill until they are written at their offset of the file.
+ */
+struct cache_writer_buffer {
+    struct cache_writer *writer;
+    char *data;
+    size_t length;
+    off_t offset;
+    int error;
+    struct cache_writer_buffer *next;
+};
+
+/**
+ * Disk I/O backend of one event loop. With the thread backend, full buffers are queued to a
+ * background thread, which hands them back through an eventfd once written.
+ */
+struct cache_io {
+    struct cache *cache;
+    struct event_loop *loop;
+    enum cache_writer_backend backend;
+
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t job_ready;       // Signalled when a job is queued
+    struct cache_writer_buffer *jobs;
+    struct cache_writer_buffer *jobs_tail;
+    struct cache_writer_buffer *done;
+    int event_fd;
+};
+
+/**
+ * Writes one cache fill at its offsets of the file and publishes it when the transfer ended.
+ */
+struct cache_writer {
+    struct cache_io *io;
+    struct cache_entry *entry;
+    char fill_path[64];             // Temporary file of a new entry, or the file of a partial one
+    int file_fd;
+    off_t offset;                   // Offset of the first byte of the current buffer
+
+    struct cache_writer_buffer *current;    // Buffer being filled
+    struct cache_writer_buffer *free;       // Buffers ready for reuse
+    int allocated;
+    int in_flight;                  // Buffers handed to the backend and not back yet
+    int error;
+    int finishing;
+    int success;                    // The fill reached the end of the file
+    int discard;                    // The fill failed and its bytes must not be kept
+    int checksummed;                // The fill writes the whole file in order, so its checksum is computed on the way
+    struct checksum checksum;       // Updated by whichever thread writes the buffers, in their order
+    void (*done)(void *data, int success);  // Called instead of ending the fill by a range writer
+    void *done_data;
+    void (*wake)(void *data);       // Called once a buffer came back after the writer ran out of room
+    void *wake_data;
+};
+
+int cache_io_init(struct cache_io *io, struct cache *cache, struct event_loop *loop,
+                  enum cache_writer_backend backend);
+
+struct cache_writer *cache_writer_open(struct cache_io *io, struct cache_entry *entry);
+
+struct cache_writer *cache_writer_open_range(struct cache_io *io, struct cache_entry *entry, off_t offset,
+                                             void (*done)(void *data, int success), void *data);
+
+size_t cache_writer_room(const struct cache_writer *writer);
+
+void cache_writer_wait(struct cache_writer *writer, void (*wake)(void *data), void *data);
+
+int cache_writer_write(struct cache_writer *writer, const char *data, size_t length);
+
+int cache_writer_write_from_pipe(struct cache_writer *writer, int pipe_fd, size_t length);
+
+void cache_writer_flush(struct cache_writer *writer);
+
+void cache_writer_finish(struct cache_writer *writer);
+
+void cache_writer_abort(struct cache_writer *writer, int keep);
+
+void cache_publish_fill(struct cache *cache, struct cache_entry *entry, int success);
+
+#endif
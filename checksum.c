@@ -0,0 +1,300 @@
+#include "checksum.h"
+
+#include <string.h>
+
+#define XXH64_PRIME1 0x9E3779B185EBCA87ULL
+#define XXH64_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define XXH64_PRIME3 0x165667B19E3779F9ULL
+#define XXH64_PRIME4 0x85EBCA77C2B2AE63ULL
+#define XXH64_PRIME5 0x27D4EB2F165667C5ULL
+
+static const uint32_t sha256_constants[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static uint64_t rotate_left64(uint64_t value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+static uint32_t rotate_right32(uint32_t value, int bits) {
+    return (value >> bits) | (value << (32 - bits));
+}
+
+/**
+ * Reads a little-endian word, which XXH64 is defined on. The proxy only runs on little-endian hosts.
+ */
+static uint64_t read64(const unsigned char *bytes) {
+    uint64_t value;
+    memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+static uint32_t read32(const unsigned char *bytes) {
+    uint32_t value;
+    memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+static uint64_t xxh64_round(uint64_t lane, uint64_t input) {
+    lane += input * XXH64_PRIME2;
+    lane = rotate_left64(lane, 31);
+    return lane * XXH64_PRIME1;
+}
+
+static uint64_t xxh64_merge(uint64_t hash, uint64_t lane) {
+    hash ^= xxh64_round(0, lane);
+    return hash * XXH64_PRIME1 + XXH64_PRIME4;
+}
+
+/**
+ * Mixes whole 32-byte stripes into the four lanes, which are independent of each other so the
+ * CPU works on them in parallel.
+ * Returns the bytes consumed.
+ */
+static size_t xxh64_stripes(struct checksum_xxh64 *state, const unsigned char *data, size_t length) {
+    uint64_t lane0 = state->lanes[0];
+    uint64_t lane1 = state->lanes[1];
+    uint64_t lane2 = state->lanes[2];
+    uint64_t lane3 = state->lanes[3];
+    size_t position = 0;
+
+    for (; position + 32 <= length; position += 32) {
+        lane0 = xxh64_round(lane0, read64(data + position));
+        lane1 = xxh64_round(lane1, read64(data + position + 8));
+        lane2 = xxh64_round(lane2, read64(data + position + 16));
+        lane3 = xxh64_round(lane3, read64(data + position + 24));
+    }
+
+    state->lanes[0] = lane0;
+    state->lanes[1] = lane1;
+    state->lanes[2] = lane2;
+    state->lanes[3] = lane3;
+    return position;
+}
+
+static void xxh64_init(struct checksum_xxh64 *state) {
+    state->lanes[0] = XXH64_PRIME1 + XXH64_PRIME2;
+    state->lanes[1] = XXH64_PRIME2;
+    state->lanes[2] = 0;
+    state->lanes[3] = -XXH64_PRIME1;
+    state->total = 0;
+    state->pending_length = 0;
+}
+
+static void xxh64_update(struct checksum_xxh64 *state, const unsigned char *data, size_t length) {
+    state->total += length;
+
+    if (state->pending_length > 0) {
+        size_t copy_size = sizeof(state->pending) - state->pending_length;
+        if (copy_size > length) {
+            copy_size = length;
+        }
+        memcpy(state->pending + state->pending_length, data, copy_size);
+        state->pending_length += copy_size;
+        data += copy_size;
+        length -= copy_size;
+
+        if (state->pending_length < sizeof(state->pending)) {
+            return;
+        }
+        xxh64_stripes(state, state->pending, sizeof(state->pending));
+        state->pending_length = 0;
+    }
+
+    size_t consumed = xxh64_stripes(state, data, length);
+    memcpy(state->pending, data + consumed, length - consumed);
+    state->pending_length = length - consumed;
+}
+
+static uint64_t xxh64_final(const struct checksum_xxh64 *state) {
+    const unsigned char *tail = state->pending;
+    size_t length = state->pending_length;
+    uint64_t hash;
+
+    if (state->total >= 32) {
+        hash = rotate_left64(state->lanes[0], 1) + rotate_left64(state->lanes[1], 7) +
+               rotate_left64(state->lanes[2], 12) + rotate_left64(state->lanes[3], 18);
+        for (int i = 0; i < 4; i += 1) {
+            hash = xxh64_merge(hash, state->lanes[i]);
+        }
+    } else {
+        hash = XXH64_PRIME5;
+    }
+    hash += state->total;
+
+    for (; length >= 8; tail += 8, length -= 8) {
+        hash ^= xxh64_round(0, read64(tail));
+        hash = rotate_left64(hash, 27) * XXH64_PRIME1 + XXH64_PRIME4;
+    }
+    if (length >= 4) {
+        hash ^= read32(tail) * XXH64_PRIME1;
+        hash = rotate_left64(hash, 23) * XXH64_PRIME2 + XXH64_PRIME3;
+        tail += 4;
+        length -= 4;
+    }
+    for (; length > 0; tail += 1, length -= 1) {
+        hash ^= *tail * XXH64_PRIME5;
+        hash = rotate_left64(hash, 11) * XXH64_PRIME1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= XXH64_PRIME2;
+    hash ^= hash >> 29;
+    hash *= XXH64_PRIME3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+/**
+ * Compresses one 64-byte block into the state.
+ */
+static void sha256_block(uint32_t state[8], const unsigned char *block) {
+    uint32_t schedule[64];
+
+    for (int i = 0; i < 16; i += 1) {
+        schedule[i] = (uint32_t) block[i * 4] << 24 | (uint32_t) block[i * 4 + 1] << 16 |
+                      (uint32_t) block[i * 4 + 2] << 8 | (uint32_t) block[i * 4 + 3];
+    }
+    for (int i = 16; i < 64; i += 1) {
+        uint32_t s0 = rotate_right32(schedule[i - 15], 7) ^ rotate_right32(schedule[i - 15], 18) ^
+                      (schedule[i - 15] >> 3);
+        uint32_t s1 = rotate_right32(schedule[i - 2], 17) ^ rotate_right32(schedule[i - 2], 19) ^
+                      (schedule[i - 2] >> 10);
+        schedule[i] = schedule[i - 16] + s0 + schedule[i - 7] + s1;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; i += 1) {
+        uint32_t s1 = rotate_right32(e, 6) ^ rotate_right32(e, 11) ^ rotate_right32(e, 25);
+        uint32_t choice = (e & f) ^ (~e & g);
+        uint32_t temp1 = h + s1 + choice + sha256_constants[i] + schedule[i];
+        uint32_t s0 = rotate_right32(a, 2) ^ rotate_right32(a, 13) ^ rotate_right32(a, 22);
+        uint32_t majority = (a & b) ^ (a & c) ^ (b & c);
+        uint32_t temp2 = s0 + majority;
+
+        h = g;
+        g = f;
+        f = e;
+        e = d + temp1;
+        d = c;
+        c = b;
+        b = a;
+        a = temp1 + temp2;
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+
+static void sha256_init(struct checksum_sha256 *state) {
+    static const uint32_t initial[8] = {
+            0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    memcpy(state->state, initial, sizeof(initial));
+    state->total = 0;
+    state->pending_length = 0;
+}
+
+static void sha256_update(struct checksum_sha256 *state, const unsigned char *data, size_t length) {
+    state->total += length;
+
+    if (state->pending_length > 0) {
+        size_t copy_size = sizeof(state->pending) - state->pending_length;
+        if (copy_size > length) {
+            copy_size = length;
+        }
+        memcpy(state->pending + state->pending_length, data, copy_size);
+        state->pending_length += copy_size;
+        data += copy_size;
+        length -= copy_size;
+
+        if (state->pending_length < sizeof(state->pending)) {
+            return;
+        }
+        sha256_block(state->state, state->pending);
+        state->pending_length = 0;
+    }
+
+    for (; length >= 64; data += 64, length -= 64) {
+        sha256_block(state->state, data);
+    }
+    memcpy(state->pending, data, length);
+    state->pending_length = length;
+}
+
+static void sha256_final(struct checksum_sha256 *state, unsigned char digest[CHECKSUM_SHA256_SIZE]) {
+    uint64_t bits = state->total * 8;
+    unsigned char padding[72];
+    size_t padding_length = (state->pending_length < 56 ? 56 : 120) - state->pending_length;
+
+    memset(padding, 0, sizeof(padding));
+    padding[0] = 0x80;
+    for (int i = 0; i < 8; i += 1) {
+        padding[padding_length + i] = (unsigned char) (bits >> (56 - i * 8));
+    }
+    sha256_update(state, padding, padding_length + 8);
+
+    for (int i = 0; i < 8; i += 1) {
+        digest[i * 4] = (unsigned char) (state->state[i] >> 24);
+        digest[i * 4 + 1] = (unsigned char) (state->state[i] >> 16);
+        digest[i * 4 + 2] = (unsigned char) (state->state[i] >> 8);
+        digest[i * 4 + 3] = (unsigned char) state->state[i];
+    }
+}
+
+/**
+ * Starts the checksums of a new file.
+ */
+void checksum_init(struct checksum *checksum, int with_sha256) {
+    xxh64_init(&checksum->xxh64);
+    sha256_init(&checksum->sha256);
+    checksum->with_sha256 = with_sha256;
+}
+
+/**
+ * Adds the next bytes of the file.
+ */
+void checksum_update(struct checksum *checksum, const void *data, size_t length) {
+    xxh64_update(&checksum->xxh64, data, length);
+    if (checksum->with_sha256) {
+        sha256_update(&checksum->sha256, data, length);
+    }
+}
+
+/**
+ * Gets the checksums of the bytes added so far. The SHA-256 is only written if it was computed.
+ */
+void checksum_final(struct checksum *checksum, unsigned long long *xxh64, unsigned char sha256[CHECKSUM_SHA256_SIZE]) {
+    *xxh64 = xxh64_final(&checksum->xxh64);
+    if (checksum->with_sha256) {
+        sha256_final(&checksum->sha256, sha256);
+    }
+}
+
+/**
+ * Writes bytes as lower case hex digits followed by a null byte, so text needs 2 * length + 1 bytes.
+ */
+void checksum_format_hex(const unsigned char *bytes, size_t length, char *text) {
+    static const char digits[] = "0123456789abcdef";
+
+    for (size_t i = 0; i < length; i += 1) {
+        text[i * 2] = digits[bytes[i] >> 4];
+        text[i * 2 + 1] = digits[bytes[i] & 0xf];
+    }
+    text[length * 2] = '\0';
+}
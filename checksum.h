@@ -0,0 +1,47 @@
+#ifndef FTP_PROXY_CHECKSUM_H
+#define FTP_PROXY_CHECKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CHECKSUM_SHA256_SIZE 32
+
+/**
+ * Running XXH64 with seed 0, fed in pieces of any size.
+ */
+struct checksum_xxh64 {
+    uint64_t lanes[4];
+    uint64_t total;
+    unsigned char pending[32];      // Bytes not making up a whole stripe yet
+    size_t pending_length;
+};
+
+/**
+ * Running SHA-256, fed in pieces of any size.
+ */
+struct checksum_sha256 {
+    uint32_t state[8];
+    uint64_t total;
+    unsigned char pending[64];
+    size_t pending_length;
+};
+
+/**
+ * Checksums of a cached file computed in one pass: always the fast XXH64 that detects damaged
+ * files, and the SHA-256 clients ask for when it is enabled.
+ */
+struct checksum {
+    struct checksum_xxh64 xxh64;
+    struct checksum_sha256 sha256;
+    int with_sha256;
+};
+
+void checksum_init(struct checksum *checksum, int with_sha256);
+
+void checksum_update(struct checksum *checksum, const void *data, size_t length);
+
+void checksum_final(struct checksum *checksum, unsigned long long *xxh64, unsigned char sha256[CHECKSUM_SHA256_SIZE]);
+
+void checksum_format_hex(const unsigned char *bytes, size_t length, char *text);
+
+#endif
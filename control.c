@@ -0,0 +1,172 @@
+#include "control.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "proxy.h"
+
+/**
+ * Sets up an empty parser.
+ */
+void control_parser_init(struct control_parser *parser) {
+    parser->start = 0;
+    parser->length = 0;
+    parser->partial = FALSE;
+    parser->reply_code = 0;
+}
+
+/**
+ * Reads from a command socket into the free space of the parser, after moving the bytes not handed out
+ * yet to the front of the buffer.
+ * Returns the number of bytes read, 0 at end of stream, or -1 with errno set. ENOBUFS means the buffer
+ * holds unhandled lines only and nothing was read.
+ */
+ssize_t control_parser_read(struct control_parser *parser, int fd) {
+    if (parser->start > 0) {
+        memmove(parser->buffer, parser->buffer + parser->start, parser->length - parser->start);
+        parser->length -= parser->start;
+        parser->start = 0;
+    }
+
+    if (parser->length == CONTROL_BUFFER_SIZE) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    ssize_t read_size = read(fd, parser->buffer + parser->length, CONTROL_BUFFER_SIZE - parser->length);
+    if (read_size > 0) {
+        parser->length += read_size;
+    }
+
+    return read_size;
+}
+
+/**
+ * Gets the next line received, including its line feed, without handing it out yet.
+ * A line too long for the buffer is handed out in chunks, each with *complete cleared but the last one.
+ * Returns the line, or NULL if it has not been received completely yet.
+ */
+const char *control_parser_peek(struct control_parser *parser, size_t *length, int *complete) {
+    const char *line = parser->buffer + parser->start;
+    size_t available = parser->length - parser->start;
+    const char *end = memchr(line, '\n', available);
+
+    if (end != NULL) {
+        *length = end - line + 1;
+        *complete = TRUE;
+        return line;
+    }
+
+    if (parser->start == 0 && parser->length == CONTROL_BUFFER_SIZE) {
+        *length = available;
+        *complete = FALSE;
+        return line;
+    }
+
+    return NULL;
+}
+
+/**
+ * Hands out a chunk returned by control_parser_peek().
+ */
+void control_parser_consume(struct control_parser *parser, size_t length) {
+    parser->partial = parser->buffer[parser->start + length - 1] != '\n';
+    parser->start += length;
+
+    if (parser->start == parser->length) {
+        parser->start = 0;
+        parser->length = 0;
+    }
+}
+
+/**
+ * Copies the verb of a command line in upper case, truncated to CONTROL_VERB_SIZE - 1 characters.
+ * Returns the argument following the verb, which is empty if there is none.
+ */
+const char *control_parse_verb(const char *line, size_t length, char verb[CONTROL_VERB_SIZE]) {
+    size_t verb_length = 0;
+    size_t position = 0;
+
+    while (position < length && line[position] != ' ' && line[position] != '\r' && line[position] != '\n') {
+        if (verb_length < CONTROL_VERB_SIZE - 1) {
+            verb[verb_length++] = (char) toupper((unsigned char) line[position]);
+        }
+        position += 1;
+    }
+    verb[verb_length] = '\0';
+
+    if (position < length && line[position] == ' ') {
+        position += 1;
+    }
+
+    return line + position;
+}
+
+/**
+ * Follows the reply lines received from the server. A reply is one "ddd text" line, or lines from
+ * "ddd-text" up to the "ddd text" line with the same code.
+ * Returns the code if the line ends a reply, and 0 otherwise.
+ */
+int control_parse_reply(struct control_parser *parser, const char *line, size_t length) {
+    int code = 0;
+
+    if (length >= 4 && isdigit((unsigned char) line[0]) && isdigit((unsigned char) line[1]) &&
+        isdigit((unsigned char) line[2]) && (line[3] == ' ' || line[3] == '-' || line[3] == '\r')) {
+        code = (line[0] - '0') * 100 + (line[1] - '0') * 10 + (line[2] - '0');
+    }
+
+    if (parser->reply_code != 0) {
+        // Inside a multi-line reply, only its own code followed by a space ends it
+        if (code != parser->reply_code || line[3] == '-') {
+            return 0;
+        }
+        parser->reply_code = 0;
+        return code;
+    }
+
+    if (code != 0 && line[3] == '-') {
+        parser->reply_code = code;
+        return 0;
+    }
+
+    return code;
+}
+
+/**
+ * Parses the six comma separated numbers of a PORT argument or a 227 reply, which may be preceded by
+ * text and enclosed in parentheses.
+ * Returns 0 on success and -1 if the text holds no valid address.
+ */
+int control_parse_address(const char *text, size_t length, int numbers[6]) {
+    size_t position = 0;
+
+    while (position < length && !isdigit((unsigned char) text[position])) {
+        position += 1;
+    }
+
+    for (int i = 0; i < 6; i++) {
+        int value = 0;
+        size_t digits = 0;
+
+        while (position < length && isdigit((unsigned char) text[position]) && digits < 4) {
+            value = value * 10 + (text[position] - '0');
+            position += 1;
+            digits += 1;
+        }
+        if (digits == 0 || value > 255) {
+            return -1;
+        }
+        numbers[i] = value;
+
+        if (i < 5) {
+            if (position >= length || text[position] != ',') {
+                return -1;
+            }
+            position += 1;
+        }
+    }
+
+    return 0;
+}
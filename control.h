@@ -0,0 +1,37 @@
+#ifndef FTP_PROXY_CONTROL_H
+#define FTP_PROXY_CONTROL_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define CONTROL_BUFFER_SIZE 8192
+#define CONTROL_VERB_SIZE 8             // Fits verbs such as XSHA256
+
+/**
+ * Line framer of one direction of a command connection. Bytes are read into a fixed buffer and handed
+ * out line by line once complete, so a line split across reads is put back together and lines received
+ * together are handled one after the other.
+ */
+struct control_parser {
+    char buffer[CONTROL_BUFFER_SIZE];
+    size_t start;                   // First byte not handed out yet
+    size_t length;                  // Bytes in the buffer, including those handed out
+    int partial;                    // The last chunk handed out did not end its line
+    int reply_code;                 // Code of the multi-line reply being received, 0 between replies
+};
+
+void control_parser_init(struct control_parser *parser);
+
+ssize_t control_parser_read(struct control_parser *parser, int fd);
+
+const char *control_parser_peek(struct control_parser *parser, size_t *length, int *complete);
+
+void control_parser_consume(struct control_parser *parser, size_t length);
+
+const char *control_parse_verb(const char *line, size_t length, char verb[CONTROL_VERB_SIZE]);
+
+int control_parse_reply(struct control_parser *parser, const char *line, size_t length);
+
+int control_parse_address(const char *text, size_t length, int numbers[6]);
+
+#endif
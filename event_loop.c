@@ -0,0 +1,301 @@
+#include "event_loop.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+
+#define MAX_EVENTS 256
+
+/**
+ * Drains the eventfd other threads write to when they post a task or stop the loop.
+ */
+static void event_loop_handle_wake(struct event_loop *loop, int fd, uint32_t events, void *data) {
+    uint64_t count;
+
+    while (read(fd, &count, sizeof(count)) == sizeof(count)) {
+    }
+}
+
+/**
+ * Interrupts epoll_wait() when called from another thread than the one running the loop.
+ */
+static void event_loop_wake(struct event_loop *loop) {
+    uint64_t one = 1;
+
+    if (!pthread_equal(pthread_self(), loop->thread) && write(loop->wake_fd, &one, sizeof(one)) < 0) {
+        // The counter can only overflow, and then the loop is woken up anyway
+    }
+}
+
+/**
+ * Reads the monotonic clock in milliseconds.
+ */
+static unsigned long long event_loop_clock(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * Creates the epoll instance and a slot table large enough for every descriptor the process may open.
+ * The soft RLIMIT_NOFILE is raised to the hard limit first.
+ * Returns 0 on success and -1 on failure.
+ */
+int event_loop_init(struct event_loop *loop) {
+    struct rlimit limit;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        if (limit.rlim_cur < limit.rlim_max) {
+            limit.rlim_cur = limit.rlim_max;
+            setrlimit(RLIMIT_NOFILE, &limit);
+            getrlimit(RLIMIT_NOFILE, &limit);
+        }
+        loop->max_fds = limit.rlim_cur == RLIM_INFINITY || limit.rlim_cur > (1 << 20) ? (1 << 20) : (int) limit.rlim_cur;
+    } else {
+        loop->max_fds = 1024;
+    }
+
+    loop->slots = calloc(loop->max_fds, sizeof(struct event_slot));
+    if (loop->slots == NULL) {
+        perror("Error allocating event slots");
+        return -1;
+    }
+
+    loop->tasks.prev = loop->tasks.next = &loop->tasks;
+    pthread_mutex_init(&loop->task_mutex, NULL);
+    loop->thread = pthread_self();
+    loop->now = event_loop_clock();
+    timer_wheel_init(&loop->timers, loop->now / TIMER_WHEEL_TICK);
+
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd < 0) {
+        perror("Error creating epoll instance");
+        free(loop->slots);
+        return -1;
+    }
+
+    loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (loop->wake_fd < 0 || event_loop_add(loop, loop->wake_fd, EPOLLIN | EPOLLET, event_loop_handle_wake, NULL) < 0) {
+        perror("Error creating eventfd");
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Registers the file descriptor with its handler.
+ * Returns 0 on success and -1 on failure.
+ */
+int event_loop_add(struct event_loop *loop, int fd, uint32_t events, event_handler handler, void *data) {
+    if (fd < 0 || fd >= loop->max_fds) {
+        fprintf(stderr, "File descriptor %d out of range\n", fd);
+        return -1;
+    }
+
+    struct epoll_event event = {.events = events, .data.fd = fd};
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        perror("Error adding file descriptor to epoll");
+        return -1;
+    }
+
+    loop->slots[fd].handler = handler;
+    loop->slots[fd].data = data;
+
+    return 0;
+}
+
+/**
+ * Changes the events the file descriptor is watched for.
+ * Returns 0 on success and -1 on failure.
+ */
+int event_loop_modify(struct event_loop *loop, int fd, uint32_t events) {
+    struct epoll_event event = {.events = events, .data.fd = fd};
+
+    return epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, fd, &event);
+}
+
+/**
+ * Unregisters the file descriptor. Pending events for it are dropped.
+ */
+void event_loop_remove(struct event_loop *loop, int fd) {
+    if (fd < 0 || fd >= loop->max_fds) {
+        return;
+    }
+
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    loop->slots[fd].handler = NULL;
+    loop->slots[fd].data = NULL;
+}
+
+/**
+ * Queues the task to run once the events being dispatched are handled. Posting a queued task does nothing.
+ * Any thread may post a task; it always runs on the thread running the loop.
+ */
+void event_loop_post(struct event_loop *loop, struct event_task *task) {
+    pthread_mutex_lock(&loop->task_mutex);
+    if (task->queued) {
+        pthread_mutex_unlock(&loop->task_mutex);
+        return;
+    }
+
+    task->prev = loop->tasks.prev;
+    task->next = &loop->tasks;
+    loop->tasks.prev->next = task;
+    loop->tasks.prev = task;
+    task->queued = 1;
+    pthread_mutex_unlock(&loop->task_mutex);
+
+    event_loop_wake(loop);
+}
+
+/**
+ * Removes the task from the queue if it has not run yet.
+ */
+void event_loop_cancel(struct event_loop *loop, struct event_task *task) {
+    pthread_mutex_lock(&loop->task_mutex);
+    if (task->queued) {
+        task->prev->next = task->next;
+        task->next->prev = task->prev;
+        task->prev = task->next = NULL;
+        task->queued = 0;
+    }
+    pthread_mutex_unlock(&loop->task_mutex);
+}
+
+/**
+ * Runs the tasks posted so far. Tasks they post run in the next round.
+ */
+static void event_loop_run_tasks(struct event_loop *loop) {
+    struct event_task pending;
+
+    pthread_mutex_lock(&loop->task_mutex);
+    if (loop->tasks.next == &loop->tasks) {
+        pthread_mutex_unlock(&loop->task_mutex);
+        return;
+    }
+
+    // Move the queue aside, so cancelling still works on tasks that have not run yet
+    pending.next = loop->tasks.next;
+    pending.prev = loop->tasks.prev;
+    pending.next->prev = &pending;
+    pending.prev->next = &pending;
+    loop->tasks.prev = loop->tasks.next = &loop->tasks;
+
+    while (pending.next != &pending) {
+        struct event_task *task = pending.next;
+
+        task->prev->next = task->next;
+        task->next->prev = task->prev;
+        task->prev = task->next = NULL;
+        task->queued = 0;
+        pthread_mutex_unlock(&loop->task_mutex);
+
+        task->run(task);
+
+        pthread_mutex_lock(&loop->task_mutex);
+    }
+    pthread_mutex_unlock(&loop->task_mutex);
+}
+
+/**
+ * Gets the time the current round of events started at, in monotonic milliseconds.
+ */
+unsigned long long event_loop_now(const struct event_loop *loop) {
+    return loop->now;
+}
+
+/**
+ * Arms the timer to expire the given number of milliseconds from now, rounded up to the next tick
+ * of the wheel. A timer already armed is moved. Only the thread running the loop may arm timers.
+ */
+void event_loop_arm(struct event_loop *loop, struct wheel_timer *timer, unsigned long long milliseconds) {
+    timer_wheel_remove(&loop->timers, timer);
+    timer_wheel_add(&loop->timers, timer, (loop->now + milliseconds + TIMER_WHEEL_TICK - 1) / TIMER_WHEEL_TICK);
+}
+
+/**
+ * Cancels the timer if it is armed.
+ */
+void event_loop_disarm(struct event_loop *loop, struct wheel_timer *timer) {
+    timer_wheel_remove(&loop->timers, timer);
+}
+
+/**
+ * Tells whether the timer is waiting to expire.
+ */
+int event_loop_armed(const struct wheel_timer *timer) {
+    return timer->prev != NULL;
+}
+
+/**
+ * Gets how long epoll_wait() may sleep before the timer wheel has to advance.
+ * Returns the number of milliseconds, or -1 if no timer is armed.
+ */
+static int event_loop_timeout(struct event_loop *loop) {
+    long long ticks = timer_wheel_next(&loop->timers);
+    if (ticks < 0) {
+        return -1;
+    }
+
+    unsigned long long due = (loop->timers.now + ticks) * TIMER_WHEEL_TICK;
+    unsigned long long now = event_loop_clock();
+
+    return due > now ? (int) (due - now) : 0;
+}
+
+/**
+ * Waits for events and dispatches them to the owners of the ready file descriptors.
+ */
+void event_loop_run(struct event_loop *loop) {
+    struct epoll_event events[MAX_EVENTS];
+
+    loop->thread = pthread_self();
+    __atomic_store_n(&loop->running, 1, __ATOMIC_RELAXED);
+
+    while (__atomic_load_n(&loop->running, __ATOMIC_RELAXED)) {
+        // Do not sleep while posted tasks are waiting, nor past the next deadline
+        pthread_mutex_lock(&loop->task_mutex);
+        int tasks_waiting = loop->tasks.next != &loop->tasks;
+        pthread_mutex_unlock(&loop->task_mutex);
+        int timeout = tasks_waiting ? 0 : event_loop_timeout(loop);
+
+        int count = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, timeout);
+        loop->now = event_loop_clock();
+
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait() failed");
+            return;
+        }
+
+        for (int i = 0; i < count && __atomic_load_n(&loop->running, __ATOMIC_RELAXED); i += 1) {
+            int fd = events[i].data.fd;
+
+            // The owner may have been closed by an earlier handler in this batch
+            struct event_slot *slot = &loop->slots[fd];
+            if (slot->handler != NULL) {
+                slot->handler(loop, fd, events[i].events, slot->data);
+            }
+        }
+
+        event_loop_run_tasks(loop);
+        timer_wheel_advance(&loop->timers, loop->now / TIMER_WHEEL_TICK);
+    }
+}
+
+/**
+ * Makes event_loop_run() return once the current handler is done. May be called from any thread.
+ */
+void event_loop_stop(struct event_loop *loop) {
+    __atomic_store_n(&loop->running, 0, __ATOMIC_RELAXED);
+    event_loop_wake(loop);
+}
@@ -0,0 +1,75 @@
+#ifndef FTP_PROXY_EVENT_LOOP_H
+#define FTP_PROXY_EVENT_LOOP_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+
+#include "timer_wheel.h"
+
+struct event_loop;
+
+/**
+ * Callback invoked when a registered file descriptor becomes ready.
+ */
+typedef void (*event_handler)(struct event_loop *loop, int fd, uint32_t events, void *data);
+
+/**
+ * Owner of a registered file descriptor.
+ */
+struct event_slot {
+    event_handler handler;
+    void *data;
+};
+
+/**
+ * Deferred callback run by the event loop after the events it is currently dispatching.
+ */
+struct event_task {
+    void (*run)(struct event_task *task);
+    struct event_task *prev;
+    struct event_task *next;
+    int queued;
+};
+
+/**
+ * Edge-triggered epoll reactor with a lookup table from file descriptor to its owner.
+ */
+struct event_loop {
+    int epoll_fd;
+    int running;
+    int max_fds;                    // Size of the slot table, taken from RLIMIT_NOFILE
+    struct event_slot *slots;       // Indexed by file descriptor
+    struct event_task tasks;        // Sentinel of the queue of posted tasks
+    pthread_mutex_t task_mutex;     // Guards the task queue, which other threads may post to
+    pthread_t thread;               // Thread running the loop
+    int wake_fd;                    // Written by other threads to interrupt epoll_wait()
+    unsigned long long now;         // Monotonic milliseconds, read once per round of events
+    struct timer_wheel timers;      // Deadlines of the loop's owners, only armed from the loop's thread
+};
+
+int event_loop_init(struct event_loop *loop);
+
+int event_loop_add(struct event_loop *loop, int fd, uint32_t events, event_handler handler, void *data);
+
+int event_loop_modify(struct event_loop *loop, int fd, uint32_t events);
+
+void event_loop_remove(struct event_loop *loop, int fd);
+
+void event_loop_post(struct event_loop *loop, struct event_task *task);
+
+void event_loop_cancel(struct event_loop *loop, struct event_task *task);
+
+unsigned long long event_loop_now(const struct event_loop *loop);
+
+void event_loop_arm(struct event_loop *loop, struct wheel_timer *timer, unsigned long long milliseconds);
+
+void event_loop_disarm(struct event_loop *loop, struct wheel_timer *timer);
+
+int event_loop_armed(const struct wheel_timer *timer);
+
+void event_loop_run(struct event_loop *loop);
+
+void event_loop_stop(struct event_loop *loop);
+
+#endif
@@ -0,0 +1,482 @@
+#include "fetch.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "cache_writer.h"
+#include "log.h"
+#include "metrics.h"
+#include "net.h"
+#include "upstream.h"
+
+#define FETCH_READ_SIZE (64 * 1024)
+
+static void fetch_handle_event(struct event_loop *loop, int fd, uint32_t events, void *data);
+
+static void fetch_handle_writer_room(void *data);
+
+/**
+ * Starts connecting a new socket of a segment to the given port of the mirror.
+ * Returns the socket, or -1 on failure.
+ */
+static int fetch_connect(struct fetch_segment *segment, int port) {
+    struct fetch *fetch = segment->fetch;
+    struct sockaddr_in address;
+
+    bzero((char *) &address, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+
+    if (upstream_lookup(segment->upstream, &address.sin_addr) < 0) {
+        return -1;
+    }
+
+    int socket_fd = start_connection(address);
+    if (socket_fd < 0) {
+        return -1;
+    }
+
+    if (event_loop_add(fetch->loop, socket_fd, FETCH_EVENTS | EPOLLOUT, fetch_handle_event, segment) < 0) {
+        close(socket_fd);
+        return -1;
+    }
+
+    return socket_fd;
+}
+
+/**
+ * Unregisters and closes a socket of the fetch, then marks it as unused.
+ */
+static void fetch_close_socket(struct fetch *fetch, int *socket_fd) {
+    if (*socket_fd >= 0) {
+        event_loop_remove(fetch->loop, *socket_fd);
+        close(*socket_fd);
+        *socket_fd = -1;
+    }
+}
+
+/**
+ * Drops a reference to the fetch. The last one publishes the fill and releases the fetch.
+ */
+static void fetch_release(struct fetch *fetch) {
+    fetch->running -= 1;
+    if (fetch->running > 0) {
+        return;
+    }
+
+    if (fetch->failed) {
+        log_warning("Segmented fetch of %s failed\n", fetch->name);
+    } else {
+        log_info("Segmented fetch of %s done\n", fetch->name);
+    }
+    cache_publish_fill(fetch->config->cache, fetch->entry, !fetch->failed);
+    event_loop_disarm(fetch->loop, &fetch->timer);
+    free(fetch);
+}
+
+/**
+ * Hangs up the upstream session of a segment and hands what it received to the fill. The fetch may
+ * be released before this returns.
+ */
+static void fetch_end_segment(struct fetch_segment *segment, int success) {
+    struct fetch *fetch = segment->fetch;
+    struct cache_writer *writer = segment->writer;
+
+    fetch_close_socket(fetch, &segment->data_socket);
+    fetch_close_socket(fetch, &segment->command_socket);
+    if (segment->upstream != NULL) {
+        upstream_release(segment->upstream);
+        segment->upstream = NULL;
+    }
+
+    if (writer == NULL) {
+        return;
+    }
+    segment->writer = NULL;
+
+    if (success) {
+        cache_writer_finish(writer);
+    } else {
+        // The bytes before the failure are what the server holds, so they are kept as a segment
+        cache_writer_abort(writer, TRUE);
+    }
+}
+
+/**
+ * Ends every segment once one of them failed, as the fill cannot complete anymore. The fetch may
+ * be released before this returns.
+ */
+static void fetch_fail(struct fetch *fetch) {
+    fetch->failed = TRUE;
+
+    // Keeps the fetch alive while its segments end
+    fetch->running += 1;
+    for (int i = 0; i < fetch->segment_count; i += 1) {
+        fetch_end_segment(&fetch->segments[i], FALSE);
+    }
+    fetch_release(fetch);
+}
+
+/**
+ * Called by the writer of a segment once its bytes are written or it failed.
+ */
+static void fetch_segment_written(void *data, int success) {
+    struct fetch *fetch = data;
+
+    if (!success && !fetch->failed) {
+        fetch_fail(fetch);
+    }
+    fetch_release(fetch);
+}
+
+/**
+ * Sends a command on the command connection of a segment. Commands are short and only sent once the
+ * previous one was answered, so the socket always has room for them.
+ * Returns 0 on success and -1 on failure.
+ */
+static int fetch_send(struct fetch_segment *segment, const char *command) {
+    size_t length = strlen(command);
+
+    if (send(segment->command_socket, command, length, MSG_NOSIGNAL) != (ssize_t) length) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Moves the upstream session of a segment on to its next command after a final reply.
+ * Returns 0 while the segment goes on and -1 if the server refused a step.
+ */
+static int fetch_handle_reply(struct fetch_segment *segment, const char *line, int code) {
+    struct fetch *fetch = segment->fetch;
+    char command[PATH_MAX + 16];
+    int server_address[6];
+
+    switch (segment->step) {
+        case FETCH_GREETING:
+            if (code != 220) {
+                return -1;
+            }
+            snprintf(command, sizeof(command), "USER %s\r\n", fetch->user);
+            segment->step = FETCH_USER;
+            break;
+        case FETCH_USER:
+            if (code == 331) {
+                snprintf(command, sizeof(command), "PASS %s\r\n", fetch->password);
+                segment->step = FETCH_PASS;
+                break;
+            }
+            // Logged in without a password
+            // fall through
+        case FETCH_PASS:
+            if (code != 230 && code != 202) {
+                return -1;
+            }
+            snprintf(command, sizeof(command), "TYPE I\r\n");
+            segment->step = FETCH_TYPE;
+            break;
+        case FETCH_TYPE:
+            if (code != 200) {
+                return -1;
+            }
+            snprintf(command, sizeof(command), "PASV\r\n");
+            segment->step = FETCH_PASV;
+            break;
+        case FETCH_PASV:
+            if (code != 227 || control_parse_address(line + 4, strlen(line + 4), server_address) < 0) {
+                return -1;
+            }
+            segment->data_socket = fetch_connect(segment, server_address[4] * 256 + server_address[5]);
+            if (segment->data_socket < 0) {
+                return -1;
+            }
+            segment->data_connecting = TRUE;
+
+            snprintf(command, sizeof(command), "REST %lld\r\n", (long long) segment->start);
+            segment->step = FETCH_REST;
+            break;
+        case FETCH_REST:
+            if (code != 350) {
+                return -1;
+            }
+            snprintf(command, sizeof(command), "RETR %s\r\n", fetch->name);
+            segment->step = FETCH_RETR;
+            break;
+        case FETCH_RETR:
+        default:
+            // The segment ends once the data connection brought all of its bytes
+            return code < 400 ? 0 : -1;
+    }
+
+    return fetch_send(segment, command);
+}
+
+/**
+ * Reads the replies received on the command connection of a segment.
+ * Returns 0 while the segment goes on and -1 if it failed.
+ */
+static int fetch_read_replies(struct fetch_segment *segment) {
+    struct control_parser *parser = &segment->parser;
+
+    if (segment->command_connecting) {
+        if (finish_connection(segment->command_socket) < 0) {
+            log_warning("Cannot connect to server: %s\n", strerror(errno));
+            upstream_record_failure(segment->upstream);
+            return -1;
+        }
+        segment->command_connecting = FALSE;
+        event_loop_modify(segment->fetch->loop, segment->command_socket, FETCH_EVENTS);
+
+        unsigned long long latency = metrics_now() - segment->connect_started;
+        metrics_observe(&segment->fetch->config->metrics->connect_latency, latency);
+        upstream_record_connect(segment->upstream, latency);
+    }
+
+    while (TRUE) {
+        const char *received;
+        size_t length;
+        int complete;
+
+        while ((received = control_parser_peek(parser, &length, &complete)) != NULL) {
+            int continued = parser->partial;
+
+            char line[CONTROL_BUFFER_SIZE + 1];
+            memcpy(line, received, length);
+            line[length] = '\0';
+            control_parser_consume(parser, length);
+
+            int code = complete && !continued ? control_parse_reply(parser, line, length) : 0;
+            if (code >= 200 && fetch_handle_reply(segment, line, code) < 0) {
+                log_warning("Segment at %lld of %s failed: %s", (long long) segment->start, segment->fetch->name, line);
+                return -1;
+            }
+        }
+
+        ssize_t read_size = control_parser_read(parser, segment->command_socket);
+        if (read_size < 0 && errno == EINTR) {
+            continue;
+        }
+        if (read_size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        if (read_size <= 0) {
+            // The segment hangs up first once it has its bytes
+            return -1;
+        }
+    }
+}
+
+/**
+ * Reads what the data connection of a segment brought into its writer, and ends the segment once it
+ * has every byte of its range.
+ * Returns 0 while the segment goes on or once it ended, and -1 if it failed.
+ */
+static int fetch_read_data(struct fetch_segment *segment) {
+    char buffer[FETCH_READ_SIZE];
+
+    if (segment->data_connecting) {
+        if (finish_connection(segment->data_socket) < 0) {
+            log_warning("Cannot connect data connection to server: %s\n", strerror(errno));
+            return -1;
+        }
+        segment->data_connecting = FALSE;
+        event_loop_modify(segment->fetch->loop, segment->data_socket, FETCH_EVENTS);
+    }
+
+    while (segment->offset < segment->end) {
+        size_t wanted = sizeof(buffer);
+        if ((off_t) wanted > segment->end - segment->offset) {
+            wanted = segment->end - segment->offset;
+        }
+
+        size_t room = cache_writer_room(segment->writer);
+        if (room == 0) {
+            // The disk fell behind, so the segment reads on once its writer has room again
+            cache_writer_wait(segment->writer, fetch_handle_writer_room, segment);
+            return 0;
+        }
+        wanted = wanted < room ? wanted : room;
+
+        ssize_t read_size = read(segment->data_socket, buffer, wanted);
+        if (read_size < 0 && errno == EINTR) {
+            continue;
+        }
+        if (read_size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            // Transfers streaming the fill see the bytes received so far
+            cache_writer_flush(segment->writer);
+            return 0;
+        }
+        if (read_size <= 0 || cache_writer_write(segment->writer, buffer, read_size) < 0) {
+            log_warning("Segment at %lld of %s ended early\n", (long long) segment->start, segment->fetch->name);
+            return -1;
+        }
+        segment->offset += read_size;
+    }
+
+    fetch_end_segment(segment, TRUE);
+    return 0;
+}
+
+/**
+ * Called once the writer of a segment has room again, to read what its data connection holds.
+ */
+static void fetch_handle_writer_room(void *data) {
+    struct fetch_segment *segment = data;
+
+    segment->fetch->activity = event_loop_now(segment->fetch->loop);
+    if (fetch_read_data(segment) < 0) {
+        fetch_fail(segment->fetch);
+    }
+}
+
+/**
+ * Dispatches an event on one of the sockets of a segment.
+ */
+static void fetch_handle_event(struct event_loop *loop, int fd, uint32_t events, void *data) {
+    struct fetch_segment *segment = data;
+    int result;
+
+    segment->fetch->activity = event_loop_now(loop);
+    if (fd == segment->command_socket) {
+        result = fetch_read_replies(segment);
+    } else if (fd == segment->data_socket) {
+        result = fetch_read_data(segment);
+    } else {
+        return;
+    }
+
+    if (result < 0) {
+        fetch_fail(segment->fetch);
+    }
+}
+
+/**
+ * Called when the segments may have stayed silent for longer than the stall timeout, which fails the
+ * fetch so the fill does not wait for a server that stopped sending.
+ */
+static void fetch_handle_timeout(struct wheel_timer *timer) {
+    struct fetch *fetch = container_of(timer, struct fetch, timer);
+    int open = FALSE;
+
+    for (int i = 0; i < fetch->segment_count; i += 1) {
+        if (fetch->segments[i].command_socket >= 0 || fetch->segments[i].data_socket >= 0) {
+            open = TRUE;
+        }
+    }
+    if (fetch->failed || !open) {
+        // Only the writers are left, which report back on their own
+        return;
+    }
+
+    unsigned long long deadline = fetch->activity + fetch->config->stall_timeout * 1000ULL;
+    unsigned long long now = event_loop_now(fetch->loop);
+    if (now < deadline) {
+        event_loop_arm(fetch->loop, timer, deadline - now);
+        return;
+    }
+
+    log_warning("Segmented fetch of %s stalled for %d seconds\n", fetch->name, fetch->config->stall_timeout);
+    fetch_fail(fetch);
+}
+
+/**
+ * Starts fetching the file of a new cache entry over several upstream sessions, logged in like the
+ * client's session and each downloading its share of the file. On success the fetch owns the fill
+ * of the entry and ends it on its own.
+ * Returns 0 if the fetch started and -1 if it did not, in which case the fill is left to the caller.
+ */
+int fetch_start(const struct session *session, struct cache_entry *entry, off_t size) {
+    const struct proxy_config *config = session->config;
+    int segment_count = config->fetch_segments;
+
+    if (size / FETCH_MIN_SEGMENT_SIZE < segment_count) {
+        segment_count = (int) (size / FETCH_MIN_SEGMENT_SIZE);
+    }
+    if (segment_count < 2) {
+        return -1;
+    }
+
+    struct fetch *fetch = calloc(1, sizeof(struct fetch));
+    if (fetch == NULL) {
+        perror("Error allocating fetch");
+        return -1;
+    }
+
+    fetch->loop = session->loop;
+    fetch->config = config;
+    fetch->entry = entry;
+    fetch->segment_count = segment_count;
+    snprintf(fetch->name, sizeof(fetch->name), "%s", session->cache_key);
+    snprintf(fetch->user, sizeof(fetch->user), "%s", session->user);
+    snprintf(fetch->password, sizeof(fetch->password), "%s", session->password);
+
+    // Every segment writes its range into the same file, so it is created once beforehand
+    char fill_path[64];
+    cache_fill_path(entry, fill_path, sizeof(fill_path));
+    int file_fd = open(fill_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0664);
+    if (file_fd < 0) {
+        log_warning("Cannot open cache file %s\n", fill_path);
+        free(fetch);
+        return -1;
+    }
+    close(file_fd);
+
+    for (int i = 0; i < segment_count; i += 1) {
+        struct fetch_segment *segment = &fetch->segments[i];
+
+        segment->fetch = fetch;
+        segment->data_socket = -1;
+        segment->start = size / segment_count * i;
+        segment->end = i == segment_count - 1 ? size : size / segment_count * (i + 1);
+        segment->offset = segment->start;
+        control_parser_init(&segment->parser);
+
+        // Each segment goes to the mirror best placed to serve it, as any of them holds the file
+        segment->upstream = upstream_choose(config->upstreams, 0);
+        segment->connect_started = metrics_now();
+        segment->command_socket = segment->upstream != NULL ? fetch_connect(segment, segment->upstream->port) : -1;
+        segment->command_connecting = TRUE;
+        if (segment->command_socket < 0) {
+            for (int j = 0; j <= i; j += 1) {
+                fetch_end_segment(&fetch->segments[j], FALSE);
+            }
+            unlink(fill_path);
+            free(fetch);
+            return -1;
+        }
+    }
+
+    log_info("Fetching %s in %d segments\n", fetch->name, segment_count);
+
+    fetch->timer.expire = fetch_handle_timeout;
+    fetch->activity = event_loop_now(fetch->loop);
+    if (config->stall_timeout > 0) {
+        event_loop_arm(fetch->loop, &fetch->timer, config->stall_timeout * 1000ULL);
+    }
+
+    // From here on every writer reports back, which ends the fill once the last one did
+    for (int i = 0; i < segment_count; i += 1) {
+        struct fetch_segment *segment = &fetch->segments[i];
+
+        segment->writer = cache_writer_open_range(config->cache_io, entry, segment->start,
+                                                  fetch_segment_written, fetch);
+        if (segment->writer == NULL) {
+            fetch->failed = TRUE;
+        } else {
+            fetch->running += 1;
+        }
+    }
+
+    if (fetch->failed) {
+        fetch_fail(fetch);
+    }
+
+    return 0;
+}
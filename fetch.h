@@ -0,0 +1,78 @@
+#ifndef FTP_PROXY_FETCH_H
+#define FTP_PROXY_FETCH_H
+
+#include <limits.h>
+#include <sys/types.h>
+
+#include "cache.h"
+#include "control.h"
+#include "event_loop.h"
+#include "proxy.h"
+#include "session.h"
+
+#define FETCH_MAX_SEGMENTS 16
+#define FETCH_MIN_SEGMENT_SIZE (1024 * 1024)    // Smaller files are split into fewer segments
+#define FETCH_DEFAULT_THRESHOLD (64ULL * 1024 * 1024)
+#define FETCH_EVENTS (EPOLLIN | EPOLLRDHUP | EPOLLET)
+
+struct cache_writer;
+
+/**
+ * Command the upstream session of a segment waits for the final reply to.
+ */
+enum fetch_step {
+    FETCH_GREETING,
+    FETCH_USER,
+    FETCH_PASS,
+    FETCH_TYPE,
+    FETCH_PASV,
+    FETCH_REST,
+    FETCH_RETR
+};
+
+struct fetch;
+
+/**
+ * Upstream session of a segmented fetch, which logs in like the client did and downloads the bytes
+ * [start, end) of the file. It hangs up once it has them, so the server never sends past the end.
+ */
+struct fetch_segment {
+    struct fetch *fetch;
+    struct upstream *upstream;      // Mirror the segment downloads from, NULL once it hung up
+    enum fetch_step step;
+    int command_socket;
+    int data_socket;
+    int command_connecting;         // The command connection is not established yet
+    int data_connecting;            // The data connection is not established yet
+    struct control_parser parser;   // Reply lines received from the server
+    struct cache_writer *writer;    // Writes the segment's bytes, NULL once it reported back
+    off_t start;
+    off_t end;
+    off_t offset;                   // Offset of the next byte expected from the server
+    unsigned long long connect_started;     // When the command connection was started, in microseconds
+};
+
+/**
+ * Fills a new cache entry over several upstream sessions at once, each of them fetching its own range
+ * of the file. The client streams the entry like any transfer joining a fill, so it is served in order
+ * while the ranges after its position are already on their way. The fetch does not depend on the
+ * session that started it, and ends the fill once every segment reported back.
+ */
+struct fetch {
+    struct event_loop *loop;
+    const struct proxy_config *config;
+    struct cache_entry *entry;
+    char name[PATH_MAX];            // Path of the file, absolute or relative to the login directory
+    char user[SESSION_CREDENTIAL_SIZE];
+    char password[SESSION_CREDENTIAL_SIZE];
+    int segment_count;
+    int running;                    // Segments whose writer did not report back yet
+    int failed;
+    struct wheel_timer timer;       // Fails the fetch once no segment received anything for the stall timeout
+    unsigned long long activity;    // When a segment last had an event, in loop milliseconds
+    struct fetch_segment segments[FETCH_MAX_SEGMENTS];
+};
+
+int fetch_start(const struct session *session, struct cache_entry *entry, off_t size);
+
+#endif
@@ -0,0 +1,346 @@
+#define _GNU_SOURCE
+
+#include "handoff.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "proxy.h"
+
+#define HANDOFF_MAGIC "FTPCHND1"
+
+struct handoff_record {
+    int32_t kind;
+    int32_t port;
+    int32_t busy;
+};
+
+/**
+ * Message of the handoff connection. The new process sends one without records to ask for the
+ * sockets, and the running one answers with messages carrying one descriptor per record.
+ */
+struct handoff_message {
+    char magic[8];
+    uint32_t count;
+    uint32_t last;                  // No message follows
+    struct handoff_record records[HANDOFF_BATCH];
+};
+
+/**
+ * Control buffer large enough for the descriptors of one message.
+ */
+union handoff_control {
+    char buffer[CMSG_SPACE(sizeof(int) * HANDOFF_BATCH)];
+    struct cmsghdr align;
+};
+
+/**
+ * Fills in the address of the Unix socket at the path.
+ * Returns 0 on success and -1 if the path is too long.
+ */
+static int handoff_address(const char *path, struct sockaddr_un *address) {
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address->sun_path)) {
+        fprintf(stderr, "Handoff socket path is too long: %s\n", path);
+        return -1;
+    }
+    strcpy(address->sun_path, path);
+    return 0;
+}
+
+/**
+ * Listens on the Unix socket at the path for the process that will replace this one, taking the path
+ * over from a previous process or one that crashed.
+ * Returns the file descriptor of the listening socket, or -1 on failure.
+ */
+int handoff_listen(const char *path) {
+    struct sockaddr_un address;
+    if (handoff_address(path, &address) < 0) {
+        return -1;
+    }
+
+    int socket_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (socket_fd < 0) {
+        perror("Error opening handoff socket");
+        return -1;
+    }
+
+    unlink(path);
+    if (bind(socket_fd, (struct sockaddr *) &address, sizeof(address)) < 0 || listen(socket_fd, 4) < 0) {
+        perror("Error binding handoff socket");
+        close(socket_fd);
+        return -1;
+    }
+
+    return socket_fd;
+}
+
+/**
+ * Accepts a connection of a process asking for the sockets.
+ * Returns the file descriptor of the connection, or -1 if there is none.
+ */
+int handoff_accept(int listen_fd) {
+    return accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+}
+
+/**
+ * Reads the request of the new process from its connection.
+ * Returns 1 once it asked for the sockets, 0 if nothing arrived yet and -1 if the connection is not
+ * from a new process or was closed.
+ */
+int handoff_read_request(int connection) {
+    struct handoff_message message;
+
+    ssize_t read_size = recv(connection, &message, sizeof(message), 0);
+    if (read_size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return 0;
+    }
+    if (read_size < (ssize_t) offsetof(struct handoff_message, records) ||
+        memcmp(message.magic, HANDOFF_MAGIC, sizeof(message.magic)) != 0) {
+        return -1;
+    }
+
+    return 1;
+}
+
+/**
+ * Closes the descriptors received so far and frees them.
+ */
+static void handoff_discard(struct handoff_socket *sockets, int count) {
+    for (int i = 0; i < count; i += 1) {
+        close(sockets[i].fd);
+    }
+    free(sockets);
+}
+
+/**
+ * Receives one message with its descriptors, which are appended to the sockets.
+ * Returns 1 after the last message, 0 if more follow and -1 on failure.
+ */
+static int handoff_receive(int connection, struct handoff_socket **sockets, int *count) {
+    struct handoff_message message;
+    union handoff_control control;
+    struct iovec vector = {.iov_base = &message, .iov_len = sizeof(message)};
+    struct msghdr header;
+
+    memset(&header, 0, sizeof(header));
+    header.msg_iov = &vector;
+    header.msg_iovlen = 1;
+    header.msg_control = control.buffer;
+    header.msg_controllen = sizeof(control.buffer);
+
+    ssize_t read_size = recvmsg(connection, &header, MSG_CMSG_CLOEXEC);
+    if (read_size < 0) {
+        perror("Error receiving sockets from the previous process");
+        return -1;
+    }
+    if (read_size == 0) {
+        // It is handing off to another process already, or exiting
+        fprintf(stderr, "The previous process refused to hand off its sockets\n");
+        return -1;
+    }
+
+    // Descriptors arrive even in a message that turns out to be malformed, and must be closed then
+    int received[HANDOFF_BATCH];
+    int received_count = 0;
+    for (struct cmsghdr *message_control = CMSG_FIRSTHDR(&header); message_control != NULL;
+         message_control = CMSG_NXTHDR(&header, message_control)) {
+        if (message_control->cmsg_level == SOL_SOCKET && message_control->cmsg_type == SCM_RIGHTS) {
+            int fd_count = (int) ((message_control->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+            for (int i = 0; i < fd_count && received_count < HANDOFF_BATCH; i += 1) {
+                memcpy(&received[received_count], CMSG_DATA(message_control) + i * sizeof(int), sizeof(int));
+                received_count += 1;
+            }
+        }
+    }
+
+    size_t header_size = offsetof(struct handoff_message, records);
+    if (read_size < (ssize_t) header_size || memcmp(message.magic, HANDOFF_MAGIC, sizeof(message.magic)) != 0 ||
+        message.count > HANDOFF_BATCH || (size_t) read_size < header_size + message.count * sizeof(struct handoff_record) ||
+        (header.msg_flags & MSG_CTRUNC) != 0 || received_count != (int) message.count) {
+        fprintf(stderr, "The previous process sent a malformed handoff message\n");
+        for (int i = 0; i < received_count; i += 1) {
+            close(received[i]);
+        }
+        return -1;
+    }
+
+    struct handoff_socket *grown = realloc(*sockets, (*count + received_count + 1) * sizeof(struct handoff_socket));
+    if (grown == NULL) {
+        perror("Error allocating handed off sockets");
+        for (int i = 0; i < received_count; i += 1) {
+            close(received[i]);
+        }
+        return -1;
+    }
+    *sockets = grown;
+
+    for (int i = 0; i < received_count; i += 1) {
+        struct handoff_socket *handed = &grown[*count];
+        handed->fd = received[i];
+        handed->kind = (enum handoff_kind) message.records[i].kind;
+        handed->port = message.records[i].port;
+        handed->busy = message.records[i].busy;
+        *count += 1;
+    }
+
+    return message.last ? 1 : 0;
+}
+
+/**
+ * Asks the process listening at the path for its listening sockets, so this one can accept on them
+ * without ever closing the ports. The connection stays open, and the previous process hangs up once
+ * it exited.
+ * Returns 1 with the sockets and the connection, 0 if no process listens at the path and -1 on
+ * failure.
+ */
+int handoff_request(const char *path, int *connection, struct handoff_socket **sockets, int *count) {
+    struct sockaddr_un address;
+    if (handoff_address(path, &address) < 0) {
+        return -1;
+    }
+
+    int socket_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (socket_fd < 0) {
+        perror("Error opening handoff socket");
+        return -1;
+    }
+
+    if (connect(socket_fd, (struct sockaddr *) &address, sizeof(address)) < 0) {
+        int error = errno;
+        close(socket_fd);
+        // A socket file left behind by a process that is gone refuses the connection
+        if (error == ENOENT || error == ECONNREFUSED) {
+            return 0;
+        }
+        errno = error;
+        perror("Error connecting to the previous process");
+        return -1;
+    }
+
+    struct timeval timeout = {.tv_sec = HANDOFF_TIMEOUT, .tv_usec = 0};
+    setsockopt(socket_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    struct handoff_message request;
+    memset(&request, 0, sizeof(request));
+    memcpy(request.magic, HANDOFF_MAGIC, sizeof(request.magic));
+    request.last = TRUE;
+    if (send(socket_fd, &request, offsetof(struct handoff_message, records), MSG_NOSIGNAL) < 0) {
+        perror("Error asking the previous process for its sockets");
+        close(socket_fd);
+        return -1;
+    }
+
+    *sockets = NULL;
+    *count = 0;
+    int result;
+    while ((result = handoff_receive(socket_fd, sockets, count)) == 0) {
+    }
+    if (result < 0) {
+        handoff_discard(*sockets, *count);
+        close(socket_fd);
+        return -1;
+    }
+
+    *connection = socket_fd;
+    return 1;
+}
+
+/**
+ * Sends the listening sockets to the new process, in messages of at most HANDOFF_BATCH descriptors.
+ * The connection blocks meanwhile, as the new process reads them right away.
+ * Returns 0 on success and -1 on failure.
+ */
+int handoff_send(int connection, const struct handoff_socket *sockets, int count) {
+    struct timeval timeout = {.tv_sec = HANDOFF_TIMEOUT, .tv_usec = 0};
+    setsockopt(connection, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    fcntl(connection, F_SETFL, fcntl(connection, F_GETFL) & ~O_NONBLOCK);
+
+    int sent = 0;
+    do {
+        int batch = count - sent < HANDOFF_BATCH ? count - sent : HANDOFF_BATCH;
+        struct handoff_message message;
+        union handoff_control control;
+
+        memset(&message, 0, sizeof(message));
+        memcpy(message.magic, HANDOFF_MAGIC, sizeof(message.magic));
+        message.count = batch;
+        message.last = sent + batch == count;
+        for (int i = 0; i < batch; i += 1) {
+            message.records[i].kind = sockets[sent + i].kind;
+            message.records[i].port = sockets[sent + i].port;
+            message.records[i].busy = sockets[sent + i].busy;
+        }
+
+        struct iovec vector = {
+                .iov_base = &message,
+                .iov_len = offsetof(struct handoff_message, records) + batch * sizeof(struct handoff_record)
+        };
+        struct msghdr header;
+        memset(&header, 0, sizeof(header));
+        header.msg_iov = &vector;
+        header.msg_iovlen = 1;
+
+        if (batch > 0) {
+            header.msg_control = control.buffer;
+            header.msg_controllen = CMSG_SPACE(sizeof(int) * batch);
+            struct cmsghdr *message_control = CMSG_FIRSTHDR(&header);
+            message_control->cmsg_level = SOL_SOCKET;
+            message_control->cmsg_type = SCM_RIGHTS;
+            message_control->cmsg_len = CMSG_LEN(sizeof(int) * batch);
+            for (int i = 0; i < batch; i += 1) {
+                memcpy(CMSG_DATA(message_control) + i * sizeof(int), &sockets[sent + i].fd, sizeof(int));
+            }
+        }
+
+        if (sendmsg(connection, &header, MSG_NOSIGNAL) < 0) {
+            perror("Error sending sockets to the new process");
+            return -1;
+        }
+        sent += batch;
+    } while (sent < count);
+
+    return 0;
+}
+
+static int handoff_compare(const void *first, const void *second) {
+    const struct handoff_socket *a = first;
+    const struct handoff_socket *b = second;
+
+    if (a->kind != b->kind) {
+        return a->kind < b->kind ? -1 : 1;
+    }
+    return a->port < b->port ? -1 : a->port > b->port;
+}
+
+/**
+ * Orders received sockets by kind and port, so handoff_find() can look them up.
+ */
+void handoff_sort(struct handoff_socket *sockets, int count) {
+    if (count > 0) {
+        qsort(sockets, count, sizeof(struct handoff_socket), handoff_compare);
+    }
+}
+
+/**
+ * Looks up a received socket of the kind listening on the port among sorted ones.
+ * Returns the socket, or NULL if none was received or it was taken already.
+ */
+struct handoff_socket *handoff_find(struct handoff_socket *sockets, int count, enum handoff_kind kind, int port) {
+    struct handoff_socket wanted = {.fd = -1, .kind = kind, .port = port, .busy = FALSE};
+
+    if (count == 0) {
+        return NULL;
+    }
+    struct handoff_socket *found = bsearch(&wanted, sockets, count, sizeof(struct handoff_socket), handoff_compare);
+    return found != NULL && found->fd >= 0 ? found : NULL;
+}
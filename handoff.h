@@ -0,0 +1,37 @@
+#ifndef FTP_PROXY_HANDOFF_H
+#define FTP_PROXY_HANDOFF_H
+
+#define HANDOFF_BATCH 64                    // Sockets passed per message, well below the kernel's limit
+#define HANDOFF_TIMEOUT 10                  // Seconds the new process waits for the sockets
+
+enum handoff_kind {
+    HANDOFF_COMMAND,                        // Listener on the command port
+    HANDOFF_METRICS,                        // Listener of the metrics endpoint
+    HANDOFF_DATA                            // Listener of a data port from the configured range
+};
+
+/**
+ * Listening socket passed from the running process to the one replacing it.
+ */
+struct handoff_socket {
+    int fd;                         // -1 once the receiving process took it
+    enum handoff_kind kind;
+    int port;
+    int busy;                       // A transfer of the previous process still waits on the data listener
+};
+
+int handoff_listen(const char *path);
+
+int handoff_accept(int listen_fd);
+
+int handoff_read_request(int connection);
+
+int handoff_request(const char *path, int *connection, struct handoff_socket **sockets, int *count);
+
+int handoff_send(int connection, const struct handoff_socket *sockets, int count);
+
+void handoff_sort(struct handoff_socket *sockets, int count);
+
+struct handoff_socket *handoff_find(struct handoff_socket *sockets, int count, enum handoff_kind kind, int port);
+
+#endif
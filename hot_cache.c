@@ -0,0 +1,247 @@
+#define _GNU_SOURCE
+
+#include "hot_cache.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include "proxy.h"
+
+/**
+ * Reserves the arena of the budget. Its pages only take memory once a copy is written into them.
+ * Returns 0 on success and -1 on failure.
+ */
+int hot_cache_init(struct hot_cache *hot, unsigned long long budget, off_t threshold) {
+    hot->page_count = budget / HOT_CACHE_PAGE_SIZE;
+    hot->pages_used = 0;
+    hot->free_count = 0;
+    hot->threshold = threshold;
+    hot->hits = 0;
+    hot->bytes = 0;
+    hot->lru.lru_prev = hot->lru.lru_next = &hot->lru;
+    pthread_mutex_init(&hot->mutex, NULL);
+
+    hot->arena = mmap(NULL, hot->page_count * HOT_CACHE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (hot->arena == MAP_FAILED) {
+        perror("Error reserving memory cache");
+        return -1;
+    }
+
+    hot->free_pages = malloc(hot->page_count * sizeof(unsigned int));
+    if (hot->free_pages == NULL) {
+        perror("Error allocating memory cache");
+        munmap(hot->arena, hot->page_count * HOT_CACHE_PAGE_SIZE);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Gives the pages of a copy back and frees it. The mutex must be held.
+ */
+static void hot_cache_free(struct hot_cache *hot, struct hot_file *file) {
+    for (size_t i = 0; i < file->page_count; i += 1) {
+        hot->free_pages[hot->free_count++] = (unsigned int) ((file->pages[i] - hot->arena) / HOT_CACHE_PAGE_SIZE);
+    }
+    free(file);
+}
+
+/**
+ * Detaches a copy from its cache entry and from the LRU list, and frees it unless a transfer still
+ * sends it. The mutex must be held.
+ */
+static void hot_cache_detach(struct hot_cache *hot, struct hot_file *file) {
+    *file->owner = NULL;
+    file->owner = NULL;
+    file->lru_prev->lru_next = file->lru_next;
+    file->lru_next->lru_prev = file->lru_prev;
+    hot->bytes -= file->size;
+
+    if (file->refs == 0) {
+        hot_cache_free(hot, file);
+    }
+}
+
+/**
+ * Takes a free page, evicting the least recently used copies until one is given back. The pages of
+ * an evicted copy a transfer still sends only come back once it is done. The mutex must be held.
+ * Returns the page, or NULL if every page is in use.
+ */
+static char *hot_cache_take_page(struct hot_cache *hot) {
+    while (TRUE) {
+        if (hot->free_count > 0) {
+            return hot->arena + (size_t) hot->free_pages[--hot->free_count] * HOT_CACHE_PAGE_SIZE;
+        }
+        if (hot->pages_used < hot->page_count) {
+            return hot->arena + hot->pages_used++ * HOT_CACHE_PAGE_SIZE;
+        }
+        if (hot->lru.lru_prev == &hot->lru) {
+            return NULL;
+        }
+        hot_cache_detach(hot, hot->lru.lru_prev);
+    }
+}
+
+/**
+ * Copies a file of the disk cache into pages of the arena. The copy is not attached to any entry
+ * yet, and the caller holds a reference to it.
+ * Returns the copy, or NULL if it does not fit or the file cannot be read.
+ */
+struct hot_file *hot_cache_load(struct hot_cache *hot, int fd, off_t size) {
+    size_t page_count = (size + HOT_CACHE_PAGE_SIZE - 1) / HOT_CACHE_PAGE_SIZE;
+
+    if (size > hot->threshold || page_count > hot->page_count) {
+        return NULL;
+    }
+
+    struct hot_file *file = malloc(sizeof(struct hot_file) + page_count * sizeof(char *));
+    if (file == NULL) {
+        return NULL;
+    }
+    file->owner = NULL;
+    file->size = size;
+    file->refs = 1;
+    file->page_count = 0;
+
+    pthread_mutex_lock(&hot->mutex);
+    while (file->page_count < page_count) {
+        char *page = hot_cache_take_page(hot);
+        if (page == NULL) {
+            hot_cache_free(hot, file);
+            pthread_mutex_unlock(&hot->mutex);
+            return NULL;
+        }
+        file->pages[file->page_count++] = page;
+    }
+    pthread_mutex_unlock(&hot->mutex);
+
+    // Nobody else sees the copy yet, so it is read without the mutex
+    for (off_t offset = 0; offset < size;) {
+        size_t length = HOT_CACHE_PAGE_SIZE - offset % HOT_CACHE_PAGE_SIZE;
+        if ((off_t) length > size - offset) {
+            length = size - offset;
+        }
+
+        ssize_t read_size = pread(fd, file->pages[offset / HOT_CACHE_PAGE_SIZE] + offset % HOT_CACHE_PAGE_SIZE,
+                                  length, offset);
+        if (read_size < 0 && errno == EINTR) {
+            continue;
+        }
+        if (read_size <= 0) {
+            hot_cache_put(hot, file);
+            return NULL;
+        }
+        offset += read_size;
+    }
+
+    return file;
+}
+
+/**
+ * Takes a reference to the copy attached to the cache entry owning it, and marks it as the most
+ * recently used one.
+ * Returns the copy, or NULL if the entry has none.
+ */
+struct hot_file *hot_cache_get(struct hot_cache *hot, struct hot_file **owner) {
+    pthread_mutex_lock(&hot->mutex);
+    struct hot_file *file = *owner;
+    if (file != NULL) {
+        file->refs += 1;
+        file->lru_prev->lru_next = file->lru_next;
+        file->lru_next->lru_prev = file->lru_prev;
+        file->lru_next = hot->lru.lru_next;
+        file->lru_prev = &hot->lru;
+        hot->lru.lru_next->lru_prev = file;
+        hot->lru.lru_next = file;
+        __atomic_add_fetch(&hot->hits, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&hot->mutex);
+
+    return file;
+}
+
+/**
+ * Attaches a loaded copy to its cache entry, unless the entry has one already. The shard of the entry
+ * must be locked, which keeps the entry from going away. The caller keeps its reference either way.
+ * Returns 0 on success and -1 if the entry already has a copy.
+ */
+int hot_cache_attach(struct hot_cache *hot, struct hot_file **owner, struct hot_file *file) {
+    pthread_mutex_lock(&hot->mutex);
+    if (*owner != NULL || file->owner != NULL) {
+        pthread_mutex_unlock(&hot->mutex);
+        return -1;
+    }
+
+    *owner = file;
+    file->owner = owner;
+    file->lru_next = hot->lru.lru_next;
+    file->lru_prev = &hot->lru;
+    hot->lru.lru_next->lru_prev = file;
+    hot->lru.lru_next = file;
+    hot->bytes += file->size;
+    pthread_mutex_unlock(&hot->mutex);
+
+    return 0;
+}
+
+/**
+ * Drops the copy attached to a cache entry, if any, because the entry goes away. The shard of the
+ * entry must be locked.
+ */
+void hot_cache_drop(struct hot_cache *hot, struct hot_file **owner) {
+    pthread_mutex_lock(&hot->mutex);
+    if (*owner != NULL) {
+        hot_cache_detach(hot, *owner);
+    }
+    pthread_mutex_unlock(&hot->mutex);
+}
+
+/**
+ * Releases a reference to a copy, freeing it if it was detached and this was the last one.
+ */
+void hot_cache_put(struct hot_cache *hot, struct hot_file *file) {
+    pthread_mutex_lock(&hot->mutex);
+    file->refs -= 1;
+    if (file->refs == 0 && file->owner == NULL) {
+        hot_cache_free(hot, file);
+    }
+    pthread_mutex_unlock(&hot->mutex);
+}
+
+/**
+ * Writes up to count bytes of the copy from the offset to the socket, gathering its pages with writev(),
+ * and advances the offset past what was sent.
+ * Returns the number of bytes sent, or -1 on failure.
+ */
+ssize_t hot_file_send(const struct hot_file *file, int socket_fd, off_t *offset, size_t count) {
+    struct iovec vectors[HOT_CACHE_IOV_MAX];
+    int vector_count = 0;
+    off_t position = *offset;
+    off_t end = *offset + (off_t) count < file->size ? *offset + (off_t) count : file->size;
+
+    while (position < end && vector_count < HOT_CACHE_IOV_MAX) {
+        size_t start = position % HOT_CACHE_PAGE_SIZE;
+        size_t length = HOT_CACHE_PAGE_SIZE - start;
+        if ((off_t) length > end - position) {
+            length = end - position;
+        }
+
+        vectors[vector_count].iov_base = file->pages[position / HOT_CACHE_PAGE_SIZE] + start;
+        vectors[vector_count].iov_len = length;
+        vector_count += 1;
+        position += length;
+    }
+
+    ssize_t sent = writev(socket_fd, vectors, vector_count);
+    if (sent > 0) {
+        *offset += sent;
+    }
+
+    return sent;
+}
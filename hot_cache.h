@@ -0,0 +1,63 @@
+#ifndef FTP_PROXY_HOT_CACHE_H
+#define FTP_PROXY_HOT_CACHE_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define HOT_CACHE_PAGE_SIZE 4096
+#define HOT_CACHE_DEFAULT_BUDGET (64ULL * 1024 * 1024)
+#define HOT_CACHE_DEFAULT_THRESHOLD (64 * 1024)
+#define HOT_CACHE_MAX_THRESHOLD (4 * 1024 * 1024)
+#define HOT_CACHE_IOV_MAX 64                // Pages handed to one writev()
+
+/**
+ * Copy of a small cached file held in pages of the arena. It is attached to its cache entry until it
+ * is evicted or the entry goes away, and freed once no transfer sends it anymore.
+ * Every field is guarded by the mutex of the hot cache, except the pages, which never change.
+ */
+struct hot_file {
+    struct hot_file **owner;        // Field of the cache entry pointing at the copy, NULL once detached
+    off_t size;
+    int refs;                       // Transfers sending the copy
+    struct hot_file *lru_prev;      // Towards the most recently used copy
+    struct hot_file *lru_next;      // Towards the least recently used copy
+    size_t page_count;
+    char *pages[];
+};
+
+/**
+ * Memory tier on top of the disk cache, shared by every worker. Files up to the threshold are copied
+ * into fixed-size pages of one arena the first time they are served from the disk, and later hits
+ * are written to the client straight from those pages. Pages are reserved up front and only backed
+ * by memory once used; when the budget is used up, the least recently used copies are evicted.
+ */
+struct hot_cache {
+    pthread_mutex_t mutex;
+    char *arena;
+    size_t page_count;              // Pages of the budget
+    size_t pages_used;              // Pages ever handed out, from the start of the arena
+    unsigned int *free_pages;       // Stack of pages given back
+    size_t free_count;
+    off_t threshold;                // Largest file kept in memory
+
+    struct hot_file lru;            // Sentinel of the LRU list of attached copies
+    unsigned long long hits;        // Updated atomically
+    unsigned long long bytes;       // Bytes of the attached copies
+};
+
+int hot_cache_init(struct hot_cache *hot, unsigned long long budget, off_t threshold);
+
+struct hot_file *hot_cache_load(struct hot_cache *hot, int fd, off_t size);
+
+struct hot_file *hot_cache_get(struct hot_cache *hot, struct hot_file **owner);
+
+int hot_cache_attach(struct hot_cache *hot, struct hot_file **owner, struct hot_file *file);
+
+void hot_cache_drop(struct hot_cache *hot, struct hot_file **owner);
+
+void hot_cache_put(struct hot_cache *hot, struct hot_file *file);
+
+ssize_t hot_file_send(const struct hot_file *file, int socket_fd, off_t *offset, size_t count);
+
+#endif
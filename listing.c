@@ -0,0 +1,322 @@
+#define _GNU_SOURCE
+
+#include "listing.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "log.h"
+
+#define LISTING_BUFFER_INITIAL_CAPACITY (16 * 1024)
+
+/**
+ * Hashes the key of a listing with 64-bit FNV-1a.
+ */
+static unsigned long long listing_hash(const char *key) {
+    unsigned long long hash = 14695981039346656037ULL;
+
+    for (const char *c = key; *c != '\0'; c += 1) {
+        hash = (hash ^ (unsigned char) *c) * 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+/**
+ * Sets up an empty cache whose listings are answered for ttl seconds.
+ * Returns 0 on success and -1 on failure.
+ */
+int listing_cache_init(struct listing_cache *cache, int ttl) {
+    memset(cache, 0, sizeof(struct listing_cache));
+
+    if (pthread_mutex_init(&cache->mutex, NULL) != 0) {
+        perror("Error creating listing cache lock");
+        return -1;
+    }
+
+    cache->lru.lru_prev = cache->lru.lru_next = &cache->lru;
+    cache->ttl = ttl;
+
+    return 0;
+}
+
+/**
+ * Takes an entry out of the hash table and the LRU list and releases it. The cache must be locked.
+ */
+static void listing_cache_remove(struct listing_cache *cache, struct listing_entry *entry) {
+    struct listing_entry **link = &cache->buckets[entry->hash % LISTING_BUCKETS];
+
+    while (*link != entry) {
+        link = &(*link)->hash_next;
+    }
+    *link = entry->hash_next;
+
+    entry->lru_prev->lru_next = entry->lru_next;
+    entry->lru_next->lru_prev = entry->lru_prev;
+    cache->used -= entry->size;
+
+    close(entry->fd);
+    free(entry->key);
+    free(entry->upstream);
+    free(entry->directory);
+    free(entry->parent);
+    free(entry);
+}
+
+/**
+ * Looks up a listing that has not expired yet.
+ * Returns a descriptor of its memory file for the caller to send and close, with its size set, or -1
+ * if there is none.
+ */
+int listing_cache_lookup(struct listing_cache *cache, const char *key, off_t *size) {
+    unsigned long long hash = listing_hash(key);
+    int fd = -1;
+
+    pthread_mutex_lock(&cache->mutex);
+
+    struct listing_entry *entry = cache->buckets[hash % LISTING_BUCKETS];
+    while (entry != NULL && (entry->hash != hash || strcmp(entry->key, key) != 0)) {
+        entry = entry->hash_next;
+    }
+
+    if (entry != NULL && time(NULL) >= entry->expires) {
+        listing_cache_remove(cache, entry);
+    } else if (entry != NULL) {
+        // The entry may be dropped while the descriptor is being sent, so the caller gets its own
+        fd = dup(entry->fd);
+        *size = entry->size;
+
+        entry->lru_prev->lru_next = entry->lru_next;
+        entry->lru_next->lru_prev = entry->lru_prev;
+        entry->lru_prev = &cache->lru;
+        entry->lru_next = cache->lru.lru_next;
+        cache->lru.lru_next->lru_prev = entry;
+        cache->lru.lru_next = entry;
+    }
+
+    pthread_mutex_unlock(&cache->mutex);
+
+    return fd;
+}
+
+/**
+ * Caches a listing received from the server, replacing an older one of the same key and evicting
+ * the least recently used ones beyond the budget.
+ */
+void listing_cache_store(struct listing_cache *cache, const char *key, const char *upstream, const char *directory,
+                         const struct listing_buffer *buffer) {
+    if (buffer->length > LISTING_MAX_SIZE) {
+        return;
+    }
+
+    struct listing_entry *entry = calloc(1, sizeof(struct listing_entry));
+    if (entry == NULL) {
+        return;
+    }
+
+    char parent[PATH_MAX];
+    listing_parent_path(directory, parent, sizeof(parent));
+
+    entry->fd = memfd_create("listing", MFD_CLOEXEC);
+    entry->key = strdup(key);
+    entry->upstream = strdup(upstream);
+    entry->directory = strdup(directory);
+    entry->parent = strdup(parent);
+    entry->hash = listing_hash(key);
+    entry->size = buffer->length;
+    entry->expires = time(NULL) + cache->ttl;
+
+    if (entry->fd < 0 || entry->key == NULL || entry->upstream == NULL || entry->directory == NULL ||
+        entry->parent == NULL || write(entry->fd, buffer->data, buffer->length) != (ssize_t) buffer->length) {
+        if (entry->fd >= 0) {
+            close(entry->fd);
+        }
+        free(entry->key);
+        free(entry->upstream);
+        free(entry->directory);
+        free(entry->parent);
+        free(entry);
+        return;
+    }
+
+    pthread_mutex_lock(&cache->mutex);
+
+    struct listing_entry *old = cache->buckets[entry->hash % LISTING_BUCKETS];
+    while (old != NULL && (old->hash != entry->hash || strcmp(old->key, key) != 0)) {
+        old = old->hash_next;
+    }
+    if (old != NULL) {
+        listing_cache_remove(cache, old);
+    }
+
+    while (cache->used + entry->size > LISTING_BUDGET && cache->lru.lru_prev != &cache->lru) {
+        listing_cache_remove(cache, cache->lru.lru_prev);
+    }
+
+    size_t bucket = entry->hash % LISTING_BUCKETS;
+    entry->hash_next = cache->buckets[bucket];
+    cache->buckets[bucket] = entry;
+    entry->lru_prev = &cache->lru;
+    entry->lru_next = cache->lru.lru_next;
+    cache->lru.lru_next->lru_prev = entry;
+    cache->lru.lru_next = entry;
+    cache->used += entry->size;
+
+    pthread_mutex_unlock(&cache->mutex);
+
+    log_info("Cached listing of %s (%zu bytes)\n", directory, buffer->length);
+}
+
+/**
+ * Drops every listing of the server showing the directory or something directly inside it, after
+ * a command changed the directory's content. Listings of every user are dropped, as they may share
+ * the directory.
+ */
+void listing_cache_invalidate(struct listing_cache *cache, const char *upstream, const char *directory) {
+    pthread_mutex_lock(&cache->mutex);
+
+    struct listing_entry *entry = cache->lru.lru_next;
+    while (entry != &cache->lru) {
+        struct listing_entry *next = entry->lru_next;
+
+        if (strcmp(entry->upstream, upstream) == 0 &&
+            (strcmp(entry->directory, directory) == 0 || strcmp(entry->parent, directory) == 0)) {
+            log_info("Dropped cached listing of %s\n", entry->directory);
+            listing_cache_remove(cache, entry);
+        }
+        entry = next;
+    }
+
+    pthread_mutex_unlock(&cache->mutex);
+}
+
+/**
+ * Releases the data of the buffer, leaving it empty.
+ */
+void listing_buffer_reset(struct listing_buffer *buffer) {
+    free(buffer->data);
+    buffer->data = NULL;
+    buffer->length = 0;
+    buffer->capacity = 0;
+}
+
+/**
+ * Makes room for length more bytes in the buffer.
+ * Returns 0 on success and -1 if the listing grew too long to be cached.
+ */
+static int listing_buffer_reserve(struct listing_buffer *buffer, size_t length) {
+    if (buffer->length + length > LISTING_MAX_SIZE) {
+        return -1;
+    }
+
+    if (buffer->length + length > buffer->capacity) {
+        size_t capacity = buffer->capacity > 0 ? buffer->capacity : LISTING_BUFFER_INITIAL_CAPACITY;
+        while (capacity < buffer->length + length) {
+            capacity *= 2;
+        }
+
+        char *data = realloc(buffer->data, capacity);
+        if (data == NULL) {
+            return -1;
+        }
+        buffer->data = data;
+        buffer->capacity = capacity;
+    }
+
+    return 0;
+}
+
+/**
+ * Appends bytes of the listing.
+ * Returns 0 on success and -1 if the listing cannot be cached.
+ */
+int listing_buffer_append(struct listing_buffer *buffer, const char *data, size_t length) {
+    if (listing_buffer_reserve(buffer, length) < 0) {
+        return -1;
+    }
+
+    memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+
+    return 0;
+}
+
+/**
+ * Appends the next length bytes of a pipe, which holds at least that many.
+ * Returns 0 on success and -1 if the listing cannot be cached, in which case the pipe may still
+ * hold some of the bytes.
+ */
+int listing_buffer_append_from_pipe(struct listing_buffer *buffer, int pipe_fd, size_t length) {
+    if (listing_buffer_reserve(buffer, length) < 0) {
+        return -1;
+    }
+
+    while (length > 0) {
+        ssize_t read_size = read(pipe_fd, buffer->data + buffer->length, length);
+        if (read_size < 0 && errno == EINTR) {
+            continue;
+        }
+        if (read_size <= 0) {
+            return -1;
+        }
+        buffer->length += read_size;
+        length -= read_size;
+    }
+
+    return 0;
+}
+
+/**
+ * Resolves a path against a directory without asking the server, dropping "." and empty components
+ * and applying "..". The result is absolute if either of them is, and relative to the login directory
+ * otherwise.
+ */
+void listing_join_path(const char *directory, const char *path, char *result, size_t size) {
+    char joined[PATH_MAX * 2 + 2];
+    char *components[PATH_MAX / 2];
+    size_t count = 0;
+    int absolute = path[0] == '/' || directory[0] == '/';
+
+    if (path[0] == '/') {
+        snprintf(joined, sizeof(joined), "%s", path);
+    } else {
+        snprintf(joined, sizeof(joined), "%s/%s", directory, path);
+    }
+
+    char *saved;
+    for (char *component = strtok_r(joined, "/", &saved); component != NULL && count < PATH_MAX / 2;
+         component = strtok_r(NULL, "/", &saved)) {
+        if (strcmp(component, ".") == 0) {
+            continue;
+        }
+        if (strcmp(component, "..") == 0) {
+            if (count > 0 && strcmp(components[count - 1], "..") != 0) {
+                count -= 1;
+                continue;
+            }
+            if (absolute) {
+                // Nothing is above the root
+                continue;
+            }
+        }
+        components[count++] = component;
+    }
+
+    // The login directory is "." while the server did not tell where it is
+    size_t length = (size_t) snprintf(result, size, "%s", absolute ? "/" : count == 0 ? "." : "");
+    for (size_t i = 0; i < count && length < size; i += 1) {
+        length += (size_t) snprintf(result + length, size - length, "%s%s", i > 0 ? "/" : "", components[i]);
+    }
+}
+
+/**
+ * Gets the directory holding a path resolved by listing_join_path().
+ */
+void listing_parent_path(const char *path, char *result, size_t size) {
+    listing_join_path(path, "..", result, size);
+}
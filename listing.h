@@ -0,0 +1,73 @@
+#ifndef FTP_PROXY_LISTING_H
+#define FTP_PROXY_LISTING_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/types.h>
+
+#define LISTING_BUCKETS 256
+#define LISTING_DEFAULT_TTL 30          // Seconds a listing is answered from memory
+#define LISTING_BUDGET (32 * 1024 * 1024)
+#define LISTING_MAX_SIZE (1024 * 1024)  // Longer listings are never cached
+
+/**
+ * Response of the server to one LIST, NLST or MLSD, kept in a memory file so transfers can send it
+ * with sendfile() like a cache file.
+ */
+struct listing_entry {
+    char *key;                      // Server, user, working directory and command
+    char *upstream;                 // Server the listing came from
+    char *directory;                // Directory whose content the listing shows
+    char *parent;                   // Directory holding it
+    unsigned long long hash;
+    int fd;
+    size_t size;
+    time_t expires;
+
+    struct listing_entry *hash_next;
+    struct listing_entry *lru_prev; // Towards the most recently used entry
+    struct listing_entry *lru_next; // Towards the least recently used entry
+};
+
+/**
+ * In-memory cache of directory listings shared by every worker, with entries expiring after a TTL
+ * and dropped as soon as a session changes their directory.
+ */
+struct listing_cache {
+    pthread_mutex_t mutex;
+    struct listing_entry *buckets[LISTING_BUCKETS];
+    struct listing_entry lru;       // Sentinel of the LRU list
+    size_t used;                    // Total bytes of the listings
+    int ttl;
+};
+
+/**
+ * Listing being received from the server, cached once its transfer succeeded.
+ */
+struct listing_buffer {
+    char *data;
+    size_t length;
+    size_t capacity;
+};
+
+int listing_cache_init(struct listing_cache *cache, int ttl);
+
+int listing_cache_lookup(struct listing_cache *cache, const char *key, off_t *size);
+
+void listing_cache_store(struct listing_cache *cache, const char *key, const char *upstream, const char *directory,
+                         const struct listing_buffer *buffer);
+
+void listing_cache_invalidate(struct listing_cache *cache, const char *upstream, const char *directory);
+
+void listing_buffer_reset(struct listing_buffer *buffer);
+
+int listing_buffer_append(struct listing_buffer *buffer, const char *data, size_t length);
+
+int listing_buffer_append_from_pipe(struct listing_buffer *buffer, int pipe_fd, size_t length);
+
+void listing_join_path(const char *directory, const char *path, char *result, size_t size);
+
+void listing_parent_path(const char *path, char *result, size_t size);
+
+#endif
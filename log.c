@@ -0,0 +1,237 @@
+#define _GNU_SOURCE
+
+#include "log.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "proxy.h"
+
+#define LOG_IDLE_TIMEOUT 100                // Milliseconds the writer thread sleeps before checking the ring anyway
+#define LOG_LINE_SIZE (LOG_MESSAGE_SIZE + 64)   // Longest line with its timestamp and level
+
+enum log_level log_threshold = LOG_LEVEL_INFO;
+
+static struct log_ring log_ring;
+
+static const char *const log_level_names[] = {"error", "warning", "info", "debug"};
+
+/**
+ * Looks up a level by its name.
+ * Returns 0 on success and -1 if there is no such level.
+ */
+int log_parse_level(const char *name, enum log_level *level) {
+    for (size_t i = 0; i < sizeof(log_level_names) / sizeof(log_level_names[0]); i += 1) {
+        if (strcmp(log_level_names[i], name) == 0) {
+            *level = (enum log_level) i;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Writes the whole buffer to stdout, which may be a pipe accepting only part of it.
+ */
+static void log_output(const char *buffer, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(STDOUT_FILENO, buffer, length);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return;
+        }
+        buffer += written;
+        length -= written;
+    }
+}
+
+/**
+ * Formats a message into a line with its time and level. The seconds are only formatted again
+ * when they changed since the previous line.
+ * Returns the length of the line.
+ */
+static size_t log_format_line(const struct log_slot *slot, char *line) {
+    static time_t formatted_second = -1;
+    static char second_text[32];
+
+    if (slot->time.tv_sec != formatted_second) {
+        struct tm local;
+        localtime_r(&slot->time.tv_sec, &local);
+        strftime(second_text, sizeof(second_text), "%Y-%m-%d %H:%M:%S", &local);
+        formatted_second = slot->time.tv_sec;
+    }
+
+    // Messages end with the line ending of the command they show, or none if truncated
+    size_t text_length = strnlen(slot->text, sizeof(slot->text));
+    while (text_length > 0 && (slot->text[text_length - 1] == '\n' || slot->text[text_length - 1] == '\r')) {
+        text_length -= 1;
+    }
+
+    static const char *const labels[] = {"ERROR", "WARN ", "INFO ", "DEBUG"};
+    return (size_t) snprintf(line, LOG_LINE_SIZE, "%s.%03ld %s %.*s\n", second_text, slot->time.tv_nsec / 1000000,
+                             labels[slot->level], (int) text_length, slot->text);
+}
+
+/**
+ * Tells whether a message is waiting at the tail of the ring.
+ */
+static int log_ring_ready(void) {
+    struct log_slot *slot = &log_ring.slots[log_ring.tail % LOG_RING_SLOTS];
+
+    return __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) == log_ring.tail + 1;
+}
+
+/**
+ * Writes the messages of the ring out in batches, sleeping while it is empty.
+ */
+static void *log_run(void *data) {
+    static char batch[LOG_BATCH_SIZE];
+
+    while (TRUE) {
+        size_t length = 0;
+
+        while (length + LOG_LINE_SIZE <= sizeof(batch) && log_ring_ready()) {
+            struct log_slot *slot = &log_ring.slots[log_ring.tail % LOG_RING_SLOTS];
+
+            length += log_format_line(slot, batch + length);
+            __atomic_store_n(&slot->sequence, log_ring.tail + LOG_RING_SLOTS, __ATOMIC_RELEASE);
+            log_ring.tail += 1;
+        }
+
+        unsigned long dropped = 0;
+        if (length + LOG_LINE_SIZE <= sizeof(batch)) {
+            dropped = __atomic_exchange_n(&log_ring.dropped, 0, __ATOMIC_RELAXED);
+        }
+        if (dropped > 0) {
+            length += (size_t) snprintf(batch + length, LOG_LINE_SIZE, "%lu log messages dropped\n", dropped);
+        }
+
+        if (length > 0) {
+            log_output(batch, length);
+            continue;
+        }
+        if (__atomic_load_n(&log_ring.stopping, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+
+        // Producers only signal the eventfd while the thread announces it sleeps, and it looks at
+        // the ring once more after announcing it, so no message is left behind
+        __atomic_store_n(&log_ring.sleeping, TRUE, __ATOMIC_SEQ_CST);
+        if (!log_ring_ready()) {
+            struct pollfd wake = {log_ring.wake_fd, POLLIN, 0};
+            if (poll(&wake, 1, LOG_IDLE_TIMEOUT) > 0) {
+                eventfd_t value;
+                eventfd_read(log_ring.wake_fd, &value);
+            }
+        }
+        __atomic_store_n(&log_ring.sleeping, FALSE, __ATOMIC_SEQ_CST);
+    }
+
+    return NULL;
+}
+
+/**
+ * Starts the writer thread. Messages logged before are written straight away.
+ * Returns 0 on success and -1 on failure.
+ */
+int log_start(void) {
+    for (unsigned long i = 0; i < LOG_RING_SLOTS; i += 1) {
+        log_ring.slots[i].sequence = i;
+    }
+
+    log_ring.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (log_ring.wake_fd < 0) {
+        perror("Error creating log eventfd");
+        return -1;
+    }
+
+    // Signals are left to the event loops, so the thread is created with every one blocked
+    sigset_t signals;
+    sigset_t previous;
+    sigfillset(&signals);
+    pthread_sigmask(SIG_SETMASK, &signals, &previous);
+    int error = pthread_create(&log_ring.thread, NULL, log_run, NULL);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+    if (error != 0) {
+        errno = error;
+        perror("Error creating log thread");
+        close(log_ring.wake_fd);
+        return -1;
+    }
+    __atomic_store_n(&log_ring.started, TRUE, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/**
+ * Writes the messages left in the ring and stops the writer thread. Only the calling thread may
+ * still be logging.
+ */
+void log_stop(void) {
+    if (!log_ring.started) {
+        return;
+    }
+
+    __atomic_store_n(&log_ring.stopping, TRUE, __ATOMIC_RELEASE);
+    eventfd_write(log_ring.wake_fd, 1);
+    pthread_join(log_ring.thread, NULL);
+
+    __atomic_store_n(&log_ring.started, FALSE, __ATOMIC_RELEASE);
+    close(log_ring.wake_fd);
+}
+
+/**
+ * Queues a message for the writer thread, or drops it if the ring is full. Called through the
+ * log_error() to log_debug() macros, which skip disabled levels without formatting anything.
+ */
+void log_write(enum log_level level, const char *format, ...) {
+    va_list arguments;
+    struct log_slot slot_buffer;
+    struct log_slot *slot = &slot_buffer;
+    unsigned long position = 0;
+    int queued = __atomic_load_n(&log_ring.started, __ATOMIC_ACQUIRE);
+
+    while (queued) {
+        position = __atomic_load_n(&log_ring.head, __ATOMIC_RELAXED);
+        slot = &log_ring.slots[position % LOG_RING_SLOTS];
+        long difference = (long) (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - position);
+
+        if (difference < 0) {
+            // The writer thread did not take the message of the previous lap yet
+            __atomic_add_fetch(&log_ring.dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        if (difference == 0 && __atomic_compare_exchange_n(&log_ring.head, &position, position + 1, FALSE,
+                                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+
+    clock_gettime(CLOCK_REALTIME, &slot->time);
+    slot->level = level;
+    va_start(arguments, format);
+    vsnprintf(slot->text, sizeof(slot->text), format, arguments);
+    va_end(arguments);
+
+    if (!queued) {
+        char line[LOG_LINE_SIZE];
+        log_output(line, log_format_line(slot, line));
+        return;
+    }
+
+    __atomic_store_n(&slot->sequence, position + 1, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&log_ring.sleeping, __ATOMIC_RELAXED)) {
+        eventfd_write(log_ring.wake_fd, 1);
+    }
+}
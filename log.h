@@ -0,0 +1,63 @@
+#ifndef FTP_PROXY_LOG_H
+#define FTP_PROXY_LOG_H
+
+#include <pthread.h>
+#include <time.h>
+
+#define LOG_RING_SLOTS 4096                 // Messages waiting for the writer thread, a power of two
+#define LOG_MESSAGE_SIZE 256                // Longer messages are truncated
+#define LOG_BATCH_SIZE (64 * 1024)          // Bytes the writer thread gathers into one write()
+
+enum log_level {
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_WARNING,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_DEBUG                 // Every command, reply and chunk of data
+};
+
+/**
+ * Message waiting in the ring. Its sequence tells whose turn the slot is: the producer claiming
+ * position p finds p and publishes p + 1, and the writer thread hands it back for the next lap.
+ */
+struct log_slot {
+    unsigned long sequence;
+    struct timespec time;
+    enum log_level level;
+    char text[LOG_MESSAGE_SIZE];
+};
+
+/**
+ * Bounded lock-free queue of messages from every thread, written out by a background thread so an
+ * event loop never blocks on the terminal or a pipe. Messages that find the ring full are dropped
+ * and counted rather than waited for.
+ */
+struct log_ring {
+    struct log_slot slots[LOG_RING_SLOTS];
+    unsigned long head;             // Next position claimed by a producer
+    unsigned long tail;             // Next position taken by the writer thread
+    unsigned long dropped;
+    int started;                    // Messages go through the ring, instead of straight to stdout
+    int stopping;
+    int sleeping;                   // The writer thread waits on wake_fd
+    int wake_fd;
+    pthread_t thread;
+};
+
+extern enum log_level log_threshold;
+
+// The arguments are only evaluated when the level is enabled
+#define log_at(level, ...) do { if ((level) <= log_threshold) log_write((level), __VA_ARGS__); } while (0)
+#define log_error(...) log_at(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define log_warning(...) log_at(LOG_LEVEL_WARNING, __VA_ARGS__)
+#define log_info(...) log_at(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_debug(...) log_at(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+int log_parse_level(const char *name, enum log_level *level);
+
+int log_start(void);
+
+void log_stop(void);
+
+void log_write(enum log_level level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+#endif
@@ -1,592 +1,872 @@
-#define TRUE 1
-#define FALSE 0
-#define BUFFSIZE 2048
-
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <unistd.h>
-#include <netdb.h>
-#include <arpa/inet.h>
 #include <string.h>
-#include <sys/stat.h>
+#include <unistd.h>
+#include <sys/signalfd.h>
+
+#include "cache.h"
+#include "cache_writer.h"
+#include "event_loop.h"
+#include "fetch.h"
+#include "handoff.h"
+#include "hot_cache.h"
+#include "listing.h"
+#include "log.h"
+#include "metrics.h"
+#include "net.h"
+#include "port_pool.h"
+#include "proxy.h"
+#include "resolver.h"
+#include "scheduler.h"
+#include "session.h"
+#include "upstream.h"
+
+#define MAX_WORKERS 64
+#define DRAIN_INTERVAL 200                  // Milliseconds between closing the sessions that became idle after a handoff
 
 /**
- * Creates a socket and binds it onto the given port, then makes it listen for new connections.
- * Returns the file descriptor of the created socket.
+ * Event loop thread with its own listening socket on the command port. The kernel spreads new
+ * connections among the workers, and each session stays on the worker that accepted it.
  */
-int bind_and_listen_socket(int port_number) {
-    struct sockaddr_in server_address, client_address;
+struct worker {
+    pthread_t thread;
+    struct event_loop loop;
+    struct cache_io cache_io;
+    struct port_pool data_ports;
+    struct scheduler scheduler;
+    struct session_list sessions;
+    struct proxy_config config;
+
+    int listen_sockets[MAX_WORKERS];    // Several when a previous process with more workers handed them off
+    int listen_count;
+    struct handoff_socket *handoff;     // Duplicates of the worker's listeners for the new process
+    int handoff_count;
+    struct event_task handoff_task;     // Stops accepting once a new process asked for the listeners
+    struct event_task reclaim_task;     // Takes the data ports back that the previous process used until it exited
+    struct wheel_timer drain_timer;     // Closes the sessions as they become idle after the handoff
+};
+
+static struct worker *workers;
+static int worker_count = 1;
+
+static const char *handoff_path;            // Unix socket a new process takes the listeners over at, NULL if disabled
+static int handoff_listener = -1;
+static int handoff_connection = -1;         // To the new process once handing off, or to the previous one until it exited
+static int handoff_pending;                 // Workers that did not stop accepting yet, updated atomically
+static int handed_off;                      // The new process got the listeners, and this one exits once idle
+static struct handoff_socket *handoff_sockets;  // Room for the listeners of every worker
+static struct event_task handoff_send_task;
+static int metrics_port;
+static int metrics_socket = -1;
 
-    // Create a new socket
-    int socket_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (socket_fd < 0) {
-        perror("Error opening socket");
-        exit(1);
+/**
+ * Accepts every pending command connection from clients and starts a session for each of them.
+ */
+static void handle_new_command_connection(struct event_loop *loop, int fd, uint32_t events, void *data) {
+    const struct proxy_config *config = data;
+
+    while (TRUE) {
+        // New incoming command connection from client
+        struct sockaddr_in client;
+
+        int client_command_socket = accept_connection(fd, &client);
+        if (client_command_socket < 0) {
+            return;
+        }
+        log_info("Accepted new command connection from client.\n");
+
+        // Replies are short writes the client waits on, so they are not held back for its ACKs
+        set_nodelay(client_command_socket);
+
+        session_create(loop, config, client_command_socket, &client);
     }
+}
 
-    setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, &(int) {1}, sizeof(int));
+/**
+ * Stops every worker on SIGINT or SIGTERM, so the cache index can be saved before exiting.
+ */
+static void handle_signal(struct event_loop *loop, int fd, uint32_t events, void *data) {
+    struct signalfd_siginfo info;
 
-    // Prepare server address
-    bzero((char *) &server_address, sizeof(server_address));
-    server_address.sin_family = AF_INET;
-    server_address.sin_addr.s_addr = INADDR_ANY;
-    server_address.sin_port = htons(port_number);
+    while (read(fd, &info, sizeof(info)) == sizeof(info)) {
+        log_info("Received signal %d, shutting down\n", (int) info.ssi_signo);
+        for (int i = 0; i < worker_count; i += 1) {
+            event_loop_stop(&workers[i].loop);
+        }
+    }
+}
 
-    // Bind socket on the given port
-    if (bind(socket_fd, (struct sockaddr *) &server_address, sizeof(server_address)) < 0) {
-        perror("Error binding");
-        exit(1);
+/**
+ * Stops accepting on the listeners of a worker, which go to the new process, and starts closing its
+ * sessions as they become idle. The last worker to stop has the first one send the listeners.
+ */
+static void stop_accepting(struct event_task *task) {
+    struct worker *worker = container_of(task, struct worker, handoff_task);
+
+    for (int i = 0; i < worker->listen_count; i += 1) {
+        struct handoff_socket *handed = &worker->handoff[worker->handoff_count];
+
+        event_loop_remove(&worker->loop, worker->listen_sockets[i]);
+        handed->fd = dup(worker->listen_sockets[i]);
+        handed->kind = HANDOFF_COMMAND;
+        handed->port = worker->config.listen_port;
+        handed->busy = FALSE;
+        if (handed->fd >= 0) {
+            worker->handoff_count += 1;
+        }
+        close(worker->listen_sockets[i]);
     }
+    worker->listen_count = 0;
 
-    // Set the socket to listen for new connections
-    listen(socket_fd, 5);
+    worker->handoff_count += port_pool_surrender(&worker->data_ports, &worker->handoff[worker->handoff_count]);
 
-    return socket_fd;
+    if (worker == &workers[0] && metrics_socket >= 0) {
+        struct handoff_socket *handed = &worker->handoff[worker->handoff_count];
+
+        event_loop_remove(&worker->loop, metrics_socket);
+        handed->fd = dup(metrics_socket);
+        handed->kind = HANDOFF_METRICS;
+        handed->port = metrics_port;
+        handed->busy = FALSE;
+        if (handed->fd >= 0) {
+            worker->handoff_count += 1;
+        }
+        close(metrics_socket);
+        metrics_socket = -1;
+    }
+
+    event_loop_arm(&worker->loop, &worker->drain_timer, DRAIN_INTERVAL);
+
+    if (__atomic_sub_fetch(&handoff_pending, 1, __ATOMIC_ACQ_REL) == 0) {
+        event_loop_post(&workers[0].loop, &handoff_send_task);
+    }
 }
 
 /**
- * Accepts an incoming connection.
- * Returns a new socket created for the connection.
+ * Sends the listeners of every worker to the new process once they all stopped accepting, after the
+ * snapshot of the cache index it loads was written.
  */
-int accept_connection(int sockfd, struct sockaddr_in *addr) {
-    socklen_t client_length = sizeof(*addr);
+static void send_listeners(struct event_task *task) {
+    cache_hand_off(workers[0].config.cache);
+
+    // Each worker wrote into its own part of the array, which is packed here
+    int count = 0;
+    for (int i = 0; i < worker_count; i += 1) {
+        memmove(&handoff_sockets[count], workers[i].handoff, workers[i].handoff_count * sizeof(struct handoff_socket));
+        count += workers[i].handoff_count;
+    }
 
-    int command_socket_fd = accept(sockfd, addr, &client_length);
-    if (command_socket_fd < 0) {
-        perror("Error accepting connection");
-        exit(1);
+    if (handoff_send(handoff_connection, handoff_sockets, count) < 0) {
+        log_error("Handing off the listening sockets failed\n");
+    } else {
+        log_info("Handed off %d listening sockets, exiting once the running transfers finished\n", count);
+    }
+    for (int i = 0; i < count; i += 1) {
+        close(handoff_sockets[i].fd);
+    }
+    handed_off = TRUE;
+}
+
+/**
+ * Called while draining to close the sessions of a worker that became idle. The first worker stops
+ * every worker once no session is left and no cache entry is being filled anymore.
+ */
+static void handle_drain_timer(struct wheel_timer *timer) {
+    struct worker *worker = container_of(timer, struct worker, drain_timer);
+
+    session_drain(&worker->sessions);
+
+    if (worker == &workers[0] && handed_off) {
+        int open = 0;
+        for (int i = 0; i < worker_count; i += 1) {
+            open += __atomic_load_n(&workers[i].sessions.count, __ATOMIC_RELAXED);
+        }
+
+        if (open == 0 && !cache_filling(worker->config.cache)) {
+            log_info("Every transfer finished, exiting\n");
+            for (int i = 0; i < worker_count; i += 1) {
+                event_loop_stop(&workers[i].loop);
+            }
+            return;
+        }
     }
 
-    return command_socket_fd;
+    event_loop_arm(&worker->loop, timer, DRAIN_INTERVAL);
 }
 
 /**
- * Creates a new connection to the target address.
- * Returns a new socket created for the connection.
+ * Reads the request of a process that connected to the handoff socket, and starts handing off to it.
+ * Only one process takes over, and not before the one this process took over from exited.
  */
-int create_connection(struct sockaddr_in addr) {
-    int socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+static void handle_handoff_connection(struct event_loop *loop, int fd, uint32_t events, void *data) {
+    int result = handoff_read_request(fd);
+    if (result == 0) {
+        return;
+    }
 
-    if (socket_fd < 0) {
-        perror("Error opening socket");
-        exit(1);
+    event_loop_remove(loop, fd);
+    if (result < 0 || handoff_connection >= 0) {
+        close(fd);
+        return;
     }
 
-    if (connect(socket_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
-        perror("Error creating connection");
-        exit(1);
+    log_info("A new process takes over, handing off the listening sockets\n");
+    handoff_connection = fd;
+    event_loop_remove(loop, handoff_listener);
+    close(handoff_listener);
+    handoff_listener = -1;
+
+    handoff_pending = worker_count;
+    for (int i = 0; i < worker_count; i += 1) {
+        event_loop_post(&workers[i].loop, &workers[i].handoff_task);
     }
+}
+
+/**
+ * Accepts every pending connection to the handoff socket.
+ */
+static void handle_handoff_request(struct event_loop *loop, int fd, uint32_t events, void *data) {
+    int connection;
+
+    while ((connection = handoff_accept(fd)) >= 0) {
+        if (event_loop_add(loop, connection, EPOLLIN | EPOLLRDHUP | EPOLLET, handle_handoff_connection, NULL) < 0) {
+            close(connection);
+        }
+    }
+}
+
+/**
+ * Puts the data ports back into the pool of a worker once the previous process no longer uses them.
+ */
+static void reclaim_data_ports(struct event_task *task) {
+    struct worker *worker = container_of(task, struct worker, reclaim_task);
 
-    return socket_fd;
+    port_pool_reclaim(&worker->data_ports);
 }
 
 /**
- * Creates a new connection to the target host name and port.
- * Returns a new socket created for the connection.
+ * Called when the previous process hung up the handoff connection, which it does by exiting. The files
+ * it cached meanwhile are added to the index, and the data ports its transfers used are handed out again.
  */
-int create_connection_by_host_name(const char *host_name, int port) {
-    struct hostent *server = gethostbyname(host_name);
+static void handle_previous_exit(struct event_loop *loop, int fd, uint32_t events, void *data) {
+    char byte;
 
-    if (server == NULL) {
-        perror("No such host");
-        exit(0);
+    if (recv(fd, &byte, sizeof(byte), 0) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return;
     }
 
-    struct sockaddr_in address;
+    event_loop_remove(loop, fd);
+    close(fd);
+    handoff_connection = -1;
+    log_info("The previous process exited\n");
 
-    bzero((char *) &address, sizeof(address));
-    address.sin_family = AF_INET;
-    bcopy(server->h_addr, (char *) &address.sin_addr.s_addr, server->h_length);
-    address.sin_port = htons(port);
+    cache_merge_handoff(workers[0].config.cache);
+    for (int i = 0; i < worker_count; i += 1) {
+        event_loop_post(&workers[i].loop, &workers[i].reclaim_task);
+    }
+}
 
-    return create_connection(address);
+/**
+ * Runs the event loop of a worker started by main().
+ */
+static void *run_worker(void *data) {
+    struct worker *worker = data;
+
+    event_loop_run(&worker->loop);
+
+    return NULL;
 }
 
 /**
- * Sends data to the server.
+ * Sets up the event loop, disk I/O backend, scheduler and listening sockets of a worker. The worker
+ * takes every worker_count-th of the command listeners handed off by a previous process, or shares
+ * one of them if there are fewer than workers, and binds its own without any.
+ * Returns 0 on success and -1 on failure.
  */
-void send_to_server(int socket_fd, const char *buffer) {
-    printf("Send to server: %s", buffer);
-    write(socket_fd, buffer, strlen(buffer));
+static int init_worker(struct worker *worker, int index, const struct proxy_config *config,
+                       enum cache_writer_backend cache_writer_backend, int first_data_port, int data_port_count,
+                       const struct scheduler_policy *policy, struct handoff_socket *inherited, int inherited_count,
+                       const int *command_sockets, int command_count) {
+    if (event_loop_init(&worker->loop) < 0 ||
+        cache_io_init(&worker->cache_io, config->cache, &worker->loop, cache_writer_backend) < 0 ||
+        port_pool_init(&worker->data_ports, first_data_port, data_port_count, inherited, inherited_count) < 0) {
+        return -1;
+    }
+
+    worker->config = *config;
+    worker->config.cache_io = &worker->cache_io;
+    worker->config.data_ports = &worker->data_ports;
+    scheduler_init(&worker->scheduler, &worker->loop, policy);
+    worker->config.scheduler = &worker->scheduler;
+    worker->config.sessions = &worker->sessions;
+    worker->handoff_task.run = stop_accepting;
+    worker->reclaim_task.run = reclaim_data_ports;
+    worker->drain_timer.expire = handle_drain_timer;
+
+    worker->listen_count = 0;
+    for (int i = index; i < command_count; i += worker_count) {
+        worker->listen_sockets[worker->listen_count] = command_sockets[i];
+        worker->listen_count += 1;
+    }
+    if (worker->listen_count == 0 && command_count > 0) {
+        // Each worker closes its own descriptor once it hands off in turn
+        worker->listen_sockets[0] = dup(command_sockets[index % command_count]);
+        worker->listen_count = worker->listen_sockets[0] >= 0;
+    }
+    if (worker->listen_count == 0) {
+        // Bind on the command port and listen for connections from client.
+        worker->listen_sockets[0] = bind_and_listen_socket(config->listen_port, worker_count > 1);
+        worker->listen_count = 1;
+    }
+
+    for (int i = 0; i < worker->listen_count; i += 1) {
+        set_nonblocking(worker->listen_sockets[i]);
+        if (event_loop_add(&worker->loop, worker->listen_sockets[i], EPOLLIN | EPOLLET,
+                           handle_new_command_connection, &worker->config) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
 }
 
 /**
- * Sends data to the server.
+ * Parses a byte count with an optional K, M or G suffix.
+ * Returns 0 on success and -1 if the text is not a byte count.
  */
-void send_to_client(int socket_fd, const char *buffer) {
-    printf("Send to client: %s", buffer);
-    write(socket_fd, buffer, strlen(buffer));
+static int parse_size(const char *text, unsigned long long *size) {
+    char *end;
+    unsigned long long value = strtoull(text, &end, 10);
+
+    if (end == text) {
+        return -1;
+    }
+
+    switch (*end) {
+        case 'G':
+        case 'g':
+            value *= 1024;
+            // fall through
+        case 'M':
+        case 'm':
+            value *= 1024;
+            // fall through
+        case 'K':
+        case 'k':
+            value *= 1024;
+            end += 1;
+        default:
+            break;
+    }
+
+    if (*end != '\0') {
+        return -1;
+    }
+
+    *size = value;
+    return 0;
+}
+
+/**
+ * Splits a USER=VALUE argument and gets the bandwidth rule of the user, which "*" stands for every
+ * user without one of their own.
+ * Returns the rule with the value in *value, or NULL if the argument is malformed or there are too
+ * many rules.
+ */
+static struct scheduler_rule *parse_rule(struct scheduler_policy *policy, char *text, const char **value) {
+    char *separator = strchr(text, '=');
+
+    if (separator == NULL || separator == text) {
+        return NULL;
+    }
+    *separator = '\0';
+    *value = separator + 1;
+
+    return scheduler_policy_rule(policy, text);
+}
+
+static void print_usage(const char *program) {
+    fprintf(stderr, "Usage: %s [--cache-size BYTES[K|M|G]] [--cache-writer sync|thread] [--workers N] "
+                    "[--segments N] [--segment-threshold BYTES[K|M|G]] [--listing-ttl SECONDS] [--cache-fresh SECONDS] "
+                    "[--log-level error|warning|info|debug] [--metrics-port PORT] [--port PORT] [--data-ports FIRST-LAST] "
+                    "[--hot-cache-size BYTES[K|M|G]] [--hot-file-size BYTES[K|M]] "
+                    "[--idle-timeout SECONDS] [--connect-timeout SECONDS] [--stall-timeout SECONDS] "
+                    "[--quantum BYTES[K|M]] [--user-weight USER=WEIGHT] [--user-rate USER=BYTES[K|M|G]] "
+                    "[--health-interval SECONDS] [--handoff SOCKET] [server address[:port][,mirror address[:port]...]] [proxy address]\n", program);
 }
 
 int main(int argc, const char *argv[]) {
-    // Enable auto flushing of stdout
-    setvbuf(stdout, NULL, _IONBF, 0);
+    // A peer closing its socket must not kill every other session
+    signal(SIGPIPE, SIG_IGN);
+
+    unsigned long long cache_budget = CACHE_DEFAULT_BUDGET;
+    enum cache_writer_backend cache_writer_backend = CACHE_WRITER_SYNC;
+    int fetch_segments = 1;
+    unsigned long long fetch_threshold = FETCH_DEFAULT_THRESHOLD;
+    int listing_ttl = LISTING_DEFAULT_TTL;
+    int cache_freshness = CACHE_DEFAULT_FRESHNESS;
+    int listen_port = 21;
+    unsigned long long hot_budget = HOT_CACHE_DEFAULT_BUDGET;
+    unsigned long long hot_threshold = HOT_CACHE_DEFAULT_THRESHOLD;
+    int first_data_port = 0;
+    int last_data_port = 0;
+    int idle_timeout = SESSION_DEFAULT_IDLE_TIMEOUT;
+    int connect_timeout = SESSION_DEFAULT_CONNECT_TIMEOUT;
+    int stall_timeout = SESSION_DEFAULT_STALL_TIMEOUT;
+    int health_interval = UPSTREAM_DEFAULT_PROBE_INTERVAL;
+    struct scheduler_policy policy;
+    struct scheduler_rule *rule;
+    const char *value;
+    unsigned long long size;
+
+    scheduler_policy_init(&policy);
+
+    static const struct option options[] = {
+            {"cache-size",   required_argument, NULL, 's'},
+            {"cache-writer", required_argument, NULL, 'w'},
+            {"workers",           required_argument, NULL, 'n'},
+            {"segments",          required_argument, NULL, 'p'},
+            {"segment-threshold", required_argument, NULL, 't'},
+            {"listing-ttl",       required_argument, NULL, 'l'},
+            {"cache-fresh",       required_argument, NULL, 'f'},
+            {"log-level",         required_argument, NULL, 'v'},
+            {"metrics-port",      required_argument, NULL, 'm'},
+            {"port",              required_argument, NULL, 'P'},
+            {"data-ports",        required_argument, NULL, 'd'},
+            {"hot-cache-size",    required_argument, NULL, 'H'},
+            {"hot-file-size",     required_argument, NULL, 'T'},
+            {"idle-timeout",      required_argument, NULL, 'i'},
+            {"connect-timeout",   required_argument, NULL, 'C'},
+            {"stall-timeout",     required_argument, NULL, 'S'},
+            {"quantum",           required_argument, NULL, 'q'},
+            {"user-weight",       required_argument, NULL, 'W'},
+            {"user-rate",         required_argument, NULL, 'R'},
+            {"health-interval",   required_argument, NULL, 'I'},
+            {"handoff",           required_argument, NULL, 'o'},
+            {"help",              no_argument,       NULL, 'h'},
+            {NULL, 0,                                NULL, 0}
+    };
+
+    int option;
+    while ((option = getopt_long(argc, (char *const *) argv, "s:w:n:p:t:l:f:v:m:P:d:H:T:i:C:S:q:W:R:I:o:h", options, NULL)) != -1) {
+        switch (option) {
+            case 's':
+                if (parse_size(optarg, &cache_budget) < 0) {
+                    fprintf(stderr, "Invalid cache size: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'w':
+                if (strcmp(optarg, "sync") == 0) {
+                    cache_writer_backend = CACHE_WRITER_SYNC;
+                } else if (strcmp(optarg, "thread") == 0) {
+                    cache_writer_backend = CACHE_WRITER_THREAD;
+                } else {
+                    fprintf(stderr, "Invalid cache writer: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'n':
+                worker_count = atoi(optarg);
+                if (worker_count < 1 || worker_count > MAX_WORKERS) {
+                    fprintf(stderr, "Invalid number of workers: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'p':
+                fetch_segments = atoi(optarg);
+                if (fetch_segments < 1 || fetch_segments > FETCH_MAX_SEGMENTS) {
+                    fprintf(stderr, "Invalid number of segments: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 't':
+                if (parse_size(optarg, &fetch_threshold) < 0) {
+                    fprintf(stderr, "Invalid segment threshold: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'l':
+                listing_ttl = atoi(optarg);
+                if (listing_ttl < 0 || (listing_ttl == 0 && strcmp(optarg, "0") != 0)) {
+                    fprintf(stderr, "Invalid listing TTL: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'f':
+                cache_freshness = atoi(optarg);
+                if (cache_freshness < 0 || (cache_freshness == 0 && strcmp(optarg, "0") != 0)) {
+                    fprintf(stderr, "Invalid cache freshness: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'v':
+                if (log_parse_level(optarg, &log_threshold) < 0) {
+                    fprintf(stderr, "Invalid log level: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'm':
+                metrics_port = atoi(optarg);
+                if (metrics_port < 1 || metrics_port > 65535) {
+                    fprintf(stderr, "Invalid metrics port: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'P':
+                listen_port = atoi(optarg);
+                if (listen_port < 1 || listen_port > 65535) {
+                    fprintf(stderr, "Invalid port: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'H':
+                if (parse_size(optarg, &hot_budget) < 0) {
+                    fprintf(stderr, "Invalid hot cache size: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'T':
+                if (parse_size(optarg, &hot_threshold) < 0 || hot_threshold > HOT_CACHE_MAX_THRESHOLD) {
+                    fprintf(stderr, "Invalid hot file size: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'i':
+                idle_timeout = atoi(optarg);
+                if (idle_timeout < 0 || (idle_timeout == 0 && strcmp(optarg, "0") != 0)) {
+                    fprintf(stderr, "Invalid idle timeout: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'C':
+                connect_timeout = atoi(optarg);
+                if (connect_timeout < 0 || (connect_timeout == 0 && strcmp(optarg, "0") != 0)) {
+                    fprintf(stderr, "Invalid connect timeout: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'S':
+                stall_timeout = atoi(optarg);
+                if (stall_timeout < 0 || (stall_timeout == 0 && strcmp(optarg, "0") != 0)) {
+                    fprintf(stderr, "Invalid stall timeout: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'q':
+                if (parse_size(optarg, &size) < 0 || size < 1024 || size > SCHEDULER_MAX_QUANTUM) {
+                    fprintf(stderr, "Invalid quantum: %s\n", optarg);
+                    exit(1);
+                }
+                policy.quantum = (size_t) size;
+                break;
+            case 'W':
+                rule = parse_rule(&policy, optarg, &value);
+                if (rule == NULL || atoi(value) < 1 || atoi(value) > SCHEDULER_MAX_WEIGHT) {
+                    fprintf(stderr, "Invalid user weight: %s\n", optarg);
+                    exit(1);
+                }
+                rule->weight = (unsigned int) atoi(value);
+                break;
+            case 'R':
+                rule = parse_rule(&policy, optarg, &value);
+                if (rule == NULL || parse_size(value, &size) < 0 || size < 1024) {
+                    fprintf(stderr, "Invalid user rate: %s\n", optarg);
+                    exit(1);
+                }
+                rule->rate = size;
+                break;
+            case 'I':
+                health_interval = atoi(optarg);
+                if (health_interval < 0 || (health_interval == 0 && strcmp(optarg, "0") != 0)) {
+                    fprintf(stderr, "Invalid health check interval: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'o':
+                handoff_path = optarg;
+                break;
+            case 'd':
+                if (sscanf(optarg, "%d-%d", &first_data_port, &last_data_port) != 2 || first_data_port < 1 ||
+                    last_data_port > 65535 || last_data_port < first_data_port) {
+                    fprintf(stderr, "Invalid data port range: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            default:
+                print_usage(argv[0]);
+                exit(1);
+        }
+    }
 
     // Check arguments
-    if (argc < 3) {
+    if (argc - optind < 2) {
         fprintf(stderr, "Missing argument.\n");
+        print_usage(argv[0]);
         exit(1);
     }
-    if (argc > 3) {
+    if (argc - optind > 2) {
         fprintf(stderr, "Too many arguments.\n");
+        print_usage(argv[0]);
         exit(1);
     }
 
-    // Get server address from argument.
-    const char *server_address = argv[1];
-    int proxy_address[4];
-    sscanf(argv[2], "%d.%d.%d.%d", &proxy_address[0], &proxy_address[1], &proxy_address[2], &proxy_address[3]);
+    if (first_data_port > 0 && last_data_port - first_data_port + 1 < worker_count) {
+        fprintf(stderr, "The data port range needs a port for each worker.\n");
+        exit(1);
+    }
 
-    // Create directory for cached files.
-    mkdir("cache", 0775);
+    // Log lines are written by a background thread from now on
+    if (log_start() < 0) {
+        exit(1);
+    }
 
-    // File descriptor sets
-    fd_set master_set;              // Set for all file descriptors
-    fd_set working_set;             // Set for file descriptors to be listened to
+    struct proxy_config config;
+    config.listen_port = listen_port;
+    config.fetch_segments = fetch_segments;
+    config.fetch_threshold = fetch_threshold;
+    config.cache_freshness = cache_freshness;
+    config.idle_timeout = idle_timeout;
+    config.connect_timeout = connect_timeout;
+    config.stall_timeout = stall_timeout;
+    sscanf(argv[optind + 1], "%d.%d.%d.%d",
+           &config.proxy_address[0], &config.proxy_address[1],
+           &config.proxy_address[2], &config.proxy_address[3]);
+
+    // Host names are resolved once, later connections use the cached address.
+    struct resolver resolver;
+    if (resolver_init(&resolver) < 0) {
+        exit(1);
+    }
+    config.resolver = &resolver;
 
-    int proxy_cmd_socket = 0;       // Socket of listening for command connection
-    int client_command_socket = 0;  // Socket of accepting command connection from client
-    int server_command_socket = 0;  // Socket of creating command connection to server
-    int proxy_data_socket = 0;      // Socket of listening for data connection
-    int income_data_socket = 0;     // Socket of accepting data connection
-    int outcome_data_socket = 0;    // Socket of creating data connection
-    int selectResult = 0;           // Result of select
-    int select_sd = 10;             // Maximum file descriptor for select
+    // Get the mirrors of the server from the comma separated argument
+    struct upstream_set upstreams;
+    if (upstream_set_init(&upstreams, &resolver) < 0) {
+        exit(1);
+    }
+    char servers[UPSTREAM_MAX * UPSTREAM_HOST_SIZE];
+    snprintf(servers, sizeof(servers), "%s", argv[optind]);
+    int resolved = 0;
+    char *saved;
+    for (char *server = strtok_r(servers, ",", &saved); server != NULL; server = strtok_r(NULL, ",", &saved)) {
+        // A mirror may listen on another port than 21
+        int server_port = 21;
+        char *port_separator = strrchr(server, ':');
+        if (port_separator != NULL) {
+            *port_separator = '\0';
+            server_port = atoi(port_separator + 1);
+            if (server_port < 1 || server_port > 65535) {
+                fprintf(stderr, "Invalid server port: %s\n", port_separator + 1);
+                exit(1);
+            }
+        }
+        if (upstream_set_add(&upstreams, server, server_port) < 0) {
+            fprintf(stderr, "Invalid server or more than %d of them: %s\n", UPSTREAM_MAX, server);
+            exit(1);
+        }
+
+        // A mirror that cannot be resolved yet is kept, it is taken out once connecting to it fails
+        struct in_addr server_ip;
+        if (resolver_lookup(&resolver, server, &server_ip) < 0) {
+            log_warning("No such host: %s\n", server);
+        } else {
+            resolved += 1;
+        }
+    }
+    if (resolved == 0) {
+        fprintf(stderr, "No such host: %s\n", argv[optind]);
+        exit(1);
+    }
+    config.upstreams = &upstreams;
+
+    // Every mirror serves the same tree, so they share cache entries under the name of the first one
+    config.server_address = upstreams.servers[0].host;
+
+    // Take the listening sockets over from a running process, which then finishes its transfers and exits
+    struct handoff_socket *inherited = NULL;
+    int inherited_count = 0;
+    int taking_over = FALSE;
+    if (handoff_path != NULL) {
+        int result = handoff_request(handoff_path, &handoff_connection, &inherited, &inherited_count);
+        if (result < 0) {
+            exit(1);
+        }
+        taking_over = result > 0;
+        if (taking_over) {
+            log_info("Took over %d listening sockets from the previous process\n", inherited_count);
+            handoff_sort(inherited, inherited_count);
+        }
+    }
 
-    int mode = 0;                   // 0 for active mode and 1 for passive mode
-    int waiting_for_server_data_port = 0;
+    // Load the index of cached files. The previous process may still be filling some of them.
+    struct cache cache;
+    if (cache_init(&cache, cache_budget, taking_over) < 0) {
+        exit(1);
+    }
+    config.cache = &cache;
 
-    char cache_file_path[100] = {0};
-    int cache_hit = 0;
-    int should_send_cache_file = 0;
-    int should_save_cache_file = 0;
-    int file_transfer_mode = 0;     // 0 for downloading and 1 for uploading
+    // Small files are kept in memory on top of the disk
+    struct hot_cache hot;
+    if (hot_budget >= HOT_CACHE_PAGE_SIZE) {
+        if (hot_cache_init(&hot, hot_budget, (off_t) hot_threshold) < 0) {
+            exit(1);
+        }
+        cache.hot = &hot;
+    }
 
-    struct in_addr *client_address;
-    int active_client_data_port;
-    int passive_server_data_port;
+    // Directory listings are only cached with a TTL
+    struct listing_cache listings;
+    config.listings = NULL;
+    if (listing_ttl > 0) {
+        if (listing_cache_init(&listings, listing_ttl) < 0) {
+            exit(1);
+        }
+        config.listings = &listings;
+    }
 
-    // Clean master_set
-    FD_ZERO(&master_set);
+    struct metrics metrics;
+    if (metrics_init(&metrics) < 0) {
+        exit(1);
+    }
+    config.metrics = &metrics;
 
-    // Bind on port 21 and listen for connections from client.
-    proxy_cmd_socket = bind_and_listen_socket(21);
-    printf("Listening for command connection on port 21...\n");
-    // Add the socket into master set of file descriptors
-    FD_SET(proxy_cmd_socket, &master_set);
+    // Block termination signals before any thread starts, so only the signalfd receives them
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigprocmask(SIG_BLOCK, &signals, NULL);
 
-    struct timeval timeout; // Timeout structs
-    bzero(&timeout, sizeof(timeout));
-    timeout.tv_sec = 120; // Timeout interval for select
-    timeout.tv_usec = 0; // Use ms
+    // Files loaded from the snapshot are served right away and checked in the background
+    if (cache_start_threads(&cache) < 0) {
+        exit(1);
+    }
 
-    while (TRUE) {
-        FD_ZERO(&working_set);
-        memcpy(&working_set, &master_set, sizeof(master_set));
+    workers = calloc(worker_count, sizeof(struct worker));
+    if (workers == NULL) {
+        perror("Error allocating workers");
+        exit(1);
+    }
 
-        selectResult = select(select_sd, &working_set, NULL, NULL, &timeout);
+    // Listeners on another command port than the configured one are closed with the other leftovers
+    int command_sockets[MAX_WORKERS];
+    int command_count = 0;
+    for (int i = 0; i < inherited_count && command_count < MAX_WORKERS; i += 1) {
+        if (inherited[i].kind == HANDOFF_COMMAND && inherited[i].port == listen_port) {
+            command_sockets[command_count] = inherited[i].fd;
+            command_count += 1;
+            inherited[i].fd = -1;
+        }
+    }
 
-        // fail
-        if (selectResult < 0) {
-            perror("select() failed\n");
-            return 1;
+    for (int i = 0; i < worker_count; i += 1) {
+        // Each worker listens on its own share of the range, since a data connection has to reach
+        // the session waiting for it
+        int first_port = 0;
+        int port_count = PORT_POOL_DEFAULT_SIZE;
+        if (first_data_port > 0) {
+            int range = last_data_port - first_data_port + 1;
+            first_port = first_data_port + (int) ((long) range * i / worker_count);
+            port_count = first_data_port + (int) ((long) range * (i + 1) / worker_count) - first_port;
         }
 
-        // timeout
-        if (selectResult == 0) {
-            printf("select() timed out\n");
-            return 1;
+        if (init_worker(&workers[i], i, &config, cache_writer_backend, first_port, port_count, &policy,
+                        inherited, inherited_count, command_sockets, command_count) < 0) {
+            exit(1);
         }
+    }
+    log_info("Listening for command connection on port %d with %d workers...\n", config.listen_port, worker_count);
+
+    // The first worker answers the metrics endpoint next to its sessions
+    if (metrics_port > 0) {
+        struct handoff_socket *handed = handoff_find(inherited, inherited_count, HANDOFF_METRICS, metrics_port);
+        metrics_socket = metrics_listen(&workers[0].loop, &workers[0].config, metrics_port,
+                                        handed != NULL ? handed->fd : -1);
+        if (metrics_socket < 0) {
+            exit(1);
+        }
+        if (handed != NULL) {
+            handed->fd = -1;
+        }
+    }
 
-        for (int i = 0; i < select_sd; i += 1) {
-            // Check if the ith file descriptor exists in working_set
-            if (FD_ISSET(i, &working_set)) {
-                if (i == proxy_cmd_socket) {
-                    if (client_command_socket > 0) {
-                        FD_CLR(client_command_socket, &master_set);
-                        close(client_command_socket);
-                    }
-                    if (server_command_socket > 0) {
-                        FD_CLR(server_command_socket, &master_set);
-                        close(server_command_socket);
-                    }
-                    // New incoming command connection from client
-                    struct sockaddr_in client;
-
-                    client_command_socket = accept_connection(proxy_cmd_socket, &client);
-                    client_address = &client.sin_addr;
-                    printf("Accepted new command connection from client.\n");
-
-                    server_command_socket = create_connection_by_host_name(server_address, 21);
-                    printf("New command connection to server created.\n");
-
-                    // Add newly created sockets into master set
-                    FD_SET(client_command_socket, &master_set);
-                    FD_SET(server_command_socket, &master_set);
-                }
+    // Sockets of ports that are no longer configured
+    for (int i = 0; i < inherited_count; i += 1) {
+        if (inherited[i].fd >= 0) {
+            close(inherited[i].fd);
+        }
+    }
+    free(inherited);
 
-                if (i == client_command_socket) {
-                    char buff[BUFFSIZE] = {0};
-
-                    if (read(client_command_socket, buff, BUFFSIZE) == 0) {
-                        // Close command connections if nothing received
-                        FD_CLR(client_command_socket, &master_set);
-                        close(client_command_socket);
-
-                        FD_CLR(server_command_socket, &master_set);
-                        close(server_command_socket);
-
-                        printf("Client disconnected\n");
-                    } else {
-                        printf("Received from client: %s\n", buff);
-
-                        char command[5];
-                        strncpy(command, buff, 4);
-                        command[4] = '\0';
-
-                        if (command[3] == ' ') {
-                            command[3] = '\0';
-                        }
-
-                        if (strcmp(command, "PORT") == 0) {
-                            // Active mode
-                            mode = 0;
-
-                            // Get server address and data port
-                            int client_ip[4];
-                            int client_data_port[2];
-                            sscanf(buff, "PORT %d,%d,%d,%d,%d,%d",
-                                   &client_ip[0], &client_ip[1], &client_ip[2], &client_ip[3],
-                                   &client_data_port[0], &client_data_port[1]);
-
-                            active_client_data_port = client_data_port[0] * 256 + client_data_port[1];
-
-                            // Listen for new data connection from server
-                            if (proxy_data_socket > 0) {
-                                FD_CLR(proxy_data_socket, &master_set);
-                                close(proxy_data_socket);
-                            }
-                            proxy_data_socket = bind_and_listen_socket(active_client_data_port);
-                            printf("Listening for data connection on port %d...\n", active_client_data_port);
-                            FD_SET(proxy_data_socket, &master_set);
-
-                            char command[100] = {0};
-                            sprintf(command, "PORT %d,%d,%d,%d,%d,%d\n",
-                                    proxy_address[0], proxy_address[1], proxy_address[2], proxy_address[3],
-                                    client_data_port[0], client_data_port[1]);
-
-                            // Send the PORT command to server
-                            send_to_server(server_command_socket, command);
-                        } else if (strcmp(command, "PASV") == 0) {
-                            // Passive mode
-                            mode = 1;
-                            waiting_for_server_data_port = 1;
-
-                            send_to_server(server_command_socket, buff);
-                        } else if (strcmp(command, "RETR") == 0) {
-                            // Download a file
-                            file_transfer_mode = 0;
-
-                            // Get file name
-                            const char *filename = buff + 5;
-                            memset(cache_file_path, 0, sizeof(cache_file_path));
-                            sprintf(cache_file_path, "cache/%s", filename);
-                            for (int j = 0; j < strlen(cache_file_path); j += 1) {
-                                if (cache_file_path[j] == '\n' || cache_file_path[j] == '\r') {
-                                    cache_file_path[j] = '\0';
-                                    break;
-                                }
-                            }
-
-                            // Check if file exists in cache
-                            if (access(cache_file_path, F_OK) != -1) {
-                                // Cache hit
-                                printf("Cache hit: %s\n", cache_file_path);
-
-                                cache_hit = 1;
-                                should_send_cache_file = 1;
-                                should_save_cache_file = 0;
-                            } else {
-                                // Cache miss
-                                printf("Cache miss\n");
-
-                                cache_hit = 0;
-//                                rewind(cache_file);
-
-                                should_send_cache_file = 0;
-                                should_save_cache_file = 1;
-                            }
-
-                            send_to_server(server_command_socket, buff);
-                        } else if (strcmp(command, "STOR") == 0) {
-                            // Upload a file
-                            file_transfer_mode = 1;
-
-                            // Get file name
-                            const char *filename = buff + 5;
-                            memset(cache_file_path, 0, sizeof(cache_file_path));
-                            sprintf(cache_file_path, "cache/%s", filename);
-                            for (int j = 0; j < strlen(cache_file_path); j += 1) {
-                                if (cache_file_path[j] == '\n' || cache_file_path[j] == '\r') {
-                                    cache_file_path[j] = '\0';
-                                    break;
-                                }
-                            }
-
-                            // Check if file exists in cache
-                            if (access(cache_file_path, F_OK) != -1) {
-                                // Cache hit
-                                printf("Cache hit: %s\n", cache_file_path);
-
-                                cache_hit = 1;
-                                should_send_cache_file = 1;
-                                should_save_cache_file = 0;
-                            } else {
-                                // Cache miss
-                                printf("Cache miss\n");
-
-                                cache_hit = 0;
-//                                rewind(cache_file);
-
-                                should_send_cache_file = 0;
-                                should_save_cache_file = 1;
-                            }
-
-                            send_to_server(server_command_socket, buff);
-                        } else {
-                            send_to_server(server_command_socket, buff);
-                        }
-                    }
-                }
+    if (handoff_path != NULL) {
+        // Room for every listener of every worker, each of which writes its own part when handing off
+        int capacity = 1;
+        for (int i = 0; i < worker_count; i += 1) {
+            capacity += workers[i].listen_count + workers[i].data_ports.count;
+        }
+        handoff_sockets = calloc(capacity, sizeof(struct handoff_socket));
+        if (handoff_sockets == NULL) {
+            perror("Error allocating handoff sockets");
+            exit(1);
+        }
+        capacity = 0;
+        for (int i = 0; i < worker_count; i += 1) {
+            workers[i].handoff = &handoff_sockets[capacity];
+            capacity += workers[i].listen_count + workers[i].data_ports.count + (i == 0);
+        }
+        handoff_send_task.run = send_listeners;
 
-                if (i == server_command_socket) {
-                    char buff[BUFFSIZE] = {0};
-
-                    if (read(server_command_socket, buff, BUFFSIZE) == 0) {
-                        // Close command connections if nothing received
-                        FD_CLR(server_command_socket, &master_set);
-                        close(server_command_socket);
-
-                        FD_CLR(client_command_socket, &master_set);
-                        close(client_command_socket);
-
-                        printf("Server disconnected\n");
-                    } else {
-                        printf("Received from server: %s\n", buff);
-
-                        if (mode == 1 && waiting_for_server_data_port == 1 && strncmp(buff, "227", 3) == 0) {
-                            // Enter passive mode
-                            int server_ip[4];
-                            int server_data_port[2];
-
-                            // Get server address and data port
-                            sscanf(buff, "227 Entering Passive Mode (%d,%d,%d,%d,%d,%d)",
-                                   &server_ip[0], &server_ip[1], &server_ip[2], &server_ip[3],
-                                   &server_data_port[0], &server_data_port[1]);
-
-                            passive_server_data_port = server_data_port[0] * 256 + server_data_port[1];
-                            waiting_for_server_data_port = 0;
-
-                            // Close existed connection
-                            if (proxy_data_socket > 0) {
-                                FD_CLR(proxy_data_socket, &master_set);
-                                close(proxy_data_socket);
-                            }
-
-                            // Listen for new data connection from client
-                            proxy_data_socket = bind_and_listen_socket(passive_server_data_port);
-                            printf("Listening for data connection on port %d...\n", passive_server_data_port);
-                            FD_SET(proxy_data_socket, &master_set);
-
-                            // Send 227 response to client
-                            char response[60] = {0};
-                            sprintf(response, "227 Entering Passive Mode (%d,%d,%d,%d,%d,%d)\n",
-                                    proxy_address[0], proxy_address[1], proxy_address[2], proxy_address[3],
-                                    server_data_port[0], server_data_port[1]);
-                            send_to_client(client_command_socket, response);
-                        } else {
-                            send_to_client(client_command_socket, buff);
-                        }
-                    }
-                }
+        // The next process takes over from this one through the same socket
+        handoff_listener = handoff_listen(handoff_path);
+        if (handoff_listener < 0 || event_loop_add(&workers[0].loop, handoff_listener, EPOLLIN | EPOLLET,
+                                                   handle_handoff_request, NULL) < 0) {
+            exit(1);
+        }
+        if (taking_over) {
+            set_nonblocking(handoff_connection);
+            if (event_loop_add(&workers[0].loop, handoff_connection, EPOLLIN | EPOLLRDHUP | EPOLLET,
+                               handle_previous_exit, NULL) < 0) {
+                exit(1);
+            }
+        }
+    }
 
-                if (i == proxy_data_socket) {
-                    if (income_data_socket > 0) {
-                        FD_CLR(income_data_socket, &master_set);
-                        close(income_data_socket);
-                    }
-                    if (outcome_data_socket > 0) {
-                        FD_CLR(outcome_data_socket, &master_set);
-                        close(outcome_data_socket);
-                    }
-
-                    if (mode == 0) {
-                        // Active mode
-                        // Receive data connection from server
-                        struct sockaddr_in server;
-                        income_data_socket = accept_connection(proxy_data_socket, &server);
-                        printf("Accepted data connection from server\n");
-
-                        // Create data connection to client
-//                        struct sockaddr_in client;
-//                        client.sin_family = AF_INET;
-//                        client.sin_addr = *client_address;
-//                        client.sin_port = htons(active_client_data_port);
-//                        outcome_data_socket = create_connection(client);
-                        outcome_data_socket = create_connection_by_host_name(server_address, active_client_data_port);
-                        printf("Data connection to server created\n");
-
-                        if (should_send_cache_file && cache_hit) {
-                            // Send cached file
-                            FILE *cache_file = fopen(cache_file_path, "r");
-
-                            if (cache_file != NULL) {
-
-                                char buffer[BUFFSIZE] = {0};
-
-                                while (!feof(cache_file)) {
-                                    size_t read_file_size = fread(buffer, sizeof(char), BUFFSIZE - 1, cache_file);
-                                    printf("Read %d bytes from cache file\n", (int) read_file_size);
-
-                                    if (file_transfer_mode == 0) {
-                                        write(outcome_data_socket, buffer, read_file_size);
-                                    } else if (file_transfer_mode == 1) {
-                                        write(income_data_socket, buffer, read_file_size);
-                                    }
-                                }
-
-                                fclose(cache_file);
-
-                                close(income_data_socket);
-                                close(outcome_data_socket);
-                            } else {
-                                FD_SET(income_data_socket, &master_set);
-                                FD_SET(outcome_data_socket, &master_set);
-                            }
-
-                            should_send_cache_file = 0;
-                            cache_hit = 0;
-                        } else {
-                            FD_SET(income_data_socket, &master_set);
-                            FD_SET(outcome_data_socket, &master_set);
-                        }
-                    } else if (mode == 1) {
-                        // Passive mode
-                        // Receive data connection from client
-                        struct sockaddr_in client;
-                        income_data_socket = accept_connection(proxy_data_socket, &client);
-                        printf("Accepted data connection from client\n");
-
-                        // Create data connection to server
-                        outcome_data_socket = create_connection_by_host_name(server_address, passive_server_data_port);
-                        printf("Data connection to server created\n");
-
-                        if (should_send_cache_file && cache_hit) {
-                            // Send cached file
-                            FILE *cache_file = fopen(cache_file_path, "r");
-
-                            if (cache_file != NULL) {
-
-                                char file_buffer[BUFFSIZE] = {0};
-
-                                while (!feof(cache_file)) {
-                                    size_t read_file_size = fread(file_buffer, sizeof(char), BUFFSIZE - 1, cache_file);
-                                    printf("Read %d bytes from cache file\n", (int) read_file_size);
-
-                                    if (file_transfer_mode == 0) {
-                                        write(income_data_socket, file_buffer, read_file_size);
-                                    } else if (file_transfer_mode == 1) {
-                                        write(outcome_data_socket, file_buffer, read_file_size);
-                                    }
-                                }
-
-                                fclose(cache_file);
-
-                                close(income_data_socket);
-                                close(outcome_data_socket);
-                            } else {
-                                // Add the newly created sockets into master_set
-                                FD_SET(income_data_socket, &master_set);
-                                FD_SET(outcome_data_socket, &master_set);
-                            }
-
-                            should_send_cache_file = 0;
-                            cache_hit = 0;
-                        } else {
-                            // Add the newly created sockets into master_set
-                            FD_SET(income_data_socket, &master_set);
-                            FD_SET(outcome_data_socket, &master_set);
-                        }
-                    }
-                }
+    // The first worker checks on the mirrors, which only matters when there is another one to route to
+    if (upstreams.count > 1) {
+        upstream_start_probes(&upstreams, &workers[0].loop, health_interval);
+    }
 
-                if (i == income_data_socket) {
-                    char buff[BUFFSIZE] = {0};
-
-                    ssize_t read_size = read(income_data_socket, buff, BUFFSIZE);
-                    if (read_size == 0) {
-                        // Close data connections if nothing received
-                        FD_CLR(income_data_socket, &master_set);
-                        close(income_data_socket);
-
-                        FD_CLR(outcome_data_socket, &master_set);
-                        close(outcome_data_socket);
-
-                        if (should_save_cache_file) {
-                            should_save_cache_file = 0;
-                        }
-                    } else {
-                        printf("Received data: %d bytes\n", (int) read_size);
-
-                        write(outcome_data_socket, buff, read_size);
-
-                        if (should_save_cache_file) {
-                            FILE *cache_file = fopen(cache_file_path, "a");
-                            if (cache_file != NULL) {
-                                fwrite(buff, sizeof(char), read_size, cache_file);
-                                fclose(cache_file);
-                            } else {
-                                printf("Cannot open cache file %s\n", cache_file_path);
-                                should_save_cache_file = 0;
-                            }
-                        }
-                    }
-                }
+    // Deliver termination signals through the event loop of the first worker
+    int signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd < 0 || event_loop_add(&workers[0].loop, signal_fd, EPOLLIN | EPOLLET, handle_signal, NULL) < 0) {
+        perror("Error creating signalfd");
+        exit(1);
+    }
 
-                if (i == outcome_data_socket) {
-                    char buff[BUFFSIZE] = {0};
-
-                    ssize_t read_size = read(outcome_data_socket, buff, BUFFSIZE);
-                    if (read_size == 0) {
-                        // Close data connections if nothing received
-                        FD_CLR(income_data_socket, &master_set);
-                        close(income_data_socket);
-
-                        FD_CLR(outcome_data_socket, &master_set);
-                        close(outcome_data_socket);
-
-                        if (should_save_cache_file) {
-                            should_save_cache_file = 0;
-                        }
-                    } else {
-                        printf("Received data: %d bytes\n", (int) read_size);
-
-                        write(income_data_socket, buff, read_size);
-
-                        if (should_save_cache_file) {
-                            FILE *cache_file = fopen(cache_file_path, "a");
-                            if (cache_file != NULL) {
-                                fwrite(buff, sizeof(char), read_size, cache_file);
-                                fclose(cache_file);
-                            } else {
-                                should_save_cache_file = 0;
-                            }
-                        }
-                    }
-                }
-            }
+    // The main thread runs the first worker itself
+    for (int i = 1; i < worker_count; i += 1) {
+        if (pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]) != 0) {
+            perror("Error creating worker thread");
+            exit(1);
         }
     }
+    event_loop_run(&workers[0].loop);
+
+    for (int i = 1; i < worker_count; i += 1) {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    // Keep the cache across restarts; after a handoff, this only records what the new process has to merge
+    cache_save_snapshot(&cache);
+    if (handoff_path != NULL && !handed_off) {
+        unlink(handoff_path);
+    }
+    log_stop();
 
     return 0;
 }
@@ -0,0 +1,390 @@
+#define _GNU_SOURCE
+
+#include "metrics.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "cache.h"
+#include "hot_cache.h"
+#include "log.h"
+#include "net.h"
+#include "proxy.h"
+#include "upstream.h"
+
+#define METRICS_OUTPUT_SIZE (16 * 1024)
+
+// Upper bounds of the histogram buckets in microseconds
+static const unsigned long long metrics_bucket_bounds[METRICS_LATENCY_BUCKETS] = {
+        100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 1000000, 2500000, 10000000
+};
+
+/**
+ * Sets up the counters with no session open.
+ * Returns 0 on success and -1 on failure.
+ */
+int metrics_init(struct metrics *metrics) {
+    memset(metrics, 0, sizeof(struct metrics));
+
+    if (pthread_mutex_init(&metrics->mutex, NULL) != 0) {
+        perror("Error creating metrics lock");
+        return -1;
+    }
+    metrics->sessions.prev = metrics->sessions.next = &metrics->sessions;
+
+    return 0;
+}
+
+/**
+ * Gets the monotonic time in microseconds, to measure latencies with.
+ */
+unsigned long long metrics_now(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/**
+ * Counts a latency into its bucket of the histogram.
+ */
+void metrics_observe(struct metrics_histogram *histogram, unsigned long long microseconds) {
+    int bucket = 0;
+
+    while (bucket < METRICS_LATENCY_BUCKETS && microseconds > metrics_bucket_bounds[bucket]) {
+        bucket += 1;
+    }
+
+    metrics_add(histogram->buckets[bucket], 1);
+    metrics_add(histogram->count, 1);
+    metrics_add(histogram->sum, microseconds);
+}
+
+/**
+ * Adds a new session to the ones the endpoint reports.
+ */
+void metrics_open_session(struct metrics *metrics, struct metrics_session *session, struct in_addr client) {
+    session->client = client;
+    session->started = time(NULL);
+
+    pthread_mutex_lock(&metrics->mutex);
+    session->prev = &metrics->sessions;
+    session->next = metrics->sessions.next;
+    metrics->sessions.next->prev = session;
+    metrics->sessions.next = session;
+    metrics->sessions_active += 1;
+    metrics->sessions_total += 1;
+    pthread_mutex_unlock(&metrics->mutex);
+}
+
+/**
+ * Removes a closing session, whose bytes are added to the totals.
+ */
+void metrics_close_session(struct metrics *metrics, struct metrics_session *session) {
+    pthread_mutex_lock(&metrics->mutex);
+    session->prev->next = session->next;
+    session->next->prev = session->prev;
+    metrics->sessions_active -= 1;
+    metrics->bytes_downloaded += session->bytes_downloaded;
+    metrics->bytes_uploaded += session->bytes_uploaded;
+    metrics->bytes_from_cache += session->bytes_from_cache;
+    pthread_mutex_unlock(&metrics->mutex);
+}
+
+/**
+ * Writes a histogram in the Prometheus text format, with the bounds in seconds.
+ */
+static void metrics_print_histogram(FILE *output, const char *name, const char *help,
+                                    const struct metrics_histogram *histogram) {
+    unsigned long long cumulative = 0;
+
+    fprintf(output, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    for (int i = 0; i <= METRICS_LATENCY_BUCKETS; i += 1) {
+        cumulative += __atomic_load_n(&histogram->buckets[i], __ATOMIC_RELAXED);
+        if (i < METRICS_LATENCY_BUCKETS) {
+            fprintf(output, "%s_bucket{le=\"%g\"} %llu\n", name, metrics_bucket_bounds[i] / 1e6, cumulative);
+        } else {
+            fprintf(output, "%s_bucket{le=\"+Inf\"} %llu\n", name, cumulative);
+        }
+    }
+    fprintf(output, "%s_sum %g\n%s_count %llu\n", name,
+            __atomic_load_n(&histogram->sum, __ATOMIC_RELAXED) / 1e6, name, cumulative);
+}
+
+/**
+ * Writes a counter or gauge in the Prometheus text format.
+ */
+static void metrics_print_value(FILE *output, const char *name, const char *type, const char *help,
+                                unsigned long long value) {
+    fprintf(output, "# HELP %s %s\n# TYPE %s %s\n%s %llu\n", name, help, name, type, name, value);
+}
+
+/**
+ * Writes the health and averages of every mirror, labelled with its address.
+ */
+static void metrics_print_upstreams(FILE *output, struct upstream_set *set) {
+    fprintf(output, "# HELP ftp_proxy_upstream_healthy Whether new sessions are routed to the mirror\n"
+                    "# TYPE ftp_proxy_upstream_healthy gauge\n"
+                    "# HELP ftp_proxy_upstream_sessions Open sessions connected to the mirror\n"
+                    "# TYPE ftp_proxy_upstream_sessions gauge\n"
+                    "# HELP ftp_proxy_upstream_connect_average_seconds Moving average of the connect latency\n"
+                    "# TYPE ftp_proxy_upstream_connect_average_seconds gauge\n"
+                    "# HELP ftp_proxy_upstream_throughput_bytes Moving average of the download throughput per second\n"
+                    "# TYPE ftp_proxy_upstream_throughput_bytes gauge\n");
+
+    pthread_mutex_lock(&set->mutex);
+    for (int i = 0; i < set->count; i += 1) {
+        const struct upstream *upstream = &set->servers[i];
+
+        fprintf(output, "ftp_proxy_upstream_healthy{upstream=\"%s:%d\"} %d\n"
+                        "ftp_proxy_upstream_sessions{upstream=\"%s:%d\"} %d\n"
+                        "ftp_proxy_upstream_connect_average_seconds{upstream=\"%s:%d\"} %g\n"
+                        "ftp_proxy_upstream_throughput_bytes{upstream=\"%s:%d\"} %llu\n",
+                upstream->host, upstream->port, upstream->healthy,
+                upstream->host, upstream->port, upstream->sessions,
+                upstream->host, upstream->port, upstream->connect_time / 1e6,
+                upstream->host, upstream->port, upstream->throughput);
+    }
+    pthread_mutex_unlock(&set->mutex);
+}
+
+/**
+ * Formats every metric in the Prometheus text format.
+ * Returns the text for the caller to free, or NULL on failure.
+ */
+static char *metrics_format(const struct proxy_config *config, size_t *length) {
+    struct metrics *metrics = config->metrics;
+    char *text = NULL;
+
+    FILE *output = open_memstream(&text, length);
+    if (output == NULL) {
+        return NULL;
+    }
+
+    // Open sessions are listed one by one and added to the totals of the closed ones
+    pthread_mutex_lock(&metrics->mutex);
+    unsigned long long downloaded = metrics->bytes_downloaded;
+    unsigned long long uploaded = metrics->bytes_uploaded;
+    unsigned long long from_cache = metrics->bytes_from_cache;
+
+    fprintf(output, "# HELP ftp_proxy_session_bytes Bytes sent by the open sessions\n"
+                    "# TYPE ftp_proxy_session_bytes gauge\n");
+    for (struct metrics_session *session = metrics->sessions.next; session != &metrics->sessions;
+         session = session->next) {
+        unsigned long long session_downloaded = __atomic_load_n(&session->bytes_downloaded, __ATOMIC_RELAXED);
+        unsigned long long session_uploaded = __atomic_load_n(&session->bytes_uploaded, __ATOMIC_RELAXED);
+        unsigned long long session_from_cache = __atomic_load_n(&session->bytes_from_cache, __ATOMIC_RELAXED);
+        char client[INET_ADDRSTRLEN];
+
+        inet_ntop(AF_INET, &session->client, client, sizeof(client));
+        fprintf(output, "ftp_proxy_session_bytes{client=\"%s\",started=\"%lld\",direction=\"download\"} %llu\n"
+                        "ftp_proxy_session_bytes{client=\"%s\",started=\"%lld\",direction=\"upload\"} %llu\n"
+                        "ftp_proxy_session_bytes{client=\"%s\",started=\"%lld\",direction=\"cache\"} %llu\n",
+                client, (long long) session->started, session_downloaded,
+                client, (long long) session->started, session_uploaded,
+                client, (long long) session->started, session_from_cache);
+
+        downloaded += session_downloaded;
+        uploaded += session_uploaded;
+        from_cache += session_from_cache;
+    }
+    unsigned long long sessions_active = metrics->sessions_active;
+    unsigned long long sessions_total = metrics->sessions_total;
+    pthread_mutex_unlock(&metrics->mutex);
+
+    metrics_print_value(output, "ftp_proxy_sessions_active", "gauge", "Open client sessions", sessions_active);
+    metrics_print_value(output, "ftp_proxy_sessions_total", "counter", "Client sessions accepted", sessions_total);
+    metrics_print_value(output, "ftp_proxy_downloaded_bytes_total", "counter",
+                        "Bytes relayed from the server to clients", downloaded);
+    metrics_print_value(output, "ftp_proxy_uploaded_bytes_total", "counter",
+                        "Bytes relayed from clients to the server", uploaded);
+    metrics_print_value(output, "ftp_proxy_cache_sent_bytes_total", "counter",
+                        "Bytes sent to clients from the cache", from_cache);
+    metrics_print_value(output, "ftp_proxy_cache_hits_total", "counter", "Downloads served from the cache",
+                        __atomic_load_n(&metrics->cache_hits, __ATOMIC_RELAXED));
+    metrics_print_value(output, "ftp_proxy_cache_misses_total", "counter", "Downloads fetched from the server",
+                        __atomic_load_n(&metrics->cache_misses, __ATOMIC_RELAXED));
+    metrics_print_value(output, "ftp_proxy_cache_evictions_total", "counter", "Cached files evicted for space",
+                        __atomic_load_n(&config->cache->evictions, __ATOMIC_RELAXED));
+    metrics_print_value(output, "ftp_proxy_cache_damaged_total", "counter",
+                        "Cached files dropped after failing verification",
+                        __atomic_load_n(&config->cache->damaged, __ATOMIC_RELAXED));
+    metrics_print_value(output, "ftp_proxy_cache_used_bytes", "gauge", "Bytes of the cached files",
+                        __atomic_load_n(&config->cache->used, __ATOMIC_RELAXED));
+    if (config->cache->hot != NULL) {
+        metrics_print_value(output, "ftp_proxy_cache_memory_hits_total", "counter",
+                            "Cache hits sent from the copies of small files in memory",
+                            __atomic_load_n(&config->cache->hot->hits, __ATOMIC_RELAXED));
+        metrics_print_value(output, "ftp_proxy_cache_memory_bytes", "gauge", "Bytes of the copies in memory",
+                            __atomic_load_n(&config->cache->hot->bytes, __ATOMIC_RELAXED));
+    }
+    metrics_print_value(output, "ftp_proxy_listing_hits_total", "counter", "Listings served from memory",
+                        __atomic_load_n(&metrics->listing_hits, __ATOMIC_RELAXED));
+    metrics_print_value(output, "ftp_proxy_listing_misses_total", "counter", "Listings fetched from the server",
+                        __atomic_load_n(&metrics->listing_misses, __ATOMIC_RELAXED));
+    metrics_print_histogram(output, "ftp_proxy_upstream_connect_seconds",
+                            "Time to establish command connections to the server", &metrics->connect_latency);
+    metrics_print_histogram(output, "ftp_proxy_first_byte_seconds",
+                            "Time from a download command to its first byte sent to the client", &metrics->first_byte);
+    metrics_print_upstreams(output, config->upstreams);
+
+    if (fclose(output) != 0) {
+        free(text);
+        return NULL;
+    }
+
+    return text;
+}
+
+/**
+ * Closes a connection to the endpoint.
+ */
+static void metrics_close_client(struct event_loop *loop, struct metrics_client *client) {
+    event_loop_remove(loop, client->socket_fd);
+    close(client->socket_fd);
+    ring_free(&client->output);
+    free(client);
+}
+
+/**
+ * Writes the buffered response, closing the connection once all of it was sent.
+ */
+static void metrics_flush_client(struct event_loop *loop, struct metrics_client *client) {
+    while (ring_used(&client->output) > 0) {
+        ssize_t written = ring_write_to(&client->output, client->socket_fd);
+
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            event_loop_modify(loop, client->socket_fd, METRICS_EVENTS | EPOLLOUT);
+            return;
+        }
+        if (written < 0) {
+            break;
+        }
+    }
+
+    metrics_close_client(loop, client);
+}
+
+/**
+ * Answers the request with the metrics if it asked for them, and with 404 otherwise.
+ */
+static void metrics_answer(struct event_loop *loop, struct metrics_client *client) {
+    char *body = NULL;
+    size_t body_length = 0;
+    const char *status = "404 Not Found";
+
+    client->answered = TRUE;
+    client->request[client->request_length] = '\0';
+    if (strncmp(client->request, "GET / ", 6) == 0 || strncmp(client->request, "GET /metrics ", 13) == 0) {
+        body = metrics_format(client->config, &body_length);
+        status = body != NULL ? "200 OK" : "500 Internal Server Error";
+    }
+
+    char header[200];
+    snprintf(header, sizeof(header), "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                                     "Content-Length: %zu\r\nConnection: close\r\n\r\n", status, body_length);
+
+    if (ring_append(&client->output, header, strlen(header)) < 0 ||
+        (body != NULL && ring_append(&client->output, body, body_length) < 0)) {
+        ring_clear(&client->output);
+    }
+    free(body);
+
+    metrics_flush_client(loop, client);
+}
+
+/**
+ * Reads the request of a connection to the endpoint, or goes on sending the response.
+ */
+static void metrics_handle_client(struct event_loop *loop, int fd, uint32_t events, void *data) {
+    struct metrics_client *client = data;
+
+    if (client->answered) {
+        metrics_flush_client(loop, client);
+        return;
+    }
+
+    while (client->request_length < sizeof(client->request) - 1) {
+        ssize_t read_size = read(fd, client->request + client->request_length,
+                                 sizeof(client->request) - 1 - client->request_length);
+
+        if (read_size < 0 && errno == EINTR) {
+            continue;
+        }
+        if (read_size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (read_size <= 0) {
+            metrics_close_client(loop, client);
+            return;
+        }
+        client->request_length += read_size;
+    }
+
+    client->request[client->request_length] = '\0';
+    if (strstr(client->request, "\r\n\r\n") != NULL || strstr(client->request, "\n\n") != NULL ||
+        client->request_length == sizeof(client->request) - 1) {
+        metrics_answer(loop, client);
+    }
+}
+
+/**
+ * Accepts every pending connection to the endpoint.
+ */
+static void metrics_accept(struct event_loop *loop, int fd, uint32_t events, void *data) {
+    const struct proxy_config *config = data;
+
+    while (TRUE) {
+        struct sockaddr_in address;
+
+        int socket_fd = accept_connection(fd, &address);
+        if (socket_fd < 0) {
+            return;
+        }
+
+        struct metrics_client *client = calloc(1, sizeof(struct metrics_client));
+        if (client == NULL) {
+            close(socket_fd);
+            continue;
+        }
+        client->config = config;
+        client->socket_fd = socket_fd;
+        ring_init(&client->output, METRICS_OUTPUT_SIZE);
+
+        if (event_loop_add(loop, socket_fd, METRICS_EVENTS, metrics_handle_client, client) < 0) {
+            close(socket_fd);
+            free(client);
+        }
+    }
+}
+
+/**
+ * Serves the metrics over HTTP on the given port of the loopback interface, from the event loop. The
+ * listener handed off by a previous process is used if socket_fd is not -1.
+ * Returns the file descriptor of the listener, or -1 on failure.
+ */
+int metrics_listen(struct event_loop *loop, const struct proxy_config *config, int port, int socket_fd) {
+    if (socket_fd < 0) {
+        socket_fd = bind_and_listen_loopback(port);
+    }
+    if (socket_fd < 0) {
+        return -1;
+    }
+    set_nonblocking(socket_fd);
+
+    if (event_loop_add(loop, socket_fd, EPOLLIN | EPOLLET, metrics_accept, (void *) config) < 0) {
+        close(socket_fd);
+        return -1;
+    }
+
+    log_info("Serving metrics on http://127.0.0.1:%d/metrics\n", port);
+    return socket_fd;
+}
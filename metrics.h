@@ -0,0 +1,87 @@
+#ifndef FTP_PROXY_METRICS_H
+#define FTP_PROXY_METRICS_H
+
+#include <pthread.h>
+#include <time.h>
+#include <netinet/in.h>
+
+#include "event_loop.h"
+#include "ring.h"
+
+#define METRICS_LATENCY_BUCKETS 14
+#define METRICS_REQUEST_SIZE 4096           // Longer requests are answered once this much arrived
+#define METRICS_EVENTS (EPOLLIN | EPOLLRDHUP | EPOLLET)
+
+struct proxy_config;
+
+/**
+ * Latency histogram with fixed buckets from 100 microseconds to 10 seconds, updated atomically.
+ */
+struct metrics_histogram {
+    unsigned long long buckets[METRICS_LATENCY_BUCKETS + 1];  // The last one counts what exceeds every bound
+    unsigned long long count;
+    unsigned long long sum;         // Microseconds
+};
+
+/**
+ * Counters of one session, written by its worker and read by the metrics endpoint.
+ */
+struct metrics_session {
+    struct metrics_session *prev;
+    struct metrics_session *next;
+    struct in_addr client;
+    time_t started;
+    unsigned long long bytes_downloaded;    // Relayed from the server to the client
+    unsigned long long bytes_uploaded;      // Relayed from the client to the server
+    unsigned long long bytes_from_cache;    // Sent to the client from the cache
+};
+
+/**
+ * Counters shared by every worker, updated atomically. Bytes are kept per session and only added up
+ * here when a session closes, so relaying never writes to a line shared between workers.
+ */
+struct metrics {
+    pthread_mutex_t mutex;          // Guards the list of sessions
+    struct metrics_session sessions;    // Sentinel of the list of open sessions
+
+    unsigned long long sessions_active;
+    unsigned long long sessions_total;
+    unsigned long long bytes_downloaded;    // Of the closed sessions
+    unsigned long long bytes_uploaded;
+    unsigned long long bytes_from_cache;
+    unsigned long long cache_hits;
+    unsigned long long cache_misses;
+    unsigned long long listing_hits;
+    unsigned long long listing_misses;
+    struct metrics_histogram connect_latency;   // Establishing command connections to the server
+    struct metrics_histogram first_byte;        // From a download command to its first byte sent to the client
+};
+
+/**
+ * Connection to the metrics endpoint, answered once its request arrived.
+ */
+struct metrics_client {
+    const struct proxy_config *config;
+    int socket_fd;
+    char request[METRICS_REQUEST_SIZE];
+    size_t request_length;
+    int answered;
+    struct ring output;
+};
+
+// Counters only need to be exact once read, not ordered with anything else
+#define metrics_add(counter, amount) __atomic_add_fetch(&(counter), (amount), __ATOMIC_RELAXED)
+
+int metrics_init(struct metrics *metrics);
+
+unsigned long long metrics_now(void);
+
+void metrics_observe(struct metrics_histogram *histogram, unsigned long long microseconds);
+
+void metrics_open_session(struct metrics *metrics, struct metrics_session *session, struct in_addr client);
+
+void metrics_close_session(struct metrics *metrics, struct metrics_session *session);
+
+int metrics_listen(struct event_loop *loop, const struct proxy_config *config, int port, int socket_fd);
+
+#endif
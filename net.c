@@ -0,0 +1,181 @@
+#define _GNU_SOURCE
+
+#include "net.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "proxy.h"
+
+/**
+ * Creates a socket bound onto the given address and port, listening for new connections.
+ * Returns the file descriptor of the created socket, or -1 on failure.
+ */
+static int listen_on_address(in_addr_t address, int port_number, int reuse_port) {
+    struct sockaddr_in server_address;
+
+    // Create a new socket
+    int socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (socket_fd < 0) {
+        perror("Error opening socket");
+        return -1;
+    }
+
+    setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, &(int) {1}, sizeof(int));
+    if (reuse_port && setsockopt(socket_fd, SOL_SOCKET, SO_REUSEPORT, &(int) {1}, sizeof(int)) < 0) {
+        perror("Error setting SO_REUSEPORT");
+        close(socket_fd);
+        return -1;
+    }
+
+    // Prepare server address
+    bzero((char *) &server_address, sizeof(server_address));
+    server_address.sin_family = AF_INET;
+    server_address.sin_addr.s_addr = address;
+    server_address.sin_port = htons(port_number);
+
+    // Bind socket on the given port
+    if (bind(socket_fd, (struct sockaddr *) &server_address, sizeof(server_address)) < 0) {
+        perror("Error binding");
+        close(socket_fd);
+        return -1;
+    }
+
+    // Set the socket to listen for new connections
+    listen(socket_fd, SOMAXCONN);
+
+    return socket_fd;
+}
+
+/**
+ * Creates a socket and binds it onto the given port, then makes it listen for new connections.
+ * With reuse_port, several sockets can listen on the port and the kernel spreads connections among them.
+ * Returns the file descriptor of the created socket.
+ */
+int bind_and_listen_socket(int port_number, int reuse_port) {
+    int socket_fd = listen_on_address(INADDR_ANY, port_number, reuse_port);
+    if (socket_fd < 0) {
+        exit(1);
+    }
+
+    return socket_fd;
+}
+
+/**
+ * Creates a socket listening for data connections on the given port, or on one the kernel picks if it
+ * is 0, which is then stored into port_number.
+ * Returns the file descriptor of the created socket, or -1 on failure.
+ */
+int bind_and_listen_data(int *port_number) {
+    struct sockaddr_in address;
+    socklen_t length = sizeof(address);
+
+    int socket_fd = listen_on_address(INADDR_ANY, *port_number, FALSE);
+    if (socket_fd < 0) {
+        return -1;
+    }
+
+    if (getsockname(socket_fd, (struct sockaddr *) &address, &length) < 0) {
+        perror("Error getting socket name");
+        close(socket_fd);
+        return -1;
+    }
+    *port_number = ntohs(address.sin_port);
+
+    return socket_fd;
+}
+
+/**
+ * Creates a socket listening on the given port of the loopback interface only, for local tools.
+ * Returns the file descriptor of the created socket, or -1 on failure.
+ */
+int bind_and_listen_loopback(int port_number) {
+    return listen_on_address(htonl(INADDR_LOOPBACK), port_number, FALSE);
+}
+
+/**
+ * Accepts an incoming connection on a non-blocking listening socket.
+ * Returns a new non-blocking socket created for the connection, or -1 if none is pending.
+ */
+int accept_connection(int sockfd, struct sockaddr_in *addr) {
+    socklen_t client_length = sizeof(*addr);
+
+    int command_socket_fd = accept4(sockfd, (struct sockaddr *) addr, &client_length, SOCK_NONBLOCK);
+    if (command_socket_fd < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            perror("Error accepting connection");
+        }
+        return -1;
+    }
+
+    return command_socket_fd;
+}
+
+/**
+ * Starts a non-blocking connection to the target address.
+ * Returns a new socket, connected once it becomes writable, or -1 on failure.
+ */
+int start_connection(struct sockaddr_in addr) {
+    int socket_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if (socket_fd < 0) {
+        perror("Error opening socket");
+        return -1;
+    }
+
+    if (connect(socket_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 && errno != EINPROGRESS) {
+        perror("Error creating connection");
+        close(socket_fd);
+        return -1;
+    }
+
+    return socket_fd;
+}
+
+/**
+ * Gets the outcome of a connection started by start_connection() once its socket became writable.
+ * Returns 0 if the connection was established and -1 with errno set otherwise.
+ */
+int finish_connection(int socket_fd) {
+    int error = 0;
+    socklen_t length = sizeof(error);
+
+    if (getsockopt(socket_fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0) {
+        return -1;
+    }
+    if (error != 0) {
+        errno = error;
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Switches the socket into non-blocking mode.
+ * Returns 0 on success and -1 on failure.
+ */
+int set_nonblocking(int socket_fd) {
+    int flags = fcntl(socket_fd, F_GETFL, 0);
+    if (flags < 0) {
+        return -1;
+    }
+
+    return fcntl(socket_fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/**
+ * Sends small writes on the socket right away instead of coalescing them with Nagle's algorithm.
+ * Returns 0 on success and -1 on failure.
+ */
+int set_nodelay(int socket_fd) {
+    return setsockopt(socket_fd, IPPROTO_TCP, TCP_NODELAY, &(int) {1}, sizeof(int));
+}
@@ -0,0 +1,24 @@
+#ifndef FTP_PROXY_NET_H
+#define FTP_PROXY_NET_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+
+int bind_and_listen_socket(int port_number, int reuse_port);
+
+int bind_and_listen_data(int *port_number);
+
+int bind_and_listen_loopback(int port_number);
+
+int accept_connection(int sockfd, struct sockaddr_in *addr);
+
+int start_connection(struct sockaddr_in addr);
+
+int finish_connection(int socket_fd);
+
+int set_nonblocking(int socket_fd);
+
+int set_nodelay(int socket_fd);
+
+#endif
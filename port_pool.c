@@ -0,0 +1,206 @@
+#define _GNU_SOURCE
+
+#include "port_pool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "log.h"
+#include "net.h"
+#include "proxy.h"
+
+/**
+ * Puts a slot at the end of the queue of free slots.
+ */
+static void port_pool_push(struct port_pool *pool, int index) {
+    pool->slots[index].next_free = -1;
+    if (pool->free_count == 0) {
+        pool->free_head = index;
+    } else {
+        pool->slots[pool->free_tail].next_free = index;
+    }
+    pool->free_tail = index;
+    pool->free_count += 1;
+}
+
+/**
+ * Binds the listeners of the pool: count consecutive ports from first_port on, or count ports the
+ * kernel picks if first_port is 0. Ports of the range that are in use are left out, unless the
+ * previous process handed off their listeners, which are taken from the sorted inherited sockets;
+ * those its transfers still wait on stay reserved until it exited.
+ * Returns 0 on success and -1 if no port could be bound.
+ */
+int port_pool_init(struct port_pool *pool, int first_port, int count,
+                   struct handoff_socket *inherited, int inherited_count) {
+    pool->slots = calloc(count, sizeof(struct port_pool_slot));
+    if (pool->slots == NULL) {
+        perror("Error allocating data ports");
+        return -1;
+    }
+    pool->count = 0;
+    pool->fixed = first_port > 0;
+    pool->surrendered = FALSE;
+    pool->free_count = 0;
+
+    for (int i = 0; i < count; i += 1) {
+        int port = pool->fixed ? first_port + i : 0;
+        int reserved = FALSE;
+        int socket_fd;
+
+        struct handoff_socket *handed = pool->fixed ? handoff_find(inherited, inherited_count, HANDOFF_DATA, port)
+                                                    : NULL;
+        if (handed != NULL) {
+            socket_fd = handed->fd;
+            reserved = handed->busy;
+            handed->fd = -1;
+        } else {
+            socket_fd = bind_and_listen_data(&port);
+        }
+        if (socket_fd < 0) {
+            if (pool->fixed) {
+                log_warning("Data port %d is in use, left out of the pool\n", port);
+            }
+            continue;
+        }
+        set_nonblocking(socket_fd);
+
+        pool->slots[pool->count].socket_fd = socket_fd;
+        pool->slots[pool->count].port = port;
+        pool->slots[pool->count].pooled = TRUE;
+        pool->slots[pool->count].reserved = reserved;
+        if (!reserved) {
+            port_pool_push(pool, pool->count);
+        }
+        pool->count += 1;
+    }
+
+    if (pool->count == 0 && count > 0) {
+        fprintf(stderr, "No data port could be bound\n");
+        free(pool->slots);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Hands out a free listener for one transfer, dropping any connection left in its backlog since it
+ * was last used. Once every listener is in use, a listener on a port the kernel picks is created for
+ * the transfer alone, unless the ports are restricted to a configured range.
+ * Returns the slot, or NULL if no listener is available.
+ */
+struct port_pool_slot *port_pool_acquire(struct port_pool *pool) {
+    if (pool->free_count == 0) {
+        if (pool->fixed || pool->surrendered) {
+            return NULL;
+        }
+
+        struct port_pool_slot *slot = malloc(sizeof(struct port_pool_slot));
+        if (slot == NULL) {
+            return NULL;
+        }
+        slot->port = 0;
+        slot->pooled = FALSE;
+        slot->socket_fd = bind_and_listen_data(&slot->port);
+        if (slot->socket_fd < 0) {
+            free(slot);
+            return NULL;
+        }
+        slot->next_free = -1;
+        return slot;
+    }
+
+    struct port_pool_slot *slot = &pool->slots[pool->free_head];
+    pool->free_head = slot->next_free;
+    pool->free_count -= 1;
+
+    // Peers of the previous transfer may still have connected after it ended
+    int stale_socket;
+    while ((stale_socket = accept4(slot->socket_fd, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+        close(stale_socket);
+    }
+
+    return slot;
+}
+
+/**
+ * Gives back a listener once its transfer has its data connection or no longer needs it. The caller
+ * stopped watching it already.
+ */
+void port_pool_release(struct port_pool *pool, struct port_pool_slot *slot) {
+    if (!slot->pooled) {
+        close(slot->socket_fd);
+        free(slot);
+        return;
+    }
+
+    // The new process accepts on the port from now on
+    if (pool->surrendered) {
+        close(slot->socket_fd);
+        slot->socket_fd = -1;
+        return;
+    }
+
+    port_pool_push(pool, (int) (slot - pool->slots));
+}
+
+/**
+ * Writes a duplicate of the listener of a slot for the new process.
+ * Returns 1 if it was written and 0 if it could not be duplicated.
+ */
+static int port_pool_duplicate(const struct port_pool_slot *slot, struct handoff_socket *handed, int busy) {
+    handed->fd = dup(slot->socket_fd);
+    handed->kind = HANDOFF_DATA;
+    handed->port = slot->port;
+    handed->busy = busy;
+    return handed->fd >= 0;
+}
+
+/**
+ * Hands the listeners of a pool over a configured range off to a new process: a duplicate of each
+ * one is written to sockets, which has room for every slot, and the free ones are closed. The
+ * listeners of running transfers are closed once released, and no other one is handed out anymore.
+ * Returns the number of sockets written, 0 for a pool of ports the kernel picks, which the new
+ * process binds its own of.
+ */
+int port_pool_surrender(struct port_pool *pool, struct handoff_socket *sockets) {
+    int count = 0;
+
+    if (!pool->fixed) {
+        return 0;
+    }
+
+    for (int index = pool->free_count > 0 ? pool->free_head : -1; index >= 0; index = pool->slots[index].next_free) {
+        struct port_pool_slot *slot = &pool->slots[index];
+
+        count += port_pool_duplicate(slot, &sockets[count], FALSE);
+        close(slot->socket_fd);
+        slot->socket_fd = -1;
+    }
+    pool->surrendered = TRUE;
+    pool->free_count = 0;
+
+    // Whatever is still open waits for a transfer
+    for (int i = 0; i < pool->count; i += 1) {
+        if (pool->slots[i].socket_fd >= 0) {
+            count += port_pool_duplicate(&pool->slots[i], &sockets[count], TRUE);
+        }
+    }
+
+    return count;
+}
+
+/**
+ * Puts the listeners reserved for the transfers of the previous process back into the pool, once it
+ * exited.
+ */
+void port_pool_reclaim(struct port_pool *pool) {
+    for (int i = 0; i < pool->count; i += 1) {
+        if (pool->slots[i].reserved) {
+            pool->slots[i].reserved = FALSE;
+            port_pool_push(pool, i);
+        }
+    }
+}
@@ -0,0 +1,45 @@
+#ifndef FTP_PROXY_PORT_POOL_H
+#define FTP_PROXY_PORT_POOL_H
+
+#include "handoff.h"
+
+#define PORT_POOL_DEFAULT_SIZE 64           // Listeners of each worker when no range is configured
+
+/**
+ * Listening data socket bound once at startup and handed to one transfer at a time.
+ */
+struct port_pool_slot {
+    int socket_fd;
+    int port;
+    int pooled;                     // FALSE for a listener created for one transfer when the pool ran out
+    int reserved;                   // Inherited while a transfer of the previous process still waits on it
+    int next_free;                  // Index of the next free slot, -1 at the end of the queue
+};
+
+/**
+ * Data ports of one worker, each already listening, so a PASV or PORT neither binds nor collides with
+ * anything. Slots are handed out in the order they were given back, so a late connection to a port
+ * that was just released is unlikely to reach the next transfer before it is discarded.
+ */
+struct port_pool {
+    struct port_pool_slot *slots;
+    int count;
+    int fixed;                      // The ports come from a configured range, so none is bound beyond it
+    int surrendered;                // The listeners were handed off to a new process, which owns the range now
+    int free_head;
+    int free_tail;
+    int free_count;
+};
+
+int port_pool_init(struct port_pool *pool, int first_port, int count,
+                   struct handoff_socket *inherited, int inherited_count);
+
+struct port_pool_slot *port_pool_acquire(struct port_pool *pool);
+
+void port_pool_release(struct port_pool *pool, struct port_pool_slot *slot);
+
+int port_pool_surrender(struct port_pool *pool, struct handoff_socket *sockets);
+
+void port_pool_reclaim(struct port_pool *pool);
+
+#endif
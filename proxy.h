@@ -0,0 +1,49 @@
+#ifndef FTP_PROXY_PROXY_H
+#define FTP_PROXY_PROXY_H
+
+#define TRUE 1
+#define FALSE 0
+#define BUFFSIZE 2048
+
+#include <stddef.h>
+
+/**
+ * Gets the structure containing the given member.
+ */
+#define container_of(ptr, type, member) ((type *) ((char *) (ptr) - offsetof(type, member)))
+
+struct cache;
+struct cache_io;
+struct listing_cache;
+struct metrics;
+struct port_pool;
+struct resolver;
+struct scheduler;
+struct session_list;
+struct upstream_set;
+
+/**
+ * Settings and state shared by every session of the proxy.
+ */
+struct proxy_config {
+    const char *server_address;     // Name of the upstream tree in cache and listing keys, the host of the first mirror
+    struct upstream_set *upstreams; // Mirrors serving that tree, each session connects to the best healthy one
+    int listen_port;                // Command port the proxy accepts clients on
+    struct resolver *resolver;      // Caches the address of the server
+    int proxy_address[4];           // Address advertised to peers in PORT and 227 replies
+    struct port_pool *data_ports;   // Listening data sockets of the worker, handed out per transfer
+    struct cache *cache;            // Index of the cached files
+    struct cache_io *cache_io;      // Writes cache files for the event loop
+    struct scheduler *scheduler;    // Shares the bandwidth of the worker among its transfers
+    struct session_list *sessions;  // Open sessions of the worker
+    int fetch_segments;             // Upstream sessions fetching a large cache miss at once, 1 to use only the client's
+    unsigned long long fetch_threshold;     // Smallest file fetched in segments
+    int cache_freshness;            // Seconds a cached file is served before the server is asked whether it changed
+    struct listing_cache *listings; // Directory listings answered without the server, NULL if disabled
+    struct metrics *metrics;        // Counters reported by the metrics endpoint
+    int idle_timeout;               // Seconds a client may stay silent between transfers, 0 for no limit
+    int connect_timeout;            // Seconds a data connection may take to be established, 0 for no limit
+    int stall_timeout;              // Seconds a transfer may go without moving a byte, 0 for no limit
+};
+
+#endif
@@ -0,0 +1,105 @@
+#include "range.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define RANGE_SET_INITIAL_CAPACITY 4
+
+/**
+ * Sets up an empty set. Storage is only allocated once the first range is added.
+ */
+void range_set_init(struct range_set *set) {
+    set->ranges = NULL;
+    set->count = 0;
+    set->capacity = 0;
+}
+
+/**
+ * Releases the storage of the set, leaving it empty.
+ */
+void range_set_free(struct range_set *set) {
+    free(set->ranges);
+    range_set_init(set);
+}
+
+/**
+ * Adds a range, merging it with the ranges it overlaps or touches.
+ * Returns 0 on success and -1 if the set could not grow.
+ */
+int range_set_add(struct range_set *set, off_t start, off_t end) {
+    if (start >= end) {
+        return 0;
+    }
+
+    // First range ending at or after the start, which is the first one the new range can merge with
+    size_t first = 0;
+    while (first < set->count && set->ranges[first].end < start) {
+        first += 1;
+    }
+
+    // One past the last range starting at or before the end
+    size_t last = first;
+    while (last < set->count && set->ranges[last].start <= end) {
+        last += 1;
+    }
+
+    if (first == last) {
+        // Nothing to merge with, so the range is inserted on its own
+        if (set->count == set->capacity) {
+            size_t capacity = set->capacity > 0 ? set->capacity * 2 : RANGE_SET_INITIAL_CAPACITY;
+            struct range *ranges = realloc(set->ranges, capacity * sizeof(struct range));
+            if (ranges == NULL) {
+                return -1;
+            }
+            set->ranges = ranges;
+            set->capacity = capacity;
+        }
+
+        memmove(&set->ranges[first + 1], &set->ranges[first], (set->count - first) * sizeof(struct range));
+        set->ranges[first].start = start;
+        set->ranges[first].end = end;
+        set->count += 1;
+        return 0;
+    }
+
+    if (set->ranges[first].start < start) {
+        start = set->ranges[first].start;
+    }
+    if (set->ranges[last - 1].end > end) {
+        end = set->ranges[last - 1].end;
+    }
+
+    set->ranges[first].start = start;
+    set->ranges[first].end = end;
+    memmove(&set->ranges[first + 1], &set->ranges[last], (set->count - last) * sizeof(struct range));
+    set->count -= last - first - 1;
+
+    return 0;
+}
+
+/**
+ * Returns the end of the bytes present without a gap from the offset, which is the offset itself
+ * if its byte is missing.
+ */
+off_t range_set_end_from(const struct range_set *set, off_t offset) {
+    for (size_t i = 0; i < set->count && set->ranges[i].start <= offset; i += 1) {
+        if (set->ranges[i].end > offset) {
+            return set->ranges[i].end;
+        }
+    }
+
+    return offset;
+}
+
+/**
+ * Returns the number of bytes in the set.
+ */
+off_t range_set_total(const struct range_set *set) {
+    off_t total = 0;
+
+    for (size_t i = 0; i < set->count; i += 1) {
+        total += set->ranges[i].end - set->ranges[i].start;
+    }
+
+    return total;
+}
@@ -0,0 +1,34 @@
+#ifndef FTP_PROXY_RANGE_H
+#define FTP_PROXY_RANGE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * Half-open byte range [start, end) of a file.
+ */
+struct range {
+    off_t start;
+    off_t end;
+};
+
+/**
+ * Sorted set of disjoint, non-adjacent byte ranges, such as the parts of a file present in the cache.
+ */
+struct range_set {
+    struct range *ranges;
+    size_t count;
+    size_t capacity;
+};
+
+void range_set_init(struct range_set *set);
+
+void range_set_free(struct range_set *set);
+
+int range_set_add(struct range_set *set, off_t start, off_t end);
+
+off_t range_set_end_from(const struct range_set *set, off_t offset);
+
+off_t range_set_total(const struct range_set *set);
+
+#endif
@@ -0,0 +1,148 @@
+#define _GNU_SOURCE
+
+#include "relay.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/**
+ * Creates a non-blocking pipe for splicing and enlarges it to RELAY_PIPE_SIZE where allowed.
+ * Returns 0 on success and -1 on failure.
+ */
+int relay_pipe_open(struct relay_pipe *relay_pipe) {
+    int fds[2];
+
+    if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+        relay_pipe->read_fd = -1;
+        relay_pipe->write_fd = -1;
+        return -1;
+    }
+
+    // Failing to grow the pipe only makes each splice move less data
+    fcntl(fds[1], F_SETPIPE_SZ, RELAY_PIPE_SIZE);
+
+    relay_pipe->read_fd = fds[0];
+    relay_pipe->write_fd = fds[1];
+
+    return 0;
+}
+
+/**
+ * Closes both ends of the pipe.
+ */
+void relay_pipe_close(struct relay_pipe *relay_pipe) {
+    if (relay_pipe->read_fd >= 0) {
+        close(relay_pipe->read_fd);
+        relay_pipe->read_fd = -1;
+    }
+    if (relay_pipe->write_fd >= 0) {
+        close(relay_pipe->write_fd);
+        relay_pipe->write_fd = -1;
+    }
+}
+
+/**
+ * Sets up an empty channel. Its pipe and ring are only created when first used.
+ */
+void relay_channel_init(struct relay_channel *channel) {
+    channel->pipe.read_fd = channel->pipe.write_fd = -1;
+    channel->pipe_pending = 0;
+    ring_init(&channel->ring, RELAY_RING_SIZE);
+    channel->paused = 0;
+    channel->sink_blocked = 0;
+    channel->source_ended = 0;
+    channel->ready = 0;
+}
+
+/**
+ * Drops whatever the channel still holds, so it can carry the next transfer.
+ */
+void relay_channel_reset(struct relay_channel *channel) {
+    if (channel->pipe_pending > 0) {
+        // There is no way to empty a pipe without reading it, so start over with a fresh one
+        relay_pipe_close(&channel->pipe);
+        channel->pipe_pending = 0;
+    }
+    ring_clear(&channel->ring);
+    channel->paused = 0;
+    channel->sink_blocked = 0;
+    channel->source_ended = 0;
+    channel->ready = 0;
+}
+
+/**
+ * Releases the pipe and the ring of the channel.
+ */
+void relay_channel_close(struct relay_channel *channel) {
+    relay_channel_reset(channel);
+    relay_pipe_close(&channel->pipe);
+    ring_free(&channel->ring);
+}
+
+/**
+ * Returns the number of bytes waiting for the sink.
+ */
+size_t relay_channel_pending(const struct relay_channel *channel) {
+    return channel->pipe_pending + ring_used(&channel->ring);
+}
+
+/**
+ * Splices one pipe-full of data from the source into the channel, which must be empty, or at most
+ * limit bytes.
+ * When tee_pipe is not NULL, the data is also duplicated into it with tee(), for the caller to drain;
+ * a failure there only sets *tee_error, after which the tee pipe may hold a partial copy, and never
+ * interrupts the relay.
+ * Returns the number of bytes received, 0 at end of stream, or -1 with errno set. EINVAL means splicing
+ * is not supported for these descriptors and nothing was consumed.
+ */
+ssize_t relay_splice(int from_fd, struct relay_channel *channel, size_t limit, struct relay_pipe *tee_pipe,
+                     int *tee_error) {
+    size_t length = limit < RELAY_PIPE_SIZE ? limit : RELAY_PIPE_SIZE;
+    ssize_t received = splice(from_fd, NULL, channel->pipe.write_fd, NULL, length, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+    if (received <= 0) {
+        return received;
+    }
+    channel->pipe_pending = received;
+
+    if (tee_pipe != NULL && !*tee_error) {
+        // Both pipes held nothing before, so a single tee() duplicates exactly the new data
+        ssize_t copied = tee(channel->pipe.read_fd, tee_pipe->write_fd, received, 0);
+        if (copied != received) {
+            *tee_error = 1;
+        }
+    }
+
+    return received;
+}
+
+/**
+ * Writes as much of the content of the channel into the sink as it accepts.
+ * Returns 0 once the channel is empty, or -1 with errno set. EAGAIN means the sink is full.
+ */
+int relay_flush(struct relay_channel *channel, int to_fd) {
+    while (channel->pipe_pending > 0) {
+        ssize_t moved = splice(channel->pipe.read_fd, NULL, to_fd, NULL, channel->pipe_pending,
+                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK | SPLICE_F_MORE);
+        if (moved < 0 && errno == EINTR) {
+            continue;
+        }
+        if (moved < 0) {
+            return -1;
+        }
+        channel->pipe_pending -= moved;
+    }
+
+    while (ring_used(&channel->ring) > 0) {
+        ssize_t written = ring_write_to(&channel->ring, to_fd);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,51 @@
+#ifndef FTP_PROXY_RELAY_H
+#define FTP_PROXY_RELAY_H
+
+#include <sys/types.h>
+
+#include "ring.h"
+
+#define RELAY_PIPE_SIZE (256 * 1024)
+#define RELAY_RING_SIZE (256 * 1024)        // Buffer of one direction with the buffered relay
+#define RELAY_RING_LOW (64 * 1024)          // A full ring is read into again once drained below this
+
+/**
+ * Kernel pipe used to move bytes between two descriptors without copying them through user space.
+ */
+struct relay_pipe {
+    int read_fd;
+    int write_fd;
+};
+
+/**
+ * One direction of a data connection. Bytes read from the source wait here until the sink accepts them,
+ * and the source is not read while the channel is full, so a slow sink holds back a fast source.
+ */
+struct relay_channel {
+    struct relay_pipe pipe;         // Bytes spliced from the source
+    size_t pipe_pending;            // Bytes in the pipe not written to the sink yet
+    struct ring ring;               // Bytes read from the source by the buffered relay
+    int paused;                     // The ring filled up and waits to drain below RELAY_RING_LOW
+    int sink_blocked;               // The sink is watched for EPOLLOUT
+    int source_ended;               // The source reached its end, the channel closes once drained
+    int ready;                      // Has bytes to move, or room for them, once the transfer gets its turn
+};
+
+int relay_pipe_open(struct relay_pipe *relay_pipe);
+
+void relay_pipe_close(struct relay_pipe *relay_pipe);
+
+void relay_channel_init(struct relay_channel *channel);
+
+void relay_channel_reset(struct relay_channel *channel);
+
+void relay_channel_close(struct relay_channel *channel);
+
+size_t relay_channel_pending(const struct relay_channel *channel);
+
+ssize_t relay_splice(int from_fd, struct relay_channel *channel, size_t limit, struct relay_pipe *tee_pipe,
+                     int *tee_error);
+
+int relay_flush(struct relay_channel *channel, int to_fd);
+
+#endif
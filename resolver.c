@@ -0,0 +1,129 @@
+#include "resolver.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netdb.h>
+#include <sys/socket.h>
+
+#include "log.h"
+#include "proxy.h"
+
+/**
+ * Resolves a host name into its first IPv4 address, waiting for the answer.
+ * Returns 0 on success and -1 if the name cannot be resolved.
+ */
+static int resolver_resolve(const char *host_name, struct in_addr *address) {
+    struct addrinfo hints;
+    struct addrinfo *result;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    int error = getaddrinfo(host_name, NULL, &hints, &result);
+    if (error != 0) {
+        log_warning("Cannot resolve %s: %s\n", host_name, gai_strerror(error));
+        return -1;
+    }
+
+    *address = ((struct sockaddr_in *) result->ai_addr)->sin_addr;
+    freeaddrinfo(result);
+
+    return 0;
+}
+
+/**
+ * Stores the outcome of a resolution into its entry. The caller holds the mutex.
+ */
+static void resolver_update(struct resolver_entry *entry, int result, struct in_addr address) {
+    if (result == 0) {
+        entry->address = address;
+        entry->valid = TRUE;
+        entry->expires = time(NULL) + RESOLVER_TTL;
+    } else {
+        // Keep using the previous address, if any, until the name resolves again
+        entry->expires = time(NULL) + RESOLVER_RETRY;
+    }
+}
+
+/**
+ * Resolver thread refreshing one expired entry.
+ */
+static void *resolver_refresh(void *data) {
+    struct resolver_entry *entry = data;
+    struct in_addr address;
+
+    int result = resolver_resolve(entry->host_name, &address);
+
+    pthread_mutex_lock(&entry->resolver->mutex);
+    resolver_update(entry, result, address);
+    entry->refreshing = FALSE;
+    pthread_mutex_unlock(&entry->resolver->mutex);
+
+    return NULL;
+}
+
+/**
+ * Sets up an empty resolver cache.
+ * Returns 0 on success and -1 on failure.
+ */
+int resolver_init(struct resolver *resolver) {
+    resolver->entries = NULL;
+
+    if (pthread_mutex_init(&resolver->mutex, NULL) != 0) {
+        perror("Error creating resolver mutex");
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Gets the address of a host name. The first lookup of a name waits for the answer, which is why the
+ * upstream server is looked up at startup; later ones return the cached address immediately and refresh
+ * it in the background once it expired.
+ * Returns 0 on success and -1 if the name has never been resolved.
+ */
+int resolver_lookup(struct resolver *resolver, const char *host_name, struct in_addr *address) {
+    pthread_mutex_lock(&resolver->mutex);
+
+    struct resolver_entry *entry = resolver->entries;
+    while (entry != NULL && strcmp(entry->host_name, host_name) != 0) {
+        entry = entry->next;
+    }
+
+    if (entry == NULL) {
+        entry = calloc(1, sizeof(struct resolver_entry));
+        if (entry == NULL || (entry->host_name = strdup(host_name)) == NULL) {
+            free(entry);
+            pthread_mutex_unlock(&resolver->mutex);
+            return -1;
+        }
+        entry->resolver = resolver;
+        entry->next = resolver->entries;
+        resolver->entries = entry;
+
+        struct in_addr resolved;
+        resolver_update(entry, resolver_resolve(host_name, &resolved), resolved);
+    } else if (!entry->refreshing && time(NULL) >= entry->expires) {
+        pthread_t thread;
+
+        entry->refreshing = TRUE;
+        if (pthread_create(&thread, NULL, resolver_refresh, entry) == 0) {
+            pthread_detach(thread);
+        } else {
+            entry->refreshing = FALSE;
+            entry->expires = time(NULL) + RESOLVER_RETRY;
+        }
+    }
+
+    int result = entry->valid ? 0 : -1;
+    if (entry->valid) {
+        *address = entry->address;
+    }
+
+    pthread_mutex_unlock(&resolver->mutex);
+
+    return result;
+}
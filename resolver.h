@@ -0,0 +1,36 @@
+#ifndef FTP_PROXY_RESOLVER_H
+#define FTP_PROXY_RESOLVER_H
+
+#include <pthread.h>
+#include <time.h>
+#include <netinet/in.h>
+
+#define RESOLVER_TTL 300            // Seconds an address is used before it is resolved again
+#define RESOLVER_RETRY 10           // Seconds before a failed resolution is retried
+
+/**
+ * Address of one host name. Once it expires it keeps being used while a thread resolves it again.
+ */
+struct resolver_entry {
+    struct resolver *resolver;
+    char *host_name;
+    struct in_addr address;
+    int valid;                      // The host name was resolved at least once
+    int refreshing;                 // A resolver thread is working on the entry
+    time_t expires;
+    struct resolver_entry *next;
+};
+
+/**
+ * Cache of resolved host names, so the event loop never waits for DNS after a name was first looked up.
+ */
+struct resolver {
+    pthread_mutex_t mutex;
+    struct resolver_entry *entries;
+};
+
+int resolver_init(struct resolver *resolver);
+
+int resolver_lookup(struct resolver *resolver, const char *host_name, struct in_addr *address);
+
+#endif
@@ -0,0 +1,164 @@
+#include "ring.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+/**
+ * Sets up an empty ring of the given capacity, which must be a power of two.
+ */
+void ring_init(struct ring *ring, size_t capacity) {
+    ring->data = NULL;
+    ring->capacity = capacity;
+    ring->head = 0;
+    ring->tail = 0;
+}
+
+/**
+ * Releases the storage of the ring, dropping its content.
+ */
+void ring_free(struct ring *ring) {
+    free(ring->data);
+    ring->data = NULL;
+    ring->head = 0;
+    ring->tail = 0;
+}
+
+/**
+ * Drops the content of the ring but keeps its storage.
+ */
+void ring_clear(struct ring *ring) {
+    ring->head = 0;
+    ring->tail = 0;
+}
+
+/**
+ * Returns the number of bytes buffered.
+ */
+size_t ring_used(const struct ring *ring) {
+    return ring->tail - ring->head;
+}
+
+/**
+ * Returns the number of bytes that can be buffered before the ring is full.
+ */
+size_t ring_space(const struct ring *ring) {
+    return ring->capacity - ring_used(ring);
+}
+
+/**
+ * Allocates the storage of the ring, or moves its content into a larger one.
+ * Returns 0 on success and -1 on failure.
+ */
+static int ring_reserve(struct ring *ring, size_t capacity) {
+    if (ring->data != NULL && capacity <= ring->capacity) {
+        return 0;
+    }
+
+    size_t new_capacity = ring->capacity;
+    while (new_capacity < capacity) {
+        new_capacity *= 2;
+    }
+
+    char *data = malloc(new_capacity);
+    if (data == NULL) {
+        return -1;
+    }
+
+    // Lay the content out from the start of the new storage
+    size_t used = ring_used(ring);
+    for (size_t copied = 0; copied < used;) {
+        size_t offset = (ring->head + copied) & (ring->capacity - 1);
+        size_t span = ring->capacity - offset < used - copied ? ring->capacity - offset : used - copied;
+
+        memcpy(data + copied, ring->data + offset, span);
+        copied += span;
+    }
+
+    free(ring->data);
+    ring->data = data;
+    ring->capacity = new_capacity;
+    ring->head = 0;
+    ring->tail = used;
+
+    return 0;
+}
+
+/**
+ * Buffers bytes at the end of the ring, growing it if they do not fit.
+ * Returns 0 on success and -1 if memory ran out.
+ */
+int ring_append(struct ring *ring, const char *data, size_t length) {
+    if (ring_reserve(ring, ring_used(ring) + length) < 0) {
+        return -1;
+    }
+
+    while (length > 0) {
+        size_t offset = ring->tail & (ring->capacity - 1);
+        size_t span = ring->capacity - offset < length ? ring->capacity - offset : length;
+
+        memcpy(ring->data + offset, data, span);
+        ring->tail += span;
+        data += span;
+        length -= span;
+    }
+
+    return 0;
+}
+
+/**
+ * Reads at most limit bytes from a descriptor into the free space of the ring, without growing it.
+ * The bytes read are contiguous and *received points to them.
+ * Returns the number of bytes read, 0 at end of stream, or -1 with errno set.
+ */
+ssize_t ring_read_from(struct ring *ring, int fd, size_t limit, const char **received) {
+    if (ring_reserve(ring, ring->capacity) < 0) {
+        return -1;
+    }
+
+    if (ring_used(ring) == 0) {
+        // Start over at the beginning, so a whole read fits in one span
+        ring_clear(ring);
+    }
+
+    size_t offset = ring->tail & (ring->capacity - 1);
+    size_t span = ring->capacity - offset < ring_space(ring) ? ring->capacity - offset : ring_space(ring);
+    if (span > limit) {
+        span = limit;
+    }
+
+    ssize_t read_size = read(fd, ring->data + offset, span);
+    if (read_size > 0) {
+        *received = ring->data + offset;
+        ring->tail += read_size;
+    }
+
+    return read_size;
+}
+
+/**
+ * Writes as much of the content of the ring into a descriptor as it accepts.
+ * Returns the number of bytes written, or -1 with errno set.
+ */
+ssize_t ring_write_to(struct ring *ring, int fd) {
+    size_t used = ring_used(ring);
+    size_t offset = ring->head & (ring->capacity - 1);
+    struct iovec iov[2];
+    int iov_count = 1;
+
+    iov[0].iov_base = ring->data + offset;
+    iov[0].iov_len = ring->capacity - offset < used ? ring->capacity - offset : used;
+    if (iov[0].iov_len < used) {
+        iov[1].iov_base = ring->data;
+        iov[1].iov_len = used - iov[0].iov_len;
+        iov_count = 2;
+    }
+
+    ssize_t write_size = writev(fd, iov, iov_count);
+    if (write_size > 0) {
+        ring->head += write_size;
+    }
+
+    return write_size;
+}
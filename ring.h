@@ -0,0 +1,34 @@
+#ifndef FTP_PROXY_RING_H
+#define FTP_PROXY_RING_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * Byte ring buffer holding what was read from one socket until another one accepts it.
+ * The storage is only allocated once the first byte is buffered.
+ */
+struct ring {
+    char *data;
+    size_t capacity;                // Always a power of two
+    size_t head;                    // Total number of bytes taken out
+    size_t tail;                    // Total number of bytes put in
+};
+
+void ring_init(struct ring *ring, size_t capacity);
+
+void ring_free(struct ring *ring);
+
+void ring_clear(struct ring *ring);
+
+size_t ring_used(const struct ring *ring);
+
+size_t ring_space(const struct ring *ring);
+
+int ring_append(struct ring *ring, const char *data, size_t length);
+
+ssize_t ring_read_from(struct ring *ring, int fd, size_t limit, const char **received);
+
+ssize_t ring_write_to(struct ring *ring, int fd);
+
+#endif
@@ -0,0 +1,225 @@
+#include "scheduler.h"
+
+#include <string.h>
+
+#include "proxy.h"
+
+static void scheduler_run_round(struct event_task *task);
+
+/**
+ * Starts with a quantum of the default size and no rules, so every session has weight 1 and no cap.
+ */
+void scheduler_policy_init(struct scheduler_policy *policy) {
+    policy->quantum = SCHEDULER_DEFAULT_QUANTUM;
+    policy->rule_count = 0;
+}
+
+/**
+ * Gets the rule of a user, adding an empty one if the user has none yet. The user name is kept as it
+ * is, so it has to outlive the policy.
+ * Returns the rule, or NULL if there is no room for another one.
+ */
+struct scheduler_rule *scheduler_policy_rule(struct scheduler_policy *policy, const char *user) {
+    for (int i = 0; i < policy->rule_count; i += 1) {
+        if (strcmp(policy->rules[i].user, user) == 0) {
+            return &policy->rules[i];
+        }
+    }
+
+    if (policy->rule_count == SCHEDULER_MAX_RULES) {
+        return NULL;
+    }
+
+    struct scheduler_rule *rule = &policy->rules[policy->rule_count++];
+    rule->user = user;
+    rule->weight = 0;
+    rule->rate = 0;
+    return rule;
+}
+
+/**
+ * Starts a scheduler with an empty queue for the transfers of the loop.
+ */
+void scheduler_init(struct scheduler *scheduler, struct event_loop *loop, const struct scheduler_policy *policy) {
+    scheduler->loop = loop;
+    scheduler->policy = policy;
+    scheduler->queue.prev = scheduler->queue.next = &scheduler->queue;
+    scheduler->running = NULL;
+    scheduler->round_task.run = scheduler_run_round;
+}
+
+/**
+ * Called once the rate cap of a throttled flow allows it to move bytes again.
+ */
+static void scheduler_handle_refill(struct wheel_timer *timer) {
+    struct scheduler_flow *flow = container_of(timer, struct scheduler_flow, timer);
+
+    scheduler_wake(flow);
+}
+
+/**
+ * Prepares a flow of weight 1 without a cap, which is not queued until it is woken up.
+ */
+void scheduler_flow_init(struct scheduler *scheduler, struct scheduler_flow *flow,
+                         size_t (*run)(struct scheduler_flow *flow, size_t budget)) {
+    flow->run = run;
+    flow->scheduler = scheduler;
+    flow->prev = flow->next = NULL;
+    flow->weight = 1;
+    flow->rate = 0;
+    flow->deficit = 0;
+    flow->tokens = 0;
+    flow->refilled = event_loop_now(scheduler->loop);
+    flow->timer.expire = scheduler_handle_refill;
+}
+
+/**
+ * Gives the flow the weight and rate cap of the user's rule, or of the "*" rule for what the user's
+ * one does not set.
+ */
+void scheduler_flow_set_user(struct scheduler_flow *flow, const char *user) {
+    const struct scheduler_policy *policy = flow->scheduler->policy;
+    unsigned int weight = 0;
+    unsigned long long rate = 0;
+
+    for (int pass = 0; pass < 2; pass += 1) {
+        for (int i = 0; i < policy->rule_count; i += 1) {
+            const struct scheduler_rule *rule = &policy->rules[i];
+
+            if (strcmp(rule->user, pass == 0 ? user : "*") == 0) {
+                weight = weight == 0 ? rule->weight : weight;
+                rate = rate == 0 ? rule->rate : rate;
+            }
+        }
+    }
+
+    flow->weight = weight == 0 ? 1 : weight;
+    flow->rate = rate;
+    flow->tokens = 0;
+    flow->refilled = event_loop_now(flow->scheduler->loop);
+}
+
+/**
+ * Queues the flow for its next turn, unless it is queued already or waits for its rate cap. A flow
+ * woken during a round gets its turn in the next one, after the loop polled its sockets again.
+ */
+void scheduler_wake(struct scheduler_flow *flow) {
+    struct scheduler *scheduler = flow->scheduler;
+
+    if (flow->prev != NULL || event_loop_armed(&flow->timer)) {
+        return;
+    }
+
+    flow->prev = scheduler->queue.prev;
+    flow->next = &scheduler->queue;
+    scheduler->queue.prev->next = flow;
+    scheduler->queue.prev = flow;
+    event_loop_post(scheduler->loop, &scheduler->round_task);
+}
+
+/**
+ * Takes the flow out of the queue and stops waiting for its rate cap, as it has nothing to move anymore.
+ */
+void scheduler_remove(struct scheduler_flow *flow) {
+    if (flow->scheduler->running == flow) {
+        flow->scheduler->running = NULL;
+    }
+    if (flow->prev != NULL) {
+        flow->prev->next = flow->next;
+        flow->next->prev = flow->prev;
+        flow->prev = flow->next = NULL;
+    }
+    event_loop_disarm(flow->scheduler->loop, &flow->timer);
+    flow->deficit = 0;
+}
+
+/**
+ * Adds what the rate cap allowed since the last refill, up to a burst of 100 ms or a quantum,
+ * whichever is larger.
+ * Returns the depth of the bucket.
+ */
+static long long scheduler_refill(struct scheduler_flow *flow, long long quantum) {
+    unsigned long long now = event_loop_now(flow->scheduler->loop);
+    long long depth = (long long) (flow->rate / 10) > quantum ? (long long) (flow->rate / 10) : quantum;
+
+    flow->tokens += (long long) (flow->rate * (now - flow->refilled) / 1000);
+    if (flow->tokens > depth) {
+        flow->tokens = depth;
+    }
+    flow->refilled = now;
+
+    return depth;
+}
+
+/**
+ * Gives every flow queued when the round started one turn, adding a quantum per weight to its
+ * deficit. A flow that used its whole budget probably has more to move and is queued for the next
+ * round, while one that stopped short waits until its sockets are ready again, without keeping its
+ * credit.
+ */
+static void scheduler_run_round(struct event_task *task) {
+    struct scheduler *scheduler = container_of(task, struct scheduler, round_task);
+    struct scheduler_flow round;
+
+    if (scheduler->queue.next == &scheduler->queue) {
+        return;
+    }
+
+    // Flows woken during the round are queued behind it
+    round.next = scheduler->queue.next;
+    round.prev = scheduler->queue.prev;
+    round.next->prev = &round;
+    round.prev->next = &round;
+    scheduler->queue.prev = scheduler->queue.next = &scheduler->queue;
+
+    while (round.next != &round) {
+        struct scheduler_flow *flow = round.next;
+        long long quantum = (long long) (scheduler->policy->quantum * flow->weight);
+
+        flow->prev->next = flow->next;
+        flow->next->prev = flow->prev;
+        flow->prev = flow->next = NULL;
+
+        // Credit a flow could not spend, as its rate cap held it back, carries over to its next turn,
+        // though never more than a turn's worth of it
+        flow->deficit += quantum;
+        if (flow->deficit > 2 * quantum) {
+            flow->deficit = 2 * quantum;
+        }
+        if (flow->deficit <= 0) {
+            // Still paying off an overshoot, it moves again in a later round
+            scheduler_wake(flow);
+            continue;
+        }
+
+        long long budget = flow->deficit;
+        if (flow->rate > 0) {
+            long long depth = scheduler_refill(flow, quantum);
+            if (flow->tokens <= 0) {
+                long long wanted = quantum < depth ? quantum : depth;
+                event_loop_arm(scheduler->loop, &flow->timer,
+                               (unsigned long long) ((wanted - flow->tokens) * 1000 / (long long) flow->rate) + 1);
+                continue;
+            }
+            budget = budget < flow->tokens ? budget : flow->tokens;
+        }
+
+        scheduler->running = flow;
+        size_t moved = flow->run(flow, (size_t) budget);
+        if (scheduler->running == NULL) {
+            // The transfer ended during its turn
+            continue;
+        }
+        scheduler->running = NULL;
+
+        flow->deficit -= (long long) moved;
+        if (flow->rate > 0) {
+            flow->tokens -= (long long) moved;
+        }
+        if ((long long) moved >= budget) {
+            scheduler_wake(flow);
+        } else if (flow->prev == NULL) {
+            flow->deficit = 0;
+        }
+    }
+}
@@ -0,0 +1,80 @@
+#ifndef FTP_PROXY_SCHEDULER_H
+#define FTP_PROXY_SCHEDULER_H
+
+#include <stddef.h>
+
+#include "event_loop.h"
+
+#define SCHEDULER_DEFAULT_QUANTUM (256 * 1024)  // Bytes a transfer of weight 1 moves per turn, a pipe-full
+#define SCHEDULER_MAX_QUANTUM (16 * 1024 * 1024)
+#define SCHEDULER_MAX_RULES 32
+#define SCHEDULER_MAX_WEIGHT 64
+
+/**
+ * Share of the bandwidth given to the sessions of a user, or of every user without a rule of their
+ * own when the user is "*".
+ */
+struct scheduler_rule {
+    const char *user;
+    unsigned int weight;            // Quanta per turn, 0 if the rule does not set it
+    unsigned long long rate;        // Bytes per second a session may move, 0 if the rule does not set it
+};
+
+/**
+ * Settings shared by the schedulers of every worker.
+ */
+struct scheduler_policy {
+    size_t quantum;
+    struct scheduler_rule rules[SCHEDULER_MAX_RULES];
+    int rule_count;
+};
+
+struct scheduler;
+
+/**
+ * Transfer taking turns in a scheduler. It is queued while it has bytes to move and did not get its
+ * turn yet, or waits for its timer while its rate cap is used up.
+ */
+struct scheduler_flow {
+    size_t (*run)(struct scheduler_flow *flow, size_t budget);  // Moves up to about budget bytes, returns how many
+    struct scheduler *scheduler;
+    struct scheduler_flow *prev;    // Neighbours in the queue, NULL while not queued
+    struct scheduler_flow *next;
+    unsigned int weight;
+    unsigned long long rate;        // Bytes per second, 0 for no cap
+    long long deficit;              // Bytes the flow may still move, negative after it overshot its budget
+    long long tokens;               // Bytes the rate cap allows right now
+    unsigned long long refilled;    // When tokens were last added, in loop milliseconds
+    struct wheel_timer timer;       // Queues the flow again once its rate cap allows it to move bytes
+};
+
+/**
+ * Deficit round-robin over the transfers of one worker. Each turn, a queued flow is granted its
+ * weight in quanta and moves at most that many bytes, so a fast transfer never holds the loop for
+ * long. A round runs as a task after the events of the loop were handled, and the next round only
+ * after the loop polled again, so command connections are served before any bulk data.
+ */
+struct scheduler {
+    struct event_loop *loop;
+    const struct scheduler_policy *policy;
+    struct scheduler_flow queue;    // Sentinel of the flows waiting for their turn
+    struct scheduler_flow *running; // Flow taking its turn, NULL once it was removed during it
+    struct event_task round_task;
+};
+
+void scheduler_policy_init(struct scheduler_policy *policy);
+
+struct scheduler_rule *scheduler_policy_rule(struct scheduler_policy *policy, const char *user);
+
+void scheduler_init(struct scheduler *scheduler, struct event_loop *loop, const struct scheduler_policy *policy);
+
+void scheduler_flow_init(struct scheduler *scheduler, struct scheduler_flow *flow,
+                         size_t (*run)(struct scheduler_flow *flow, size_t budget));
+
+void scheduler_flow_set_user(struct scheduler_flow *flow, const char *user);
+
+void scheduler_wake(struct scheduler_flow *flow);
+
+void scheduler_remove(struct scheduler_flow *flow);
+
+#endif
@@ -0,0 +1,1484 @@
+#include "session.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "cache.h"
+#include "cache_writer.h"
+#include "control.h"
+#include "fetch.h"
+#include "hot_cache.h"
+#include "listing.h"
+#include "log.h"
+#include "metrics.h"
+#include "net.h"
+#include "port_pool.h"
+#include "transfer.h"
+
+static void session_resume_commands(struct event_task *task);
+
+/**
+ * Registers a socket of the session with the event loop.
+ * Returns 0 on success and -1 on failure.
+ */
+int session_watch(struct session *session, int socket_fd) {
+    set_nonblocking(socket_fd);
+
+    return event_loop_add(session->loop, socket_fd, SESSION_EVENTS, session_handle_event, session);
+}
+
+/**
+ * Starts connecting a new socket of the session to the given address. The socket is watched for
+ * EPOLLOUT, which tells when the connection was established or failed.
+ * Returns the socket, or -1 on failure.
+ */
+int session_connect(struct session *session, struct sockaddr_in address) {
+    int socket_fd = start_connection(address);
+    if (socket_fd < 0) {
+        return -1;
+    }
+
+    if (event_loop_add(session->loop, socket_fd, SESSION_EVENTS | EPOLLOUT, session_handle_event, session) < 0) {
+        close(socket_fd);
+        return -1;
+    }
+
+    return socket_fd;
+}
+
+/**
+ * Starts connecting a new socket of the session to the given port of its mirror.
+ * Returns the socket, or -1 on failure.
+ */
+int session_connect_server(struct session *session, int port) {
+    struct sockaddr_in address;
+
+    bzero((char *) &address, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+
+    if (upstream_lookup(session->upstream, &address.sin_addr) < 0) {
+        return -1;
+    }
+
+    return session_connect(session, address);
+}
+
+/**
+ * Starts connecting the command connection to the best mirror the session did not try yet, moving on
+ * to the next one while connecting fails right away.
+ * Returns 0 on success and -1 once every mirror was tried.
+ */
+static int session_connect_upstream(struct session *session) {
+    while (TRUE) {
+        if (session->upstream != NULL) {
+            upstream_release(session->upstream);
+        }
+        session->upstream = upstream_choose(session->config->upstreams, session->upstreams_tried);
+        if (session->upstream == NULL) {
+            return -1;
+        }
+        session->upstreams_tried |= 1u << session->upstream->index;
+        log_debug("Connecting to upstream %s:%d\n", session->upstream->host, session->upstream->port);
+
+        session->server_connect_started = metrics_now();
+        session->server_command_socket = session_connect_server(session, session->upstream->port);
+        if (session->server_command_socket >= 0) {
+            session->server_connecting = TRUE;
+            return 0;
+        }
+        upstream_record_failure(session->upstream);
+    }
+}
+
+/**
+ * Unregisters and closes a socket of the session, then marks it as unused.
+ */
+void session_close_socket(struct session *session, int *socket_fd) {
+    if (*socket_fd >= 0) {
+        event_loop_remove(session->loop, *socket_fd);
+        close(*socket_fd);
+        *socket_fd = -1;
+    }
+}
+
+/**
+ * Writes the buffered output of a command connection into its socket, and watches the socket for
+ * EPOLLOUT while the socket does not accept all of it.
+ */
+static void session_flush(struct session *session, int to_client) {
+    int socket_fd = to_client ? session->client_command_socket : session->server_command_socket;
+    struct ring *output = to_client ? &session->client_output : &session->server_output;
+    int *blocked = to_client ? &session->client_output_blocked : &session->server_output_blocked;
+
+    if (socket_fd < 0 || (!to_client && session->server_connecting)) {
+        return;
+    }
+
+    while (ring_used(output) > 0) {
+        ssize_t written = ring_write_to(output, socket_fd);
+
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (!*blocked) {
+                *blocked = TRUE;
+                event_loop_modify(session->loop, socket_fd, SESSION_EVENTS | EPOLLOUT);
+            }
+            return;
+        }
+        if (written < 0) {
+            // The peer is gone, which the next read notices
+            ring_clear(output);
+            break;
+        }
+    }
+
+    if (*blocked) {
+        *blocked = FALSE;
+        event_loop_modify(session->loop, socket_fd, SESSION_EVENTS);
+    }
+}
+
+/**
+ * Buffers a command for the server or a reply for the client, to be written by the next flush.
+ */
+static void session_queue(struct session *session, int to_client, const char *buffer) {
+    struct ring *output = to_client ? &session->client_output : &session->server_output;
+
+    log_debug(to_client ? "Send to client: %s" : "Send to server: %s", buffer);
+
+    if (ring_append(output, buffer, strlen(buffer)) < 0) {
+        perror("Error buffering command");
+    }
+}
+
+/**
+ * Sends a command to the server or a reply to the client. Whatever the socket does not accept
+ * right away is buffered and written once it drains.
+ */
+void session_send(struct session *session, int to_client, const char *buffer) {
+    session_queue(session, to_client, buffer);
+    session_flush(session, to_client);
+}
+
+/**
+ * Stops streaming a cache entry filled by another transfer.
+ */
+static void session_stop_following(struct session *session) {
+    if (session->cache_follow_entry != NULL) {
+        cache_cancel_wait(session->cache_follow_entry, &session->cache_waiter);
+        event_loop_cancel(session->loop, &session->wake_task);
+        cache_release(session->cache_follow_entry);
+        session->cache_follow_entry = NULL;
+    }
+}
+
+/**
+ * Closes both sockets of the current data transfer and the cache file it was sending.
+ */
+void session_close_data_sockets(struct session *session) {
+    session_close_socket(session, &session->income_data_socket);
+    session_close_socket(session, &session->outcome_data_socket);
+    session->data_connecting = FALSE;
+    relay_channel_reset(&session->income_channel);
+    relay_channel_reset(&session->outcome_channel);
+
+    if (session->cache_send_fd >= 0) {
+        close(session->cache_send_fd);
+        session->cache_send_fd = -1;
+    }
+    if (session->cache_send_hot != NULL) {
+        hot_cache_put(session->config->cache->hot, session->cache_send_hot);
+        session->cache_send_hot = NULL;
+    }
+    session->cache_send_prefix = FALSE;
+    session->cache_send_blocked = FALSE;
+    scheduler_remove(&session->flow);
+
+    session_stop_following(session);
+}
+
+/**
+ * Called when the client may have stayed silent for longer than the idle timeout. A session whose
+ * transfer is still running is kept, and the silence is counted from its last step; otherwise the
+ * client is told and the session is closed.
+ */
+static void session_handle_idle_timeout(struct wheel_timer *timer) {
+    struct session *session = container_of(timer, struct session, idle_timer);
+    unsigned long long timeout = session->config->idle_timeout * 1000ULL;
+    unsigned long long now = event_loop_now(session->loop);
+
+    if (session->income_data_socket >= 0 || session->outcome_data_socket >= 0 || session->data_connecting
+        || transfer_sending_cache(session)) {
+        event_loop_arm(session->loop, timer, timeout);
+        return;
+    }
+
+    unsigned long long last = session->last_command > session->data_activity ? session->last_command
+                                                                              : session->data_activity;
+    if (now < last + timeout) {
+        event_loop_arm(session->loop, timer, last + timeout - now);
+        return;
+    }
+
+    log_info("Closing session of %s, idle for %d seconds\n", inet_ntoa(session->client_address),
+             session->config->idle_timeout);
+    session_send(session, TRUE, "421 Timeout.\r\n");
+    session_close(session);
+}
+
+/**
+ * Creates a session for a newly accepted client command connection and connects it to the server.
+ * The session owns the client socket from now on, and closes it when it cannot be set up.
+ * Returns the session, or NULL if it could not be set up.
+ */
+struct session *session_create(struct event_loop *loop, const struct proxy_config *config,
+                               int client_command_socket, const struct sockaddr_in *client) {
+    struct session *session = calloc(1, sizeof(struct session));
+    if (session == NULL) {
+        perror("Error allocating session");
+        close(client_command_socket);
+        return NULL;
+    }
+
+    session->loop = loop;
+    session->config = config;
+    session->client_command_socket = -1;
+    session->server_command_socket = -1;
+    session->proxy_data_socket = -1;
+    session->income_data_socket = -1;
+    session->outcome_data_socket = -1;
+    session->cache_send_fd = -1;
+    session->remote_size = -1;
+    snprintf(session->cache_upstream, sizeof(session->cache_upstream), "%s", config->server_address);
+    session->splice_supported = TRUE;
+    scheduler_flow_init(config->scheduler, &session->flow, transfer_take_turn);
+    relay_channel_init(&session->income_channel);
+    relay_channel_init(&session->outcome_channel);
+    session->cache_pipe.read_fd = session->cache_pipe.write_fd = -1;
+    ring_init(&session->client_output, SESSION_OUTPUT_SIZE);
+    ring_init(&session->server_output, SESSION_OUTPUT_SIZE);
+    control_parser_init(&session->client_parser);
+    control_parser_init(&session->server_parser);
+    session->cache_waiter.wake = transfer_wake_follower;
+    session->wake_task.run = transfer_resume_follower;
+    session->resume_task.run = session_resume_commands;
+    session->idle_timer.expire = session_handle_idle_timeout;
+    session->data_timer.expire = transfer_handle_timeout;
+    session->client_address = client->sin_addr;
+
+    if (session_watch(session, client_command_socket) < 0) {
+        close(client_command_socket);
+        free(session);
+        return NULL;
+    }
+    session->client_command_socket = client_command_socket;
+    metrics_open_session(config->metrics, &session->metrics, client->sin_addr);
+
+    struct session_list *sessions = config->sessions;
+    session->next = sessions->head;
+    if (sessions->head != NULL) {
+        sessions->head->prev = session;
+    }
+    sessions->head = session;
+    __atomic_add_fetch(&sessions->count, 1, __ATOMIC_RELAXED);
+
+    // Client commands wait in their socket until the connection to the server is established
+    if (session_connect_upstream(session) < 0) {
+        session_send(session, TRUE, "421 Service not available, cannot reach the server.\r\n");
+        session_close(session);
+        return NULL;
+    }
+
+    session->last_command = event_loop_now(loop);
+    if (config->idle_timeout > 0) {
+        event_loop_arm(loop, &session->idle_timer, config->idle_timeout * 1000ULL);
+    }
+
+    return session;
+}
+
+/**
+ * Closes every socket of the session and releases it.
+ */
+void session_close(struct session *session) {
+    event_loop_cancel(session->loop, &session->resume_task);
+    event_loop_disarm(session->loop, &session->idle_timer);
+    event_loop_disarm(session->loop, &session->data_timer);
+    session_close_data_sockets(session);
+    session_end_fill(session, FALSE);
+    session_end_listing(session, FALSE);
+    session_release_data_listener(session);
+    session_close_socket(session, &session->server_command_socket);
+    session_close_socket(session, &session->client_command_socket);
+    relay_channel_close(&session->income_channel);
+    relay_channel_close(&session->outcome_channel);
+    relay_pipe_close(&session->cache_pipe);
+    if (session->upstream != NULL) {
+        upstream_release(session->upstream);
+    }
+    ring_free(&session->client_output);
+    ring_free(&session->server_output);
+
+    log_info("Session of %s closed after %llu bytes downloaded, %llu uploaded and %llu sent from the cache\n",
+             inet_ntoa(session->client_address), session->metrics.bytes_downloaded, session->metrics.bytes_uploaded,
+             session->metrics.bytes_from_cache);
+    metrics_close_session(session->config->metrics, &session->metrics);
+
+    struct session_list *sessions = session->config->sessions;
+    if (session->prev != NULL) {
+        session->prev->next = session->next;
+    } else {
+        sessions->head = session->next;
+    }
+    if (session->next != NULL) {
+        session->next->prev = session->prev;
+    }
+    __atomic_sub_fetch(&sessions->count, 1, __ATOMIC_RELAXED);
+
+    free(session);
+}
+
+/**
+ * Tells whether a session is between commands: every command was answered, no data connection is
+ * set up or running and no cache fill is finishing.
+ * Returns TRUE if closing the session loses nothing but its control connection.
+ */
+static int session_idle(struct session *session) {
+    return session->pending_count == 0 && !session->client_blocked && !session->probe_pending &&
+           session->proxy_data_slot == NULL && session->income_data_socket < 0 && session->outcome_data_socket < 0 &&
+           !session->data_connecting && !transfer_sending_cache(session) && session->cache_writer == NULL &&
+           ring_used(&session->client_output) == 0;
+}
+
+/**
+ * Closes the sessions of a worker that are idle, while the proxy hands off to a new process. The
+ * others finish their transfer first and are closed by a later call; their clients log in again on
+ * the new process.
+ */
+void session_drain(struct session_list *sessions) {
+    struct session *session = sessions->head;
+
+    while (session != NULL) {
+        struct session *next = session->next;
+
+        if (session_idle(session)) {
+            log_info("Closing idle session of %s for the restart\n", inet_ntoa(session->client_address));
+            session_send(session, TRUE, "421 Service restarting, please reconnect.\r\n");
+            session_close(session);
+        }
+        session = next;
+    }
+}
+
+/**
+ * Gives the listening data socket of the session back to the pool of the worker.
+ */
+void session_release_data_listener(struct session *session) {
+    if (session->proxy_data_slot == NULL) {
+        return;
+    }
+
+    event_loop_remove(session->loop, session->proxy_data_socket);
+    port_pool_release(session->config->data_ports, session->proxy_data_slot);
+    session->proxy_data_slot = NULL;
+    session->proxy_data_socket = -1;
+}
+
+/**
+ * Replaces the listening data socket of the session with a free one of the pool, already bound on a
+ * port no client or server chose, so a transfer neither binds a socket nor collides with another.
+ * Returns the port, or -1 if no data port is available.
+ */
+static int session_listen_for_data(struct session *session) {
+    session_release_data_listener(session);
+
+    struct port_pool_slot *slot = port_pool_acquire(session->config->data_ports);
+    if (slot == NULL) {
+        log_warning("No data port available\n");
+        return -1;
+    }
+
+    if (session_watch(session, slot->socket_fd) < 0) {
+        port_pool_release(session->config->data_ports, slot);
+        return -1;
+    }
+    session->proxy_data_slot = slot;
+    session->proxy_data_socket = slot->socket_fd;
+    log_debug("Listening for data connection on port %d...\n", slot->port);
+
+    return slot->port;
+}
+
+/**
+ * Starts filling a cache entry with the current transfer from the offset, unless another transfer is
+ * filling it already. A partial entry is filled from its first byte missing from the offset on, unless
+ * the transfer replaces its content.
+ */
+static void session_begin_fill(struct session *session, off_t offset, int replace) {
+    struct cache *cache = session->config->cache;
+
+    session->cache_fill_entry = cache_begin_fill(cache, session->cache_key, session->cache_upstream, offset, replace);
+    session->cache_fill_eof = FALSE;
+    session->cache_fill_reply = FALSE;
+
+    if (session->cache_fill_entry == NULL) {
+        return;
+    }
+
+    // Created right away, so transfers joining the fill can open it
+    snprintf(session->cache_file_path, sizeof(session->cache_file_path), "%s", session->cache_fill_entry->path);
+    session->cache_writer = cache_writer_open(session->config->cache_io, session->cache_fill_entry);
+    if (session->cache_writer == NULL) {
+        cache_remove(cache, session->cache_fill_entry);
+        session->cache_fill_entry = NULL;
+    }
+}
+
+/**
+ * Ends the fill of the current cache entry. A successful fill only becomes a hit once the data
+ * connection reached its end and the server confirmed the transfer, and its last buffers are written;
+ * a failed download keeps the bytes it received as a segment, and a failed upload is dropped.
+ */
+void session_end_fill(struct session *session, int success) {
+    struct cache_writer *writer = session->cache_writer;
+
+    if (writer == NULL || (success && !(session->cache_fill_eof && session->cache_fill_reply))) {
+        return;
+    }
+
+    session->cache_writer = NULL;
+    session->cache_fill_entry = NULL;
+
+    if (success) {
+        cache_writer_finish(writer);
+    } else if (session->file_transfer_mode == 0) {
+        // The bytes received so far are what the server holds, so a resumed download can use them
+        log_info("Keeping incomplete cache file for %s\n", writer->entry->key);
+        cache_writer_abort(writer, TRUE);
+    } else {
+        // The server may have stored fewer bytes of a failed upload than the proxy relayed
+        log_info("Discarding incomplete cache file for %s\n", writer->entry->key);
+        cache_writer_abort(writer, FALSE);
+    }
+}
+
+/**
+ * Ends capturing the listing of the current transfer. Like a cache fill, it is only cached once
+ * the data connection reached its end and the server confirmed the transfer.
+ */
+void session_end_listing(struct session *session, int success) {
+    const struct proxy_config *config = session->config;
+
+    if (!session->listing_capturing || (success && !(session->cache_fill_eof && session->cache_fill_reply))) {
+        return;
+    }
+
+    session->listing_capturing = FALSE;
+    if (success) {
+        listing_cache_store(config->listings, session->listing_key, config->server_address,
+                            session->listing_directory, &session->listing_buffer);
+    }
+    listing_buffer_reset(&session->listing_buffer);
+}
+
+/**
+ * Answers the transfer command forwarded last with a failure of the proxy, as its data connection
+ * could not be set up, and drops the reply the server sends for it later, so the client gets a single
+ * final reply. Nothing is sent if the server's reply was relayed already.
+ */
+void session_abandon_transfer(struct session *session, const char *response) {
+    const struct proxy_config *config = session->config;
+
+    for (int i = session->pending_count - 1; i >= 0; i -= 1) {
+        int index = (session->pending_head + i) % SESSION_PIPELINE_DEPTH;
+
+        if (session->pending[index] == SESSION_PENDING_TRANSFER) {
+            session->pending[index] = SESSION_PENDING_ABANDONED;
+
+            // An upload may have reached the server in part
+            if (session->upload_pending && config->listings != NULL) {
+                listing_cache_invalidate(config->listings, config->server_address, session->upload_directory);
+            }
+            session->upload_pending = FALSE;
+
+            session_send(session, TRUE, response);
+            return;
+        }
+    }
+
+    log_debug("The server answered the transfer already\n");
+}
+
+/**
+ * Drops the cached listings showing the directory holding the path a command changes, or the working
+ * directory if the command names no path. The directory is stored into the buffer of PATH_MAX bytes.
+ */
+static void session_invalidate_listings(struct session *session, const char *path, char *directory) {
+    const struct proxy_config *config = session->config;
+    char changed[PATH_MAX];
+
+    if (path[0] == '\0') {
+        listing_join_path(session->directory, "", directory, PATH_MAX);
+    } else {
+        listing_join_path(session->directory, path, changed, sizeof(changed));
+        listing_parent_path(changed, directory, PATH_MAX);
+    }
+
+    if (config->listings != NULL) {
+        listing_cache_invalidate(config->listings, config->server_address, directory);
+    }
+}
+
+/**
+ * Takes the file name argument of a RETR or STOR command, whose cache key is its path on the server,
+ * so the same name in another directory is another file.
+ */
+static void session_name_transfer(struct session *session, const char *filename) {
+    snprintf(session->transfer_name, sizeof(session->transfer_name), "%s", filename);
+    listing_join_path(session->directory, session->transfer_name, session->cache_key, sizeof(session->cache_key));
+}
+
+/**
+ * Decides whether the transfer is served from or saved into the cache. A download missing the cache
+ * only starts filling it when fill is set.
+ */
+static void session_prepare_cache(struct session *session, int fill) {
+    struct cache *cache = session->config->cache;
+
+    // A fill the client gave up on without a final reply can no longer be trusted
+    session_end_fill(session, FALSE);
+
+    session->cache_hit = 0;
+    session->cache_file_size = -1;
+
+    if (session->file_transfer_mode == 0) {
+        // Only files whose bytes are all present from the offset on are hits
+        if (cache_lookup(cache, session->cache_key, session->cache_upstream, session->transfer_offset,
+                         session->cache_file_path, sizeof(session->cache_file_path), &session->cache_file_size) == 0) {
+            // Cache hit
+            log_info("Cache hit: %s\n", session->cache_key);
+
+            session->cache_hit = 1;
+            return;
+        }
+
+        // Another transfer is downloading the file, so stream it from there instead of fetching it again
+        struct cache_entry *entry = cache_join_fill(cache, session->cache_key, session->cache_upstream,
+                                                    session->transfer_offset, session->cache_file_path,
+                                                    sizeof(session->cache_file_path));
+        if (entry != NULL) {
+            log_info("Joining cache fill: %s\n", session->cache_key);
+
+            session->cache_hit = 1;
+            session->cache_follow_entry = entry;
+            return;
+        }
+
+        // Segments already cached are kept, and only the missing bytes are fetched
+        if (fill) {
+            log_info("Cache miss\n");
+            session_begin_fill(session, session->transfer_offset, FALSE);
+        }
+        return;
+    }
+
+    if (session->transfer_offset > 0) {
+        // Uploading into the middle of the file leaves content the proxy never saw
+        cache_invalidate(cache, session->cache_key, session->cache_upstream);
+        return;
+    }
+
+    // Uploads always go to the server, and the uploaded content replaces the cached one
+    session_begin_fill(session, 0, TRUE);
+}
+
+/**
+ * Forwards a command to the server and remembers how to handle its reply.
+ */
+static void session_forward_command(struct session *session, const char *line, enum session_pending kind) {
+    session->pending[(session->pending_head + session->pending_count) % SESSION_PIPELINE_DEPTH] = kind;
+    session->pending_count += 1;
+
+    session_queue(session, FALSE, line);
+}
+
+/**
+ * Sends a REST of its own to the server before a command the proxy does not serve itself, as the
+ * client's REST was answered by the proxy. Its reply is dropped, so the client sees a single reply per
+ * command.
+ */
+static void session_forward_restart(struct session *session, off_t offset) {
+    char command[64];
+
+    if (offset > 0) {
+        snprintf(command, sizeof(command), "REST %lld\r\n", (long long) offset);
+        session_forward_command(session, command, SESSION_PENDING_RESTART);
+    }
+}
+
+/**
+ * Handles USER, whose name is kept for the upstream sessions of segmented fetches and picks the
+ * session's share of the bandwidth. Users may see different files under the same path, so each of
+ * them has their own cache entries.
+ */
+static void session_handle_user(struct session *session, const char *line, const char *argument) {
+    snprintf(session->user, sizeof(session->user), "%s", argument);
+    scheduler_flow_set_user(&session->flow, session->user);
+    session->password[0] = '\0';
+    session->directory[0] = '\0';
+    snprintf(session->cache_upstream, sizeof(session->cache_upstream), "%s@%s", argument,
+             session->config->server_address);
+
+    session_forward_command(session, line, SESSION_PENDING_OTHER);
+}
+
+/**
+ * Handles PASS, whose password is kept for the upstream sessions of segmented fetches. The server is
+ * asked for the login directory right after, so paths relative to it resolve like those after a CWD.
+ */
+static void session_handle_pass(struct session *session, const char *line, const char *argument) {
+    snprintf(session->password, sizeof(session->password), "%s", argument);
+
+    session_forward_command(session, line, SESSION_PENDING_OTHER);
+    session_forward_command(session, "PWD\r\n", SESSION_PENDING_PWD);
+}
+
+/**
+ * Handles REST. The offset is kept for the next command and answered by the proxy, which may serve
+ * the transfer from the cache; the server only gets a REST when the transfer reaches it.
+ */
+static void session_handle_rest(struct session *session, const char *line, const char *argument) {
+    char *end;
+    errno = 0;
+    long long offset = strtoll(argument, &end, 10);
+
+    if (argument[0] < '0' || argument[0] > '9' || *end != '\0' || errno == ERANGE) {
+        // Let the server reject it
+        session_forward_command(session, line, SESSION_PENDING_OTHER);
+        return;
+    }
+
+    session->restart_offset = offset;
+
+    char response[100];
+    snprintf(response, sizeof(response), "350 Restarting at %lld. Send STORE or RETRIEVE to initiate transfer.\r\n",
+             offset);
+    session_queue(session, TRUE, response);
+}
+
+/**
+ * Handles PORT: the proxy listens on a port of its own and hands its address to the server. Without
+ * a port to listen on, the server is given port 0 and refuses the PORT.
+ */
+static void session_handle_port(struct session *session, const char *line, const char *argument) {
+    const struct proxy_config *config = session->config;
+    int client_address[6];
+
+    if (control_parse_address(argument, strlen(argument), client_address) < 0) {
+        // Let the server reject it
+        session_forward_command(session, line, SESSION_PENDING_OTHER);
+        return;
+    }
+
+    // Active mode
+    session->mode = 0;
+    session->data_command_pending = 0;
+    session->active_client_data_port = client_address[4] * 256 + client_address[5];
+
+    // Listen for new data connection from server
+    int port = session_listen_for_data(session);
+    if (port < 0) {
+        port = 0;
+    }
+
+    char command[100];
+    snprintf(command, sizeof(command), "PORT %d,%d,%d,%d,%d,%d\r\n",
+             config->proxy_address[0], config->proxy_address[1],
+             config->proxy_address[2], config->proxy_address[3],
+             port / 256, port % 256);
+
+    // Send the PORT command to server
+    session_forward_command(session, command, SESSION_PENDING_OTHER);
+}
+
+/**
+ * Handles PASV. The 227 reply is rewritten once it arrives.
+ */
+static void session_handle_pasv(struct session *session, const char *line, const char *argument) {
+    // Passive mode
+    session->mode = 1;
+    session->data_command_pending = 0;
+
+    session_forward_command(session, line, SESSION_PENDING_PASV);
+}
+
+/**
+ * Handles a command transferring something over the data connection.
+ */
+static void session_handle_transfer(struct session *session, const char *line, const char *argument) {
+    session_forward_command(session, line, SESSION_PENDING_TRANSFER);
+    transfer_command_forwarded(session);
+}
+
+/**
+ * Asks the server for the size and modification time of the file of a RETR, to check a stale cache
+ * entry or to decide how to fetch a miss. The RETR and every client command after it wait for the
+ * replies.
+ */
+static void session_request_probe(struct session *session) {
+    char command[PATH_MAX + 16];
+
+    snprintf(command, sizeof(command), "SIZE %s\r\n", session->transfer_name);
+    session_forward_command(session, command, SESSION_PENDING_SIZE);
+    snprintf(command, sizeof(command), "MDTM %s\r\n", session->transfer_name);
+    session_forward_command(session, command, SESSION_PENDING_MDTM);
+    session->probe_pending = TRUE;
+}
+
+/**
+ * Fills the cache entry of a large file over several upstream sessions at once, and streams it to
+ * the client as it fills, like a transfer joining the fill.
+ * Returns 0 if the client is served that way and -1 if the session is to fetch the file itself.
+ */
+static int session_fetch_segmented(struct session *session, off_t size) {
+    struct cache *cache = session->config->cache;
+    const char *upstream = session->cache_upstream;
+
+    struct cache_entry *entry = cache_begin_fill(cache, session->cache_key, upstream, 0, FALSE);
+    if (entry == NULL) {
+        return -1;
+    }
+
+    // Partial entries are completed by the session, which only fetches the bytes they are missing
+    if (!entry->temporary || fetch_start(session, entry, size) < 0) {
+        cache_end_fill(cache, entry, FALSE);
+        return -1;
+    }
+
+    session->cache_follow_entry = cache_join_fill(cache, session->cache_key, upstream, 0,
+                                                  session->cache_file_path, sizeof(session->cache_file_path));
+    if (session->cache_follow_entry == NULL) {
+        return -1;
+    }
+    session->cache_hit = 1;
+
+    if (transfer_serve_cache_file(session, 0) < 0) {
+        session_stop_following(session);
+        return -1;
+    }
+
+    metrics_add(session->config->metrics->cache_misses, 1);
+    return 0;
+}
+
+/**
+ * Handles CWD and CDUP. The server is asked for the new working directory right after, which keys the
+ * cached listings and locates the files of segmented fetches.
+ */
+static void session_handle_cwd(struct session *session, const char *line, const char *argument) {
+    session_forward_command(session, line, SESSION_PENDING_OTHER);
+    session_forward_command(session, "PWD\r\n", SESSION_PENDING_PWD);
+}
+
+/**
+ * Handles a command changing the content of a directory, whose cached listings are dropped.
+ */
+static void session_handle_change(struct session *session, const char *line, const char *argument) {
+    char directory[PATH_MAX];
+
+    session_invalidate_listings(session, argument, directory);
+
+    session_forward_command(session, line, SESSION_PENDING_OTHER);
+}
+
+/**
+ * Handles STOU and APPE, whose directory listings are dropped when the transfer starts and again
+ * once it ended, so no listing taken during the upload survives it.
+ */
+static void session_handle_upload(struct session *session, const char *line, const char *argument) {
+    session_invalidate_listings(session, argument, session->upload_directory);
+    session->upload_pending = TRUE;
+
+    session_forward_restart(session, session->transfer_offset);
+    session_handle_transfer(session, line, argument);
+}
+
+/**
+ * Handles LIST, NLST and MLSD, which are answered from the listing cache when possible, and
+ * otherwise relayed while their listing is captured for the cache.
+ */
+static void session_handle_listing(struct session *session, const char *line, const char *argument) {
+    const struct proxy_config *config = session->config;
+
+    session->file_transfer_mode = 0;
+    session_end_listing(session, FALSE);
+
+    session->download_requested = metrics_now();
+    if (config->listings == NULL || session->transfer_offset > 0) {
+        // Only the server knows what a listing restarted at an offset holds
+        session_forward_restart(session, session->transfer_offset);
+        session_handle_transfer(session, line, argument);
+        return;
+    }
+
+    if (session->mode == 0) {
+        // In active mode the data connection of the previous transfer is of no use anymore
+        session_close_data_sockets(session);
+    }
+
+    // Options such as -la come before the path
+    const char *path = argument;
+    while (path[0] == '-') {
+        path += strcspn(path, " ");
+        path += strspn(path, " ");
+    }
+    listing_join_path(session->directory, path, session->listing_directory, sizeof(session->listing_directory));
+
+    char verb[CONTROL_VERB_SIZE];
+    control_parse_verb(line, strlen(line), verb);
+    int key_length = snprintf(session->listing_key, sizeof(session->listing_key), "%s\n%s\n%s\n%s %s",
+                              config->server_address, session->user, session->directory, verb, argument);
+    int label_length = snprintf(session->cache_key, sizeof(session->cache_key), "listing of %s",
+                                session->listing_directory);
+    if (key_length < 0 || (size_t) key_length >= sizeof(session->listing_key) ||
+        label_length < 0 || (size_t) label_length >= sizeof(session->cache_key)) {
+        // A truncated key could name another listing, so this one is relayed without the cache
+        session_handle_transfer(session, line, argument);
+        return;
+    }
+
+    off_t size;
+    int listing_fd = listing_cache_lookup(config->listings, session->listing_key, &size);
+    if (listing_fd >= 0) {
+        log_info("Listing cache hit: %s\n", session->listing_directory);
+        metrics_add(config->metrics->listing_hits, 1);
+
+        transfer_serve_listing(session, listing_fd, size);
+        return;
+    }
+
+    metrics_add(config->metrics->listing_misses, 1);
+    session->listing_capturing = TRUE;
+    session->cache_fill_eof = FALSE;
+    session->cache_fill_reply = FALSE;
+    session_handle_transfer(session, line, argument);
+}
+
+/**
+ * Handles RETR, which is answered from the cache when possible. A cache entry not validated within
+ * the freshness window, and a miss of a whole file when segmented fetches are enabled, first ask the
+ * server for the size and modification time of the file; the RETR is handled again once it replied.
+ */
+static void session_handle_retr(struct session *session, const char *line, const char *argument) {
+    const struct proxy_config *config = session->config;
+    int probed = session->probed;
+    off_t size = session->remote_size;
+    char modified[CACHE_MODIFIED_SIZE];
+    int segmented = config->fetch_segments > 1 && session->transfer_offset == 0;
+
+    snprintf(modified, sizeof(modified), "%s", session->remote_modified);
+    if (!probed) {
+        session->download_requested = metrics_now();
+    }
+    session->probed = FALSE;
+    session->remote_size = -1;
+    session->remote_modified[0] = '\0';
+
+    // Download a file
+    session->file_transfer_mode = 0;
+
+    if (session->mode == 0) {
+        // In active mode the data connection of the previous transfer is of no use anymore
+        session_close_data_sockets(session);
+    }
+    session_name_transfer(session, argument);
+
+    if (probed) {
+        cache_revalidate(config->cache, session->cache_key, session->cache_upstream, size, modified);
+    } else if (cache_check_freshness(config->cache, session->cache_key, session->cache_upstream,
+                                     config->cache_freshness) == CACHE_STALE) {
+        log_info("Cached %s is stale, asking the server whether it changed\n", session->cache_key);
+        session_request_probe(session);
+        return;
+    }
+    session_prepare_cache(session, !segmented);
+
+    // Cache hits are answered by the proxy itself
+    if (session->cache_hit) {
+        if (transfer_serve_cache_file(session, session->transfer_offset) == 0) {
+            metrics_add(config->metrics->cache_hits, 1);
+            return;
+        }
+
+        if (session->cache_follow_entry != NULL) {
+            // The fill cannot be joined, so fetch the file without caching it
+            session_stop_following(session);
+        } else {
+            // The file disappeared from the cache directory, so fetch it again
+            cache_invalidate(config->cache, session->cache_key, session->cache_upstream);
+            session_begin_fill(session, session->transfer_offset, FALSE);
+        }
+    } else if (segmented && !probed) {
+        log_info("Cache miss, asking for the size of %s\n", session->cache_key);
+        session_request_probe(session);
+        return;
+    } else if (segmented) {
+        if (size >= 0 && (unsigned long long) size >= config->fetch_threshold &&
+            session_fetch_segmented(session, size) == 0) {
+            if (modified[0] != '\0') {
+                cache_set_modified(session->cache_follow_entry, modified);
+            }
+            return;
+        }
+
+        // Smaller files, and those the server tells no size of, come over the session's own connection
+        session_begin_fill(session, 0, FALSE);
+    }
+
+    // The server only sends what the cache is missing, after the cached bytes before it are sent
+    off_t server_offset = session->transfer_offset;
+    if (session->cache_fill_entry != NULL && session->cache_fill_entry->fill_offset > server_offset &&
+        transfer_serve_cache_prefix(session, server_offset, session->cache_fill_entry->fill_offset) == 0) {
+        server_offset = session->cache_fill_entry->fill_offset;
+    } else if (session->cache_fill_entry != NULL && session->cache_fill_entry->fill_offset != server_offset) {
+        // The cached start cannot be sent, so the fill is given up rather than fetched twice
+        session_end_fill(session, FALSE);
+    }
+
+    // The modification time is kept with the entry, to tell later whether the file changed
+    if (session->cache_fill_entry != NULL && modified[0] != '\0') {
+        cache_set_modified(session->cache_fill_entry, modified);
+    } else if (session->cache_fill_entry != NULL && !probed) {
+        char command[PATH_MAX + 16];
+        snprintf(command, sizeof(command), "MDTM %s\r\n", session->transfer_name);
+        session_forward_command(session, command, SESSION_PENDING_MDTM);
+    }
+
+    metrics_add(config->metrics->cache_misses, 1);
+    session_forward_restart(session, server_offset);
+    session_handle_transfer(session, line, argument);
+}
+
+/**
+ * Handles STOR, whose content replaces the cached file.
+ */
+static void session_handle_stor(struct session *session, const char *line, const char *argument) {
+    // Upload a file
+    session->file_transfer_mode = 1;
+    session_name_transfer(session, argument);
+    session_prepare_cache(session, TRUE);
+    session_invalidate_listings(session, argument, session->upload_directory);
+    session->upload_pending = TRUE;
+
+    session_forward_restart(session, session->transfer_offset);
+    session_handle_transfer(session, line, argument);
+}
+
+/**
+ * Handles OPTS, noting which algorithm the client picks for HASH before the server is told.
+ */
+static void session_handle_opts(struct session *session, const char *line, const char *argument) {
+    if (strncasecmp(argument, "HASH ", 5) == 0) {
+        session->hash_other_algorithm = strcasecmp(argument + 5, "SHA-256") != 0;
+    }
+
+    session_forward_command(session, line, SESSION_PENDING_OTHER);
+}
+
+/**
+ * Handles HASH and XSHA256, which are answered from the SHA-256 of a fresh, complete cache entry when
+ * it is known. Otherwise the server answers, and the verifier computes the SHA-256 for the next time.
+ */
+static void session_handle_hash(struct session *session, const char *line, const char *argument) {
+    const struct proxy_config *config = session->config;
+    unsigned char sha256[CHECKSUM_SHA256_SIZE];
+    char verb[CONTROL_VERB_SIZE];
+    char path[PATH_MAX];
+    off_t size;
+
+    control_parse_verb(line, strlen(line), verb);
+    int hash = strcmp(verb, "HASH") == 0;
+    listing_join_path(session->directory, argument, path, sizeof(path));
+
+    // Only whole files are hashed locally
+    if (session->transfer_offset > 0 || (hash && session->hash_other_algorithm) ||
+        cache_check_freshness(config->cache, path, session->cache_upstream, config->cache_freshness) != CACHE_FRESH ||
+        cache_lookup_sha256(config->cache, path, session->cache_upstream, &size, sha256) < 0 ||
+        (hash && size == 0)) {
+        // An empty file has no byte range to report, so the server phrases that reply itself
+        session_forward_command(session, line, SESSION_PENDING_OTHER);
+        return;
+    }
+
+    char digest[CHECKSUM_SHA256_SIZE * 2 + 1];
+    char response[PATH_MAX + 200];
+    checksum_format_hex(sha256, sizeof(sha256), digest);
+    if (hash) {
+        snprintf(response, sizeof(response), "213 SHA-256 0-%lld %s %s\r\n", (long long) size - 1, digest, argument);
+    } else {
+        snprintf(response, sizeof(response), "213 %s\r\n", digest);
+    }
+
+    log_info("Answered %s of %s from the cache\n", verb, path);
+    session_queue(session, TRUE, response);
+}
+
+/**
+ * Commands the proxy takes part in. The others are forwarded as they are.
+ */
+static const struct session_command session_commands[] = {
+        {"USER", FALSE, session_handle_user},
+        {"PASS", FALSE, session_handle_pass},
+        {"REST", TRUE,  session_handle_rest},
+        {"PORT", FALSE, session_handle_port},
+        {"PASV", FALSE, session_handle_pasv},
+        {"RETR", TRUE,  session_handle_retr},
+        {"STOR", TRUE,  session_handle_stor},
+        {"STOU", TRUE,  session_handle_upload},
+        {"APPE", TRUE,  session_handle_upload},
+        {"LIST", TRUE,  session_handle_listing},
+        {"NLST", TRUE,  session_handle_listing},
+        {"MLSD", TRUE,  session_handle_listing},
+        {"CWD",  FALSE, session_handle_cwd},
+        {"XCWD", FALSE, session_handle_cwd},
+        {"CDUP", FALSE, session_handle_cwd},
+        {"XCUP", FALSE, session_handle_cwd},
+        {"DELE", FALSE, session_handle_change},
+        {"MKD",  FALSE, session_handle_change},
+        {"XMKD", FALSE, session_handle_change},
+        {"RMD",  FALSE, session_handle_change},
+        {"XRMD", FALSE, session_handle_change},
+        {"RNFR", FALSE, session_handle_change},
+        {"RNTO", FALSE, session_handle_change},
+        {"OPTS", FALSE, session_handle_opts},
+        {"HASH", TRUE,  session_handle_hash},
+        {"XSHA256", TRUE, session_handle_hash},
+};
+
+/**
+ * Looks up the handler of a verb.
+ * Returns the command, or NULL if the verb is only forwarded.
+ */
+static const struct session_command *session_find_command(const char *verb) {
+    for (size_t i = 0; i < sizeof(session_commands) / sizeof(session_commands[0]); i++) {
+        if (strcmp(session_commands[i].verb, verb) == 0) {
+            return &session_commands[i];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Handles the command lines received from the client in order. Commands are forwarded back-to-back
+ * without waiting for replies, except those using the data connection, which wait until every command
+ * before them was answered, as there is only one data connection and its transfer may be served locally.
+ */
+static void session_handle_client_lines(struct session *session) {
+    struct control_parser *parser = &session->client_parser;
+    const char *received;
+    size_t length;
+    int complete;
+
+    session->client_blocked = FALSE;
+
+    while ((received = control_parser_peek(parser, &length, &complete)) != NULL) {
+        if (!complete || parser->partial) {
+            // Only the start of a line that does not fit is answered, the rest is dropped
+            if (!parser->partial) {
+                session_queue(session, TRUE, "500 Command line too long.\r\n");
+            }
+            control_parser_consume(parser, length);
+            continue;
+        }
+
+        char line[CONTROL_BUFFER_SIZE + 1];
+        memcpy(line, received, length);
+        line[length] = '\0';
+
+        char verb[CONTROL_VERB_SIZE];
+        const char *argument = control_parse_verb(line, length, verb);
+        const struct session_command *command = session_find_command(verb);
+
+        // A command may be followed by one the proxy sends on its own, such as the PWD after a CWD
+        if (session->probe_pending || session->pending_count >= SESSION_PIPELINE_DEPTH - 1 ||
+            (command != NULL && command->waits_for_replies &&
+             (session->pending_count > 0 || transfer_sending_cache(session)))) {
+            // Continued once the server replied
+            session->client_blocked = TRUE;
+            break;
+        }
+        control_parser_consume(parser, length);
+
+        log_debug("Received from client: %s", line);
+
+        // The argument without its line ending
+        char argument_text[CONTROL_BUFFER_SIZE + 1];
+        snprintf(argument_text, sizeof(argument_text), "%s", argument);
+        argument_text[strcspn(argument_text, "\r\n")] = '\0';
+
+        // A REST only applies to the command right after it
+        session->transfer_offset = session->restart_offset;
+        session->restart_offset = 0;
+
+        if (command != NULL) {
+            command->handle(session, line, argument_text);
+        } else {
+            session_forward_restart(session, session->transfer_offset);
+            session_forward_command(session, line, SESSION_PENDING_OTHER);
+        }
+    }
+
+    session_flush(session, FALSE);
+    session_flush(session, TRUE);
+}
+
+/**
+ * Records the working directory from the 257 reply to a PWD the proxy sent on its own. Quotes
+ * inside the directory name are doubled.
+ */
+static void session_handle_pwd_reply(struct session *session, const char *line, int code) {
+    const char *quote = strchr(line, '"');
+    size_t length = 0;
+
+    session->directory[0] = '\0';
+    if (code != 257 || quote == NULL) {
+        return;
+    }
+
+    for (const char *c = quote + 1; *c != '\0'; c++) {
+        if (*c == '"' && c[1] != '"') {
+            session->directory[length] = '\0';
+            return;
+        }
+        if (*c == '"') {
+            c++;
+        }
+        if (length == sizeof(session->directory) - 1) {
+            break;
+        }
+        session->directory[length++] = *c;
+    }
+
+    // Without its closing quote, the name cannot be trusted
+    session->directory[0] = '\0';
+}
+
+/**
+ * Records the size from the reply to a SIZE the proxy sent on its own.
+ */
+static void session_handle_size_reply(struct session *session, const char *line, int code) {
+    char *end;
+    long long size = code == 213 ? strtoll(line + 4, &end, 10) : -1;
+
+    if (code == 213 && (end == line + 4 || size < 0)) {
+        size = -1;
+    }
+
+    session->remote_size = size;
+}
+
+/**
+ * Handles the reply to an MDTM the proxy sent on its own. The modification time either completes
+ * the probe a RETR waited for, which goes on, or is recorded with the entry the RETR after it fills.
+ */
+static void session_handle_mdtm_reply(struct session *session, const char *line, int code) {
+    char modified[CACHE_MODIFIED_SIZE] = "";
+
+    // A time too long to be one is taken as unknown rather than cut short
+    size_t length = code == 213 ? strcspn(line + 4, " \r\n") : 0;
+    if (length < sizeof(modified)) {
+        memcpy(modified, line + 4, length);
+        modified[length] = '\0';
+    }
+
+    if (!session->probe_pending) {
+        if (session->cache_fill_entry != NULL && modified[0] != '\0') {
+            cache_set_modified(session->cache_fill_entry, modified);
+        }
+        return;
+    }
+
+    session->probe_pending = FALSE;
+    session->probed = TRUE;
+    snprintf(session->remote_modified, sizeof(session->remote_modified), "%s", modified);
+
+    char argument[PATH_MAX];
+    char command[PATH_MAX + 16];
+    snprintf(argument, sizeof(argument), "%s", session->transfer_name);
+    snprintf(command, sizeof(command), "RETR %s\r\n", argument);
+    session_handle_retr(session, command, argument);
+
+    session_flush(session, FALSE);
+}
+
+/**
+ * Tells whether the oldest command waiting for its final reply was sent by the proxy on its own, so
+ * no line of its reply reaches the client.
+ */
+static int session_pending_internal(const struct session *session) {
+    if (!session->server_greeted || session->pending_count == 0) {
+        return FALSE;
+    }
+
+    switch (session->pending[session->pending_head]) {
+        case SESSION_PENDING_RESTART:
+        case SESSION_PENDING_PWD:
+        case SESSION_PENDING_SIZE:
+        case SESSION_PENDING_MDTM:
+        case SESSION_PENDING_ABANDONED:
+            return TRUE;
+        default:
+            return FALSE;
+    }
+}
+
+/**
+ * Handles the final reply to a command forwarded to the server.
+ */
+static void session_handle_server_reply(struct session *session, const char *line, int code) {
+    const struct proxy_config *config = session->config;
+    enum session_pending kind = SESSION_PENDING_OTHER;
+
+    if (!session->server_greeted) {
+        // The greeting answers no command
+        session->server_greeted = TRUE;
+    } else if (session->pending_count > 0) {
+        kind = session->pending[session->pending_head];
+        session->pending_head = (session->pending_head + 1) % SESSION_PIPELINE_DEPTH;
+        session->pending_count -= 1;
+    }
+
+    int server_address[6];
+    int port;
+    if (kind == SESSION_PENDING_PASV && code == 227 &&
+        control_parse_address(line + 4, strlen(line + 4), server_address) == 0) {
+        // Enter passive mode
+        session->passive_server_data_port = server_address[4] * 256 + server_address[5];
+
+        // Listen for new data connection from client
+        port = session_listen_for_data(session);
+
+        // Send 227 response to client
+        char response[60];
+        snprintf(response, sizeof(response), "227 Entering Passive Mode (%d,%d,%d,%d,%d,%d)\r\n",
+                 config->proxy_address[0], config->proxy_address[1],
+                 config->proxy_address[2], config->proxy_address[3],
+                 port / 256, port % 256);
+        session_queue(session, TRUE, port < 0 ? "425 Can't open data connection.\r\n" : response);
+    } else if (kind == SESSION_PENDING_PWD) {
+        session_handle_pwd_reply(session, line, code);
+    } else if (kind == SESSION_PENDING_SIZE) {
+        session_handle_size_reply(session, line, code);
+    } else if (kind == SESSION_PENDING_MDTM) {
+        session_handle_mdtm_reply(session, line, code);
+    } else if (kind == SESSION_PENDING_RESTART) {
+        if (code != 350) {
+            // The transfer will not start at the offset the cache fill expects
+            log_warning("Server cannot restart the transfer\n");
+            session_end_fill(session, FALSE);
+        }
+    } else if (kind == SESSION_PENDING_ABANDONED) {
+        log_debug("Dropped reply to a failed transfer: %s", line);
+    } else {
+        session_queue(session, TRUE, line);
+    }
+
+    if (kind == SESSION_PENDING_TRANSFER) {
+        if (code == 226 || code == 250) {
+            session->cache_fill_reply = TRUE;
+            session_end_fill(session, TRUE);
+            session_end_listing(session, TRUE);
+        } else if (code >= 400) {
+            session_end_fill(session, FALSE);
+            session_end_listing(session, FALSE);
+        }
+
+        if (session->upload_pending && config->listings != NULL) {
+            listing_cache_invalidate(config->listings, config->server_address, session->upload_directory);
+        }
+        session->upload_pending = FALSE;
+    }
+}
+
+/**
+ * Handles the reply lines received from the server in order. Lines of multi-line replies and
+ * preliminary replies are relayed as they are, unless they belong to a command the proxy sent on its
+ * own; final replies are matched with the oldest command waiting for one.
+ */
+static void session_handle_server_lines(struct session *session) {
+    struct control_parser *parser = &session->server_parser;
+    const char *received;
+    size_t length;
+    int complete;
+
+    while ((received = control_parser_peek(parser, &length, &complete)) != NULL) {
+        int continued = parser->partial;
+
+        char line[CONTROL_BUFFER_SIZE + 1];
+        memcpy(line, received, length);
+        line[length] = '\0';
+        control_parser_consume(parser, length);
+
+        log_debug("Received from server: %s", line);
+
+        int code = complete && !continued ? control_parse_reply(parser, line, length) : 0;
+        if (code < 200 && session_pending_internal(session)) {
+            log_debug("Dropped line of a reply to the proxy: %s", line);
+        } else if (code < 200) {
+            session_queue(session, TRUE, line);
+        } else {
+            session_handle_server_reply(session, line, code);
+        }
+    }
+
+    session_flush(session, TRUE);
+}
+
+/**
+ * Reads everything available on a command socket and handles it line by line.
+ * Closes the session when the peer disconnects.
+ * Returns 0 if the session is still alive and -1 if it was closed.
+ */
+static int session_read_commands(struct session *session, int from_client) {
+    int socket_fd = from_client ? session->client_command_socket : session->server_command_socket;
+    struct control_parser *parser = from_client ? &session->client_parser : &session->server_parser;
+    struct ring *output = from_client ? &session->server_output : &session->client_output;
+
+    while (TRUE) {
+        if (from_client) {
+            session_handle_client_lines(session);
+        } else {
+            session_handle_server_lines(session);
+            session_resume_client(session);
+        }
+
+        if (ring_used(output) >= SESSION_OUTPUT_HIGH) {
+            // The other side is not keeping up, so leave the rest in the socket until it drains
+            return 0;
+        }
+
+        ssize_t read_size = control_parser_read(parser, socket_fd);
+        if (read_size < 0 && errno == EINTR) {
+            continue;
+        }
+        if (read_size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)) {
+            // A full buffer only holds commands waiting for replies, and is read again once they came
+            return 0;
+        }
+        if (read_size > 0 && from_client) {
+            session->last_command = event_loop_now(session->loop);
+        }
+        if (read_size <= 0) {
+            // Close command connections if nothing received
+            log_info(from_client ? "Client disconnected\n" : "Server disconnected\n");
+            session_close(session);
+            return -1;
+        }
+    }
+}
+
+/**
+ * Handles the client commands that waited for replies or for a transfer served from the cache.
+ */
+static void session_resume_commands(struct event_task *task) {
+    struct session *session = container_of(task, struct session, resume_task);
+
+    session_read_commands(session, TRUE);
+}
+
+/**
+ * Lets waiting client commands continue after a reply or a transfer ended. They are handled once the
+ * current events are, so the caller never sees the session change under it.
+ */
+void session_resume_client(struct session *session) {
+    if (session->client_blocked) {
+        event_loop_post(session->loop, &session->resume_task);
+    }
+}
+
+/**
+ * Called when the connection to the server completed. Commands the client sent meanwhile are handled now.
+ * If the mirror could not be reached, the session fails over to the next one, and only gives up once
+ * none is left.
+ */
+static void session_server_connected(struct session *session) {
+    if (finish_connection(session->server_command_socket) < 0) {
+        log_warning("Cannot connect to upstream %s:%d: %s\n", session->upstream->host, session->upstream->port,
+                    strerror(errno));
+        upstream_record_failure(session->upstream);
+        session_close_socket(session, &session->server_command_socket);
+        session->server_connecting = FALSE;
+        if (session_connect_upstream(session) < 0) {
+            session_send(session, TRUE, "421 Service not available, cannot reach the server.\r\n");
+            session_close(session);
+        }
+        return;
+    }
+
+    log_debug("New command connection to server created.\n");
+    session->server_connecting = FALSE;
+    event_loop_modify(session->loop, session->server_command_socket, SESSION_EVENTS);
+    unsigned long long latency = metrics_now() - session->server_connect_started;
+    metrics_observe(&session->config->metrics->connect_latency, latency);
+    upstream_record_connect(session->upstream, latency);
+    session_flush(session, FALSE);
+
+    if (session_read_commands(session, FALSE) == 0) {
+        session_read_commands(session, TRUE);
+    }
+}
+
+/**
+ * Dispatches an event on one of the session's sockets.
+ */
+void session_handle_event(struct event_loop *loop, int fd, uint32_t events, void *data) {
+    struct session *session = data;
+
+    if (fd == session->client_command_socket) {
+        if (events & EPOLLOUT) {
+            session_flush(session, TRUE);
+
+            // Replies were left in the server socket while the client was not reading them
+            if (ring_used(&session->client_output) <= SESSION_OUTPUT_LOW && !session->server_connecting &&
+                session_read_commands(session, FALSE) < 0) {
+                return;
+            }
+        }
+        if (!session->server_connecting) {
+            session_read_commands(session, TRUE);
+        }
+    } else if (fd == session->server_command_socket) {
+        if (session->server_connecting) {
+            session_server_connected(session);
+            return;
+        }
+        if (events & EPOLLOUT) {
+            session_flush(session, FALSE);
+
+            // Commands were left in the client socket while the server was not reading them
+            if (ring_used(&session->server_output) <= SESSION_OUTPUT_LOW && session_read_commands(session, TRUE) < 0) {
+                return;
+            }
+        }
+        session_read_commands(session, FALSE);
+    } else if (fd == session->proxy_data_socket) {
+        transfer_accept_data_connection(session);
+    } else if (fd == session->outcome_data_socket && session->data_connecting) {
+        transfer_data_connected(session);
+    } else if (transfer_sending_cache(session)) {
+        transfer_send_cache_file(session);
+    } else if (fd == session->income_data_socket || fd == session->outcome_data_socket) {
+        transfer_handle_data_event(session, fd, events);
+    }
+}
@@ -0,0 +1,193 @@
+#ifndef FTP_PROXY_SESSION_H
+#define FTP_PROXY_SESSION_H
+
+#include <limits.h>
+#include <netinet/in.h>
+#include <sys/types.h>
+
+#include "cache.h"
+#include "control.h"
+#include "event_loop.h"
+#include "listing.h"
+#include "metrics.h"
+#include "port_pool.h"
+#include "proxy.h"
+#include "relay.h"
+#include "ring.h"
+#include "scheduler.h"
+#include "upstream.h"
+
+#define SESSION_EVENTS (EPOLLIN | EPOLLRDHUP | EPOLLET)
+#define SESSION_OUTPUT_SIZE (4 * 1024)      // Initial size of the output buffer of a command connection
+#define SESSION_OUTPUT_HIGH (16 * 1024)     // The other command connection is not read above this
+#define SESSION_OUTPUT_LOW (4 * 1024)       // and is read again once drained below this
+#define SESSION_PIPELINE_DEPTH 16           // Commands forwarded to the server without a final reply yet
+#define SESSION_CREDENTIAL_SIZE 256         // Longest user name or password kept for segmented fetches
+#define SESSION_DEFAULT_IDLE_TIMEOUT 300    // Seconds a client may stay silent between transfers
+#define SESSION_DEFAULT_CONNECT_TIMEOUT 60  // Seconds a data connection may take to come in or be established
+#define SESSION_DEFAULT_STALL_TIMEOUT 300   // Seconds a transfer may go without moving a byte
+
+/**
+ * What to do with the final reply to a command forwarded to the server.
+ */
+enum session_pending {
+    SESSION_PENDING_OTHER,          // Relay it as it is
+    SESSION_PENDING_PASV,           // Rewrite the 227 reply to point at the proxy
+    SESSION_PENDING_TRANSFER,       // End the transfer and its cache fill
+    SESSION_PENDING_RESTART,        // Drop the 350 reply to a REST the proxy sent on its own
+    SESSION_PENDING_PWD,            // Record the working directory from the 257 reply to a PWD sent after login or a CWD and drop it
+    SESSION_PENDING_SIZE,           // Record the size of the file of a RETR from the reply and drop it
+    SESSION_PENDING_MDTM,           // Record its modification time, go on with a RETR waiting for it and drop the reply
+    SESSION_PENDING_ABANDONED       // Drop the reply to a transfer the proxy already answered with a failure of its own
+};
+
+struct session;
+
+/**
+ * Open sessions of one worker, only touched by its thread.
+ */
+struct session_list {
+    struct session *head;
+    int count;                      // Read by the first worker while draining, updated atomically
+};
+
+/**
+ * Handler of a command the proxy takes part in.
+ */
+struct session_command {
+    const char *verb;
+    int waits_for_replies;          // Waits until every command before it was answered
+    void (*handle)(struct session *session, const char *line, const char *argument);
+};
+
+/**
+ * State of one proxied FTP session: the client's command connection, its upstream
+ * counterpart and the data connections of the current transfer.
+ */
+struct session {
+    struct event_loop *loop;
+    const struct proxy_config *config;
+    struct session *prev;           // In the list of the worker's sessions
+    struct session *next;
+
+    int client_command_socket;      // Socket of accepting command connection from client
+    int server_command_socket;      // Socket of creating command connection to server
+    int proxy_data_socket;          // Socket of listening for data connection
+    struct port_pool_slot *proxy_data_slot;     // Listener of the data pool behind proxy_data_socket
+    int income_data_socket;         // Socket of accepting data connection
+    int outcome_data_socket;        // Socket of creating data connection
+
+    int mode;                       // 0 for active mode and 1 for passive mode
+
+    char transfer_name[PATH_MAX];   // File name of the current transfer as the client gave it
+    char cache_key[PATH_MAX];       // Path of that file resolved against the working directory
+    char cache_upstream[SESSION_CREDENTIAL_SIZE + 256];     // User and server the cached files come from
+    char cache_file_path[PATH_MAX];
+    off_t cache_file_size;          // Size the cache file of a hit must have, -1 while following a fill
+    struct cache_entry *cache_fill_entry;   // Entry filled by the current transfer
+    int cache_fill_eof;             // The data connection of the fill reached its end
+    int cache_fill_reply;           // The server confirmed the transfer of the fill
+    int cache_hit;
+    int file_transfer_mode;         // 0 for downloading and 1 for uploading
+    struct cache_writer *cache_writer;      // Writes the cache file filled by the current transfer
+    struct cache_entry *cache_follow_entry;  // Entry filled by another transfer and streamed to the client
+    struct cache_waiter cache_waiter;       // Registered while the client caught up with that fill
+    struct event_task wake_task;    // Resumes streaming once the fill progressed
+    int cache_send_fd;              // Cache file being served to the client without the server
+    struct hot_file *cache_send_hot;    // Copy in memory being served instead of a cache file
+    off_t cache_send_offset;
+    off_t cache_send_size;
+    int cache_send_blocked;         // The client data socket is watched for EPOLLOUT while the cache file is sent
+    int cache_send_prefix;          // The cache file only holds the start of the transfer, the server sends the rest
+    off_t restart_offset;           // Offset of the REST command just received
+    off_t transfer_offset;          // Offset the current transfer starts at
+    int probe_pending;              // A RETR waits for the replies to the SIZE and MDTM the proxy sent on its own
+    int probed;                     // The RETR handled again once they came
+    off_t remote_size;              // Size from those replies, or -1 if the server did not tell
+    char remote_modified[CACHE_MODIFIED_SIZE];  // Modification time from them, empty if the server did not tell
+    int data_command_pending;       // A command using the data connection was forwarded to the server
+    int server_connecting;          // The command connection to the server is not established yet
+    struct upstream *upstream;      // Mirror the session is connected to
+    unsigned int upstreams_tried;   // Mask of the mirrors the session tried to connect to
+    int data_connecting;            // The outcome data connection is not established yet
+
+    int splice_supported;           // Cleared once splice() fails, so the buffered relay is used instead
+    struct relay_channel income_channel;    // Data read from the income data socket
+    struct relay_channel outcome_channel;   // Data read from the outcome data socket
+    struct relay_pipe cache_pipe;   // Receives a tee() of the relayed data for the cache file
+    struct scheduler_flow flow;     // Turn of the transfer among those of the worker
+
+    struct ring client_output;      // Replies the client command socket did not accept yet
+    struct ring server_output;      // Commands the server command socket did not accept yet
+    int client_output_blocked;      // The client command socket is watched for EPOLLOUT
+    int server_output_blocked;      // The server command socket is watched for EPOLLOUT
+
+    struct control_parser client_parser;    // Command lines received from the client
+    struct control_parser server_parser;    // Reply lines received from the server
+    enum session_pending pending[SESSION_PIPELINE_DEPTH];   // Commands waiting for their final reply, oldest first
+    int pending_head;
+    int pending_count;
+    int client_blocked;             // A client command waits for the commands before it to complete
+    struct event_task resume_task;  // Handles the waiting client commands
+    int server_greeted;             // The greeting of the server was received
+    int hash_other_algorithm;       // The client picked another algorithm than SHA-256 for HASH
+
+    char user[SESSION_CREDENTIAL_SIZE];     // Credentials the client logged in with, used by segmented fetches
+    char password[SESSION_CREDENTIAL_SIZE];
+    char directory[PATH_MAX];       // Working directory of the client as the server reported it, empty for the login one
+
+    int listing_capturing;          // The listing of the current transfer is cached once the transfer succeeded
+    char listing_key[PATH_MAX * 3]; // Server, user, working directory and command of the listing
+    char listing_directory[PATH_MAX];   // Directory the listing shows
+    struct listing_buffer listing_buffer;
+    int upload_pending;             // An upload changes upload_directory, whose listings are dropped again once it ended
+    char upload_directory[PATH_MAX];
+
+    struct metrics_session metrics; // Bytes of the session reported by the metrics endpoint
+    unsigned long long server_connect_started;  // When the command connection to the server was started, in microseconds
+    unsigned long long download_requested;      // When the current download command arrived, 0 once its first byte was sent
+    unsigned long long transfer_started;        // When the command of the current transfer was forwarded, in microseconds
+    unsigned long long transfer_start_bytes;    // Bytes downloaded by the session before it
+
+    struct wheel_timer idle_timer;  // Closes the session once the client stayed silent for too long
+    struct wheel_timer data_timer;  // Gives up a data connection that is not established or stalled
+    unsigned long long last_command;    // When the client sent its last command, in loop milliseconds
+    unsigned long long data_activity;   // When the data connection was last waited for or moved bytes
+
+    struct in_addr client_address;
+    int active_client_data_port;
+    int passive_server_data_port;
+};
+
+struct session *session_create(struct event_loop *loop, const struct proxy_config *config,
+                               int client_command_socket, const struct sockaddr_in *client);
+
+void session_close(struct session *session);
+
+void session_drain(struct session_list *sessions);
+
+int session_watch(struct session *session, int socket_fd);
+
+int session_connect(struct session *session, struct sockaddr_in address);
+
+int session_connect_server(struct session *session, int port);
+
+void session_close_socket(struct session *session, int *socket_fd);
+
+void session_close_data_sockets(struct session *session);
+
+void session_release_data_listener(struct session *session);
+
+void session_send(struct session *session, int to_client, const char *buffer);
+
+void session_resume_client(struct session *session);
+
+void session_end_fill(struct session *session, int success);
+
+void session_end_listing(struct session *session, int success);
+
+void session_abandon_transfer(struct session *session, const char *response);
+
+void session_handle_event(struct event_loop *loop, int fd, uint32_t events, void *data);
+
+#endif
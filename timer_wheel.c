@@ -0,0 +1,175 @@
+#include "timer_wheel.h"
+
+#include <stddef.h>
+
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_SPAN (1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))     // Ticks the levels cover
+
+/**
+ * Starts the wheel at the given tick, with every slot empty.
+ */
+void timer_wheel_init(struct timer_wheel *wheel, unsigned long long now) {
+    wheel->now = now;
+    wheel->count = 0;
+
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level += 1) {
+        wheel->occupied[level] = 0;
+        for (int slot = 0; slot < TIMER_WHEEL_SLOTS; slot += 1) {
+            wheel->slots[level][slot].prev = wheel->slots[level][slot].next = &wheel->slots[level][slot];
+        }
+    }
+}
+
+/**
+ * Links the timer into the slot of the level covering its distance from the current tick.
+ */
+static void timer_wheel_link(struct timer_wheel *wheel, struct wheel_timer *timer) {
+    unsigned long long delta = timer->expires - wheel->now;
+    int level = 0;
+
+    while (level < TIMER_WHEEL_LEVELS - 1 && delta >= 1ULL << (TIMER_WHEEL_BITS * (level + 1))) {
+        level += 1;
+    }
+
+    int slot = (int) ((timer->expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK);
+    struct wheel_timer *head = &wheel->slots[level][slot];
+
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+    wheel->occupied[level] |= 1ULL << slot;
+}
+
+/**
+ * Arms the timer to expire at the given tick, or at the current one if that passed already. A
+ * timer already armed has to be removed first.
+ */
+void timer_wheel_add(struct timer_wheel *wheel, struct wheel_timer *timer, unsigned long long expires) {
+    if (expires < wheel->now) {
+        expires = wheel->now;
+    }
+    if (expires - wheel->now >= TIMER_WHEEL_SPAN) {
+        expires = wheel->now + TIMER_WHEEL_SPAN - 1;
+    }
+
+    timer->expires = expires;
+    timer_wheel_link(wheel, timer);
+    wheel->count += 1;
+}
+
+/**
+ * Cancels the timer, if it is armed.
+ */
+void timer_wheel_remove(struct timer_wheel *wheel, struct wheel_timer *timer) {
+    if (timer->prev == NULL) {
+        return;
+    }
+
+    struct wheel_timer *neighbour = timer->prev;
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->prev = timer->next = NULL;
+    wheel->count -= 1;
+
+    // Only the sentinel of an emptied slot links to itself
+    ptrdiff_t index = neighbour - &wheel->slots[0][0];
+    if (neighbour->next == neighbour && index >= 0 && index < TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS) {
+        wheel->occupied[index / TIMER_WHEEL_SLOTS] &= ~(1ULL << (index % TIMER_WHEEL_SLOTS));
+    }
+}
+
+/**
+ * Moves the timers of a slot into the list of the sentinel given, emptying the slot.
+ */
+static void timer_wheel_take(struct timer_wheel *wheel, int level, int slot, struct wheel_timer *list) {
+    struct wheel_timer *head = &wheel->slots[level][slot];
+
+    if (head->next == head) {
+        list->prev = list->next = list;
+        return;
+    }
+
+    list->next = head->next;
+    list->prev = head->prev;
+    list->next->prev = list;
+    list->prev->next = list;
+    head->prev = head->next = head;
+    wheel->occupied[level] &= ~(1ULL << slot);
+}
+
+/**
+ * Spreads the timers of the slot of a level whose ticks come next over the levels below.
+ * Returns the index of that slot, which wraps around to 0 when the level above is due as well.
+ */
+static int timer_wheel_cascade(struct timer_wheel *wheel, int level) {
+    int slot = (int) ((wheel->now >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK);
+    struct wheel_timer list;
+
+    timer_wheel_take(wheel, level, slot, &list);
+    while (list.next != &list) {
+        struct wheel_timer *timer = list.next;
+
+        list.next = timer->next;
+        timer->next->prev = &list;
+        timer_wheel_link(wheel, timer);
+    }
+
+    return slot;
+}
+
+/**
+ * Expires every timer due up to the given tick. Expired timers may arm timers again, which expire in
+ * the same call if they are due as well. One armed for the tick being expired or an earlier one is
+ * due on the next tick, as the slot of the current one was emptied already.
+ */
+void timer_wheel_advance(struct timer_wheel *wheel, unsigned long long now) {
+    while (wheel->now <= now) {
+        int slot = (int) (wheel->now & TIMER_WHEEL_MASK);
+
+        if (wheel->count == 0) {
+            // Nothing to cascade or expire, so skip straight to the tick
+            wheel->now = now + 1;
+            return;
+        }
+
+        for (int level = 1; slot == 0 && level < TIMER_WHEEL_LEVELS; level += 1) {
+            if (timer_wheel_cascade(wheel, level) != 0) {
+                break;
+            }
+        }
+
+        struct wheel_timer list;
+        timer_wheel_take(wheel, 0, slot, &list);
+        wheel->now += 1;
+        while (list.next != &list) {
+            struct wheel_timer *timer = list.next;
+
+            // Unlinked before it runs, so it may arm itself again or cancel the others of the list
+            list.next = timer->next;
+            timer->next->prev = &list;
+            timer->prev = timer->next = NULL;
+            wheel->count -= 1;
+            timer->expire(timer);
+        }
+    }
+}
+
+/**
+ * Gets how many ticks from the current one the wheel has to be advanced next: to the first slot of
+ * level 0 holding timers, or to where the next level cascades down.
+ * Returns the number of ticks, or -1 if no timer is armed.
+ */
+long long timer_wheel_next(const struct timer_wheel *wheel) {
+    if (wheel->count == 0) {
+        return -1;
+    }
+
+    int slot = (int) (wheel->now & TIMER_WHEEL_MASK);
+    uint64_t ahead = wheel->occupied[0] >> slot;
+    if (ahead != 0) {
+        return __builtin_ctzll(ahead);
+    }
+
+    return TIMER_WHEEL_SLOTS - slot;
+}
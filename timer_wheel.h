@@ -0,0 +1,43 @@
+#ifndef FTP_PROXY_TIMER_WHEEL_H
+#define FTP_PROXY_TIMER_WHEEL_H
+
+#include <stdint.h>
+
+#define TIMER_WHEEL_TICK 100                // Milliseconds per tick
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4                // Deadlines up to 64^4 ticks away, about 19 days
+
+/**
+ * Deadline kept in a slot of the wheel. The timer is armed while it is linked into a slot.
+ */
+struct wheel_timer {
+    void (*expire)(struct wheel_timer *timer);
+    unsigned long long expires;     // Tick the timer expires at
+    struct wheel_timer *prev;
+    struct wheel_timer *next;
+};
+
+/**
+ * Hierarchical timer wheel: level 0 has a slot per tick for the next 64 ticks, and each further level
+ * a slot per 64 slots of the level below. Timers of a higher level cascade down once the ticks of
+ * their slot come near, so arming and cancelling are O(1), and each timer moves at most once per level.
+ */
+struct timer_wheel {
+    unsigned long long now;         // Next tick to process
+    unsigned long long count;       // Armed timers
+    uint64_t occupied[TIMER_WHEEL_LEVELS];      // Bit per slot holding timers
+    struct wheel_timer slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];    // Sentinels of the slots' lists
+};
+
+void timer_wheel_init(struct timer_wheel *wheel, unsigned long long now);
+
+void timer_wheel_add(struct timer_wheel *wheel, struct wheel_timer *timer, unsigned long long expires);
+
+void timer_wheel_remove(struct timer_wheel *wheel, struct wheel_timer *timer);
+
+void timer_wheel_advance(struct timer_wheel *wheel, unsigned long long now);
+
+long long timer_wheel_next(const struct timer_wheel *wheel);
+
+#endif
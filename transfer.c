@@ -0,0 +1,858 @@
+#define _GNU_SOURCE
+
+#include "transfer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+#include "cache_writer.h"
+#include "hot_cache.h"
+#include "listing.h"
+#include "log.h"
+#include "metrics.h"
+#include "net.h"
+
+/**
+ * Returns the data socket connected to the client, or -1 if there is none yet.
+ */
+static int transfer_client_data_socket(struct session *session) {
+    return session->mode == 0 ? session->outcome_data_socket : session->income_data_socket;
+}
+
+/**
+ * Ends measuring the time to the first byte of the current download, once its first bytes are on
+ * their way to the client.
+ */
+static void transfer_count_first_byte(struct session *session) {
+    if (session->download_requested != 0) {
+        metrics_observe(&session->config->metrics->first_byte, metrics_now() - session->download_requested);
+        session->download_requested = 0;
+    }
+}
+
+/**
+ * Gives up a data connection that could not be created and tells the client, unless the server's
+ * reply to the transfer reached it first.
+ */
+static void transfer_fail_data_connection(struct session *session) {
+    if (transfer_sending_cache(session)) {
+        transfer_finish_cache_file(session, "425 Can't open data connection.\r\n");
+        return;
+    }
+
+    session_close_data_sockets(session);
+    session_end_fill(session, FALSE);
+    session_end_listing(session, FALSE);
+    session_abandon_transfer(session, "425 Can't open data connection.\r\n");
+}
+
+/**
+ * Starts creating the data connection to the server for a client that connected in passive mode.
+ */
+static void transfer_connect_server(struct session *session) {
+    int outcome_data_socket = session_connect_server(session, session->passive_server_data_port);
+
+    session->data_command_pending = 0;
+
+    if (outcome_data_socket < 0) {
+        transfer_fail_data_connection(session);
+        return;
+    }
+
+    session->outcome_data_socket = outcome_data_socket;
+    session->data_connecting = TRUE;
+    transfer_watch_data(session);
+}
+
+/**
+ * Starts creating the data connection to the client in active mode.
+ * Returns 0 on success and -1 on failure, after which the client has been told.
+ */
+static int transfer_connect_client(struct session *session) {
+    struct sockaddr_in client;
+
+    bzero((char *) &client, sizeof(client));
+    client.sin_family = AF_INET;
+    client.sin_addr = session->client_address;
+    client.sin_port = htons(session->active_client_data_port);
+
+    int outcome_data_socket = session_connect(session, client);
+    if (outcome_data_socket < 0) {
+        transfer_fail_data_connection(session);
+        return -1;
+    }
+
+    session->outcome_data_socket = outcome_data_socket;
+    session->data_connecting = TRUE;
+    transfer_watch_data(session);
+
+    return 0;
+}
+
+/**
+ * Called when the outcome data connection completed. Data that arrived on the other side meanwhile
+ * is still waiting in its socket and is relayed on the transfer's next turn.
+ */
+void transfer_data_connected(struct session *session) {
+    if (finish_connection(session->outcome_data_socket) < 0) {
+        log_warning("Cannot create data connection: %s\n", strerror(errno));
+        transfer_fail_data_connection(session);
+        return;
+    }
+
+    log_debug(session->mode == 0 ? "Data connection to client created\n" : "Data connection to server created\n");
+    session->data_connecting = FALSE;
+    event_loop_modify(session->loop, session->outcome_data_socket, SESSION_EVENTS);
+    transfer_watch_data(session);
+
+    // The server's data is only relayed once the cached start of the transfer was sent
+    if (!transfer_sending_cache(session)) {
+        session->income_channel.ready = TRUE;
+        session->outcome_channel.ready = TRUE;
+    }
+    scheduler_wake(&session->flow);
+}
+
+/**
+ * Accepts the data connection of a transfer and creates its counterpart.
+ * In passive mode the connection to the server is only created once a transfer command has been
+ * forwarded, so transfers served from the cache never reach the server.
+ */
+void transfer_accept_data_connection(struct session *session) {
+    struct sockaddr_in peer;
+    int income_data_socket;
+
+    while ((income_data_socket = accept_connection(session->proxy_data_socket, &peer)) >= 0) {
+        if (session->income_data_socket >= 0 || session->outcome_data_socket >= 0) {
+            session_close_data_sockets(session);
+        }
+
+        if (session_watch(session, income_data_socket) < 0) {
+            close(income_data_socket);
+            continue;
+        }
+        session->income_data_socket = income_data_socket;
+
+        if (session->mode == 0) {
+            // Active mode
+            // Receive data connection from server, then create data connection to client
+            log_debug("Accepted data connection from server\n");
+
+            transfer_connect_client(session);
+        } else {
+            // Passive mode
+            // Receive data connection from client
+            log_debug("Accepted data connection from client\n");
+
+            if (session->data_command_pending && (!transfer_sending_cache(session) || session->cache_send_prefix)) {
+                transfer_connect_server(session);
+            }
+            if (transfer_sending_cache(session)) {
+                transfer_send_cache_file(session);
+            }
+        }
+    }
+
+    // The transfer has its data connection, so the port can serve the next one
+    if (session->income_data_socket >= 0) {
+        session_release_data_listener(session);
+        transfer_watch_data(session);
+    }
+}
+
+/**
+ * Called when a command that uses the data connection has been forwarded to the server.
+ * Connects a client already waiting in passive mode to the server.
+ */
+void transfer_command_forwarded(struct session *session) {
+    session->data_command_pending = 1;
+    session->transfer_started = metrics_now();
+    session->transfer_start_bytes = session->metrics.bytes_downloaded;
+    transfer_watch_data(session);
+
+    if (session->mode == 1 && session->income_data_socket >= 0 && session->outcome_data_socket < 0) {
+        transfer_connect_server(session);
+    }
+}
+
+/**
+ * Tells whether the client is sent a cache file or a copy in memory, rather than the server's data.
+ */
+int transfer_sending_cache(const struct session *session) {
+    return session->cache_send_fd >= 0 || session->cache_send_hot != NULL;
+}
+
+/**
+ * Sends the preliminary reply, then what the session serves from the cache once the client data
+ * connection is there.
+ */
+static void transfer_begin_serving(struct session *session, const char *response) {
+    session_send(session, TRUE, response);
+    transfer_watch_data(session);
+
+    if (session->mode == 0) {
+        // Active mode: the server is not involved, so the proxy connects to the client itself
+        transfer_connect_client(session);
+        return;
+    }
+
+    if (transfer_client_data_socket(session) >= 0) {
+        transfer_send_cache_file(session);
+    }
+}
+
+/**
+ * Serves the descriptor from the offset up to the size.
+ */
+static void transfer_serve_fd(struct session *session, int fd, off_t offset, off_t size, const char *response) {
+    session->cache_send_fd = fd;
+    session->cache_send_offset = offset;
+    session->cache_send_size = size;
+
+    transfer_begin_serving(session, response);
+}
+
+/**
+ * Serves a copy in memory of a cached file from the offset, which the session holds a reference to
+ * from now on.
+ */
+static void transfer_serve_hot(struct session *session, struct hot_file *file, off_t offset) {
+    char response[PATH_MAX + 100];
+
+    snprintf(response, sizeof(response), "150 Opening BINARY mode data connection for %s (%lld bytes).\r\n",
+             session->transfer_name, (long long) file->size);
+
+    session->cache_send_hot = file;
+    session->cache_send_offset = offset;
+    session->cache_send_size = file->size;
+
+    transfer_begin_serving(session, response);
+}
+
+/**
+ * Starts answering a RETR from the cache file without contacting the server, from the offset of a REST.
+ * The client gets synthesized 150 and 226 replies, and the file is sent with sendfile() as its
+ * data socket drains. Small complete files are sent from their copy in memory instead, which is
+ * made the first time they are served.
+ * Returns 0 on success and -1 if the cache file cannot be served, in which case the command has
+ * to be forwarded to the server.
+ */
+int transfer_serve_cache_file(struct session *session, off_t offset) {
+    struct cache *cache = session->config->cache;
+
+    if (session->cache_follow_entry == NULL) {
+        struct hot_file *file = cache_lookup_hot(cache, session->cache_key, session->cache_upstream);
+        if (file != NULL) {
+            transfer_serve_hot(session, file, offset);
+            return 0;
+        }
+    }
+
+    int cache_send_fd = open(session->cache_file_path, O_RDONLY | O_CLOEXEC);
+    if (cache_send_fd < 0) {
+        return -1;
+    }
+
+    struct stat file_stat;
+    if (fstat(cache_send_fd, &file_stat) < 0) {
+        close(cache_send_fd);
+        return -1;
+    }
+
+    // A file cut short on disk is caught before it is sent, a damaged one by the verifier
+    if (session->cache_follow_entry == NULL && file_stat.st_size != session->cache_file_size) {
+        log_warning("Cached %s has %lld bytes instead of %lld\n", session->cache_key, (long long) file_stat.st_size,
+                    (long long) session->cache_file_size);
+        close(cache_send_fd);
+        return -1;
+    }
+
+    if (session->cache_follow_entry == NULL) {
+        struct hot_file *file = cache_promote(cache, session->cache_key, session->cache_upstream, cache_send_fd,
+                                              file_stat.st_size);
+        if (file != NULL) {
+            close(cache_send_fd);
+            transfer_serve_hot(session, file, offset);
+            return 0;
+        }
+    }
+
+    char response[PATH_MAX + 100];
+    if (session->cache_follow_entry != NULL) {
+        // The size is not known before the fill ends
+        snprintf(response, sizeof(response), "150 Opening BINARY mode data connection for %s.\r\n",
+                 session->transfer_name);
+    } else {
+        snprintf(response, sizeof(response), "150 Opening BINARY mode data connection for %s (%lld bytes).\r\n",
+                 session->transfer_name, (long long) file_stat.st_size);
+    }
+
+    transfer_serve_fd(session, cache_send_fd, offset, file_stat.st_size, response);
+    return 0;
+}
+
+/**
+ * Starts answering a LIST, NLST or MLSD with a cached listing held by the memory file, which the
+ * session owns from now on. The client gets synthesized 150 and 226 replies like for a cached file.
+ */
+void transfer_serve_listing(struct session *session, int listing_fd, off_t size) {
+    transfer_serve_fd(session, listing_fd, 0, size,
+                      "150 Opening ASCII mode data connection for file list.\r\n");
+}
+
+/**
+ * Starts a RETR whose first bytes, from the offset up to the end, are in the cache file, while the
+ * server is asked for the rest. The cached bytes are sent first, then the server's data connection
+ * is relayed, and the server's replies are the ones the client gets.
+ * Returns 0 on success and -1 if the cache file cannot be read, in which case the server has to send
+ * everything.
+ */
+int transfer_serve_cache_prefix(struct session *session, off_t offset, off_t end) {
+    int cache_send_fd = open(session->cache_file_path, O_RDONLY | O_CLOEXEC);
+    if (cache_send_fd < 0) {
+        return -1;
+    }
+
+    log_info("Sending %lld cached bytes of %s before the server's\n", (long long) (end - offset), session->cache_key);
+
+    session->cache_send_fd = cache_send_fd;
+    session->cache_send_offset = offset;
+    session->cache_send_size = end;
+    session->cache_send_prefix = TRUE;
+
+    // In passive mode the client may be connected already; in active mode the server connects first
+    if (session->mode == 1 && transfer_client_data_socket(session) >= 0) {
+        transfer_send_cache_file(session);
+    }
+
+    return 0;
+}
+
+/**
+ * Ends a transfer served from the cache and sends the final reply to the client.
+ * When only the start of the transfer came from the cache, the server has its own reply to the
+ * transfer command, so the transfer and its fill are just ended.
+ */
+void transfer_finish_cache_file(struct session *session, const char *response) {
+    int prefix = session->cache_send_prefix;
+
+    session_close_data_sockets(session);
+
+    if (prefix) {
+        session_end_fill(session, FALSE);
+        return;
+    }
+
+    session_send(session, TRUE, response);
+    session_resume_client(session);
+}
+
+/**
+ * Switches a transfer over to relaying the server's data once the cached start of it was sent.
+ */
+static void transfer_end_cache_prefix(struct session *session) {
+    int client_data_socket = transfer_client_data_socket(session);
+
+    close(session->cache_send_fd);
+    session->cache_send_fd = -1;
+    session->cache_send_prefix = FALSE;
+
+    if (session->cache_send_blocked) {
+        event_loop_modify(session->loop, client_data_socket, SESSION_EVENTS);
+        session->cache_send_blocked = FALSE;
+    }
+    session->income_channel.ready = TRUE;
+    session->outcome_channel.ready = TRUE;
+    scheduler_wake(&session->flow);
+}
+
+/**
+ * Sends the cache file, or its copy in memory, until the client data socket is full or about budget
+ * bytes were sent, then waits for EPOLLOUT or the transfer's next turn.
+ * Returns the number of bytes sent.
+ */
+static size_t transfer_send_cache_data(struct session *session, size_t budget) {
+    int client_data_socket = transfer_client_data_socket(session);
+    size_t moved = 0;
+
+    while (TRUE) {
+        if (moved >= budget) {
+            return moved;
+        }
+
+        struct cache_entry *fill = session->cache_follow_entry;
+        enum cache_fill_state state = CACHE_FILL_COMPLETE;
+        off_t available = session->cache_send_size;
+
+        if (fill != NULL) {
+            // The fill may belong to another worker, which updates it concurrently
+            state = cache_fill_status(fill, session->cache_send_offset, &available);
+        }
+
+        if (session->cache_send_offset >= available) {
+            if (state == CACHE_FILL_COMPLETE) {
+                break;
+            }
+            if (state == CACHE_FILL_FAILED) {
+                log_warning("Cache fill of %s failed\n", session->cache_key);
+                transfer_finish_cache_file(session, "426 Connection closed; transfer aborted.\r\n");
+                return moved;
+            }
+
+            // Caught up with the fill, continue once it wrote more
+            if (cache_wait(fill, session->cache_send_offset, &session->cache_waiter) < 0) {
+                continue;
+            }
+            return moved;
+        }
+
+        size_t count = available - session->cache_send_offset < (off_t) (budget - moved)
+                       ? (size_t) (available - session->cache_send_offset) : budget - moved;
+        ssize_t sent;
+        if (session->cache_send_hot != NULL) {
+            sent = hot_file_send(session->cache_send_hot, client_data_socket, &session->cache_send_offset, count);
+        } else {
+            sent = sendfile(client_data_socket, session->cache_send_fd, &session->cache_send_offset, count);
+        }
+
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            // Edge-triggered EPOLLOUT tells when the socket drains again
+            if (!session->cache_send_blocked) {
+                event_loop_modify(session->loop, client_data_socket, SESSION_EVENTS | EPOLLOUT);
+                session->cache_send_blocked = TRUE;
+            }
+            return moved;
+        }
+        if (sent <= 0) {
+            log_warning("Cannot send %s from the cache\n", session->cache_key);
+            transfer_finish_cache_file(session, "426 Connection closed; transfer aborted.\r\n");
+            return moved;
+        }
+        transfer_count_first_byte(session);
+        metrics_add(session->metrics.bytes_from_cache, sent);
+        session->data_activity = event_loop_now(session->loop);
+        moved += sent;
+    }
+
+    log_info("Sent %s from the cache up to offset %lld\n", session->cache_key, (long long) session->cache_send_offset);
+    if (session->cache_send_prefix) {
+        transfer_end_cache_prefix(session);
+        return moved;
+    }
+    transfer_finish_cache_file(session, "226 Transfer complete.\r\n");
+    return moved;
+}
+
+/**
+ * Queues the transfer from the cache for its next turn, once the client data socket is there or
+ * drained, or the fill it follows progressed.
+ */
+void transfer_send_cache_file(struct session *session) {
+    scheduler_wake(&session->flow);
+}
+
+/**
+ * Called by the cache when the fill a client is waiting for progressed or ended, possibly on the
+ * thread of the worker filling it.
+ */
+void transfer_wake_follower(struct cache_waiter *waiter) {
+    struct session *session = container_of(waiter, struct session, cache_waiter);
+
+    // Sending from inside the filling transfer's relay loop would nest the sessions
+    event_loop_post(session->loop, &session->wake_task);
+}
+
+/**
+ * Resumes streaming a cache entry to the client after its fill progressed.
+ */
+void transfer_resume_follower(struct event_task *task) {
+    struct session *session = container_of(task, struct session, wake_task);
+
+    if (session->cache_send_fd >= 0 && transfer_client_data_socket(session) >= 0 && !session->data_connecting) {
+        transfer_send_cache_file(session);
+    }
+}
+
+/**
+ * Stops saving the current transfer into the cache after the cache file could not be written.
+ */
+static void transfer_abandon_cache_file(struct session *session) {
+    log_warning("Cannot write cache file %s\n", session->cache_file_path);
+
+    session_end_fill(session, FALSE);
+}
+
+/**
+ * Closes the data connections once one of them ended. The cache entry being filled is complete
+ * only if the connection that reached its end normally is the one the file came from.
+ */
+static void transfer_end_data(struct session *session, int from_fd, int end_of_stream) {
+    int server_data_socket = session->mode == 0 ? session->income_data_socket : session->outcome_data_socket;
+    int source_data_socket = session->file_transfer_mode == 0 ? server_data_socket
+                                                               : transfer_client_data_socket(session);
+
+    // Close data connections
+    session_close_data_sockets(session);
+
+    if (end_of_stream && from_fd == source_data_socket) {
+        if (session->file_transfer_mode == 0) {
+            // The mirror sent the whole file, which tells how fast it serves
+            unsigned long long received = session->metrics.bytes_downloaded - session->transfer_start_bytes;
+            upstream_record_transfer(session->upstream, received, metrics_now() - session->transfer_started);
+        }
+        session->cache_fill_eof = TRUE;
+        session_end_fill(session, TRUE);
+        session_end_listing(session, TRUE);
+    } else {
+        session_end_fill(session, FALSE);
+        session_end_listing(session, FALSE);
+    }
+}
+
+/**
+ * Makes sure the pipes used for splicing exist.
+ * Returns 0 on success and -1 if splicing has to be given up.
+ */
+static int transfer_open_relay_pipes(struct session *session, struct relay_channel *channel) {
+    if (channel->pipe.read_fd < 0 && relay_pipe_open(&channel->pipe) < 0) {
+        return -1;
+    }
+    if (session->cache_pipe.read_fd < 0 && relay_pipe_open(&session->cache_pipe) < 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Starts or stops watching the sink of a channel for EPOLLOUT.
+ */
+static void transfer_block_sink(struct session *session, struct relay_channel *channel, int to_fd, int blocked) {
+    if (channel->sink_blocked != blocked) {
+        channel->sink_blocked = blocked;
+        event_loop_modify(session->loop, to_fd, SESSION_EVENTS | (blocked ? EPOLLOUT : 0));
+    }
+}
+
+/**
+ * Writes what the channel holds into the sink.
+ * Returns 0 once the channel is empty, 1 while the sink is full, and -1 if the transfer was ended.
+ */
+static int transfer_flush_channel(struct session *session, struct relay_channel *channel, int from_fd, int to_fd) {
+    if (relay_flush(channel, to_fd) == 0) {
+        transfer_block_sink(session, channel, to_fd, FALSE);
+        return 0;
+    }
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        transfer_block_sink(session, channel, to_fd, TRUE);
+        return 1;
+    }
+
+    transfer_end_data(session, from_fd, FALSE);
+    return -1;
+}
+
+/**
+ * Receives one pipe-full, or at most limit bytes, from the source with splice(), teeing it into the
+ * cache file if needed.
+ * Returns the number of bytes received, 0 at end of stream, or -1 with errno set.
+ */
+static ssize_t transfer_splice_data(struct session *session, struct relay_channel *channel, int from_fd,
+                                    size_t limit) {
+    int tee_error = 0;
+    struct cache_writer *writer = session->cache_writer;
+    int saving = writer != NULL || session->listing_capturing;
+
+    ssize_t received = relay_splice(from_fd, channel, limit, saving ? &session->cache_pipe : NULL, &tee_error);
+
+    if (received > 0 && writer != NULL &&
+        (tee_error || cache_writer_write_from_pipe(writer, session->cache_pipe.read_fd, received) < 0)) {
+        // The cache pipe may still hold part of the data, so start over with a fresh one
+        transfer_abandon_cache_file(session);
+        relay_pipe_close(&session->cache_pipe);
+        relay_pipe_open(&session->cache_pipe);
+    } else if (received > 0 && session->listing_capturing &&
+               (tee_error || listing_buffer_append_from_pipe(&session->listing_buffer, session->cache_pipe.read_fd,
+                                                             received) < 0)) {
+        session_end_listing(session, FALSE);
+        relay_pipe_close(&session->cache_pipe);
+        relay_pipe_open(&session->cache_pipe);
+    }
+
+    return received;
+}
+
+/**
+ * Receives at most limit bytes from the source into the ring of the channel, saving them into the
+ * cache file if needed.
+ * Returns the number of bytes received, 0 at end of stream, or -1 with errno set.
+ */
+static ssize_t transfer_read_data(struct session *session, struct relay_channel *channel, int from_fd,
+                                  size_t limit) {
+    const char *received;
+
+    ssize_t read_size = ring_read_from(&channel->ring, from_fd, limit, &received);
+    if (read_size <= 0) {
+        return read_size;
+    }
+
+    log_debug("Received data: %d bytes\n", (int) read_size);
+
+    if (session->cache_writer != NULL && cache_writer_write(session->cache_writer, received, read_size) < 0) {
+        transfer_abandon_cache_file(session);
+    }
+    if (session->listing_capturing && listing_buffer_append(&session->listing_buffer, received, read_size) < 0) {
+        session_end_listing(session, FALSE);
+    }
+
+    return read_size;
+}
+
+/**
+ * Called once the writer of the cache fill has room again, so the transfer reads its source on its
+ * next turn.
+ */
+static void transfer_handle_writer_room(void *data) {
+    struct session *session = data;
+
+    session->income_channel.ready = TRUE;
+    session->outcome_channel.ready = TRUE;
+    scheduler_wake(&session->flow);
+}
+
+/**
+ * Relays data from one data socket into the other one, with splice() when possible, until about
+ * budget bytes were received. The source is only read while its channel has room, so a sink that
+ * does not keep up holds it back until EPOLLOUT tells the sink drained, and while the writer of the
+ * cache fill has room, so a disk that falls behind holds it back as well.
+ * Returns the number of bytes received.
+ */
+static size_t transfer_relay_data(struct session *session, int from_fd, int to_fd, size_t budget) {
+    if (from_fd < 0 || to_fd < 0 || session->data_connecting) {
+        // The other side of the transfer is not connected yet
+        return 0;
+    }
+
+    struct relay_channel *channel = from_fd == session->income_data_socket ? &session->income_channel
+                                                                           : &session->outcome_channel;
+    size_t moved = 0;
+
+    // Only a channel stopped by its budget is ready for the next turn without a new event
+    channel->ready = FALSE;
+
+    while (TRUE) {
+        int flushed = transfer_flush_channel(session, channel, from_fd, to_fd);
+        if (flushed < 0) {
+            return moved;
+        }
+
+        // A pipe is only spliced into once empty, so tee() sees just the new data, while a ring is
+        // read into until full and then waits to drain below its low watermark
+        if (channel->pipe_pending > 0 || ring_space(&channel->ring) == 0) {
+            channel->paused = TRUE;
+            return moved;
+        }
+        if (channel->paused && ring_used(&channel->ring) > RELAY_RING_LOW) {
+            return moved;
+        }
+        channel->paused = FALSE;
+
+        if (channel->source_ended) {
+            if (flushed == 0) {
+                transfer_end_data(session, from_fd, TRUE);
+            }
+            return moved;
+        }
+
+        if (moved >= budget) {
+            channel->ready = TRUE;
+            return moved;
+        }
+
+        size_t limit = budget - moved;
+        if (session->cache_writer != NULL) {
+            size_t room = cache_writer_room(session->cache_writer);
+            if (room == 0) {
+                // The disk fell behind, so the source is left alone until the writer has room again
+                cache_writer_wait(session->cache_writer, transfer_handle_writer_room, session);
+                return moved;
+            }
+            limit = limit < room ? limit : room;
+        }
+
+        ssize_t received;
+        if (session->splice_supported) {
+            if (transfer_open_relay_pipes(session, channel) == 0) {
+                received = transfer_splice_data(session, channel, from_fd, limit);
+            } else {
+                received = -1;
+                errno = EINVAL;
+            }
+
+            if (received < 0 && errno == EINVAL) {
+                log_warning("splice() not available, falling back to buffered relay\n");
+                session->splice_supported = FALSE;
+                continue;
+            }
+        } else {
+            received = transfer_read_data(session, channel, from_fd, limit);
+        }
+
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            // The sender is idle, so let transfers streaming the fill see what has been received
+            if (session->cache_writer != NULL) {
+                cache_writer_flush(session->cache_writer);
+            }
+            return moved;
+        }
+        if (received < 0) {
+            transfer_end_data(session, from_fd, FALSE);
+            return moved;
+        }
+        if (received > 0) {
+            session->data_activity = event_loop_now(session->loop);
+            moved += received;
+        }
+        if (received == 0) {
+            // Whatever the channel still holds is written before the connections are closed
+            channel->source_ended = TRUE;
+        } else if (to_fd == transfer_client_data_socket(session)) {
+            transfer_count_first_byte(session);
+            metrics_add(session->metrics.bytes_downloaded, received);
+        } else {
+            metrics_add(session->metrics.bytes_uploaded, received);
+        }
+    }
+}
+
+/**
+ * Dispatches an event on one of the data sockets of a relayed transfer.
+ */
+void transfer_handle_data_event(struct session *session, int fd, uint32_t events) {
+    struct relay_channel *channel = fd == session->income_data_socket ? &session->income_channel
+                                                                      : &session->outcome_channel;
+    struct relay_channel *peer_channel = fd == session->income_data_socket ? &session->outcome_channel
+                                                                           : &session->income_channel;
+
+    if (events & EPOLLOUT) {
+        // The socket drained, so the data held back for it can move on
+        session->data_activity = event_loop_now(session->loop);
+        peer_channel->ready = TRUE;
+    }
+    if (events & ~EPOLLOUT) {
+        channel->ready = TRUE;
+    }
+
+    // Moved on the transfer's turn, once the loop handled the command connections
+    scheduler_wake(&session->flow);
+}
+
+/**
+ * Moves the bytes of the session's transfer on its turn in the worker's scheduler, from the cache or
+ * between the data sockets of the channels that are ready.
+ * Returns the number of bytes moved.
+ */
+size_t transfer_take_turn(struct scheduler_flow *flow, size_t budget) {
+    struct session *session = container_of(flow, struct session, flow);
+
+    if (transfer_sending_cache(session)) {
+        if (transfer_client_data_socket(session) < 0 || session->data_connecting) {
+            return 0;
+        }
+        return transfer_send_cache_data(session, budget);
+    }
+
+    size_t moved = 0;
+    if (session->income_channel.ready) {
+        moved += transfer_relay_data(session, session->income_data_socket, session->outcome_data_socket, budget);
+    }
+    if (session->outcome_channel.ready && moved < budget) {
+        moved += transfer_relay_data(session, session->outcome_data_socket, session->income_data_socket,
+                                     budget - moved);
+    }
+
+    return moved;
+}
+
+/**
+ * Gets the deadline that applies to the data connection: the wait for it while a transfer needs it
+ * but it is not established, and the wait for progress once it is.
+ * Returns the number of seconds, or 0 if there is no data connection or no limit.
+ */
+static int transfer_data_timeout(const struct session *session) {
+    int transferring = session->data_command_pending || transfer_sending_cache(session);
+
+    if (session->data_connecting || (transferring && session->proxy_data_socket >= 0 && session->income_data_socket < 0)) {
+        return session->config->connect_timeout;
+    }
+    if (session->income_data_socket >= 0 || session->outcome_data_socket >= 0) {
+        return session->config->stall_timeout;
+    }
+
+    return 0;
+}
+
+/**
+ * Restarts the deadline of the data connection once it was set up or waited for, as the wait for the
+ * connection and the wait for progress have different limits. Bytes moved later only update the time
+ * of the last activity; when the timer expires, it finds out how long ago that was.
+ */
+void transfer_watch_data(struct session *session) {
+    int timeout = transfer_data_timeout(session);
+
+    session->data_activity = event_loop_now(session->loop);
+    if (timeout > 0) {
+        event_loop_arm(session->loop, &session->data_timer, timeout * 1000ULL);
+    }
+}
+
+/**
+ * Called when the deadline of the data connection may have passed. A connection that did not come in
+ * or could not be established in time is given up with a 425 reply, and a transfer that stalled is
+ * aborted: a transfer from the cache gets a 426 reply, while a relayed one gets the server's reply to
+ * its closed data connection.
+ */
+void transfer_handle_timeout(struct wheel_timer *timer) {
+    struct session *session = container_of(timer, struct session, data_timer);
+    int timeout = transfer_data_timeout(session);
+
+    if (timeout == 0) {
+        // The data connection is gone, the next one arms the timer again
+        return;
+    }
+
+    unsigned long long deadline = session->data_activity + timeout * 1000ULL;
+    unsigned long long now = event_loop_now(session->loop);
+    if (now < deadline) {
+        event_loop_arm(session->loop, timer, deadline - now);
+        return;
+    }
+
+    if (session->data_connecting || (session->income_data_socket < 0 && session->outcome_data_socket < 0)) {
+        log_warning("Data connection not established within %d seconds\n", timeout);
+        session_release_data_listener(session);
+        session->data_command_pending = 0;
+        transfer_fail_data_connection(session);
+    } else {
+        log_warning("Transfer stalled for %d seconds, aborting it\n", timeout);
+        if (transfer_sending_cache(session)) {
+            transfer_finish_cache_file(session, "426 Connection closed; transfer aborted.\r\n");
+        } else {
+            transfer_end_data(session, -1, FALSE);
+        }
+    }
+}
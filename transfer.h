@@ -0,0 +1,36 @@
+#ifndef FTP_PROXY_TRANSFER_H
+#define FTP_PROXY_TRANSFER_H
+
+#include "session.h"
+
+void transfer_accept_data_connection(struct session *session);
+
+void transfer_data_connected(struct session *session);
+
+void transfer_command_forwarded(struct session *session);
+
+int transfer_sending_cache(const struct session *session);
+
+void transfer_watch_data(struct session *session);
+
+void transfer_handle_timeout(struct wheel_timer *timer);
+
+int transfer_serve_cache_file(struct session *session, off_t offset);
+
+void transfer_serve_listing(struct session *session, int listing_fd, off_t size);
+
+int transfer_serve_cache_prefix(struct session *session, off_t offset, off_t end);
+
+void transfer_send_cache_file(struct session *session);
+
+void transfer_finish_cache_file(struct session *session, const char *response);
+
+void transfer_wake_follower(struct cache_waiter *waiter);
+
+void transfer_resume_follower(struct event_task *task);
+
+void transfer_handle_data_event(struct session *session, int fd, uint32_t events);
+
+size_t transfer_take_turn(struct scheduler_flow *flow, size_t budget);
+
+#endif
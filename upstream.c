@@ -0,0 +1,332 @@
+#include "upstream.h"
+
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "log.h"
+#include "metrics.h"
+#include "net.h"
+#include "proxy.h"
+#include "resolver.h"
+
+#define UPSTREAM_PROBE_EVENTS (EPOLLIN | EPOLLRDHUP | EPOLLET)
+
+static void upstream_handle_probe_timeout(struct wheel_timer *timer);
+
+/**
+ * Starts an empty set of mirrors resolved with the given resolver.
+ * Returns 0 on success and -1 on failure.
+ */
+int upstream_set_init(struct upstream_set *set, struct resolver *resolver) {
+    if (pthread_mutex_init(&set->mutex, NULL) != 0) {
+        perror("Error creating upstream mutex");
+        return -1;
+    }
+
+    set->count = 0;
+    set->resolver = resolver;
+    set->loop = NULL;
+    set->probe_interval = 0;
+    bzero(&set->probe_timer, sizeof(set->probe_timer));
+    return 0;
+}
+
+/**
+ * Adds a mirror, healthy until it fails. The host is resolved anew on every connection.
+ * Returns 0 on success and -1 if the set is full or the host name too long.
+ */
+int upstream_set_add(struct upstream_set *set, const char *host, int port) {
+    if (set->count == UPSTREAM_MAX || strlen(host) >= UPSTREAM_HOST_SIZE) {
+        return -1;
+    }
+
+    struct upstream *upstream = &set->servers[set->count];
+    bzero(upstream, sizeof(*upstream));
+    upstream->set = set;
+    upstream->index = set->count;
+    strcpy(upstream->host, host);
+    upstream->port = port;
+    upstream->healthy = TRUE;
+    upstream->probe_socket = -1;
+    upstream->probe_timer.expire = upstream_handle_probe_timeout;
+
+    set->count += 1;
+    return 0;
+}
+
+/**
+ * Moves an average towards a sample, or starts it with the first one.
+ */
+static void upstream_average(unsigned long long *average, unsigned long long sample) {
+    if (*average == 0) {
+        *average = sample > 0 ? sample : 1;
+    } else if (sample >= *average) {
+        *average += (sample - *average) >> UPSTREAM_EWMA_SHIFT;
+    } else {
+        *average -= (*average - sample) >> UPSTREAM_EWMA_SHIFT;
+    }
+}
+
+/**
+ * Estimates how long a new session on the mirror would wait for a transfer of the reference size:
+ * connecting plus moving the bytes, stretched by the sessions already sharing the mirror. A mirror
+ * without samples scores 0, so it is tried before the others. Called with the mutex held.
+ */
+static unsigned long long upstream_score(const struct upstream *upstream) {
+    unsigned long long expected = upstream->connect_time;
+
+    if (upstream->throughput > 0) {
+        expected += UPSTREAM_REFERENCE_SIZE * 1000000ULL / upstream->throughput;
+    }
+    return expected * (unsigned long long) (upstream->sessions + 1);
+}
+
+/**
+ * Picks the mirror with the best score among the healthy ones not in the tried mask, or among all
+ * those not tried if none is healthy, since a mirror marked down may be back already. The mirror
+ * counts the session until it is released.
+ * Returns the mirror, or NULL once every one was tried.
+ */
+struct upstream *upstream_choose(struct upstream_set *set, unsigned int tried) {
+    struct upstream *best = NULL;
+    unsigned long long best_score = 0;
+
+    pthread_mutex_lock(&set->mutex);
+    for (int pass = 0; pass < 2 && best == NULL; pass += 1) {
+        for (int i = 0; i < set->count; i += 1) {
+            struct upstream *upstream = &set->servers[i];
+
+            if ((tried & (1u << i)) != 0 || (pass == 0 && !upstream->healthy)) {
+                continue;
+            }
+
+            unsigned long long score = upstream_score(upstream);
+            if (best == NULL || score < best_score) {
+                best = upstream;
+                best_score = score;
+            }
+        }
+    }
+    if (best != NULL) {
+        best->sessions += 1;
+    }
+    pthread_mutex_unlock(&set->mutex);
+
+    return best;
+}
+
+/**
+ * Stops counting a session that was routed to the mirror.
+ */
+void upstream_release(struct upstream *upstream) {
+    pthread_mutex_lock(&upstream->set->mutex);
+    upstream->sessions -= 1;
+    pthread_mutex_unlock(&upstream->set->mutex);
+}
+
+/**
+ * Resolves the address of a mirror.
+ * Returns 0 on success and -1 if the host is unknown.
+ */
+int upstream_lookup(const struct upstream *upstream, struct in_addr *address) {
+    return resolver_lookup(upstream->set->resolver, upstream->host, address);
+}
+
+/**
+ * Records a successful connection to the mirror, which brings it back if it was down.
+ */
+void upstream_record_connect(struct upstream *upstream, unsigned long long microseconds) {
+    pthread_mutex_lock(&upstream->set->mutex);
+    upstream_average(&upstream->connect_time, microseconds);
+    upstream->failures = 0;
+    if (!upstream->healthy) {
+        upstream->healthy = TRUE;
+        log_info("Upstream %s:%d is back up\n", upstream->host, upstream->port);
+    }
+    pthread_mutex_unlock(&upstream->set->mutex);
+}
+
+/**
+ * Records a failed connection or probe, which takes the mirror out once it failed too many times
+ * in a row.
+ */
+void upstream_record_failure(struct upstream *upstream) {
+    pthread_mutex_lock(&upstream->set->mutex);
+    upstream->failures += 1;
+    if (upstream->healthy && upstream->failures >= UPSTREAM_FAILURE_LIMIT) {
+        upstream->healthy = FALSE;
+        log_warning("Upstream %s:%d is down, routing new sessions to the other mirrors\n",
+                    upstream->host, upstream->port);
+    }
+    pthread_mutex_unlock(&upstream->set->mutex);
+}
+
+/**
+ * Records the throughput of a download from the mirror. Small ones are ignored, as their time is
+ * mostly latency.
+ */
+void upstream_record_transfer(struct upstream *upstream, unsigned long long bytes, unsigned long long microseconds) {
+    if (bytes < UPSTREAM_MIN_SAMPLE || microseconds == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&upstream->set->mutex);
+    upstream_average(&upstream->throughput, bytes * 1000000ULL / microseconds);
+    pthread_mutex_unlock(&upstream->set->mutex);
+}
+
+/**
+ * Closes the connection of a probe and records how it went.
+ */
+static void upstream_end_probe(struct upstream *upstream, int success) {
+    struct upstream_set *set = upstream->set;
+
+    event_loop_disarm(set->loop, &upstream->probe_timer);
+    event_loop_remove(set->loop, upstream->probe_socket);
+    close(upstream->probe_socket);
+    upstream->probe_socket = -1;
+
+    if (success) {
+        upstream_record_connect(upstream, upstream->probe_latency);
+    } else {
+        upstream_record_failure(upstream);
+    }
+}
+
+/**
+ * Called when the connection of a probe is established or the greeting arrives. A probe succeeds once
+ * the mirror greets with 220, after which it says goodbye and hangs up.
+ */
+static void upstream_handle_probe(struct event_loop *loop, int fd, uint32_t events, void *data) {
+    struct upstream *upstream = data;
+    struct control_parser *parser = &upstream->probe_parser;
+
+    if (upstream->probe_connecting) {
+        if (finish_connection(fd) < 0) {
+            log_debug("Probe of %s:%d cannot connect: %s\n", upstream->host, upstream->port, strerror(errno));
+            upstream_end_probe(upstream, FALSE);
+            return;
+        }
+        upstream->probe_connecting = FALSE;
+        upstream->probe_latency = metrics_now() - upstream->probe_started;
+        event_loop_modify(loop, fd, UPSTREAM_PROBE_EVENTS);
+    }
+
+    while (TRUE) {
+        const char *received;
+        size_t length;
+        int complete;
+
+        while ((received = control_parser_peek(parser, &length, &complete)) != NULL) {
+            int continued = parser->partial;
+
+            char line[CONTROL_BUFFER_SIZE + 1];
+            memcpy(line, received, length);
+            line[length] = '\0';
+            control_parser_consume(parser, length);
+
+            // A 120 only announces the greeting for later
+            int code = complete && !continued ? control_parse_reply(parser, line, length) : 0;
+            if (code >= 200) {
+                if (code == 220) {
+                    send(fd, "QUIT\r\n", 6, MSG_NOSIGNAL | MSG_DONTWAIT);
+                } else {
+                    log_debug("Probe of %s:%d was greeted with: %s", upstream->host, upstream->port, line);
+                }
+                upstream_end_probe(upstream, code == 220);
+                return;
+            }
+        }
+
+        ssize_t read_size = control_parser_read(parser, fd);
+        if (read_size < 0 && errno == EINTR) {
+            continue;
+        }
+        if (read_size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (read_size <= 0) {
+            log_debug("Probe of %s:%d was hung up on\n", upstream->host, upstream->port);
+            upstream_end_probe(upstream, FALSE);
+            return;
+        }
+    }
+}
+
+/**
+ * Called when a probe did not get the greeting in time.
+ */
+static void upstream_handle_probe_timeout(struct wheel_timer *timer) {
+    struct upstream *upstream = container_of(timer, struct upstream, probe_timer);
+
+    log_debug("Probe of %s:%d timed out\n", upstream->host, upstream->port);
+    upstream_end_probe(upstream, FALSE);
+}
+
+/**
+ * Starts connecting a probe to the mirror, unless the previous one is still running.
+ */
+static void upstream_start_probe(struct upstream *upstream) {
+    struct upstream_set *set = upstream->set;
+    struct sockaddr_in address;
+
+    if (upstream->probe_socket >= 0) {
+        return;
+    }
+
+    bzero((char *) &address, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(upstream->port);
+
+    if (upstream_lookup(upstream, &address.sin_addr) < 0) {
+        upstream_record_failure(upstream);
+        return;
+    }
+
+    int socket_fd = start_connection(address);
+    if (socket_fd < 0) {
+        upstream_record_failure(upstream);
+        return;
+    }
+
+    if (event_loop_add(set->loop, socket_fd, UPSTREAM_PROBE_EVENTS | EPOLLOUT, upstream_handle_probe, upstream) < 0) {
+        close(socket_fd);
+        return;
+    }
+
+    upstream->probe_socket = socket_fd;
+    upstream->probe_connecting = TRUE;
+    upstream->probe_started = metrics_now();
+    control_parser_init(&upstream->probe_parser);
+    event_loop_arm(set->loop, &upstream->probe_timer, UPSTREAM_PROBE_TIMEOUT);
+}
+
+/**
+ * Called every probe interval to check on every mirror.
+ */
+static void upstream_handle_probe_round(struct wheel_timer *timer) {
+    struct upstream_set *set = container_of(timer, struct upstream_set, probe_timer);
+
+    for (int i = 0; i < set->count; i += 1) {
+        upstream_start_probe(&set->servers[i]);
+    }
+    event_loop_arm(set->loop, &set->probe_timer, (unsigned long long) set->probe_interval * 1000);
+}
+
+/**
+ * Starts checking on the mirrors from the given loop every interval seconds, so one that went down
+ * is taken out before sessions wait on it and one that came back gets sessions again. Does nothing
+ * for an interval of 0.
+ */
+void upstream_start_probes(struct upstream_set *set, struct event_loop *loop, int interval) {
+    set->loop = loop;
+    set->probe_interval = interval;
+    set->probe_timer.expire = upstream_handle_probe_round;
+
+    if (interval > 0) {
+        event_loop_arm(loop, &set->probe_timer, (unsigned long long) interval * 1000);
+    }
+}
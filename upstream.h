@@ -0,0 +1,79 @@
+#ifndef FTP_PROXY_UPSTREAM_H
+#define FTP_PROXY_UPSTREAM_H
+
+#include <pthread.h>
+#include <stdio.h>
+#include <netinet/in.h>
+
+#include "control.h"
+#include "event_loop.h"
+
+#define UPSTREAM_MAX 16
+#define UPSTREAM_HOST_SIZE 256
+#define UPSTREAM_DEFAULT_PROBE_INTERVAL 10  // Seconds between health probes of the mirrors
+#define UPSTREAM_PROBE_TIMEOUT 5000         // Milliseconds a probe may take to get the greeting
+#define UPSTREAM_FAILURE_LIMIT 2            // Failures in a row that take a mirror out
+#define UPSTREAM_EWMA_SHIFT 3               // Each sample moves the averages by 1/8 of the difference
+#define UPSTREAM_REFERENCE_SIZE (1024 * 1024)   // Transfer size the score estimates the time of
+#define UPSTREAM_MIN_SAMPLE (256 * 1024)    // Smaller downloads say more about latency than throughput
+
+struct resolver;
+struct upstream_set;
+
+/**
+ * Mirror serving the upstream tree. Its averages and health are guarded by the mutex of its set, and
+ * its probe is only touched by the loop running the probes.
+ */
+struct upstream {
+    struct upstream_set *set;
+    int index;
+    char host[UPSTREAM_HOST_SIZE];
+    int port;
+    int healthy;                    // New sessions are routed to it
+    int failures;                   // Failed connections and probes since the last success
+    unsigned long long connect_time;    // Moving average of the connect latency in microseconds, 0 before a sample
+    unsigned long long throughput;      // Moving average of download throughput in bytes per second, 0 before a sample
+    int sessions;                   // Open sessions routed to it
+
+    int probe_socket;               // Connection of the running probe, -1 between probes
+    int probe_connecting;
+    unsigned long long probe_started;   // In microseconds
+    unsigned long long probe_latency;   // Time the probe took to connect
+    struct control_parser probe_parser;
+    struct wheel_timer probe_timer; // Gives up a probe that did not get the greeting in time
+};
+
+/**
+ * Mirrors of the upstream server, shared by every worker. Each new session goes to the healthy
+ * mirror expected to serve it fastest, and a mirror that keeps failing is taken out until a probe
+ * finds it back.
+ */
+struct upstream_set {
+    pthread_mutex_t mutex;
+    struct upstream servers[UPSTREAM_MAX];
+    int count;
+    struct resolver *resolver;
+    struct event_loop *loop;        // Runs the health probes
+    int probe_interval;             // Seconds
+    struct wheel_timer probe_timer; // Starts the next round of probes
+};
+
+int upstream_set_init(struct upstream_set *set, struct resolver *resolver);
+
+int upstream_set_add(struct upstream_set *set, const char *host, int port);
+
+struct upstream *upstream_choose(struct upstream_set *set, unsigned int tried);
+
+void upstream_release(struct upstream *upstream);
+
+int upstream_lookup(const struct upstream *upstream, struct in_addr *address);
+
+void upstream_record_connect(struct upstream *upstream, unsigned long long microseconds);
+
+void upstream_record_failure(struct upstream *upstream);
+
+void upstream_record_transfer(struct upstream *upstream, unsigned long long bytes, unsigned long long microseconds);
+
+void upstream_start_probes(struct upstream_set *set, struct event_loop *loop, int interval);
+
+#endif